@@ -118,11 +118,11 @@
 
 #include <net/if.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
-#include <sys/wait.h>
 
 #include <linux/can.h>
 #include <linux/can/bcm.h>
@@ -131,239 +131,770 @@
 #define FORMATSZ 80
 #define PORT 28600
 
-void childdied(int i)
+/* "< ifname canid dlc " + 8 data bytes + ">" + '\0', with some spare */
+#define RXMSGSZ (2 + IFNAMSIZ + 9 + 4 + 3 * CAN_MAX_DLEN + 2 + 8)
+#define RXBATCH 32 /* BCM notifications received with one recvmmsg() */
+#define MAXEVENTS 64
+#define OUTBUFSZ (64 * 1024) /* pending notifications per client */
+#define JOBHASHSZ 1024
+#define MAXIFCACHE 32
+
+enum {
+	EV_LISTEN,
+	EV_BCM,
+	EV_CLIENT,
+};
+
+/* event source referenced by epoll_event.data.ptr */
+struct evsrc {
+	int type;
+	int fd;
+};
+
+/*
+ * The BCM identifies its TX and RX jobs by (ifindex, can_id) per socket.
+ * All clients share a pool of BCM sockets and a job is placed into the
+ * first BCM socket where its (ifindex, can_id) is not yet used by another
+ * client. So additional sockets are only needed for conflicting jobs.
+ */
+struct bcmsock {
+	struct evsrc ev;
+	int idx;
+};
+
+struct client;
+
+struct bcmjob {
+	struct bcmjob *hnext; /* job hash chain */
+	struct bcmjob *cnext; /* jobs of the client */
+	struct client *client;
+	int sock; /* index in bcmsocks */
+	int ifindex;
+	canid_t can_id;
+	int rx;
+};
+
+struct client {
+	struct evsrc ev;
+	struct bcmjob *jobs;
+	char buf[MAXLEN];
+	int idx;
+	char outbuf[OUTBUFSZ];
+	size_t outlen;
+	int pending; /* in the list of clients to flush */
+	int pollout;
+	int closed;
+	struct client *next_pending;
+	struct client *next_closed;
+};
+
+static struct bcmsock **bcmsocks;
+static int nbcmsocks;
+
+static struct bcmjob *jobhash[JOBHASHSZ];
+
+/* clients with new notifications - sent at the end of the event round */
+static struct client *pending_clients;
+
+/* closed clients may still be referenced by pending epoll events */
+static struct client *closed_clients;
+
+static struct {
+	int ifindex;
+	char name[IFNAMSIZ];
+} ifcache[MAXIFCACHE];
+static int ifcache_used;
+
+static int epfd;
+static char format[FORMATSZ];
+
+static unsigned int jobhash_fn(int sock, int ifindex, canid_t can_id, int rx)
 {
-	wait(NULL);
+	return (can_id * 31 + ifindex * 7 + sock * 3 + rx) % JOBHASHSZ;
 }
 
-int main(void)
+static struct bcmjob *job_lookup(int sock, int ifindex, canid_t can_id, int rx)
 {
+	struct bcmjob *job;
 
-	int sl, sa, sc;
-	int i;
-	int idx = 0;
-	struct sockaddr_in  saddr, clientaddr;
-	struct sockaddr_can caddr;
-	socklen_t caddrlen = sizeof(caddr);
-	struct ifreq ifr;
-	fd_set readfds;
-	socklen_t sin_size = sizeof(clientaddr);
-	struct sigaction signalaction;
-	sigset_t sigset;
+	for (job = jobhash[jobhash_fn(sock, ifindex, can_id, rx)]; job; job = job->hnext) {
+		if (job->sock == sock && job->ifindex == ifindex &&
+		    job->can_id == can_id && job->rx == rx)
+			return job;
+	}
 
-	char buf[MAXLEN];
-	char format[FORMATSZ];
-	char rxmsg[50];
+	return NULL;
+}
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpragmas"
-#pragma GCC diagnostic ignored "-Wgnu-variable-sized-type-not-at-end"
-	struct {
-		struct bcm_msg_head msg_head;
-		struct can_frame frame;
-	} msg;
-#pragma GCC diagnostic pop
+static struct bcmjob *client_job(struct client *c, int ifindex, canid_t can_id, int rx)
+{
+	struct bcmjob *job;
 
-	if (snprintf(format, FORMATSZ, "< %%%ds %%c %%lu %%lu %%x %%hhu "
-		     "%%hhx %%hhx %%hhx %%hhx %%hhx %%hhx "
-		     "%%hhx %%hhx >", IFNAMSIZ-1) >= FORMATSZ-1)
-		exit(1);
+	for (job = c->jobs; job; job = job->cnext) {
+		if (job->ifindex == ifindex && job->can_id == can_id && job->rx == rx)
+			return job;
+	}
 
-	sigemptyset(&sigset);
-	signalaction.sa_handler = &childdied;
-	signalaction.sa_mask = sigset;
-	signalaction.sa_flags = 0;
-	sigaction(SIGCHLD, &signalaction, NULL);  /* signal for dying child */
+	return NULL;
+}
 
-	if((sl = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("inetsocket");
-		exit(1);
-	}
+static void job_remove(struct bcmjob *job)
+{
+	struct bcmjob **pp;
 
-	saddr.sin_family = AF_INET;
-	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	saddr.sin_port = htons(PORT);
+	pp = &jobhash[jobhash_fn(job->sock, job->ifindex, job->can_id, job->rx)];
+	while (*pp != job)
+		pp = &(*pp)->hnext;
+	*pp = job->hnext;
 
-	while(bind(sl,(struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
-		struct timespec f = {
-			.tv_nsec = 100 * 1000 * 1000,
-		};
+	pp = &job->client->jobs;
+	while (*pp != job)
+		pp = &(*pp)->cnext;
+	*pp = job->cnext;
 
-		printf(".");fflush(NULL);
-		nanosleep(&f, NULL);
-	}
+	free(job);
+}
 
-	if (listen(sl,3) != 0) {
-		perror("listen");
+static int bcmsock_open(void)
+{
+	struct sockaddr_can caddr;
+	struct epoll_event ev;
+	struct bcmsock **tmp;
+	struct bcmsock *bs;
+
+	bs = calloc(1, sizeof(*bs));
+	tmp = realloc(bcmsocks, (nbcmsocks + 1) * sizeof(*bcmsocks));
+	if (!bs || !tmp) {
+		perror("alloc");
 		exit(1);
 	}
-
-	while (1) {
-		sa = accept(sl,(struct sockaddr *)&clientaddr, &sin_size);
-		if (sa > 0 ){
-			if (!fork())
-				break;
-			close(sa);
-		}
-		else {
-			if (errno != EINTR) {
-				/*
-				 * If the cause for the error was NOT the
-				 * signal from a dying child => give an error
-				 */
-				perror("accept");
-				exit(1);
-			}
-		}
-	}
+	bcmsocks = tmp;
 
 	/* open BCM socket */
 
-	if ((sc = socket(PF_CAN, SOCK_DGRAM, CAN_BCM)) < 0) {
+	if ((bs->ev.fd = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK, CAN_BCM)) < 0) {
 		perror("bcmsocket");
-		return 1;
+		free(bs);
+		return -1;
 	}
 
 	memset(&caddr, 0, sizeof(caddr));
 	caddr.can_family = PF_CAN;
 	/* can_ifindex is set to 0 (any device) => need for sendto() */
 
-	if (connect(sc, (struct sockaddr *)&caddr, sizeof(caddr)) < 0) {
+	if (connect(bs->ev.fd, (struct sockaddr *)&caddr, sizeof(caddr)) < 0) {
 		perror("connect");
-		return 1;
+		close(bs->ev.fd);
+		free(bs);
+		return -1;
 	}
 
-	while (1) {
+	bs->ev.type = EV_BCM;
+	bs->idx = nbcmsocks;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = bs;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, bs->ev.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		close(bs->ev.fd);
+		free(bs);
+		return -1;
+	}
+
+	bcmsocks[nbcmsocks++] = bs;
+
+	return bs->idx;
+}
 
-		FD_ZERO(&readfds);
-		FD_SET(sc, &readfds);
-		FD_SET(sa, &readfds);
+/* find a BCM socket where the (ifindex, can_id) of a new job is still free */
+static int job_socket(int ifindex, canid_t can_id, int rx)
+{
+	int sock;
 
-		select((sc > sa)?sc+1:sa+1, &readfds, NULL, NULL, NULL);
+	for (sock = 0; sock < nbcmsocks; sock++) {
+		if (!job_lookup(sock, ifindex, can_id, rx))
+			break;
+	}
 
-		if (FD_ISSET(sc, &readfds)) {
+	if (sock == nbcmsocks && bcmsock_open() < 0)
+		return -1;
 
-			recvfrom(sc, &msg, sizeof(msg), 0,
-				 (struct sockaddr*)&caddr, &caddrlen);
+	return sock;
+}
 
-			ifr.ifr_ifindex = caddr.can_ifindex;
-			ioctl(sc, SIOCGIFNAME, &ifr);
+/* register the job once the BCM has accepted its setup */
+static void job_add(struct client *c, int sock, int ifindex, canid_t can_id, int rx)
+{
+	struct bcmjob *job;
+	unsigned int h;
 
-			sprintf(rxmsg, "< %s %03X %d ", ifr.ifr_name,
-				msg.msg_head.can_id, msg.frame.can_dlc);
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		perror("calloc");
+		exit(1);
+	}
 
-			for ( i = 0; i < msg.frame.can_dlc; i++)
-				sprintf(rxmsg + strlen(rxmsg), "%02X ",
-					msg.frame.data[i]);
+	job->client = c;
+	job->sock = sock;
+	job->ifindex = ifindex;
+	job->can_id = can_id;
+	job->rx = rx;
 
-			/* delimiter '\0' for Adobe(TM) Flash(TM) XML sockets */
-			strcat(rxmsg, ">\0");
+	h = jobhash_fn(sock, ifindex, can_id, rx);
+	job->hnext = jobhash[h];
+	jobhash[h] = job;
 
-			send(sa, rxmsg, strlen(rxmsg) + 1, 0);
-		}
+	job->cnext = c->jobs;
+	c->jobs = job;
+}
+
+static int if_index(const char *name)
+{
+	int i;
 
+	for (i = 0; i < ifcache_used; i++) {
+		if (!strcmp(ifcache[i].name, name))
+			return ifcache[i].ifindex;
+	}
 
-		if (FD_ISSET(sa, &readfds)) {
+	i = if_nametoindex(name);
+	if (i && ifcache_used < MAXIFCACHE) {
+		ifcache[ifcache_used].ifindex = i;
+		strcpy(ifcache[ifcache_used++].name, name);
+	}
 
-			char cmd;
-			int items;
+	return i;
+}
 
-			if (read(sa, buf+idx, 1) < 1)
-				exit(1);
+/* the interface is gone (or was renamed), resolve it again next time */
+static void if_forget(int ifindex)
+{
+	int i;
+
+	for (i = 0; i < ifcache_used; i++) {
+		if (ifcache[i].ifindex == ifindex)
+			ifcache[i--] = ifcache[--ifcache_used];
+	}
+}
+
+static const char *if_name(int ifindex)
+{
+	static char name[IFNAMSIZ];
+	int i;
+
+	for (i = 0; i < ifcache_used; i++) {
+		if (ifcache[i].ifindex == ifindex)
+			return ifcache[i].name;
+	}
+
+	if (!if_indextoname(ifindex, name))
+		return "";
+
+	if (ifcache_used < MAXIFCACHE) {
+		ifcache[ifcache_used].ifindex = ifindex;
+		strcpy(ifcache[ifcache_used++].name, name);
+	}
+
+	return name;
+}
+
+static void client_set_pollout(struct client *c, int on)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP,
+		.data.ptr = c,
+	};
 
-			if (!idx) {
-				if (buf[0] == '<')
-					idx = 1;
+	if (c->pollout == on)
+		return;
 
+	if (on)
+		ev.events |= EPOLLOUT;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->ev.fd, &ev) < 0)
+		perror("epoll_ctl");
+
+	c->pollout = on;
+}
+
+static void client_close(struct client *c)
+{
+	struct bcmjob *job;
+	struct bcm_msg_head head;
+	struct sockaddr_can caddr;
+
+	if (c->closed)
+		return;
+
+	/* terminate the cyclic transmissions and filters of this client */
+	while ((job = c->jobs)) {
+		memset(&head, 0, sizeof(head));
+		head.opcode = job->rx ? RX_DELETE : TX_DELETE;
+		head.can_id = job->can_id;
+
+		memset(&caddr, 0, sizeof(caddr));
+		caddr.can_family = PF_CAN;
+		caddr.can_ifindex = job->ifindex;
+
+		sendto(bcmsocks[job->sock]->ev.fd, &head, sizeof(head), 0,
+		       (struct sockaddr*)&caddr, sizeof(caddr));
+
+		job_remove(job);
+	}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->ev.fd, NULL);
+	close(c->ev.fd);
+
+	c->closed = 1;
+	c->next_closed = closed_clients;
+	closed_clients = c;
+}
+
+static void client_flush(struct client *c)
+{
+	ssize_t nbytes;
+
+	while (c->outlen) {
+		nbytes = send(c->ev.fd, c->outbuf, c->outlen,
+			      MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (nbytes < 0) {
+			if (errno == EINTR)
 				continue;
-			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				client_close(c);
+			break;
+		}
+
+		c->outlen -= nbytes;
+		memmove(c->outbuf, c->outbuf + nbytes, c->outlen);
+	}
+
+	if (!c->closed)
+		client_set_pollout(c, c->outlen != 0);
+}
+
+/* send the notifications collected in this event round */
+static void clients_flush_pending(void)
+{
+	struct client *c;
+
+	while (pending_clients) {
+		c = pending_clients;
+		pending_clients = c->next_pending;
+		c->pending = 0;
+
+		if (!c->closed)
+			client_flush(c);
+	}
+
+	while (closed_clients) {
+		c = closed_clients;
+		closed_clients = c->next_closed;
+		free(c);
+	}
+}
 
-			if (idx > MAXLEN-2) {
-				idx = 0;
+static void client_notify(struct client *c, const char *rxmsg, size_t len)
+{
+	/* drop notifications for clients that do not read */
+	if (c->outlen + len > OUTBUFSZ)
+		return;
+
+	memcpy(c->outbuf + c->outlen, rxmsg, len);
+	c->outlen += len;
+
+	if (!c->pending) {
+		c->pending = 1;
+		c->next_pending = pending_clients;
+		pending_clients = c;
+	}
+}
+
+static void bcm_receive(struct bcmsock *bs)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wgnu-variable-sized-type-not-at-end"
+	static struct {
+		struct bcm_msg_head msg_head;
+		struct can_frame frame;
+	} msg[RXBATCH];
+#pragma GCC diagnostic pop
+	static struct sockaddr_can caddr[RXBATCH];
+	struct mmsghdr msgs[RXBATCH];
+	struct iovec iov[RXBATCH];
+	struct bcmjob *job;
+	char rxmsg[RXMSGSZ];
+	int nmsgs, i, j, len;
+
+	do {
+		for (i = 0; i < RXBATCH; i++) {
+			iov[i].iov_base = &msg[i];
+			iov[i].iov_len = sizeof(msg[i]);
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_name = &caddr[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(caddr[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		nmsgs = recvmmsg(bs->ev.fd, msgs, RXBATCH, MSG_DONTWAIT, NULL);
+		if (nmsgs < 0)
+			return;
+
+		for (i = 0; i < nmsgs; i++) {
+
+			if (msg[i].msg_head.opcode != RX_CHANGED ||
+			    msgs[i].msg_len < sizeof(msg[i]))
 				continue;
-			}
 
-			if (buf[idx] != '>') {
-				idx++;
+			job = job_lookup(bs->idx, caddr[i].can_ifindex,
+					 msg[i].msg_head.can_id, 1);
+			if (!job)
 				continue;
+
+			/* leave room for the delimiters */
+			len = snprintf(rxmsg, RXMSGSZ - 2, "< %s %03X %d ",
+				       if_name(caddr[i].can_ifindex),
+				       msg[i].msg_head.can_id, msg[i].frame.can_dlc);
+			if (len > RXMSGSZ - 3)
+				len = RXMSGSZ - 3;
+
+			for (j = 0; j < msg[i].frame.can_dlc && j < CAN_MAX_DLEN; j++) {
+				len += snprintf(rxmsg + len, RXMSGSZ - 2 - len,
+						"%02X ", msg[i].frame.data[j]);
+				if (len > RXMSGSZ - 3)
+					len = RXMSGSZ - 3;
 			}
 
-			buf[idx+1] = 0;
-			idx = 0;
-
-			//printf("read '%s'\n", buf);
-
-			/* prepare bcm message settings */
-			memset(&msg, 0, sizeof(msg));
-			msg.msg_head.nframes = 1;
-
-			items = sscanf(buf, format,
-				       ifr.ifr_name,
-				       &cmd,
-				       &msg.msg_head.ival2.tv_sec,
-				       &msg.msg_head.ival2.tv_usec,
-				       &msg.msg_head.can_id,
-				       &msg.frame.can_dlc,
-				       &msg.frame.data[0],
-				       &msg.frame.data[1],
-				       &msg.frame.data[2],
-				       &msg.frame.data[3],
-				       &msg.frame.data[4],
-				       &msg.frame.data[5],
-				       &msg.frame.data[6],
-				       &msg.frame.data[7]);
-
-			if (items < 6)
-				break;
-			if (msg.frame.can_dlc > 8)
-				break;
-			if (items != 6 + msg.frame.can_dlc)
-				break;
+			/* delimiter '\0' for Adobe(TM) Flash(TM) XML sockets */
+			rxmsg[len++] = '>';
+			rxmsg[len++] = 0;
 
-			msg.frame.can_id = msg.msg_head.can_id;
+			client_notify(job->client, rxmsg, len);
+		}
+	} while (nmsgs == RXBATCH);
+}
 
-			switch (cmd) {
-			case 'S':
-				msg.msg_head.opcode = TX_SEND;
-				break;
-			case 'A':
-				msg.msg_head.opcode = TX_SETUP;
-				msg.msg_head.flags |= SETTIMER | STARTTIMER;
-				break;
-			case 'U':
-				msg.msg_head.opcode = TX_SETUP;
-				msg.msg_head.flags  = 0;
-				break;
-			case 'D':
-				msg.msg_head.opcode = TX_DELETE;
-				break;
+/* process one '< ... >' command, returns -1 on invalid commands */
+static int client_command(struct client *c, char *buf)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wgnu-variable-sized-type-not-at-end"
+	struct {
+		struct bcm_msg_head msg_head;
+		struct can_frame frame;
+	} msg;
+#pragma GCC diagnostic pop
+	struct sockaddr_can caddr;
+	struct bcmjob *job = NULL;
+	char ifname[IFNAMSIZ];
+	int ifindex, sock, rx;
+	char cmd;
+	int items;
+	ssize_t ret;
+
+	//printf("read '%s'\n", buf);
+
+	/* prepare bcm message settings */
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_head.nframes = 1;
+
+	items = sscanf(buf, format,
+		       ifname,
+		       &cmd,
+		       &msg.msg_head.ival2.tv_sec,
+		       &msg.msg_head.ival2.tv_usec,
+		       &msg.msg_head.can_id,
+		       &msg.frame.can_dlc,
+		       &msg.frame.data[0],
+		       &msg.frame.data[1],
+		       &msg.frame.data[2],
+		       &msg.frame.data[3],
+		       &msg.frame.data[4],
+		       &msg.frame.data[5],
+		       &msg.frame.data[6],
+		       &msg.frame.data[7]);
+
+	if (items < 6)
+		return -1;
+	if (msg.frame.can_dlc > 8)
+		return -1;
+	if (items != 6 + msg.frame.can_dlc)
+		return -1;
+
+	msg.frame.can_id = msg.msg_head.can_id;
+
+	switch (cmd) {
+	case 'S':
+		msg.msg_head.opcode = TX_SEND;
+		break;
+	case 'A':
+		msg.msg_head.opcode = TX_SETUP;
+		msg.msg_head.flags |= SETTIMER | STARTTIMER;
+		break;
+	case 'U':
+		msg.msg_head.opcode = TX_SETUP;
+		msg.msg_head.flags  = 0;
+		break;
+	case 'D':
+		msg.msg_head.opcode = TX_DELETE;
+		break;
+
+	case 'R':
+		msg.msg_head.opcode = RX_SETUP;
+		msg.msg_head.flags  = SETTIMER;
+		break;
+	case 'F':
+		msg.msg_head.opcode = RX_SETUP;
+		msg.msg_head.flags  = RX_FILTER_ID | SETTIMER;
+		break;
+	case 'X':
+		msg.msg_head.opcode = RX_DELETE;
+		break;
+	default:
+		printf("unknown command '%c'.\n", cmd);
+		return -1;
+	}
 
-			case 'R':
-				msg.msg_head.opcode = RX_SETUP;
-				msg.msg_head.flags  = SETTIMER;
-				break;
-			case 'F':
-				msg.msg_head.opcode = RX_SETUP;
-				msg.msg_head.flags  = RX_FILTER_ID | SETTIMER;
+	ifindex = if_index(ifname);
+	if (!ifindex)
+		return 0;
+
+	rx = msg.msg_head.opcode == RX_SETUP || msg.msg_head.opcode == RX_DELETE;
+
+	switch (msg.msg_head.opcode) {
+	case TX_SEND:
+		/* no job state in the BCM */
+		if (!nbcmsocks && bcmsock_open() < 0)
+			return 0;
+		sock = 0;
+		break;
+
+	case TX_DELETE:
+	case RX_DELETE:
+		job = client_job(c, ifindex, msg.msg_head.can_id, rx);
+		if (!job)
+			return 0;
+		sock = job->sock;
+		break;
+
+	default:
+		/* an update of an existing job stays in its socket */
+		job = client_job(c, ifindex, msg.msg_head.can_id, rx);
+		sock = job ? job->sock : job_socket(ifindex, msg.msg_head.can_id, rx);
+		if (sock < 0)
+			return 0;
+		break;
+	}
+
+	memset(&caddr, 0, sizeof(caddr));
+	caddr.can_family = PF_CAN;
+	caddr.can_ifindex = ifindex;
+
+	ret = sendto(bcmsocks[sock]->ev.fd, &msg, sizeof(msg), 0,
+		     (struct sockaddr*)&caddr, sizeof(caddr));
+	if (ret < 0 && (errno == ENODEV || errno == ENXIO))
+		if_forget(ifindex);
+
+	switch (msg.msg_head.opcode) {
+	case TX_DELETE:
+	case RX_DELETE:
+		/* the BCM drops the jobs of a vanished interface itself */
+		job_remove(job);
+		break;
+
+	case TX_SETUP:
+	case RX_SETUP:
+		if (ret >= 0 && !job)
+			job_add(c, sock, ifindex, msg.msg_head.can_id, rx);
+		break;
+	}
+
+	return 0;
+}
+
+static void client_input(struct client *c, unsigned int events)
+{
+	char rxbuf[1024];
+	ssize_t nbytes;
+	int i;
+
+	if (events & EPOLLOUT)
+		client_flush(c);
+
+	if (c->closed || !(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		return;
+
+	nbytes = recv(c->ev.fd, rxbuf, sizeof(rxbuf), MSG_DONTWAIT);
+	if (nbytes < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (nbytes < 1) {
+		client_close(c);
+		return;
+	}
+
+	for (i = 0; i < nbytes && !c->closed; i++) {
+
+		c->buf[c->idx] = rxbuf[i];
+
+		if (!c->idx) {
+			if (c->buf[0] == '<')
+				c->idx = 1;
+
+			continue;
+		}
+
+		if (c->idx > MAXLEN-2) {
+			c->idx = 0;
+			continue;
+		}
+
+		if (c->buf[c->idx] != '>') {
+			c->idx++;
+			continue;
+		}
+
+		c->buf[c->idx+1] = 0;
+		c->idx = 0;
+
+		if (client_command(c, c->buf) < 0)
+			client_close(c);
+	}
+}
+
+static void client_accept(int sl)
+{
+	struct sockaddr_in clientaddr;
+	socklen_t sin_size = sizeof(clientaddr);
+	struct epoll_event ev;
+	struct client *c;
+	int sa;
+
+	sa = accept4(sl, (struct sockaddr *)&clientaddr, &sin_size,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sa < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+			perror("accept");
+		return;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		perror("calloc");
+		close(sa);
+		return;
+	}
+
+	c->ev.type = EV_CLIENT;
+	c->ev.fd = sa;
+
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sa, &ev) < 0) {
+		perror("epoll_ctl");
+		close(sa);
+		free(c);
+	}
+}
+
+int main(void)
+{
+	struct epoll_event events[MAXEVENTS];
+	struct epoll_event ev;
+	struct evsrc listensrc;
+	struct sockaddr_in saddr;
+	int sl;
+	int nevents, i;
+
+	if (snprintf(format, FORMATSZ, "< %%%ds %%c %%lu %%lu %%x %%hhu "
+		     "%%hhx %%hhx %%hhx %%hhx %%hhx %%hhx "
+		     "%%hhx %%hhx >", IFNAMSIZ-1) >= FORMATSZ-1)
+		exit(1);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	/* the first BCM socket is always available */
+	if (bcmsock_open() < 0)
+		return 1;
+
+	if((sl = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("inetsocket");
+		exit(1);
+	}
+
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	saddr.sin_port = htons(PORT);
+
+	while(bind(sl,(struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
+		struct timespec f = {
+			.tv_nsec = 100 * 1000 * 1000,
+		};
+
+		printf(".");fflush(NULL);
+		nanosleep(&f, NULL);
+	}
+
+	if (listen(sl, 32) != 0) {
+		perror("listen");
+		exit(1);
+	}
+
+	listensrc.type = EV_LISTEN;
+	listensrc.fd = sl;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listensrc;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sl, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+
+	while (1) {
+
+		nevents = epoll_wait(epfd, events, MAXEVENTS, -1);
+		if (nevents < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < nevents; i++) {
+			struct evsrc *src = events[i].data.ptr;
+
+			switch (src->type) {
+			case EV_LISTEN:
+				client_accept(src->fd);
 				break;
-			case 'X':
-				msg.msg_head.opcode = RX_DELETE;
+
+			case EV_BCM:
+				bcm_receive((struct bcmsock *)src);
 				break;
-			default:
-				printf("unknown command '%c'.\n", cmd);
-				exit(1);
-			}
 
-			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
-				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &msg, sizeof(msg), 0,
-				       (struct sockaddr*)&caddr, sizeof(caddr));
+			case EV_CLIENT:
+				if (!((struct client *)src)->closed)
+					client_input((struct client *)src,
+						     events[i].events);
+				break;
 			}
 		}
+
+		/* one send() per client and event round */
+		clients_flush_pending();
 	}
 
-	close(sc);
-	close(sa);
+	for (i = 0; i < nbcmsocks; i++)
+		close(bcmsocks[i]->ev.fd);
+
+	close(sl);
+	close(epfd);
 
 	return 0;
 }
@@ -48,20 +48,40 @@
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <net/if.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "terminal.h"
+
 enum {
 	UNSPEC,
 	ADD,
 	DEL,
 	FLUSH,
-	LIST
+	LIST,
+	SYNC,
+	WATCH
 };
 
+/* options describing a single gateway rule */
+#define RULE_OPTS "s:d:Xteiu:l:f:c:p:x:m:M:"
+
+#define RULEFILE_MAXTOKENS 64
+
+#define NL_RXBUF_SIZE 32768 /* allows the kernel to fill large dump messages */
+#define NL_TXBUF_SIZE 32768 /* batch of requests sent with one sendto() */
+#define NL_RULEMSG_MAX 1536 /* max. size of a single rule request */
+#define NL_SOCK_RCVBUF (1024 * 1024)
+
+#define MAXIFCACHE 32
+
+#define ATTDROP ATTBOLD FGRED
+
 struct modattr {
 	struct can_frame cf;
 	__u8 modtype;
@@ -75,6 +95,45 @@ struct fdmodattr {
 } __attribute__((packed));
 
 
+struct gwrule {
+	/* rule key - compared bytewise, see normalize_rule() */
+	__u16 flags;
+	__u8 limit_hops;
+	__u8 have_filter;
+	__u32 src_ifindex;
+	__u32 dst_ifindex;
+	__u32 uid;
+	struct can_filter filter;
+	struct cgw_csum_xor cs_xor;
+	struct cgw_csum_crc8 cs_crc8;
+	struct modattr modmsg[CGW_MOD_FUNCS];
+	struct fdmodattr fdmodmsg[CGW_MOD_FUNCS];
+	int modidx;
+	int fdmodidx;
+	int have_cs_xor;
+	int have_cs_crc8;
+
+	/* statistics and origin - not part of the rule key */
+	__u32 handled;
+	__u32 dropped;
+	__u32 deleted;
+	int lineno;
+
+	/* per second rates calculated in watch mode */
+	double handled_rate;
+	double dropped_rate;
+	double deleted_rate;
+};
+
+#define GWRULE_KEYLEN offsetof(struct gwrule, handled)
+
+/* if_indextoname() and if_nametoindex() open a socket for each lookup */
+static struct {
+	unsigned int ifindex;
+	char name[IF_NAMESIZE];
+} ifcache[MAXIFCACHE];
+static int ifcache_used;
+
 #define RTCAN_RTA(r)  ((struct rtattr*)(((char*)(r)) + NLMSG_ALIGN(sizeof(struct rtcanmsg))))
 #define RTCAN_PAYLOAD(n) NLMSG_PAYLOAD(n,sizeof(struct rtcanmsg))
 
@@ -101,6 +160,61 @@ static int addattr_l(struct nlmsghdr *n, int maxlen, int type,
 	return 0;
 }
 
+static const char *ifindex2name(unsigned int ifindex)
+{
+	int i;
+
+	for (i = 0; i < ifcache_used; i++) {
+		if (ifcache[i].ifindex == ifindex)
+			return ifcache[i].name;
+	}
+
+	if (ifcache_used == MAXIFCACHE)
+		ifcache_used = 0; /* simply start over */
+
+	if (!if_indextoname(ifindex, ifcache[ifcache_used].name))
+		return "(unknown)";
+
+	ifcache[ifcache_used].ifindex = ifindex;
+
+	return ifcache[ifcache_used++].name;
+}
+
+static unsigned int ifname2index(const char *name)
+{
+	unsigned int ifindex;
+	int i;
+
+	for (i = 0; i < ifcache_used; i++) {
+		if (!strncmp(ifcache[i].name, name, IF_NAMESIZE))
+			return ifcache[i].ifindex;
+	}
+
+	ifindex = if_nametoindex(name);
+	if (!ifindex || strlen(name) >= IF_NAMESIZE)
+		return ifindex;
+
+	if (ifcache_used == MAXIFCACHE)
+		ifcache_used = 0;
+
+	ifcache[ifcache_used].ifindex = ifindex;
+	strcpy(ifcache[ifcache_used++].name, name);
+
+	return ifindex;
+}
+
+static const char *modname(int idx)
+{
+	static const char * const names[CGW_MOD_FUNCS] = {
+		"AND", "OR", "XOR", "SET"
+	};
+
+	if (idx < 0 || idx >= CGW_MOD_FUNCS)
+		return "???";
+
+	return names[idx];
+}
+
 static void printfilter(const void *data)
 {
 	struct can_filter *filter = (struct can_filter *)data;
@@ -229,10 +343,15 @@ static void print_usage(char *prg)
 	fprintf(stderr, "          -D  (delete a rule)\n");
 	fprintf(stderr, "          -F  (flush / delete all rules)\n");
 	fprintf(stderr, "          -L  (list all rules)\n");
+	fprintf(stderr, "          -S <file>  (sync rules: add/delete only the differences to <file>)\n");
+	fprintf(stderr, "          -W <ms>  (watch rule statistics: frame and drop rates every <ms>)\n");
 	fprintf(stderr, "Mandatory:\n");
 	fprintf(stderr, "          -s <src_dev>  (source netdevice)\n");
 	fprintf(stderr, "          -d <dst_dev>  (destination netdevice)\n");
 	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "          -j  (list rules / watch rates as JSON - one object per line)\n");
+	fprintf(stderr, "          -a  (show all rules in watch mode - not only the active ones)\n");
+	fprintf(stderr, "          -n  (dry run - only print the differences for -S)\n");
 	fprintf(stderr, "          -X  (this is a CAN FD rule)\n");
 	fprintf(stderr, "          -t  (preserve src_dev rx timestamp)\n");
 	fprintf(stderr, "          -e  (echo sent frames - recommended on vcanx)\n");
@@ -274,8 +393,11 @@ static void print_usage(char *prg)
 	fprintf(stderr, " Profile '%d' (16U8)       add u8 value from table[16] indexed by (data[1] & 0xF)\n", CGW_CRC8PRF_16U8);
 	fprintf(stderr, " Profile '%d' (SFFID_XOR)  add u8 value (can_id & 0xFF) ^ (can_id >> 8 & 0xFF)\n", CGW_CRC8PRF_SFFID_XOR);
 	fprintf(stderr, "\n");
+	fprintf(stderr, "The <file> for -S contains one rule per line in the format of the -L output.\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "Examples:\n");
 	fprintf(stderr, "%s -A -s can0 -d vcan3 -e -f 123:C00007FF -m SET:IL:333.4.1122334455667788\n", prg);
+	fprintf(stderr, "%s -L > rules.txt ; vi rules.txt ; %s -S rules.txt\n", prg, prg);
 	fprintf(stderr, "\n");
 }
 
@@ -470,482 +592,337 @@ static int parse_fdmod(char *optarg, struct fdmodattr *modmsg)
 	return 0; /* ok */
 }
 
-static int parse_rtlist(char *prgname, unsigned char *rxbuf, int len)
+static void print_rule(char *prgname, struct gwrule *r)
 {
-	char ifname[IF_NAMESIZE]; /* interface name for if_indextoname() */
-	struct rtcanmsg *rtc;
-	struct rtattr *rta;
-	struct nlmsghdr *nlh;
-	unsigned int src_ifindex = 0;
-	unsigned int dst_ifindex = 0;
-	__u32 handled, dropped, deleted;
-	int rtlen;
-
-
-	nlh = (struct nlmsghdr *)rxbuf;
-
-	while (1) {
-		if (!NLMSG_OK(nlh, len))
-			return 0;
-
-		if (nlh->nlmsg_type == NLMSG_ERROR) {
-			printf("NLMSG_ERROR\n");
-			return 1;
-		}
-
-		if (nlh->nlmsg_type == NLMSG_DONE) {
-			//printf("NLMSG_DONE\n");
-			return 1;
-		}
-
-		rtc = (struct rtcanmsg *)NLMSG_DATA(nlh);
-		if (rtc->can_family != AF_CAN) {
-			printf("received msg from unknown family %d\n", rtc->can_family);
-			return -EINVAL;
-		}
-
-		if (rtc->gwtype != CGW_TYPE_CAN_CAN) {
-			printf("received msg with unknown gwtype %d\n", rtc->gwtype);
-			return -EINVAL;
-		}
-
-		/*
-		 * print list in a representation that
-		 * can be used directly for start scripts.
-		 *
-		 * To order the mandatory and optional parameters in the
-		 * output string, the NLMSG is parsed twice.
-		 */
-
-		handled = 0;
-		dropped = 0;
-		deleted = 0;
-		src_ifindex = 0;
-		dst_ifindex = 0;
-
-		printf("%s -A ", basename(prgname));
-
-		/* first parse for mandatory options */
-		rta = (struct rtattr *) RTCAN_RTA(rtc);
-		rtlen = RTCAN_PAYLOAD(nlh);
-		for(;RTA_OK(rta, rtlen);rta=RTA_NEXT(rta,rtlen))
-		{
-			//printf("(A-%d)", rta->rta_type);
-			switch(rta->rta_type) {
-
-			case CGW_FILTER:
-			case CGW_MOD_AND:
-			case CGW_MOD_OR:
-			case CGW_MOD_XOR:
-			case CGW_MOD_SET:
-			case CGW_FDMOD_AND:
-			case CGW_FDMOD_OR:
-			case CGW_FDMOD_XOR:
-			case CGW_FDMOD_SET:
-			case CGW_MOD_UID:
-			case CGW_LIM_HOPS:
-			case CGW_CS_XOR:
-			case CGW_CS_CRC8:
-				break;
-
-			case CGW_SRC_IF:
-				src_ifindex = *(__u32 *)RTA_DATA(rta);
-				break;
+	int i;
 
-			case CGW_DST_IF:
-				dst_ifindex = *(__u32 *)RTA_DATA(rta);
-				break;
+	/*
+	 * print rule in a representation that
+	 * can be used directly for start scripts.
+	 */
 
-			case CGW_HANDLED:
-				handled = *(__u32 *)RTA_DATA(rta);
-				break;
+	printf("%s -A ", basename(prgname));
 
-			case CGW_DROPPED:
-				dropped = *(__u32 *)RTA_DATA(rta);
-				break;
+	printf("-s %s ", ifindex2name(r->src_ifindex));
+	printf("-d %s ", ifindex2name(r->dst_ifindex));
 
-			case CGW_DELETED:
-				deleted = *(__u32 *)RTA_DATA(rta);
-				break;
+	if (r->flags & CGW_FLAGS_CAN_FD)
+		printf("-X ");
 
-			default:
-				printf("Unknown attribute %d!", rta->rta_type);
-				return -EINVAL;
-				break;
-			}
-		}
+	if (r->flags & CGW_FLAGS_CAN_ECHO)
+		printf("-e ");
 
+	if (r->flags & CGW_FLAGS_CAN_SRC_TSTAMP)
+		printf("-t ");
 
-		printf("-s %s ", if_indextoname(src_ifindex, ifname));
-		printf("-d %s ", if_indextoname(dst_ifindex, ifname));
+	if (r->flags & CGW_FLAGS_CAN_IIF_TX_OK)
+		printf("-i ");
 
-		if (rtc->flags & CGW_FLAGS_CAN_FD)
-			printf("-X ");
+	if (r->have_filter)
+		printfilter(&r->filter);
 
-		if (rtc->flags & CGW_FLAGS_CAN_ECHO)
-			printf("-e ");
+	for (i = 0; i < r->modidx; i++)
+		printmod(modname(r->modmsg[i].instruction - CGW_MOD_AND),
+			 &r->modmsg[i]);
 
-		if (rtc->flags & CGW_FLAGS_CAN_SRC_TSTAMP)
-			printf("-t ");
+	for (i = 0; i < r->fdmodidx; i++)
+		printfdmod(modname(r->fdmodmsg[i].instruction - CGW_FDMOD_AND),
+			   &r->fdmodmsg[i]);
 
-		if (rtc->flags & CGW_FLAGS_CAN_IIF_TX_OK)
-			printf("-i ");
+	if (r->uid)
+		printf("-u %X ", r->uid);
 
-		/* second parse for mod attributes */
-		rta = (struct rtattr *) RTCAN_RTA(rtc);
-		rtlen = RTCAN_PAYLOAD(nlh);
-		for(;RTA_OK(rta, rtlen);rta=RTA_NEXT(rta,rtlen))
-		{
-			//printf("(B-%d)", rta->rta_type);
-			switch(rta->rta_type) {
+	if (r->limit_hops)
+		printf("-l %d ", r->limit_hops);
 
-			case CGW_FILTER:
-				printfilter(RTA_DATA(rta));
-				break;
+	if (r->have_cs_xor)
+		print_cs_xor(&r->cs_xor);
 
-			case CGW_MOD_AND:
-				printmod("AND", RTA_DATA(rta));
-				break;
+	if (r->have_cs_crc8)
+		print_cs_crc8(&r->cs_crc8);
 
-			case CGW_MOD_OR:
-				printmod("OR", RTA_DATA(rta));
-				break;
+	/* end of entry */
+	printf("# %d handled %d dropped %d deleted\n",
+	       r->handled, r->dropped, r->deleted);
+}
 
-			case CGW_MOD_XOR:
-				printmod("XOR", RTA_DATA(rta));
-				break;
+static void print_hexdata(const __u8 *data, int len)
+{
+	int i;
 
-			case CGW_MOD_SET:
-				printmod("SET", RTA_DATA(rta));
-				break;
+	for (i = 0; i < len; i++)
+		printf("%02X", data[i]);
+}
 
-			case CGW_FDMOD_AND:
-				printfdmod("AND", RTA_DATA(rta));
-				break;
+static void print_rule_json(struct gwrule *r)
+{
+	int i;
 
-			case CGW_FDMOD_OR:
-				printfdmod("OR", RTA_DATA(rta));
-				break;
+	/* one JSON object per line (JSON Lines) */
+
+	printf("{\"src\":\"%s\",", ifindex2name(r->src_ifindex));
+	printf("\"dst\":\"%s\",", ifindex2name(r->dst_ifindex));
+	printf("\"fd\":%s,", (r->flags & CGW_FLAGS_CAN_FD) ? "true" : "false");
+	printf("\"echo\":%s,", (r->flags & CGW_FLAGS_CAN_ECHO) ? "true" : "false");
+	printf("\"src_tstamp\":%s,", (r->flags & CGW_FLAGS_CAN_SRC_TSTAMP) ? "true" : "false");
+	printf("\"iif_tx_ok\":%s,", (r->flags & CGW_FLAGS_CAN_IIF_TX_OK) ? "true" : "false");
+
+	if (r->have_filter)
+		printf("\"filter\":{\"can_id\":\"%03X\",\"can_mask\":\"%X\",\"inverted\":%s},",
+		       r->filter.can_id & ~CAN_INV_FILTER, r->filter.can_mask,
+		       (r->filter.can_id & CAN_INV_FILTER) ? "true" : "false");
+
+	printf("\"mods\":[");
+	for (i = 0; i < r->modidx; i++) {
+		struct modattr *mod = &r->modmsg[i];
+
+		printf("%s{\"op\":\"%s\",\"type\":%d,\"can_id\":\"%03X\",\"dlc\":%d,\"data\":\"",
+		       i ? "," : "", modname(mod->instruction - CGW_MOD_AND),
+		       mod->modtype, mod->cf.can_id, mod->cf.can_dlc);
+		print_hexdata(mod->cf.data, CAN_MAX_DLEN);
+		printf("\"}");
+	}
+	for (i = 0; i < r->fdmodidx; i++) {
+		struct fdmodattr *mod = &r->fdmodmsg[i];
+
+		printf("%s{\"op\":\"%s\",\"type\":%d,\"can_id\":\"%03X\",\"flags\":%d,\"len\":%d,\"data\":\"",
+		       i ? "," : "", modname(mod->instruction - CGW_FDMOD_AND),
+		       mod->modtype, mod->cf.can_id, mod->cf.flags, mod->cf.len);
+		print_hexdata(mod->cf.data, CANFD_MAX_DLEN);
+		printf("\"}");
+	}
+	printf("],");
+
+	if (r->uid)
+		printf("\"uid\":\"%X\",", r->uid);
+
+	if (r->limit_hops)
+		printf("\"limit_hops\":%d,", r->limit_hops);
+
+	if (r->have_cs_xor)
+		printf("\"cs_xor\":{\"from\":%d,\"to\":%d,\"result\":%d,\"init\":\"%02X\"},",
+		       r->cs_xor.from_idx, r->cs_xor.to_idx,
+		       r->cs_xor.result_idx, r->cs_xor.init_xor_val);
+
+	if (r->have_cs_crc8) {
+		printf("\"cs_crc8\":{\"from\":%d,\"to\":%d,\"result\":%d,\"init\":\"%02X\",\"final_xor\":\"%02X\",\"profile\":%d,\"crctab\":\"",
+		       r->cs_crc8.from_idx, r->cs_crc8.to_idx,
+		       r->cs_crc8.result_idx, r->cs_crc8.init_crc_val,
+		       r->cs_crc8.final_xor_val, r->cs_crc8.profile);
+		print_hexdata(r->cs_crc8.crctab, 256);
+		printf("\",\"profile_data\":\"");
+		print_hexdata(r->cs_crc8.profile_data, 20);
+		printf("\"},");
+	}
 
-			case CGW_FDMOD_XOR:
-				printfdmod("XOR", RTA_DATA(rta));
-				break;
+	printf("\"handled\":%u,\"dropped\":%u,\"deleted\":%u}\n",
+	       r->handled, r->dropped, r->deleted);
+}
 
-			case CGW_FDMOD_SET:
-				printfdmod("SET", RTA_DATA(rta));
-				break;
+/*
+ * Bring a rule into the form the kernel reports it in a dump, so that
+ * rules from the command line or a rule file can be compared bytewise
+ * against the current kernel rules.
+ */
+static void normalize_rule(struct gwrule *r)
+{
+	struct modattr mods[CGW_MOD_FUNCS];
+	struct fdmodattr fdmods[CGW_MOD_FUNCS];
+	int i, idx;
 
-			case CGW_MOD_UID:
-				printf("-u %X ", *(__u32 *)RTA_DATA(rta));
-				break;
+	/* the kernel does not report an all-zero filter */
+	if (!r->filter.can_id && !r->filter.can_mask)
+		r->have_filter = 0;
 
-			case CGW_LIM_HOPS:
-				printf("-l %d ", *(__u8 *)RTA_DATA(rta));
-				break;
+	if (!r->have_filter)
+		memset(&r->filter, 0, sizeof(r->filter));
 
-			case CGW_CS_XOR:
-				print_cs_xor((struct cgw_csum_xor *)RTA_DATA(rta));
-				break;
+	if (!r->have_cs_xor)
+		memset(&r->cs_xor, 0, sizeof(r->cs_xor));
 
-			case CGW_CS_CRC8:
-				print_cs_crc8((struct cgw_csum_crc8 *)RTA_DATA(rta));
-				break;
+	if (!r->have_cs_crc8)
+		memset(&r->cs_crc8, 0, sizeof(r->cs_crc8));
 
-			case CGW_SRC_IF:
-			case CGW_DST_IF:
-			case CGW_HANDLED:
-			case CGW_DROPPED:
-			case CGW_DELETED:
-				break;
+	/* one modification per instruction (last one wins), AND -> SET order */
+	memset(mods, 0, sizeof(mods));
+	for (i = 0; i < r->modidx; i++) {
+		idx = r->modmsg[i].instruction - CGW_MOD_AND;
+		if (idx >= 0 && idx < CGW_MOD_FUNCS)
+			mods[idx] = r->modmsg[i];
+	}
 
-			default:
-				printf("Unknown attribute %d!", rta->rta_type);
-				return -EINVAL;
-				break;
-			}
-		}
+	memset(r->modmsg, 0, sizeof(r->modmsg));
+	r->modidx = 0;
+	for (i = 0; i < CGW_MOD_FUNCS; i++) {
+		if (mods[i].modtype)
+			r->modmsg[r->modidx++] = mods[i];
+	}
 
-		/* end of entry */
-		printf("# %d handled %d dropped %d deleted\n",
-		       handled, dropped, deleted);
+	memset(fdmods, 0, sizeof(fdmods));
+	for (i = 0; i < r->fdmodidx; i++) {
+		idx = r->fdmodmsg[i].instruction - CGW_FDMOD_AND;
+		if (idx >= 0 && idx < CGW_MOD_FUNCS)
+			fdmods[idx] = r->fdmodmsg[i];
+	}
 
-		/* jump to next NLMSG in the given buffer */
-		nlh = NLMSG_NEXT(nlh, len);
+	memset(r->fdmodmsg, 0, sizeof(r->fdmodmsg));
+	r->fdmodidx = 0;
+	for (i = 0; i < CGW_MOD_FUNCS; i++) {
+		if (fdmods[i].modtype)
+			r->fdmodmsg[r->fdmodidx++] = fdmods[i];
 	}
 }
 
-int main(int argc, char **argv)
+static int rule_cmp(const void *a, const void *b)
 {
-	int s;
-	int err = 0;
-
-	int opt;
-	extern int optind, opterr, optopt;
-
-	int cmd = UNSPEC;
-	int have_filter = 0;
-	int have_cs_xor = 0;
-	int have_cs_crc8 = 0;
-
-	struct {
-		struct nlmsghdr nh;
-		struct rtcanmsg rtcan;
-		char buf[1500];
-	} req;
-
-	unsigned char rxbuf[8192]; /* netlink receive buffer */
-	struct nlmsghdr *nlh;
-	struct nlmsgerr *rte;
-	unsigned int src_ifindex = 0;
-	unsigned int dst_ifindex = 0;
-	__u32 uid = 0;
-	__u8 limit_hops = 0;
-	__u16 flags = 0;
-	int len;
-
-	struct can_filter filter;
-	struct sockaddr_nl nladdr;
+	const struct gwrule *ra = *(const struct gwrule **)a;
+	const struct gwrule *rb = *(const struct gwrule **)b;
 
-	struct cgw_csum_xor cs_xor = { 0 };
-	struct cgw_csum_crc8 cs_crc8 = { 0 };
-	char crc8tab[513] = {0};
-
-	struct modattr modmsg[CGW_MOD_FUNCS];
-	struct fdmodattr fdmodmsg[CGW_MOD_FUNCS];
-	int modidx = 0;
-	int fdmodidx = 0;
-	int i;
+	return memcmp(ra, rb, GWRULE_KEYLEN);
+}
 
-	memset(&req, 0, sizeof(req));
+static int rule_from_nlmsg(struct nlmsghdr *nlh, struct gwrule *r)
+{
+	struct rtcanmsg *rtc;
+	struct rtattr *rta;
+	int rtlen;
 
-	while ((opt = getopt(argc, argv, "ADFLs:d:Xteiu:l:f:c:p:x:m:M:?")) != -1) {
-		switch (opt) {
+	rtc = (struct rtcanmsg *)NLMSG_DATA(nlh);
+	if (rtc->can_family != AF_CAN) {
+		printf("received msg from unknown family %d\n", rtc->can_family);
+		return -EINVAL;
+	}
 
-		case 'A':
-			if (cmd == UNSPEC)
-				cmd = ADD;
-			break;
+	if (rtc->gwtype != CGW_TYPE_CAN_CAN) {
+		printf("received msg with unknown gwtype %d\n", rtc->gwtype);
+		return -EINVAL;
+	}
 
-		case 'D':
-			if (cmd == UNSPEC)
-				cmd = DEL;
-			break;
+	memset(r, 0, sizeof(*r));
+	r->flags = rtc->flags;
 
-		case 'F':
-			if (cmd == UNSPEC)
-				cmd = FLUSH;
-			break;
+	rta = (struct rtattr *) RTCAN_RTA(rtc);
+	rtlen = RTCAN_PAYLOAD(nlh);
+	for(;RTA_OK(rta, rtlen);rta=RTA_NEXT(rta,rtlen))
+	{
+		switch(rta->rta_type) {
 
-		case 'L':
-			if (cmd == UNSPEC)
-				cmd = LIST;
+		case CGW_FILTER:
+			memcpy(&r->filter, RTA_DATA(rta), sizeof(r->filter));
+			r->have_filter = 1;
 			break;
 
-		case 's':
-			src_ifindex = if_nametoindex(optarg);
-			if (!src_ifindex) {
-				perror("src if_nametoindex");
-				exit(1);
+		case CGW_MOD_AND:
+		case CGW_MOD_OR:
+		case CGW_MOD_XOR:
+		case CGW_MOD_SET:
+			if (r->modidx < CGW_MOD_FUNCS) {
+				memcpy(&r->modmsg[r->modidx], RTA_DATA(rta), CGW_MODATTR_LEN);
+				r->modmsg[r->modidx++].instruction = rta->rta_type;
 			}
 			break;
 
-		case 'd':
-			dst_ifindex = if_nametoindex(optarg);
-			if (!dst_ifindex) {
-				perror("dst if_nametoindex");
-				exit(1);
+		case CGW_FDMOD_AND:
+		case CGW_FDMOD_OR:
+		case CGW_FDMOD_XOR:
+		case CGW_FDMOD_SET:
+			if (r->fdmodidx < CGW_MOD_FUNCS) {
+				memcpy(&r->fdmodmsg[r->fdmodidx], RTA_DATA(rta), CGW_FDMODATTR_LEN);
+				r->fdmodmsg[r->fdmodidx++].instruction = rta->rta_type;
 			}
 			break;
 
-		case 'X':
-			flags |= CGW_FLAGS_CAN_FD;
-			break;
-
-		case 't':
-			flags |= CGW_FLAGS_CAN_SRC_TSTAMP;
+		case CGW_MOD_UID:
+			r->uid = *(__u32 *)RTA_DATA(rta);
 			break;
 
-		case 'e':
-			flags |= CGW_FLAGS_CAN_ECHO;
+		case CGW_LIM_HOPS:
+			r->limit_hops = *(__u8 *)RTA_DATA(rta);
 			break;
 
-		case 'i':
-			flags |= CGW_FLAGS_CAN_IIF_TX_OK;
+		case CGW_CS_XOR:
+			memcpy(&r->cs_xor, RTA_DATA(rta), sizeof(r->cs_xor));
+			r->have_cs_xor = 1;
 			break;
 
-		case 'u':
-			uid = strtoul(optarg, NULL, 16);
+		case CGW_CS_CRC8:
+			memcpy(&r->cs_crc8, RTA_DATA(rta), sizeof(r->cs_crc8));
+			r->have_cs_crc8 = 1;
 			break;
 
-		case 'l':
-			if (sscanf(optarg, "%hhu", &limit_hops) != 1 || !(limit_hops)) {
-				printf("Bad hop limit definition '%s'.\n", optarg);
-				exit(1);
-			}
-			break;
-
-		case 'f':
-			if (sscanf(optarg, "%x:%x", &filter.can_id,
-				   &filter.can_mask) == 2) {
-				have_filter = 1;
-			} else if (sscanf(optarg, "%x~%x", &filter.can_id,
-					  &filter.can_mask) == 2) {
-				filter.can_id |= CAN_INV_FILTER;
-				have_filter = 1;
-			} else {
-				printf("Bad filter definition '%s'.\n", optarg);
-				exit(1);
-			}
-			break;
-
-		case 'x':
-			if (sscanf(optarg, "%hhd:%hhd:%hhd:%hhx",
-				   &cs_xor.from_idx, &cs_xor.to_idx,
-				   &cs_xor.result_idx, &cs_xor.init_xor_val) == 4) {
-				have_cs_xor = 1;
-			} else {
-				printf("Bad XOR checksum definition '%s'.\n", optarg);
-				exit(1);
-			}
-			break;
-
-		case 'c':
-			if ((sscanf(optarg, "%hhd:%hhd:%hhd:%hhx:%hhx:%512s",
-				    &cs_crc8.from_idx, &cs_crc8.to_idx,
-				    &cs_crc8.result_idx, &cs_crc8.init_crc_val,
-				    &cs_crc8.final_xor_val, crc8tab) == 6) &&
-			    (strlen(crc8tab) == 512) &&
-			    (b64hex(crc8tab, (unsigned char *)&cs_crc8.crctab, 256) == 0)) {
-				have_cs_crc8 = 1;
-			} else {
-				printf("Bad CRC8 checksum definition '%s'.\n", optarg);
-				exit(1);
-			}
+		case CGW_SRC_IF:
+			r->src_ifindex = *(__u32 *)RTA_DATA(rta);
 			break;
 
-		case 'p':
-			if (parse_crc8_profile(optarg, &cs_crc8)) {
-				printf("Bad CRC8 profile definition '%s'.\n", optarg);
-				exit(1);
-			}
+		case CGW_DST_IF:
+			r->dst_ifindex = *(__u32 *)RTA_DATA(rta);
 			break;
 
-		case 'm':
-			/* may be triggered by each of the CGW_MOD_FUNCS functions */
-			if ((modidx < CGW_MOD_FUNCS) && (err = parse_mod(optarg, &modmsg[modidx++]))) {
-				printf("Problem %d with modification definition '%s'.\n", err, optarg);
-				exit(1);
-			}
+		case CGW_HANDLED:
+			r->handled = *(__u32 *)RTA_DATA(rta);
 			break;
 
-		case 'M':
-			/* may be triggered by each of the CGW_FDMOD_FUNCS functions */
-			if ((fdmodidx < CGW_MOD_FUNCS) && (err = parse_fdmod(optarg, &fdmodmsg[fdmodidx++]))) {
-				printf("Problem %d with modification definition '%s'.\n", err, optarg);
-				exit(1);
-			}
+		case CGW_DROPPED:
+			r->dropped = *(__u32 *)RTA_DATA(rta);
 			break;
 
-		case '?':
-			print_usage(basename(argv[0]));
-			exit(0);
+		case CGW_DELETED:
+			r->deleted = *(__u32 *)RTA_DATA(rta);
 			break;
 
 		default:
-			fprintf(stderr, "Unknown option %c\n", opt);
-			print_usage(basename(argv[0]));
-			exit(1);
+			printf("Unknown attribute %d!", rta->rta_type);
+			return -EINVAL;
 			break;
 		}
 	}
 
-	if ((argc - optind != 0) || (cmd == UNSPEC)) {
-		print_usage(basename(argv[0]));
-		exit(1);
-	}
-
-	if ((cmd == ADD || cmd == DEL) &&
-	    ((!src_ifindex) || (!dst_ifindex))) {
-		print_usage(basename(argv[0]));
-		exit(1);
-	}
-
-	if (flags & CGW_FLAGS_CAN_FD) {
-		if (modidx) {
-			printf("No -m modifications allowed in CAN FD mode!\n");
-			exit(1);
-		}
-	} else {
-		if (fdmodidx) {
-			printf("No -M modifications allowed in Classic CAN mode!\n");
-			exit(1);
-		}
-	}
-
-	if ((!modidx && !fdmodidx) && (have_cs_crc8 || have_cs_xor)) {
-		printf("-c or -x can only be used in conjunction with -m/-M\n");
-		exit(1);
-	}
-
-	s = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
-
-	switch (cmd) {
-
-	case ADD:
-		req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-		req.nh.nlmsg_type  = RTM_NEWROUTE;
-		break;
-
-	case DEL:
-		req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-		req.nh.nlmsg_type  = RTM_DELROUTE;
-		break;
-
-	case FLUSH:
-		req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-		req.nh.nlmsg_type  = RTM_DELROUTE;
-		/* if_index set to 0 => remove all entries */
-		src_ifindex  = 0;
-		dst_ifindex  = 0;
-		break;
+	return 0;
+}
 
-	case LIST:
-		req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-		req.nh.nlmsg_type  = RTM_GETROUTE;
-		break;
+static int build_rule_msg(struct nlmsghdr *nh, int maxlen, struct gwrule *r,
+			  __u16 type, __u16 nlflags, __u32 seq)
+{
+	struct rtcanmsg *rtc;
+	int i;
 
-	default:
-		printf("This function is not yet implemented.\n");
-		exit(1);
-		break;
-	}
+	memset(nh, 0, NLMSG_LENGTH(sizeof(struct rtcanmsg)));
 
-	req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtcanmsg));
-	req.nh.nlmsg_seq   = 0;
+	nh->nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtcanmsg));
+	nh->nlmsg_type  = type;
+	nh->nlmsg_flags = nlflags;
+	nh->nlmsg_seq   = seq;
 
-	req.rtcan.can_family  = AF_CAN;
-	req.rtcan.gwtype = CGW_TYPE_CAN_CAN;
-	req.rtcan.flags = flags;
+	rtc = (struct rtcanmsg *)NLMSG_DATA(nh);
+	rtc->can_family  = AF_CAN;
+	rtc->gwtype = CGW_TYPE_CAN_CAN;
+	rtc->flags = r->flags;
 
-	addattr_l(&req.nh, sizeof(req), CGW_SRC_IF, &src_ifindex, sizeof(src_ifindex));
-	addattr_l(&req.nh, sizeof(req), CGW_DST_IF, &dst_ifindex, sizeof(dst_ifindex));
+	if (addattr_l(nh, maxlen, CGW_SRC_IF, &r->src_ifindex, sizeof(r->src_ifindex)) ||
+	    addattr_l(nh, maxlen, CGW_DST_IF, &r->dst_ifindex, sizeof(r->dst_ifindex)))
+		return -1;
 
 	/* add new attributes here */
 
-	if (have_filter)
-		addattr_l(&req.nh, sizeof(req), CGW_FILTER, &filter, sizeof(filter));
+	if (r->have_filter &&
+	    addattr_l(nh, maxlen, CGW_FILTER, &r->filter, sizeof(r->filter)))
+		return -1;
 
-	if (have_cs_crc8)
-		addattr_l(&req.nh, sizeof(req), CGW_CS_CRC8, &cs_crc8, sizeof(cs_crc8));
+	if (r->have_cs_crc8 &&
+	    addattr_l(nh, maxlen, CGW_CS_CRC8, &r->cs_crc8, sizeof(r->cs_crc8)))
+		return -1;
 
-	if (have_cs_xor)
-		addattr_l(&req.nh, sizeof(req), CGW_CS_XOR, &cs_xor, sizeof(cs_xor));
+	if (r->have_cs_xor &&
+	    addattr_l(nh, maxlen, CGW_CS_XOR, &r->cs_xor, sizeof(r->cs_xor)))
+		return -1;
 
-	if (uid)
-		addattr_l(&req.nh, sizeof(req), CGW_MOD_UID, &uid, sizeof(__u32));
+	if (r->uid &&
+	    addattr_l(nh, maxlen, CGW_MOD_UID, &r->uid, sizeof(__u32)))
+		return -1;
 
-	if (limit_hops)
-		addattr_l(&req.nh, sizeof(req), CGW_LIM_HOPS, &limit_hops, sizeof(__u8));
+	if (r->limit_hops &&
+	    addattr_l(nh, maxlen, CGW_LIM_HOPS, &r->limit_hops, sizeof(__u8)))
+		return -1;
 
 	/*
 	 * a better example code
@@ -954,77 +931,1007 @@ int main(int argc, char **argv)
 	 */
 
 	/* add up to CGW_MOD_FUNCS modification definitions */
-	for (i = 0; i < modidx; i++)
-		addattr_l(&req.nh, sizeof(req), modmsg[i].instruction, &modmsg[i], CGW_MODATTR_LEN);
+	for (i = 0; i < r->modidx; i++) {
+		if (addattr_l(nh, maxlen, r->modmsg[i].instruction,
+			      &r->modmsg[i], CGW_MODATTR_LEN))
+			return -1;
+	}
 
 	/* add up to CGW_FDMOD_FUNCS modification definitions */
-	for (i = 0; i < fdmodidx; i++)
-		addattr_l(&req.nh, sizeof(req), fdmodmsg[i].instruction, &fdmodmsg[i], CGW_FDMODATTR_LEN);
+	for (i = 0; i < r->fdmodidx; i++) {
+		if (addattr_l(nh, maxlen, r->fdmodmsg[i].instruction,
+			      &r->fdmodmsg[i], CGW_FDMODATTR_LEN))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int nl_send(int s, void *buf, int len)
+{
+	struct sockaddr_nl nladdr;
 
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
 	nladdr.nl_pid    = 0;
 	nladdr.nl_groups = 0;
 
-	err = sendto(s, &req, req.nh.nlmsg_len, 0,
-		     (struct sockaddr*)&nladdr, sizeof(nladdr));
-	if (err < 0) {
-		perror("netlink sendto");
-		return err;
-	}
+	return sendto(s, buf, len, 0, (struct sockaddr*)&nladdr, sizeof(nladdr));
+}
 
-	/* clean netlink receive buffer */
-	memset(rxbuf, 0x0, sizeof(rxbuf));
+/*
+ * Dump all gateway rules and hand each of them to rule_cb().
+ * The large receive buffer allows the kernel to pack many rules
+ * into each netlink dump message.
+ */
+static int nl_dump_rules(int s, int (*rule_cb)(struct gwrule *r, void *data),
+			 void *data)
+{
+	static unsigned char rxbuf[NL_RXBUF_SIZE]; /* netlink receive buffer */
+	struct {
+		struct nlmsghdr nh;
+		struct rtcanmsg rtcan;
+	} req;
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *rte;
+	struct gwrule rule;
+	int len, err;
 
-	if (cmd != LIST) {
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtcanmsg));
+	req.nh.nlmsg_type  = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.rtcan.can_family = AF_CAN;
+	req.rtcan.gwtype = CGW_TYPE_CAN_CAN;
 
-		/*
-		 * cmd == ADD || cmd == DEL || cmd == FLUSH
-		 *
-		 * Parse the requested netlink acknowledge return values.
-		 */
+	if (nl_send(s, &req, req.nh.nlmsg_len) < 0) {
+		perror("netlink sendto");
+		return -errno;
+	}
 
-		err = recv(s, &rxbuf, sizeof(rxbuf), 0);
-		if (err < 0) {
+	while (1) {
+		len = recv(s, rxbuf, sizeof(rxbuf), 0);
+		if (len < 0) {
 			perror("netlink recv");
-			return err;
+			return -errno;
 		}
-		nlh = (struct nlmsghdr *)rxbuf;
-		if (nlh->nlmsg_type != NLMSG_ERROR) {
-			fprintf(stderr, "unexpected netlink answer of type %d\n", nlh->nlmsg_type);
-			return -EINVAL;
+
+		for (nlh = (struct nlmsghdr *)rxbuf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+
+			/* leave on errors or NLMSG_DONE */
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				rte = (struct nlmsgerr *)NLMSG_DATA(nlh);
+				fprintf(stderr, "netlink error %d (%s)\n",
+					rte->error, strerror(abs(rte->error)));
+				return rte->error ? rte->error : -EINVAL;
+			}
+
+			err = rule_from_nlmsg(nlh, &rule);
+			if (err)
+				return err;
+
+			err = rule_cb(&rule, data);
+			if (err)
+				return err;
 		}
-		rte = (struct nlmsgerr *)NLMSG_DATA(nlh);
-		err = rte->error;
-		if (err < 0)
-			fprintf(stderr, "netlink error %d (%s)\n", err, strerror(abs(err)));
+	}
+}
 
-	} else {
+/*
+ * Send the given rules as RTM_NEWROUTE/RTM_DELROUTE requests. As many
+ * requests as fit into one buffer are sent with a single sendto() and
+ * the acknowledges are collected afterwards. Returns the number of
+ * rules that have been rejected by the kernel.
+ */
+static int nl_apply_rules(int s, char *prgname, struct gwrule **rules,
+			  int count, __u16 type)
+{
+	static unsigned char txbuf[NL_TXBUF_SIZE];
+	static unsigned char rxbuf[NL_RXBUF_SIZE];
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *rte;
+	int failed = 0;
+	int first = 0;
+	int txlen, pending, len, idx;
+
+	while (first < count) {
+		txlen = 0;
+		idx = first;
+
+		while (idx < count && (int)sizeof(txbuf) - txlen >= NL_RULEMSG_MAX) {
+			nlh = (struct nlmsghdr *)(txbuf + txlen);
+			if (build_rule_msg(nlh, NL_RULEMSG_MAX, rules[idx], type,
+					   NLM_F_REQUEST | NLM_F_ACK, idx + 1))
+				return count - first;
+
+			txlen += NLMSG_ALIGN(nlh->nlmsg_len);
+			idx++;
+		}
 
-		/* cmd == LIST */
+		if (nl_send(s, txbuf, txlen) < 0) {
+			perror("netlink sendto");
+			return count - first;
+		}
+
+		pending = idx - first;
 
-		while (1) {
-			len = recv(s, &rxbuf, sizeof(rxbuf), 0);
+		while (pending) {
+			len = recv(s, rxbuf, sizeof(rxbuf), 0);
 			if (len < 0) {
 				perror("netlink recv");
-				return len;
+				return failed + pending + count - idx;
+			}
+
+			for (nlh = (struct nlmsghdr *)rxbuf; NLMSG_OK(nlh, len);
+			     nlh = NLMSG_NEXT(nlh, len)) {
+
+				if (nlh->nlmsg_type != NLMSG_ERROR) {
+					fprintf(stderr, "unexpected netlink answer of type %d\n",
+						nlh->nlmsg_type);
+					continue;
+				}
+
+				pending--;
+
+				rte = (struct nlmsgerr *)NLMSG_DATA(nlh);
+				if (rte->error >= 0)
+					continue;
+
+				failed++;
+				fprintf(stderr, "netlink error %d (%s) on %s rule: ",
+					rte->error, strerror(abs(rte->error)),
+					(type == RTM_NEWROUTE) ? "adding" : "deleting");
+
+				if (nlh->nlmsg_seq >= 1 && nlh->nlmsg_seq <= (__u32)count) {
+					fflush(stdout);
+					print_rule(prgname, rules[nlh->nlmsg_seq - 1]);
+					fflush(stdout);
+				} else {
+					fprintf(stderr, "(unknown sequence %u)\n",
+						nlh->nlmsg_seq);
+				}
 			}
-#if 0
-			printf("received msg len %d\n", len);
+		}
 
-			for (i = 0; i < len; i++)
-				printf("%02X ", rxbuf[i]);
+		first = idx;
+	}
 
-			printf("\n");
-#endif
-			/* leave on errors or NLMSG_DONE */
-			if (parse_rtlist(argv[0], rxbuf, len))
+	return failed;
+}
+
+static int check_rule(struct gwrule *r)
+{
+	if (r->flags & CGW_FLAGS_CAN_FD) {
+		if (r->modidx) {
+			printf("No -m modifications allowed in CAN FD mode!\n");
+			return 1;
+		}
+	} else {
+		if (r->fdmodidx) {
+			printf("No -M modifications allowed in Classic CAN mode!\n");
+			return 1;
+		}
+	}
+
+	if ((!r->modidx && !r->fdmodidx) && (r->have_cs_crc8 || r->have_cs_xor)) {
+		printf("-c or -x can only be used in conjunction with -m/-M\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse one of the rule related command line options into r.
+ * Returns 0 on success and 1 on a bad definition (already reported).
+ */
+static int parse_rule_opt(int opt, char *optarg, struct gwrule *r)
+{
+	int err;
+
+	switch (opt) {
+
+	case 's':
+		r->src_ifindex = ifname2index(optarg);
+		if (!r->src_ifindex) {
+			perror("src if_nametoindex");
+			return 1;
+		}
+		break;
+
+	case 'd':
+		r->dst_ifindex = ifname2index(optarg);
+		if (!r->dst_ifindex) {
+			perror("dst if_nametoindex");
+			return 1;
+		}
+		break;
+
+	case 'X':
+		r->flags |= CGW_FLAGS_CAN_FD;
+		break;
+
+	case 't':
+		r->flags |= CGW_FLAGS_CAN_SRC_TSTAMP;
+		break;
+
+	case 'e':
+		r->flags |= CGW_FLAGS_CAN_ECHO;
+		break;
+
+	case 'i':
+		r->flags |= CGW_FLAGS_CAN_IIF_TX_OK;
+		break;
+
+	case 'u':
+		r->uid = strtoul(optarg, NULL, 16);
+		break;
+
+	case 'l':
+		if (sscanf(optarg, "%hhu", &r->limit_hops) != 1 || !(r->limit_hops)) {
+			printf("Bad hop limit definition '%s'.\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'f':
+		if (sscanf(optarg, "%x:%x", &r->filter.can_id,
+			   &r->filter.can_mask) == 2) {
+			r->have_filter = 1;
+		} else if (sscanf(optarg, "%x~%x", &r->filter.can_id,
+				  &r->filter.can_mask) == 2) {
+			r->filter.can_id |= CAN_INV_FILTER;
+			r->have_filter = 1;
+		} else {
+			printf("Bad filter definition '%s'.\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'x':
+		if (sscanf(optarg, "%hhd:%hhd:%hhd:%hhx",
+			   &r->cs_xor.from_idx, &r->cs_xor.to_idx,
+			   &r->cs_xor.result_idx, &r->cs_xor.init_xor_val) == 4) {
+			r->have_cs_xor = 1;
+		} else {
+			printf("Bad XOR checksum definition '%s'.\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'c': {
+		char crc8tab[513] = {0};
+
+		if ((sscanf(optarg, "%hhd:%hhd:%hhd:%hhx:%hhx:%512s",
+			    &r->cs_crc8.from_idx, &r->cs_crc8.to_idx,
+			    &r->cs_crc8.result_idx, &r->cs_crc8.init_crc_val,
+			    &r->cs_crc8.final_xor_val, crc8tab) == 6) &&
+		    (strlen(crc8tab) == 512) &&
+		    (b64hex(crc8tab, (unsigned char *)&r->cs_crc8.crctab, 256) == 0)) {
+			r->have_cs_crc8 = 1;
+		} else {
+			printf("Bad CRC8 checksum definition '%s'.\n", optarg);
+			return 1;
+		}
+		break;
+	}
+
+	case 'p':
+		if (parse_crc8_profile(optarg, &r->cs_crc8)) {
+			printf("Bad CRC8 profile definition '%s'.\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'm':
+		/* may be triggered by each of the CGW_MOD_FUNCS functions */
+		if ((r->modidx < CGW_MOD_FUNCS) && (err = parse_mod(optarg, &r->modmsg[r->modidx++]))) {
+			printf("Problem %d with modification definition '%s'.\n", err, optarg);
+			return 1;
+		}
+		break;
+
+	case 'M':
+		/* may be triggered by each of the CGW_FDMOD_FUNCS functions */
+		if ((r->fdmodidx < CGW_MOD_FUNCS) && (err = parse_fdmod(optarg, &r->fdmodmsg[r->fdmodidx++]))) {
+			printf("Problem %d with modification definition '%s'.\n", err, optarg);
+			return 1;
+		}
+		break;
+
+	default:
+		return 1;
+	}
+
+	return 0;
+}
+
+struct rulelist {
+	struct gwrule **rules;
+	int count;
+	int alloced; /* allocated rules - reused after rulelist_reset() */
+	int size;
+};
+
+static struct gwrule *rulelist_add(struct rulelist *list)
+{
+	struct gwrule **rules;
+	struct gwrule *r;
+
+	if (list->count < list->alloced) {
+		r = list->rules[list->count++];
+		memset(r, 0, sizeof(*r));
+		return r;
+	}
+
+	if (list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 64;
+		rules = realloc(list->rules, list->size * sizeof(*rules));
+		if (!rules) {
+			perror("realloc");
+			exit(1);
+		}
+		list->rules = rules;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		perror("calloc");
+		exit(1);
+	}
+
+	list->rules[list->count++] = r;
+	list->alloced++;
+
+	return r;
+}
+
+static void rulelist_reset(struct rulelist *list)
+{
+	list->count = 0;
+}
+
+static void rulelist_free(struct rulelist *list)
+{
+	int i;
+
+	for (i = 0; i < list->alloced; i++)
+		free(list->rules[i]);
+
+	free(list->rules);
+	memset(list, 0, sizeof(*list));
+}
+
+/*
+ * Read a rule file in the format of the list output (-L), e.g.
+ *
+ * cangw -A -s can0 -d vcan3 -e -f 123:C00007FF # comment
+ *
+ * The leading program name and -A are optional. Empty lines and
+ * everything following a '#' are ignored.
+ */
+static int read_rulefile(const char *filename, struct rulelist *list)
+{
+	char *tokv[RULEFILE_MAXTOKENS + 2];
+	char *line = NULL;
+	size_t linesize = 0;
+	int lineno = 0;
+	int tokc, opt;
+	struct gwrule *r;
+	char *ptr;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		perror(filename);
+		return 1;
+	}
+
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+
+		ptr = strchr(line, '#');
+		if (ptr)
+			*ptr = 0;
+
+		tokc = 0;
+		tokv[tokc++] = "cangw";
+		for (ptr = strtok(line, " \t\r\n"); ptr; ptr = strtok(NULL, " \t\r\n")) {
+			/* skip the program name */
+			if (tokc == 1 && ptr[0] != '-')
+				continue;
+
+			if (tokc > RULEFILE_MAXTOKENS) {
+				fprintf(stderr, "%s:%d: too many options\n", filename, lineno);
+				goto out_err;
+			}
+			tokv[tokc++] = ptr;
+		}
+		tokv[tokc] = NULL;
+
+		if (tokc == 1)
+			continue;
+
+		r = rulelist_add(list);
+		r->lineno = lineno;
+
+		/* restart getopt() for each line */
+		optind = 0;
+		while ((opt = getopt(tokc, tokv, "A" RULE_OPTS)) != -1) {
+			if (opt == 'A')
+				continue;
+
+			if (opt == '?' || parse_rule_opt(opt, optarg, r)) {
+				fprintf(stderr, "%s:%d: bad rule definition\n", filename, lineno);
+				goto out_err;
+			}
+		}
+
+		if (optind != tokc || !r->src_ifindex || !r->dst_ifindex ||
+		    check_rule(r)) {
+			fprintf(stderr, "%s:%d: incomplete rule definition\n", filename, lineno);
+			goto out_err;
+		}
+
+		normalize_rule(r);
+	}
+
+	free(line);
+	fclose(fp);
+	return 0;
+
+ out_err:
+	free(line);
+	fclose(fp);
+	return 1;
+}
+
+static int print_rule_cb(struct gwrule *r, void *data)
+{
+	char *prgname = data;
+
+	if (prgname)
+		print_rule(prgname, r);
+	else
+		print_rule_json(r);
+
+	return 0;
+}
+
+static int collect_rule_cb(struct gwrule *r, void *data)
+{
+	struct rulelist *list = data;
+
+	*rulelist_add(list) = *r;
+
+	return 0;
+}
+
+/*
+ * Converge the kernel rule set to the rules given in rulefile:
+ * Only the missing rules are added and the surplus rules are deleted,
+ * so routing of unchanged rules is not interrupted. New rules are added
+ * before outdated rules are deleted.
+ */
+static int sync_rules(int s, char *prgname, const char *rulefile, int dryrun)
+{
+	struct rulelist want = { 0 };
+	struct rulelist have = { 0 };
+	struct gwrule **add, **del;
+	int nadd = 0, ndel = 0;
+	int i, j, k, cmp;
+	int err;
+
+	if (read_rulefile(rulefile, &want))
+		return 1;
+
+	err = nl_dump_rules(s, collect_rule_cb, &have);
+	if (err) {
+		rulelist_free(&want);
+		rulelist_free(&have);
+		return 1;
+	}
+
+	for (i = 0; i < have.count; i++)
+		normalize_rule(have.rules[i]);
+
+	qsort(want.rules, want.count, sizeof(*want.rules), rule_cmp);
+	qsort(have.rules, have.count, sizeof(*have.rules), rule_cmp);
+
+	add = calloc(want.count + 1, sizeof(*add));
+	del = calloc(have.count + 1, sizeof(*del));
+	if (!add || !del) {
+		perror("calloc");
+		exit(1);
+	}
+
+	/* merge both sorted lists (identical rules may exist several times) */
+	i = 0;
+	j = 0;
+	while (i < want.count || j < have.count) {
+		if (i == want.count)
+			cmp = 1;
+		else if (j == have.count)
+			cmp = -1;
+		else
+			cmp = rule_cmp(&want.rules[i], &have.rules[j]);
+
+		if (cmp < 0) {
+			add[nadd++] = want.rules[i++];
+		} else if (cmp > 0) {
+			del[ndel++] = have.rules[j++];
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	/*
+	 * Adding a rule with an already existing uid updates the
+	 * modifications of the existing rule in the kernel. A following
+	 * delete of the outdated rule would remove the updated rule.
+	 */
+	for (j = 0, k = 0; j < ndel; j++) {
+		for (i = 0; i < nadd; i++) {
+			if (del[j]->uid && del[j]->uid == add[i]->uid &&
+			    del[j]->src_ifindex == add[i]->src_ifindex &&
+			    del[j]->dst_ifindex == add[i]->dst_ifindex)
 				break;
 		}
+
+		if (i == nadd)
+			del[k++] = del[j];
 	}
+	ndel = k;
 
-	close(s);
+	if (dryrun) {
+		for (i = 0; i < nadd; i++) {
+			printf("+ ");
+			print_rule(prgname, add[i]);
+		}
+		for (j = 0; j < ndel; j++) {
+			printf("- ");
+			print_rule(prgname, del[j]);
+		}
+		err = 0;
+	} else {
+		err = nl_apply_rules(s, prgname, add, nadd, RTM_NEWROUTE);
+		err += nl_apply_rules(s, prgname, del, ndel, RTM_DELROUTE);
+	}
+
+	fprintf(stderr, "%s: %d rules kept, %d added, %d deleted%s\n",
+		basename(prgname), want.count - nadd, nadd, ndel,
+		dryrun ? " (dry run)" : "");
+
+	if (err)
+		fprintf(stderr, "%s: %d rules failed\n", basename(prgname), err);
+
+	free(add);
+	free(del);
+	rulelist_free(&want);
+	rulelist_free(&have);
+
+	return err ? 1 : 0;
+}
+
+static void print_rule_summary(struct gwrule *r)
+{
+	printf("-s %s ", ifindex2name(r->src_ifindex));
+	printf("-d %s ", ifindex2name(r->dst_ifindex));
+
+	if (r->flags & CGW_FLAGS_CAN_FD)
+		printf("-X ");
+
+	if (r->have_filter)
+		printfilter(&r->filter);
+
+	if (r->uid)
+		printf("-u %X ", r->uid);
+
+	if (r->modidx + r->fdmodidx)
+		printf("(%d mods) ", r->modidx + r->fdmodidx);
+}
+
+static void print_rates_json(struct gwrule *r, int idx, struct timespec *now)
+{
+	printf("{\"time\":%lld.%06ld,\"rule\":%d,", (long long)now->tv_sec,
+	       now->tv_nsec / 1000, idx);
+	printf("\"src\":\"%s\",", ifindex2name(r->src_ifindex));
+	printf("\"dst\":\"%s\",", ifindex2name(r->dst_ifindex));
+
+	if (r->have_filter)
+		printf("\"filter\":\"%03X%c%X\",", r->filter.can_id & ~CAN_INV_FILTER,
+		       (r->filter.can_id & CAN_INV_FILTER) ? '~' : ':',
+		       r->filter.can_mask);
+
+	if (r->uid)
+		printf("\"uid\":\"%X\",", r->uid);
+
+	printf("\"handled\":%u,\"dropped\":%u,\"deleted\":%u,",
+	       r->handled, r->dropped, r->deleted);
+	printf("\"handled_per_s\":%.1f,\"dropped_per_s\":%.1f,\"deleted_per_s\":%.1f}\n",
+	       r->handled_rate, r->dropped_rate, r->deleted_rate);
+}
+
+static int rate_cmp(const void *a, const void *b)
+{
+	const struct gwrule *ra = *(const struct gwrule **)a;
+	const struct gwrule *rb = *(const struct gwrule **)b;
+
+	/* dropping rules first, then by frame rate */
+	if (ra->dropped_rate != rb->dropped_rate)
+		return (ra->dropped_rate < rb->dropped_rate) ? 1 : -1;
+
+	if (ra->handled_rate != rb->handled_rate)
+		return (ra->handled_rate < rb->handled_rate) ? 1 : -1;
+
+	return 0;
+}
+
+/*
+ * Periodically dump the rules and calculate the per rule frame rates
+ * from the difference to the previous dump. The rules of both dumps are
+ * sorted by their rule key and matched in a single merge pass. The rule
+ * buffers are reused, so there are no allocations after the first dumps.
+ */
+static int watch_rules(int s, int interval_ms, int json, int show_all)
+{
+	struct rulelist lists[2] = { { 0 } };
+	struct rulelist *cur = &lists[0];
+	struct rulelist *prev = &lists[1];
+	struct rulelist *tmp;
+	struct gwrule **shown = NULL;
+	int shown_size = 0;
+	struct timespec next, now, last;
+	int have_last = 0;
+	double dt, handled_sum, dropped_sum;
+	int tty = isatty(STDOUT_FILENO);
+	int nshown, i, j, cmp;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (1) {
+		rulelist_reset(cur);
+
+		err = nl_dump_rules(s, collect_rule_cb, cur);
+		if (err)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (i = 0; i < cur->count; i++)
+			normalize_rule(cur->rules[i]);
+
+		qsort(cur->rules, cur->count, sizeof(*cur->rules), rule_cmp);
+
+		if (shown_size < cur->count) {
+			shown_size = cur->count;
+			free(shown);
+			shown = malloc(shown_size * sizeof(*shown));
+			if (!shown) {
+				perror("malloc");
+				exit(1);
+			}
+		}
+
+		if (have_last)
+			dt = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+		else
+			dt = 0;
+		nshown = 0;
+		handled_sum = 0;
+		dropped_sum = 0;
+
+		/* match the rules of both dumps (u32 counters may wrap) */
+		i = 0;
+		j = 0;
+		while (i < cur->count && have_last) {
+			struct gwrule *r = cur->rules[i];
+
+			if (j == prev->count)
+				cmp = -1;
+			else
+				cmp = rule_cmp(&cur->rules[i], &prev->rules[j]);
+
+			if (cmp > 0) {
+				/* rule has been removed */
+				j++;
+				continue;
+			}
+
+			if (cmp == 0) {
+				r->handled_rate = (__u32)(r->handled - prev->rules[j]->handled) / dt;
+				r->dropped_rate = (__u32)(r->dropped - prev->rules[j]->dropped) / dt;
+				r->deleted_rate = (__u32)(r->deleted - prev->rules[j]->deleted) / dt;
+				j++;
+			}
+
+			/* new rules (cmp < 0) start with zero rates */
+
+			handled_sum += r->handled_rate;
+			dropped_sum += r->dropped_rate;
+
+			if (show_all || r->handled_rate || r->dropped_rate ||
+			    r->deleted_rate)
+				shown[nshown++] = r;
+
+			i++;
+		}
+
+		if (have_last) {
+			qsort(shown, nshown, sizeof(*shown), rate_cmp);
+
+			if (json) {
+				for (i = 0; i < nshown; i++)
+					print_rates_json(shown[i], i, &now);
+			} else {
+				if (tty)
+					printf("%s%s", CLR_SCREEN, CSR_HOME);
+
+				printf("%d rules, %d active: %.1f frames/s handled, %.1f frames/s dropped\n\n",
+				       cur->count, nshown, handled_sum, dropped_sum);
+				printf("%12s %12s %12s %6s  rule\n",
+				       "handled/s", "dropped/s", "deleted/s", "drop%");
+
+				for (i = 0; i < nshown; i++) {
+					struct gwrule *r = shown[i];
+					double total = r->handled_rate + r->dropped_rate;
+
+					if (tty && r->dropped_rate)
+						printf("%s", ATTDROP);
+
+					printf("%12.1f %12.1f %12.1f %5.1f%%  ",
+					       r->handled_rate, r->dropped_rate,
+					       r->deleted_rate,
+					       total ? 100.0 * r->dropped_rate / total : 0.0);
+					print_rule_summary(r);
+
+					if (tty && r->dropped_rate)
+						printf("%s", ATTRESET);
+
+					printf("\n");
+				}
+
+				if (!tty)
+					printf("\n");
+			}
+
+			fflush(stdout);
+		}
+
+		last = now;
+		have_last = 1;
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+
+		/* absolute timeouts avoid drifting intervals */
+		next.tv_sec += interval_ms / 1000;
+		next.tv_nsec += (interval_ms % 1000) * 1000000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+	}
+
+	free(shown);
+	rulelist_free(&lists[0]);
+	rulelist_free(&lists[1]);
 
 	return err;
 }
 
+int main(int argc, char **argv)
+{
+	int s;
+	int err = 0;
+
+	int opt;
+	extern int optind, opterr, optopt;
+
+	int cmd = UNSPEC;
+	int json = 0;
+	int dryrun = 0;
+	int show_all = 0;
+	int interval_ms = 0;
+	char *rulefile = NULL;
+
+	struct {
+		struct nlmsghdr nh;
+		struct rtcanmsg rtcan;
+		char buf[1500];
+	} req;
+
+	unsigned char rxbuf[8192]; /* netlink receive buffer */
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *rte;
+	__u16 nlflags = 0;
+	__u16 type = 0;
+	int rcvbuf = NL_SOCK_RCVBUF;
+	int one = 1;
+
+	struct gwrule rule;
+
+	memset(&req, 0, sizeof(req));
+	memset(&rule, 0, sizeof(rule));
+
+	while ((opt = getopt(argc, argv, "ADFLS:W:ajn" RULE_OPTS "?")) != -1) {
+		switch (opt) {
+
+		case 'A':
+			if (cmd == UNSPEC)
+				cmd = ADD;
+			break;
+
+		case 'D':
+			if (cmd == UNSPEC)
+				cmd = DEL;
+			break;
+
+		case 'F':
+			if (cmd == UNSPEC)
+				cmd = FLUSH;
+			break;
+
+		case 'L':
+			if (cmd == UNSPEC)
+				cmd = LIST;
+			break;
+
+		case 'S':
+			if (cmd == UNSPEC) {
+				cmd = SYNC;
+				rulefile = optarg;
+			}
+			break;
+
+		case 'W':
+			if (cmd == UNSPEC) {
+				cmd = WATCH;
+				interval_ms = strtoul(optarg, NULL, 10);
+				if (!interval_ms) {
+					printf("Bad watch interval '%s'.\n", optarg);
+					exit(1);
+				}
+			}
+			break;
+
+		case 'a':
+			show_all = 1;
+			break;
+
+		case 'j':
+			json = 1;
+			break;
+
+		case 'n':
+			dryrun = 1;
+			break;
+
+		case '?':
+			print_usage(basename(argv[0]));
+			exit(0);
+			break;
+
+		default:
+			if (strchr(RULE_OPTS, opt)) {
+				if (parse_rule_opt(opt, optarg, &rule))
+					exit(1);
+				break;
+			}
+
+			fprintf(stderr, "Unknown option %c\n", opt);
+			print_usage(basename(argv[0]));
+			exit(1);
+			break;
+		}
+	}
+
+	if ((argc - optind != 0) || (cmd == UNSPEC)) {
+		print_usage(basename(argv[0]));
+		exit(1);
+	}
+
+	if ((cmd == ADD || cmd == DEL) &&
+	    ((!rule.src_ifindex) || (!rule.dst_ifindex))) {
+		print_usage(basename(argv[0]));
+		exit(1);
+	}
+
+	if (check_rule(&rule))
+		exit(1);
+
+	s = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (s < 0) {
+		perror("netlink socket");
+		return 1;
+	}
+
+	switch (cmd) {
+
+	case ADD:
+		nlflags = NLM_F_REQUEST | NLM_F_ACK;
+		type  = RTM_NEWROUTE;
+		break;
+
+	case DEL:
+		nlflags = NLM_F_REQUEST | NLM_F_ACK;
+		type  = RTM_DELROUTE;
+		break;
+
+	case FLUSH:
+		nlflags = NLM_F_REQUEST | NLM_F_ACK;
+		type  = RTM_DELROUTE;
+		/* if_index set to 0 => remove all entries */
+		rule.src_ifindex  = 0;
+		rule.dst_ifindex  = 0;
+		break;
+
+	case LIST:
+		err = nl_dump_rules(s, print_rule_cb, json ? NULL : argv[0]);
+		close(s);
+		return err;
+
+	case SYNC:
+		/* batched requests: only report errors and keep acks small */
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		setsockopt(s, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+		err = sync_rules(s, argv[0], rulefile, dryrun);
+		close(s);
+		return err;
+
+	case WATCH:
+		err = watch_rules(s, interval_ms, json, show_all);
+		close(s);
+		return err;
+
+	default:
+		printf("This function is not yet implemented.\n");
+		exit(1);
+		break;
+	}
+
+	build_rule_msg(&req.nh, sizeof(req), &rule, type, nlflags, 0);
+
+	err = nl_send(s, &req, req.nh.nlmsg_len);
+	if (err < 0) {
+		perror("netlink sendto");
+		return err;
+	}
+
+	/* clean netlink receive buffer */
+	memset(rxbuf, 0x0, sizeof(rxbuf));
+
+	/*
+	 * cmd == ADD || cmd == DEL || cmd == FLUSH
+	 *
+	 * Parse the requested netlink acknowledge return values.
+	 */
+
+	err = recv(s, &rxbuf, sizeof(rxbuf), 0);
+	if (err < 0) {
+		perror("netlink recv");
+		return err;
+	}
+	nlh = (struct nlmsghdr *)rxbuf;
+	if (nlh->nlmsg_type != NLMSG_ERROR) {
+		fprintf(stderr, "unexpected netlink answer of type %d\n", nlh->nlmsg_type);
+		return -EINVAL;
+	}
+	rte = (struct nlmsgerr *)NLMSG_DATA(nlh);
+	err = rte->error;
+	if (err < 0)
+		fprintf(stderr, "netlink error %d (%s)\n", err, strerror(abs(err)));
+
+	close(s);
+
+	return err;
+}
@@ -0,0 +1,324 @@
+/* SPDX-License-Identifier: (GPL-2.0-only OR BSD-3-Clause) */
+/*
+ * canlogbin.c - binary streaming protocol of canlogserver
+ *
+ * Send feedback to <linux-can@vger.kernel.org>
+ *
+ */
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <string.h>
+
+#include "canlogbin.h"
+
+int clb_put_frame(void *buf, cu_t *cu, int ifindex, struct timeval *tv)
+{
+	struct clb_frame_hdr *hdr = buf;
+	unsigned char *data = (unsigned char *)buf + sizeof(*hdr);
+	int len;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->tv_sec = htobe64(tv->tv_sec);
+	hdr->tv_usec = htonl(tv->tv_usec);
+	hdr->ifindex = htonl(ifindex);
+
+	if (cu->xl.flags & CANXL_XLF) {
+		len = cu->xl.len;
+		if (len > CANXL_MAX_DLEN)
+			len = CANXL_MAX_DLEN;
+		hdr->type = CLB_TYPE_XL;
+		hdr->can_id = htonl(cu->xl.prio);
+		hdr->flags = cu->xl.flags;
+		hdr->len8_dlc = cu->xl.sdt;
+		hdr->af = htonl(cu->xl.af);
+		memcpy(data, cu->xl.data, len);
+	} else if (cu->fd.flags & CANFD_FDF) {
+		len = cu->fd.len;
+		if (len > CANFD_MAX_DLEN)
+			len = CANFD_MAX_DLEN;
+		hdr->type = CLB_TYPE_FD;
+		hdr->can_id = htonl(cu->fd.can_id);
+		hdr->flags = cu->fd.flags;
+		memcpy(data, cu->fd.data, len);
+	} else {
+		len = cu->cc.len;
+		if (len > CAN_MAX_DLEN)
+			len = CAN_MAX_DLEN;
+		hdr->type = CLB_TYPE_CC;
+		hdr->can_id = htonl(cu->cc.can_id);
+		hdr->len8_dlc = cu->cc.len8_dlc;
+		memcpy(data, cu->cc.data, len);
+	}
+
+	hdr->len = htons(len);
+
+	return sizeof(*hdr) + len;
+}
+
+int clb_get_frame(const void *buf, size_t len, cu_t *cu, int *ifindex,
+		  struct timeval *tv)
+{
+	struct clb_frame_hdr hdr;
+	const unsigned char *data = (const unsigned char *)buf + sizeof(hdr);
+	unsigned int dlen;
+
+	if (len < sizeof(hdr))
+		return -1;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	dlen = ntohs(hdr.len);
+
+	if (len < sizeof(hdr) + dlen)
+		return -1;
+
+	tv->tv_sec = be64toh(hdr.tv_sec);
+	tv->tv_usec = ntohl(hdr.tv_usec);
+	*ifindex = ntohl(hdr.ifindex);
+
+	memset(cu, 0, sizeof(*cu));
+
+	switch (hdr.type) {
+	case CLB_TYPE_CC:
+		if (dlen > CAN_MAX_DLEN)
+			return -1;
+		cu->cc.can_id = ntohl(hdr.can_id);
+		cu->cc.len = dlen;
+		cu->cc.len8_dlc = hdr.len8_dlc;
+		memcpy(cu->cc.data, data, dlen);
+		break;
+
+	case CLB_TYPE_FD:
+		if (dlen > CANFD_MAX_DLEN)
+			return -1;
+		cu->fd.can_id = ntohl(hdr.can_id);
+		cu->fd.len = dlen;
+		cu->fd.flags = hdr.flags | CANFD_FDF;
+		memcpy(cu->fd.data, data, dlen);
+		break;
+
+	case CLB_TYPE_XL:
+		if (dlen < CANXL_MIN_DLEN || dlen > CANXL_MAX_DLEN)
+			return -1;
+		cu->xl.prio = ntohl(hdr.can_id);
+		cu->xl.flags = hdr.flags | CANXL_XLF;
+		cu->xl.sdt = hdr.len8_dlc;
+		cu->xl.len = dlen;
+		cu->xl.af = ntohl(hdr.af);
+		memcpy(cu->xl.data, data, dlen);
+		break;
+
+	default:
+		return -1;
+	}
+
+	return sizeof(hdr) + dlen;
+}
+
+void clb_put_msg_hdr(void *buf, __u8 type, __u8 flags, __u16 count,
+		     __u32 len, __u32 rawlen)
+{
+	struct clb_msg_hdr *hdr = buf;
+
+	hdr->type = type;
+	hdr->flags = flags;
+	hdr->count = htons(count);
+	hdr->len = htonl(len);
+	hdr->rawlen = htonl(rawlen);
+}
+
+/*
+ * LZ4 block format: a sequence starts with a token holding the literal
+ * length (high nibble) and the match length - 4 (low nibble). A nibble
+ * value of 15 is extended by bytes that are added until a byte != 255.
+ * The literals are followed by the 16 bit little endian match offset.
+ * The last sequence only contains literals and the last 5 bytes of the
+ * block are always literals.
+ */
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAXOFFSET 65535
+#define LZ4_HASHLOG 12
+
+static inline __u32 lz4_read32(const unsigned char *ptr)
+{
+	__u32 val;
+
+	memcpy(&val, ptr, sizeof(val));
+
+	return val;
+}
+
+static inline unsigned int lz4_hash(__u32 val)
+{
+	return (val * 2654435761U) >> (32 - LZ4_HASHLOG);
+}
+
+static unsigned char *lz4_put_len(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+static unsigned char *lz4_put_seq(unsigned char *op, const unsigned char *oend,
+				  const unsigned char *lit, size_t litlen,
+				  size_t offset, size_t mlen)
+{
+	unsigned char *token;
+
+	/* worst case space for this sequence */
+	if ((size_t)(oend - op) < 1 + litlen + litlen / 255 + 1 + 2 + mlen / 255 + 1)
+		return NULL;
+
+	token = op++;
+
+	if (litlen >= 15) {
+		*token = 15 << 4;
+		op = lz4_put_len(op, litlen - 15);
+	} else {
+		*token = litlen << 4;
+	}
+
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	/* last literals only */
+	if (!mlen)
+		return op;
+
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+
+	mlen -= LZ4_MINMATCH;
+	if (mlen >= 15) {
+		*token |= 15;
+		op = lz4_put_len(op, mlen - 15);
+	} else {
+		*token |= mlen;
+	}
+
+	return op;
+}
+
+int clb_lz4_compress(const void *src, int srclen, void *dst, int dstcap)
+{
+	const unsigned char *istart = src;
+	const unsigned char *iend = istart + srclen;
+	const unsigned char *mflimit = iend - LZ4_MFLIMIT;
+	const unsigned char *matchlimit = iend - LZ4_LASTLITERALS;
+	const unsigned char *ip = istart;
+	const unsigned char *anchor = istart;
+	const unsigned char *match;
+	unsigned char *op = dst;
+	const unsigned char *oend = op + dstcap;
+	unsigned int table[1 << LZ4_HASHLOG]; /* position + 1, 0 is unused */
+	unsigned int h;
+	size_t mlen;
+
+	memset(table, 0, sizeof(table));
+
+	while (srclen > LZ4_MFLIMIT && ip <= mflimit) {
+		h = lz4_hash(lz4_read32(ip));
+		match = table[h] ? istart + table[h] - 1 : NULL;
+		table[h] = ip - istart + 1;
+
+		if (!match || ip - match > LZ4_MAXOFFSET ||
+		    lz4_read32(match) != lz4_read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		mlen = LZ4_MINMATCH;
+		while (ip + mlen < matchlimit && ip[mlen] == match[mlen])
+			mlen++;
+
+		op = lz4_put_seq(op, oend, anchor, ip - anchor, ip - match, mlen);
+		if (!op)
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = lz4_put_seq(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (unsigned char *)dst;
+}
+
+static int lz4_get_len(const unsigned char **ip, const unsigned char *iend,
+		       size_t *len)
+{
+	unsigned char byte;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+
+	return 0;
+}
+
+int clb_lz4_decompress(const void *src, int srclen, void *dst, int dstcap)
+{
+	const unsigned char *ip = src;
+	const unsigned char *iend = ip + srclen;
+	unsigned char *ostart = dst;
+	unsigned char *op = dst;
+	unsigned char *oend = op + dstcap;
+	const unsigned char *match;
+	unsigned char token;
+	size_t len, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == 15 && lz4_get_len(&ip, iend, &len))
+			return -1;
+
+		if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+			return -1;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (!offset || offset > (size_t)(op - ostart))
+			return -1;
+
+		len = token & 15;
+		if (len == 15 && lz4_get_len(&ip, iend, &len))
+			return -1;
+		len += LZ4_MINMATCH;
+
+		if (len > (size_t)(oend - op))
+			return -1;
+
+		/* byte wise copy as source and destination may overlap */
+		match = op - offset;
+		while (len--)
+			*op++ = *match++;
+	}
+
+	return op - ostart;
+}
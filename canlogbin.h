@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: (GPL-2.0-only OR BSD-3-Clause) */
+/*
+ * canlogbin.h - binary streaming protocol of canlogserver
+ *
+ * Send feedback to <linux-can@vger.kernel.org>
+ *
+ */
+
+#ifndef CANLOGBIN_H
+#define CANLOGBIN_H
+
+#include <linux/can.h>
+#include <linux/types.h>
+#include <net/if.h>
+#include <sys/time.h>
+
+#include "lib.h"
+
+/*
+ * By default canlogserver sends ASCII log file lines. A client requests
+ * the binary stream by sending the line
+ *
+ *   "binary\n"      (uncompressed messages)
+ *   "binary lz4\n"  (messages may be LZ4 block compressed)
+ *
+ * The server completes a partially sent log line, sends CLB_MAGIC and
+ * continues with a stream of messages. Each message is a struct
+ * clb_msg_hdr followed by 'len' bytes of payload. When CLB_FLAG_LZ4 is
+ * set the payload is a LZ4 block that decompresses to 'rawlen' bytes.
+ *
+ * The (decompressed) payload of CLB_MSG_FRAMES holds 'count' records of
+ * a struct clb_frame_hdr followed by 'len' bytes of CAN frame data.
+ * CLB_MSG_IFNAME holds 'count' struct clb_ifname entries and is sent
+ * before the first frame of a new interface index.
+ *
+ * All multi byte values are in network byte order.
+ */
+
+#define CLB_MAGIC "\0CLSBIN\1"
+#define CLB_MAGIC_LEN 8
+
+#define CLB_REQ_BINARY "binary"
+#define CLB_REQ_LZ4 "lz4"
+
+/* message types */
+#define CLB_MSG_FRAMES 1
+#define CLB_MSG_IFNAME 2
+
+/* message flags */
+#define CLB_FLAG_LZ4 0x01
+
+/* upper limit for (decompressed) payloads accepted by receivers */
+#define CLB_MAX_PAYLOAD (4 * 1024 * 1024)
+
+struct clb_msg_hdr {
+	__u8 type;
+	__u8 flags;
+	__be16 count;
+	__be32 len;
+	__be32 rawlen;
+} __attribute__((packed));
+
+/* frame types */
+#define CLB_TYPE_CC 0
+#define CLB_TYPE_FD 1
+#define CLB_TYPE_XL 2
+
+struct clb_frame_hdr {
+	__be64 tv_sec;
+	__be32 tv_usec;
+	__be32 ifindex;
+	__be32 can_id;	/* CAN XL: prio (incl. VCID) */
+	__u8 type;
+	__u8 flags;	/* CAN FD / CAN XL flags */
+	__be16 len;
+	__u8 len8_dlc;	/* CAN XL: SDT */
+	__u8 res[3];
+	__be32 af;	/* CAN XL: acceptance field */
+} __attribute__((packed));
+
+struct clb_ifname {
+	__be32 ifindex;
+	char name[IFNAMSIZ];
+} __attribute__((packed));
+
+/* max. size of a struct clb_frame_hdr followed by the frame data */
+#define CLB_MAX_RECORD (sizeof(struct clb_frame_hdr) + CANXL_MAX_DLEN)
+
+/* worst case size of a LZ4 block for len bytes of input */
+#define CLB_LZ4_BOUND(len) ((len) + (len) / 255 + 16)
+
+/*
+ * Write a frame record for the CAN CC/FD/XL frame cu to buf which has to
+ * provide CLB_MAX_RECORD bytes. For CAN CC/FD frames the CANFD_FDF flag
+ * has to mark the frame type as in candump. Returns the record length.
+ */
+int clb_put_frame(void *buf, cu_t *cu, int ifindex, struct timeval *tv);
+
+/*
+ * Read a frame record from buf with len bytes into cu, ifindex and tv.
+ * Returns the record length or -1 on malformed records.
+ */
+int clb_get_frame(const void *buf, size_t len, cu_t *cu, int *ifindex,
+		  struct timeval *tv);
+
+void clb_put_msg_hdr(void *buf, __u8 type, __u8 flags, __u16 count,
+		     __u32 len, __u32 rawlen);
+
+/*
+ * LZ4 block format compression (without LZ4 frame header).
+ * Returns the compressed length or 0 if it does not fit into dstcap.
+ */
+int clb_lz4_compress(const void *src, int srclen, void *dst, int dstcap);
+
+/* Returns the decompressed length or -1 on corrupted input */
+int clb_lz4_decompress(const void *src, int srclen, void *dst, int dstcap);
+
+#endif
@@ -0,0 +1,444 @@
+/* SPDX-License-Identifier: (GPL-2.0-only OR BSD-3-Clause) */
+/*
+ * canlogclient.c - receive the binary stream of canlogserver
+ *
+ * Converts the batched (and optionally LZ4 compressed) binary stream of
+ * canlogserver into the log file format of candump or stores the raw
+ * binary stream for a later conversion.
+ *
+ * Send feedback to <linux-can@vger.kernel.org>
+ *
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "canlogbin.h"
+#include "lib.h"
+
+#define DEFPORT "28700"
+#define RXBUFSZ (64 * 1024)
+
+static struct {
+	int ifindex;
+	char name[IFNAMSIZ];
+} *ifnames;
+static int ifnames_len;
+
+static int raw_output;
+static int print_stats;
+
+static unsigned long long rx_bytes;
+static unsigned long long raw_bytes;
+static unsigned long long rx_frames;
+static unsigned long long rx_msgs;
+
+extern int optind, opterr, optopt;
+
+static volatile int running = 1;
+
+static void print_usage(char *prg)
+{
+	fprintf(stderr, "%s - receive the binary stream of canlogserver.\n", prg);
+	fprintf(stderr, "\nUsage: %s [options] <host>\n", prg);
+	fprintf(stderr, "       %s [options] -f <file>\n", prg);
+	fprintf(stderr, "  (use CTRL-C to terminate %s)\n\n", prg);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "         -p <port>   (connect to port <port>. Default: %s)\n", DEFPORT);
+	fprintf(stderr, "         -z          (request LZ4 compressed messages)\n");
+	fprintf(stderr, "         -r          (write the raw binary stream to stdout)\n");
+	fprintf(stderr, "         -f <file>   (convert a raw binary stream file - '-' for stdin)\n");
+	fprintf(stderr, "         -s          (print transfer statistics to stderr at exit)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "The received CAN frames are printed in the candump log file format.\n");
+	fprintf(stderr, "Examples:\n");
+	fprintf(stderr, "  %s -z localhost > candump.log\n", prg);
+	fprintf(stderr, "  %s -r localhost > canlog.bin ; %s -f canlog.bin\n", prg, prg);
+	fprintf(stderr, "\n");
+}
+
+static void sigterm(int signo)
+{
+	running = 0;
+}
+
+static const char *ifname(int ifindex)
+{
+	static char buf[IFNAMSIZ];
+	int i;
+
+	for (i = 0; i < ifnames_len; i++) {
+		if (ifnames[i].ifindex == ifindex)
+			return ifnames[i].name;
+	}
+
+	snprintf(buf, sizeof(buf), "if%d", ifindex);
+
+	return buf;
+}
+
+static int handle_ifnames(const unsigned char *data, size_t len, int count)
+{
+	struct clb_ifname entry;
+	int i, j;
+
+	if (len < count * sizeof(entry))
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		memcpy(&entry, data + i * sizeof(entry), sizeof(entry));
+		entry.name[IFNAMSIZ - 1] = 0;
+
+		for (j = 0; j < ifnames_len; j++) {
+			if (ifnames[j].ifindex == (int)ntohl(entry.ifindex))
+				break;
+		}
+
+		if (j == ifnames_len) {
+			ifnames = realloc(ifnames, (ifnames_len + 1) * sizeof(*ifnames));
+			if (!ifnames) {
+				perror("realloc");
+				exit(1);
+			}
+			ifnames_len++;
+		}
+
+		ifnames[j].ifindex = ntohl(entry.ifindex);
+		strcpy(ifnames[j].name, entry.name);
+	}
+
+	return 0;
+}
+
+static int handle_frames(const unsigned char *data, size_t len, int count)
+{
+	static char buf[AFRSZ];
+	struct timeval tv;
+	cu_t cu;
+	int ifindex, reclen, i;
+
+	for (i = 0; i < count; i++) {
+		reclen = clb_get_frame(data, len, &cu, &ifindex, &tv);
+		if (reclen < 0)
+			return -1;
+
+		data += reclen;
+		len -= reclen;
+
+		snprintf_canframe(buf, sizeof(buf), &cu, 0);
+		printf("(%llu.%06llu) %s %s\n",
+		       (unsigned long long)tv.tv_sec,
+		       (unsigned long long)tv.tv_usec, ifname(ifindex), buf);
+		rx_frames++;
+	}
+
+	return 0;
+}
+
+static int handle_msg(const unsigned char *msg, size_t msglen)
+{
+	static unsigned char *rawbuf;
+	struct clb_msg_hdr hdr;
+	const unsigned char *data = msg + sizeof(hdr);
+	size_t len, rawlen;
+
+	memcpy(&hdr, msg, sizeof(hdr));
+	len = ntohl(hdr.len);
+	rawlen = ntohl(hdr.rawlen);
+
+	rx_msgs++;
+	raw_bytes += sizeof(hdr) + rawlen;
+
+	if (raw_output) {
+		if (fwrite(msg, 1, msglen, stdout) != msglen) {
+			perror("fwrite");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (hdr.flags & CLB_FLAG_LZ4) {
+		if (!rawbuf) {
+			rawbuf = malloc(CLB_MAX_PAYLOAD);
+			if (!rawbuf) {
+				perror("malloc");
+				return -1;
+			}
+		}
+
+		if (rawlen > CLB_MAX_PAYLOAD ||
+		    clb_lz4_decompress(data, len, rawbuf, rawlen) != (int)rawlen) {
+			fprintf(stderr, "corrupted compressed message\n");
+			return -1;
+		}
+
+		data = rawbuf;
+		len = rawlen;
+	}
+
+	switch (hdr.type) {
+	case CLB_MSG_FRAMES:
+		if (handle_frames(data, len, ntohs(hdr.count))) {
+			fprintf(stderr, "corrupted frame message\n");
+			return -1;
+		}
+		break;
+
+	case CLB_MSG_IFNAME:
+		if (handle_ifnames(data, len, ntohs(hdr.count))) {
+			fprintf(stderr, "corrupted interface name message\n");
+			return -1;
+		}
+		break;
+
+	default:
+		/* ignore unknown message types */
+		break;
+	}
+
+	return 0;
+}
+
+/* read the stream from fd and handle all complete messages */
+static int receive(int fd, int search_magic)
+{
+	unsigned char *buf, *ptr;
+	size_t bufsize = RXBUFSZ;
+	size_t len = 0;
+	size_t msglen;
+	struct clb_msg_hdr hdr;
+	ssize_t nbytes;
+	int ret = 0;
+
+	buf = malloc(bufsize);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+
+	while (running) {
+		nbytes = read(fd, buf + len, bufsize - len);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			ret = 1;
+			break;
+		}
+
+		if (!nbytes)
+			break;
+
+		rx_bytes += nbytes;
+		len += nbytes;
+		ptr = buf;
+
+		/* skip a partial ASCII log line that precedes the stream */
+		if (search_magic) {
+			unsigned char *magic;
+
+			magic = memmem(buf, len, CLB_MAGIC, CLB_MAGIC_LEN);
+			if (!magic) {
+				/* keep a possibly incomplete magic */
+				if (len >= CLB_MAGIC_LEN) {
+					memmove(buf, buf + len - (CLB_MAGIC_LEN - 1),
+						CLB_MAGIC_LEN - 1);
+					len = CLB_MAGIC_LEN - 1;
+				}
+				continue;
+			}
+
+			search_magic = 0;
+			ptr = magic + CLB_MAGIC_LEN;
+		}
+
+		while ((size_t)(buf + len - ptr) >= sizeof(hdr)) {
+			memcpy(&hdr, ptr, sizeof(hdr));
+
+			if (ntohl(hdr.len) > CLB_MAX_PAYLOAD ||
+			    ntohl(hdr.rawlen) > CLB_MAX_PAYLOAD) {
+				fprintf(stderr, "invalid message length\n");
+				ret = 1;
+				goto out;
+			}
+
+			msglen = sizeof(hdr) + ntohl(hdr.len);
+			if ((size_t)(buf + len - ptr) < msglen)
+				break;
+
+			if (handle_msg(ptr, msglen)) {
+				ret = 1;
+				goto out;
+			}
+
+			ptr += msglen;
+		}
+
+		/* move the incomplete message to the buffer start */
+		len = buf + len - ptr;
+		memmove(buf, ptr, len);
+
+		if (len >= sizeof(hdr)) {
+			memcpy(&hdr, buf, sizeof(hdr));
+			msglen = sizeof(hdr) + ntohl(hdr.len);
+
+			if (msglen > bufsize) {
+				bufsize = msglen;
+				buf = realloc(buf, bufsize);
+				if (!buf) {
+					perror("realloc");
+					return 1;
+				}
+			}
+		}
+	}
+
+	if (len && !search_magic)
+		fprintf(stderr, "incomplete message at end of stream\n");
+ out:
+	free(buf);
+
+	return ret;
+}
+
+static int connect_server(const char *host, const char *port, int lz4)
+{
+	struct addrinfo hints = { 0 };
+	struct addrinfo *res, *ai;
+	char req[32];
+	int s = -1;
+	int err;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0)
+			continue;
+
+		if (!connect(s, ai->ai_addr, ai->ai_addrlen))
+			break;
+
+		close(s);
+		s = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (s < 0) {
+		perror("connect");
+		return -1;
+	}
+
+	snprintf(req, sizeof(req), "%s%s\n", CLB_REQ_BINARY,
+		 lz4 ? " " CLB_REQ_LZ4 : "");
+
+	if (write(s, req, strlen(req)) < 0) {
+		perror("write");
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+int main(int argc, char **argv)
+{
+	const char *port = DEFPORT;
+	const char *filename = NULL;
+	static char outbuf[RXBUFSZ];
+	struct sigaction sa = { 0 };
+	int lz4 = 0;
+	int opt, fd, ret;
+
+	sa.sa_handler = sigterm;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	while ((opt = getopt(argc, argv, "p:zrf:s?")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = optarg;
+			break;
+
+		case 'z':
+			lz4 = 1;
+			break;
+
+		case 'r':
+			raw_output = 1;
+			break;
+
+		case 'f':
+			filename = optarg;
+			break;
+
+		case 's':
+			print_stats = 1;
+			break;
+
+		default:
+			print_usage(basename(argv[0]));
+			exit(1);
+			break;
+		}
+	}
+
+	if ((filename && argc - optind != 0) ||
+	    (!filename && argc - optind != 1)) {
+		print_usage(basename(argv[0]));
+		exit(1);
+	}
+
+	setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+	if (filename) {
+		if (!strcmp(filename, "-")) {
+			fd = STDIN_FILENO;
+		} else {
+			fd = open(filename, O_RDONLY);
+			if (fd < 0) {
+				perror(filename);
+				return 1;
+			}
+		}
+	} else {
+		fd = connect_server(argv[optind], port, lz4);
+		if (fd < 0)
+			return 1;
+	}
+
+	if (raw_output)
+		fwrite(CLB_MAGIC, 1, CLB_MAGIC_LEN, stdout);
+
+	/* a recorded stream starts with the magic too */
+	ret = receive(fd, 1);
+
+	fflush(stdout);
+	close(fd);
+
+	if (print_stats)
+		fprintf(stderr, "%llu bytes received, %llu bytes uncompressed, %llu messages, %llu frames\n",
+			rx_bytes, raw_bytes, rx_msgs, rx_frames);
+
+	return ret;
+}
@@ -43,6 +43,7 @@
  */
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <signal.h>
 #include <stdio.h>
@@ -53,30 +54,113 @@
 
 #include <net/if.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/uio.h>
-#include <sys/wait.h>
 
 #include <errno.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
 #include <linux/sockios.h>
-#include <signal.h>
 
+#include "canlogbin.h"
 #include "lib.h"
 
-#define MAXDEV 6 /* change sscanf()'s manually if changed here */
 #define ANYDEV "any"
 #define ANL "\r\n" /* newline in ASC mode */
 
 #define DEFPORT 28700
 
-static char devname[MAXDEV][IFNAMSIZ+1];
-static int  dindex[MAXDEV];
-static int  max_devname_len;
+#define RXBATCH 32 /* CAN frames received with one recvmmsg() */
+#define RXROUNDS 8 /* max. recvmmsg() calls per CAN socket and wakeup */
+#define MAXEVENTS 64
+#define MAXIOV 64
+#define LINESZ (AFRSZ + IFNAMSIZ + 2) /* one log line incl. newline */
+
+#define DEFCLIENTBUF 256 /* default client buffer size in KiB */
+#define CLIENTQUEUE 1024 /* max. queued log blocks per client */
+#define CMDBUFSZ 64 /* client request line */
+
+#define DEFBINBATCH 16 /* default binary message size in KiB */
+#define DEFBINLATENCY 20 /* default binary message latency in ms */
+
+enum {
+	EV_LISTEN,
+	EV_CAN,
+	EV_CLIENT,
+	EV_TIMER,
+};
+
+/* output format requested by the client */
+enum {
+	MODE_TEXT,
+	MODE_BIN,
+	MODE_BINLZ4,
+	MODE_MAX
+};
+
+/* event source referenced by epoll_event.data.ptr */
+struct evsrc {
+	int type;
+	int fd;
+};
+
+/*
+ * Log lines of one receive batch. A block is formatted once and shared
+ * by reference between the output queues of all connected clients.
+ */
+struct logblock {
+	int refcnt;
+	size_t len;
+	char data[];
+};
+
+struct client {
+	struct evsrc ev;
+	struct logblock *queue[CLIENTQUEUE];
+	unsigned int head;
+	unsigned int count;
+	size_t offset; /* bytes of queue[head] that are already sent */
+	size_t queued; /* bytes waiting to be sent */
+	unsigned long dropped; /* dropped log blocks */
+	int pollout;
+	int mode;
+	char cmdbuf[CMDBUFSZ];
+	int cmdlen;
+	struct client *next_closed;
+};
+
+static struct {
+	int ifindex;
+	char name[IFNAMSIZ];
+} *devcache;
+static int devcache_len;
+static int max_devname_len;
+
+static struct client **clients;
+static int nclients;
+static int maxclients;
+
+static int nmode[MODE_MAX]; /* number of clients per output format */
+
+/* closed clients may still be referenced by pending epoll events */
+static struct client *closed_clients;
+
+/* frame records collected for the next binary message */
+static unsigned char *binbuf;
+static size_t binlen;
+static size_t binbatch = DEFBINBATCH * 1024;
+static int binlatency = DEFBINLATENCY;
+static unsigned int binframes;
+static struct evsrc timersrc;
+
+static int epfd;
+static size_t clientbuf = DEFCLIENTBUF * 1024;
+static int disconnect_slow;
 
 extern int optind, opterr, optopt;
 
@@ -94,6 +178,11 @@ static void print_usage(char *prg)
 	fprintf(stderr, "         -i <0|1>    (invert the specified ID filter) *\n");
 	fprintf(stderr, "         -e <emask>  (mask for error frames)\n");
 	fprintf(stderr, "         -p <port>   (listen on port <port>. Default: %d)\n", DEFPORT);
+	fprintf(stderr, "         -b <kbytes> (output buffer per client. Default: %d)\n", DEFCLIENTBUF);
+	fprintf(stderr, "         -x          (disconnect slow clients instead of dropping\n");
+	fprintf(stderr, "                      their oldest pending log data)\n");
+	fprintf(stderr, "         -B <kbytes> (binary stream message size. Default: %d)\n", DEFBINBATCH);
+	fprintf(stderr, "         -L <ms>     (binary stream max. latency. Default: %d)\n", DEFBINLATENCY);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "* The CAN ID filter matches, when ...\n");
 	fprintf(stderr, "       <received_can_id> & mask == value & mask\n");
@@ -104,62 +193,64 @@ static void print_usage(char *prg)
 	fprintf(stderr, "\n");
 	fprintf(stderr, "After running canlogserver, connect to it via TCP to get logged data.\n");
 	fprintf(stderr, "e.g. with 'nc localhost %d'\n", DEFPORT);
+	fprintf(stderr, "Use 'canlogclient' to receive the batched (compressed) binary stream.\n");
 	fprintf(stderr, "\n");
 }
 
+static void bin_announce_ifname(int idx);
+
 static int idx2dindex(int ifidx, int socket)
 {
 	int i;
 	struct ifreq ifr;
 
-	for (i=0; i<MAXDEV; i++) {
-		if (dindex[i] == ifidx)
+	for (i = 0; i < devcache_len; i++) {
+		if (devcache[i].ifindex == ifidx)
 			return i;
 	}
 
 	/* create new interface index cache entry */
 
 	/* remove index cache zombies first */
-	for (i=0; i < MAXDEV; i++) {
-		if (dindex[i]) {
-			ifr.ifr_ifindex = dindex[i];
+	for (i = 0; i < devcache_len; i++) {
+		if (devcache[i].ifindex) {
+			ifr.ifr_ifindex = devcache[i].ifindex;
 			if (ioctl(socket, SIOCGIFNAME, &ifr) < 0)
-				dindex[i] = 0;
+				devcache[i].ifindex = 0;
 		}
 	}
 
-	for (i=0; i < MAXDEV; i++)
-		if (!dindex[i]) /* free entry */
+	for (i = 0; i < devcache_len; i++)
+		if (!devcache[i].ifindex) /* free entry */
 			break;
 
-	if (i == MAXDEV) {
-		printf("Interface index cache only supports %d interfaces.\n", MAXDEV);
-		exit(1);
+	if (i == devcache_len) {
+		devcache = realloc(devcache, (devcache_len + 1) * sizeof(*devcache));
+		if (!devcache) {
+			perror("realloc");
+			exit(1);
+		}
+		devcache_len++;
 	}
 
-	dindex[i] = ifidx;
+	devcache[i].ifindex = ifidx;
 
 	ifr.ifr_ifindex = ifidx;
-	if (ioctl(socket, SIOCGIFNAME, &ifr) < 0)
+	if (ioctl(socket, SIOCGIFNAME, &ifr) < 0) {
 		perror("SIOCGIFNAME");
+		ifr.ifr_name[0] = 0;
+	}
 
 	if (max_devname_len < (int)strlen(ifr.ifr_name))
 		max_devname_len = strlen(ifr.ifr_name);
 
-	strcpy(devname[i], ifr.ifr_name);
+	strcpy(devcache[i].name, ifr.ifr_name);
 
-	pr_debug("new index %d (%s)\n", i, devname[i]);
+	pr_debug("new index %d (%s)\n", i, devcache[i].name);
 
-	return i;
-}
+	bin_announce_ifname(i);
 
-/* 
- * This is a Signalhandler. When we get a signal, that a child
- * terminated, we wait for it, so the zombie will disappear.
- */
-static void childdied(int i)
-{
-	wait(NULL);
+	return i;
 }
 
 /*
@@ -171,18 +262,614 @@ static void shutdown_gra(int i)
 	signal_num = i;
 }
 
+/* parse the comma separated values of the m/v/i/e options */
+static int parse_values(char *arg, __u32 *vals, int max, int base)
+{
+	char *ptr = arg;
+	char *end;
+	int n = 0;
+
+	while (1) {
+		__u32 val = strtoul(ptr, &end, base);
+
+		if (end == ptr)
+			break;
+
+		if (n < max)
+			vals[n] = val;
+		n++;
+
+		if (*end != ',')
+			break;
+		ptr = end + 1;
+	}
+
+	return n;
+}
+
+static void logblock_put(struct logblock *blk)
+{
+	if (--blk->refcnt == 0)
+		free(blk);
+}
+
+static void client_set_pollout(struct client *c, int on)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP,
+		.data.ptr = c,
+	};
+
+	if (c->pollout == on)
+		return;
+
+	if (on)
+		ev.events |= EPOLLOUT;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->ev.fd, &ev) < 0)
+		perror("epoll_ctl");
+
+	c->pollout = on;
+}
+
+static void client_close(struct client *c)
+{
+	int i;
+
+	if (c->dropped)
+		fprintf(stderr, "client %d: dropped %lu log blocks\n",
+			c->ev.fd, c->dropped);
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->ev.fd, NULL);
+	close(c->ev.fd);
+	nmode[c->mode]--;
+
+	while (c->count) {
+		logblock_put(c->queue[c->head]);
+		c->head = (c->head + 1) % CLIENTQUEUE;
+		c->count--;
+	}
+
+	for (i = 0; i < nclients; i++) {
+		if (clients[i] == c) {
+			clients[i] = clients[--nclients];
+			break;
+		}
+	}
+
+	c->ev.fd = -1;
+	c->next_closed = closed_clients;
+	closed_clients = c;
+}
+
+static void clients_free_closed(void)
+{
+	struct client *c;
+
+	while (closed_clients) {
+		c = closed_clients;
+		closed_clients = c->next_closed;
+		free(c);
+	}
+}
+
+/* send as much queued data as possible without blocking */
+static int client_flush(struct client *c)
+{
+	struct iovec iov[MAXIOV];
+	struct msghdr msg = { 0 };
+	unsigned int i, idx;
+	ssize_t nbytes;
+	size_t len;
+
+	while (c->count) {
+		for (i = 0; i < c->count && i < MAXIOV; i++) {
+			idx = (c->head + i) % CLIENTQUEUE;
+			iov[i].iov_base = c->queue[idx]->data;
+			iov[i].iov_len = c->queue[idx]->len;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + c->offset;
+		iov[0].iov_len -= c->offset;
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = i;
+
+		nbytes = sendmsg(c->ev.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (nbytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		c->queued -= nbytes;
+
+		/* release completely sent blocks */
+		while (nbytes) {
+			len = c->queue[c->head]->len - c->offset;
+			if ((size_t)nbytes < len) {
+				c->offset += nbytes;
+				break;
+			}
+
+			nbytes -= len;
+			logblock_put(c->queue[c->head]);
+			c->head = (c->head + 1) % CLIENTQUEUE;
+			c->count--;
+			c->offset = 0;
+		}
+	}
+
+	client_set_pollout(c, c->count != 0);
+
+	return 0;
+}
+
+/*
+ * Queue a log block for a client. When the client does not keep up,
+ * either its oldest unsent blocks are dropped or it is disconnected.
+ */
+static int client_queue(struct client *c, struct logblock *blk)
+{
+	unsigned int next;
+
+	while (c->count == CLIENTQUEUE || c->queued + blk->len > clientbuf) {
+
+		if (disconnect_slow)
+			return -1;
+
+		/* a partially sent block has to be completed */
+		if (c->count <= (c->offset ? 1U : 0U))
+			break;
+
+		if (c->offset) {
+			/* drop the block following the partially sent one */
+			next = (c->head + 1) % CLIENTQUEUE;
+			c->queued -= c->queue[next]->len;
+			logblock_put(c->queue[next]);
+			c->queue[next] = c->queue[c->head];
+		} else {
+			c->queued -= c->queue[c->head]->len;
+			logblock_put(c->queue[c->head]);
+		}
+
+		c->head = (c->head + 1) % CLIENTQUEUE;
+		c->count--;
+		c->dropped++;
+	}
+
+	if (c->count == CLIENTQUEUE)
+		return 0;
+
+	blk->refcnt++;
+	c->queue[(c->head + c->count) % CLIENTQUEUE] = blk;
+	c->count++;
+	c->queued += blk->len;
+
+	return 0;
+}
+
+static void clients_send(struct logblock *blk, int mode)
+{
+	int i;
+
+	/* iterate backwards as client_close() reorders the list */
+	for (i = nclients - 1; i >= 0; i--) {
+		struct client *c = clients[i];
+
+		if (c->mode != mode)
+			continue;
+
+		if (client_queue(c, blk) < 0 || client_flush(c) < 0)
+			client_close(c);
+	}
+}
+
+static struct logblock *logblock_alloc(size_t len)
+{
+	struct logblock *blk;
+
+	blk = malloc(sizeof(*blk) + len);
+	if (!blk) {
+		perror("malloc");
+		exit(1);
+	}
+
+	blk->refcnt = 1;
+	blk->len = len;
+
+	return blk;
+}
+
+/* create a binary message block - LZ4 compressed if this helps */
+static struct logblock *bin_msg(__u8 type, __u16 count, const void *data,
+				size_t len, int lz4)
+{
+	struct clb_msg_hdr *hdr;
+	struct logblock *blk;
+	int zlen = 0;
+
+	blk = logblock_alloc(sizeof(*hdr) + (lz4 ? CLB_LZ4_BOUND(len) : len));
+	hdr = (struct clb_msg_hdr *)blk->data;
+
+	if (lz4)
+		zlen = clb_lz4_compress(data, len, blk->data + sizeof(*hdr), len);
+
+	if (zlen) {
+		clb_put_msg_hdr(hdr, type, CLB_FLAG_LZ4, count, zlen, len);
+		blk->len = sizeof(*hdr) + zlen;
+	} else {
+		clb_put_msg_hdr(hdr, type, 0, count, len, len);
+		memcpy(blk->data + sizeof(*hdr), data, len);
+		blk->len = sizeof(*hdr) + len;
+	}
+
+	return blk;
+}
+
+/* send the collected frame records to the binary clients */
+static void bin_flush(void)
+{
+	struct logblock *blk;
+	int mode;
+
+	if (!binlen)
+		return;
+
+	for (mode = MODE_BIN; mode <= MODE_BINLZ4; mode++) {
+		if (!nmode[mode])
+			continue;
+
+		blk = bin_msg(CLB_MSG_FRAMES, binframes, binbuf, binlen,
+			      mode == MODE_BINLZ4);
+		clients_send(blk, mode);
+		logblock_put(blk);
+	}
+
+	binlen = 0;
+	binframes = 0;
+}
+
+static void bin_add_frame(cu_t *cu, int ifindex, struct timeval *tv)
+{
+	struct itimerspec its = { 0 };
+
+	/* start the latency timer with the first record */
+	if (!binlen) {
+		its.it_value.tv_sec = binlatency / 1000;
+		its.it_value.tv_nsec = (binlatency % 1000) * 1000000;
+		if (timerfd_settime(timersrc.fd, 0, &its, NULL) < 0)
+			perror("timerfd_settime");
+	}
+
+	binlen += clb_put_frame(binbuf + binlen, cu, ifindex, tv);
+	binframes++;
+
+	if (binlen >= binbatch || binframes == 0xFFFF)
+		bin_flush();
+}
+
+static void bin_send_ifnames(struct client *c, int first, int count)
+{
+	struct clb_ifname *names;
+	struct logblock *blk;
+	int i;
+
+	names = calloc(count, sizeof(*names));
+	if (!names) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++) {
+		names[i].ifindex = htonl(devcache[first + i].ifindex);
+		strcpy(names[i].name, devcache[first + i].name);
+	}
+
+	blk = bin_msg(CLB_MSG_IFNAME, count, names, count * sizeof(*names), 0);
+	free(names);
+
+	if (c) {
+		if (client_queue(c, blk) < 0 || client_flush(c) < 0)
+			client_close(c);
+	} else {
+		clients_send(blk, MODE_BIN);
+		clients_send(blk, MODE_BINLZ4);
+	}
+
+	logblock_put(blk);
+}
+
+/* the binary clients learn new interface names before their frames */
+static void bin_announce_ifname(int idx)
+{
+	if (!nmode[MODE_BIN] && !nmode[MODE_BINLZ4])
+		return;
+
+	bin_flush();
+	bin_send_ifnames(NULL, idx, 1);
+}
+
+/* switch the client to the binary stream requested with cmd */
+static void client_command(struct client *c, char *cmd)
+{
+	struct logblock *blk;
+	int mode;
+
+	if (!strcmp(cmd, CLB_REQ_BINARY))
+		mode = MODE_BIN;
+	else if (!strcmp(cmd, CLB_REQ_BINARY " " CLB_REQ_LZ4))
+		mode = MODE_BINLZ4;
+	else
+		return;
+
+	if (c->mode != MODE_TEXT)
+		return;
+
+	/* only complete a partially sent log block */
+	while (c->count > (c->offset ? 1U : 0U)) {
+		unsigned int last = (c->head + c->count - 1) % CLIENTQUEUE;
+
+		c->queued -= c->queue[last]->len;
+		logblock_put(c->queue[last]);
+		c->count--;
+	}
+
+	nmode[c->mode]--;
+	c->mode = mode;
+	nmode[c->mode]++;
+
+	blk = logblock_alloc(CLB_MAGIC_LEN);
+	memcpy(blk->data, CLB_MAGIC, CLB_MAGIC_LEN);
+	if (client_queue(c, blk) < 0 || client_flush(c) < 0) {
+		logblock_put(blk);
+		client_close(c);
+		return;
+	}
+	logblock_put(blk);
+
+	if (devcache_len)
+		bin_send_ifnames(c, 0, devcache_len);
+}
+
+static void client_accept(int socki)
+{
+	struct sockaddr_in clientaddr;
+	socklen_t sin_size = sizeof(clientaddr);
+	struct epoll_event ev;
+	struct client *c;
+	int accsocket;
+
+	accsocket = accept4(socki, (struct sockaddr*)&clientaddr, &sin_size,
+			    SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (accsocket < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+			perror("accept");
+		return;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		perror("calloc");
+		close(accsocket);
+		return;
+	}
+
+	c->ev.type = EV_CLIENT;
+	c->ev.fd = accsocket;
+	c->mode = MODE_TEXT;
+
+	if (nclients == maxclients) {
+		struct client **tmp;
+
+		maxclients = maxclients ? maxclients * 2 : 16;
+		tmp = realloc(clients, maxclients * sizeof(*clients));
+		if (!tmp) {
+			perror("realloc");
+			exit(1);
+		}
+		clients = tmp;
+	}
+
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, accsocket, &ev) < 0) {
+		perror("epoll_ctl");
+		close(accsocket);
+		free(c);
+		return;
+	}
+
+	clients[nclients++] = c;
+	nmode[c->mode]++;
+}
+
+static void client_input(struct client *c, unsigned int events)
+{
+	char buf[256];
+	ssize_t nbytes;
+	int i;
+
+	if (events & EPOLLOUT) {
+		if (client_flush(c) < 0) {
+			client_close(c);
+			return;
+		}
+	}
+
+	if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		return;
+
+	nbytes = recv(c->ev.fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (nbytes == 0 || (nbytes < 0 && errno != EAGAIN && errno != EINTR)) {
+		client_close(c);
+		return;
+	}
+
+	/* collect request lines - overlong lines are discarded */
+	for (i = 0; i < nbytes && c->ev.fd >= 0; i++) {
+		if (buf[i] == '\n' || buf[i] == '\r') {
+			if (c->cmdlen < CMDBUFSZ) {
+				c->cmdbuf[c->cmdlen] = 0;
+				client_command(c, c->cmdbuf);
+			}
+			c->cmdlen = 0;
+		} else if (c->cmdlen < CMDBUFSZ) {
+			c->cmdbuf[c->cmdlen++] = buf[i];
+		}
+	}
+}
+
+/* check the received CAN frame and mark the CAN CC/FD/XL frame type */
+static int check_frame(cu_t *cu, int nbytes)
+{
+	if (nbytes < (int)CANXL_HDR_SIZE + CANXL_MIN_DLEN) {
+		fprintf(stderr, "read: no CAN frame\n");
+		return -1;
+	}
+
+	if (cu->xl.flags & CANXL_XLF) {
+		if (nbytes != (int)CANXL_HDR_SIZE + cu->xl.len) {
+			printf("nbytes = %d\n", nbytes);
+			fprintf(stderr, "read: no CAN XL frame\n");
+			return -1;
+		}
+	} else {
+		/* mark dual-use struct canfd_frame */
+		if (nbytes == CAN_MTU) {
+			cu->fd.flags = 0;
+		} else if (nbytes == CANFD_MTU) {
+			cu->fd.flags |= CANFD_FDF;
+		} else {
+			fprintf(stderr, "read: incomplete CAN CC/FD frame\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* format a received CAN frame as log file line, returns the length */
+static int format_frame(char *buf, cu_t *cu, int idx, struct timeval *tv)
+{
+	int len;
+
+	len = sprintf(buf, "(%llu.%06llu) %*s ",
+		      (unsigned long long)tv->tv_sec, (unsigned long long)tv->tv_usec,
+		      max_devname_len, devcache[idx].name);
+	len += snprintf_canframe(buf + len, LINESZ - len - 1, cu, 0);
+	buf[len++] = '\n';
+
+#if 0
+	/* print CAN frame in log file style to stdout */
+	fwrite(buf, 1, len, stdout);
+#endif
+
+	return len;
+}
+
+/*
+ * Drain a CAN socket with recvmmsg() and distribute the received frames
+ * to all clients. The log lines of one batch are formatted only once.
+ */
+static int can_receive(int s)
+{
+	static cu_t cu[RXBATCH]; /* union for CAN CC/FD/XL frames */
+	static struct sockaddr_can addr[RXBATCH];
+	static char ctrlmsg[RXBATCH][CMSG_SPACE(sizeof(struct timeval))];
+	static char linebuf[RXBATCH * LINESZ];
+	struct mmsghdr msgs[RXBATCH];
+	struct iovec iov[RXBATCH];
+	struct logblock *blk;
+	struct cmsghdr *cmsg;
+	struct timeval tv;
+	int round, nframes, i, idx;
+	int text = nmode[MODE_TEXT];
+	int bin = nmode[MODE_BIN] + nmode[MODE_BINLZ4];
+	size_t len;
+
+	for (round = 0; round < RXROUNDS; round++) {
+
+		for (i = 0; i < RXBATCH; i++) {
+			iov[i].iov_base = &cu[i];
+			iov[i].iov_len = sizeof(cu[i]);
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_name = &addr[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = ctrlmsg[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrlmsg[i]);
+		}
+
+		nframes = recvmmsg(s, msgs, RXBATCH, MSG_DONTWAIT, NULL);
+		if (nframes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 0;
+			perror("read");
+			return -1;
+		}
+
+		/* nobody is interested in the content */
+		if (!nclients) {
+			if (nframes < RXBATCH)
+				return 0;
+			continue;
+		}
+
+		len = 0;
+		for (i = 0; i < nframes; i++) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+
+			for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+			     cmsg && (cmsg->cmsg_level == SOL_SOCKET);
+			     cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+				if (cmsg->cmsg_type == SO_TIMESTAMP)
+					memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+			}
+
+			if (check_frame(&cu[i], msgs[i].msg_len))
+				continue;
+
+			/* may announce a new interface to binary clients */
+			idx = idx2dindex(addr[i].can_ifindex, s);
+
+			if (text)
+				len += format_frame(linebuf + len, &cu[i], idx, &tv);
+
+			if (bin)
+				bin_add_frame(&cu[i], addr[i].can_ifindex, &tv);
+		}
+
+		if (len) {
+			blk = logblock_alloc(len);
+			memcpy(blk->data, linebuf, len);
+
+			clients_send(blk, MODE_TEXT);
+			logblock_put(blk);
+		}
+
+		if (nframes < RXBATCH)
+			return 0;
+	}
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	struct sigaction signalaction;
 	sigset_t sigset;
-	fd_set rdfs;
-	int s[MAXDEV];
-	int socki, accsocket;
-	canid_t mask[MAXDEV] = {0};
-	canid_t value[MAXDEV] = {0};
-	int inv_filter[MAXDEV] = {0};
-	can_err_mask_t err_mask[MAXDEV] = {0};
-	int opt, ret;
+	struct epoll_event events[MAXEVENTS];
+	struct epoll_event ev;
+	struct evsrc *cansrc;
+	struct evsrc listensrc;
+	int socki;
+	char *optmask = NULL, *optvalue = NULL, *optinv = NULL, *opterrmask = NULL;
+	__u32 *mask, *value, *inv_filter, *err_mask;
+	int opt, nevents, n;
 	int currmax = 1; /* we assume at least one can bus ;-) */
 	struct sockaddr_can addr;
 	struct can_raw_vcid_options vcid_opts = {
@@ -191,65 +878,71 @@ int main(int argc, char **argv)
 		.rx_vcid_mask = 0,
 	};
 	struct can_filter rfilter;
-	static cu_t cu; /* union for CAN CC/FD/XL frames */
 	const int canfx_on = 1;
-	int nbytes, i, j;
+	const int timestamp_on = 1;
+	int i, j;
 	struct ifreq ifr;
-	struct timeval tv;
 	int port = DEFPORT;
 	struct sockaddr_in inaddr;
-	struct sockaddr_in clientaddr;
-	socklen_t sin_size = sizeof(clientaddr);
-	static char afrbuf[AFRSZ];
 
 	sigemptyset(&sigset);
-	signalaction.sa_handler = &childdied;
-	signalaction.sa_mask = sigset;
-	signalaction.sa_flags = 0;
-	sigaction(SIGCHLD, &signalaction, NULL);  /* install signal for dying child */
 	signalaction.sa_handler = &shutdown_gra;
 	signalaction.sa_mask = sigset;
 	signalaction.sa_flags = 0;
 	sigaction(SIGTERM, &signalaction, NULL); /* install Signal for termination */
 	sigaction(SIGINT, &signalaction, NULL); /* install Signal for termination */
 
-	while ((opt = getopt(argc, argv, "m:v:i:e:p:?")) != -1) {
+	while ((opt = getopt(argc, argv, "m:v:i:e:p:b:xB:L:?")) != -1) {
 
 		switch (opt) {
 		case 'm':
-			i = sscanf(optarg, "%x,%x,%x,%x,%x,%x",
-				   &mask[0], &mask[1], &mask[2],
-				   &mask[3], &mask[4], &mask[5]);
-			if (i > currmax)
-				currmax = i;
+			optmask = optarg;
 			break;
 
 		case 'v':
-			i = sscanf(optarg, "%x,%x,%x,%x,%x,%x",
-				   &value[0], &value[1], &value[2],
-				   &value[3], &value[4], &value[5]);
-			if (i > currmax)
-				currmax = i;
+			optvalue = optarg;
 			break;
 
 		case 'i':
-			i = sscanf(optarg, "%d,%d,%d,%d,%d,%d",
-				   &inv_filter[0], &inv_filter[1], &inv_filter[2],
-				   &inv_filter[3], &inv_filter[4], &inv_filter[5]);
-			if (i > currmax)
-				currmax = i;
+			optinv = optarg;
 			break;
 
 		case 'e':
-			i = sscanf(optarg, "%x,%x,%x,%x,%x,%x",
-				   &err_mask[0], &err_mask[1], &err_mask[2],
-				   &err_mask[3], &err_mask[4], &err_mask[5]);
-			if (i > currmax)
-				currmax = i;
+			opterrmask = optarg;
 			break;
+
 		case 'p':
 			port = atoi(optarg);
 			break;
+
+		case 'b':
+			clientbuf = strtoul(optarg, NULL, 10) * 1024;
+			if (!clientbuf) {
+				printf("invalid client buffer size '%s'\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'x':
+			disconnect_slow = 1;
+			break;
+
+		case 'B':
+			binbatch = strtoul(optarg, NULL, 10) * 1024;
+			if (!binbatch || binbatch > CLB_MAX_PAYLOAD / 2) {
+				printf("invalid binary message size '%s'\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'L':
+			binlatency = strtoul(optarg, NULL, 10);
+			if (!binlatency) {
+				printf("invalid binary message latency '%s'\n", optarg);
+				return 1;
+			}
+			break;
+
 		default:
 			print_usage(basename(argv[0]));
 			exit(1);
@@ -262,56 +955,60 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
-	/* count in options higher than device count ? */
-	if (optind + currmax > argc) {
-		printf("low count of CAN devices!\n");
+	n = argc - optind; /* find real number of CAN devices */
+
+	mask = calloc(n, sizeof(*mask));
+	value = calloc(n, sizeof(*value));
+	inv_filter = calloc(n, sizeof(*inv_filter));
+	err_mask = calloc(n, sizeof(*err_mask));
+	cansrc = calloc(n, sizeof(*cansrc));
+	if (!mask || !value || !inv_filter || !err_mask || !cansrc) {
+		perror("calloc");
 		return 1;
 	}
 
-	currmax = argc - optind; /* find real number of CAN devices */
+	if (optmask && (i = parse_values(optmask, mask, n, 16)) > currmax)
+		currmax = i;
+	if (optvalue && (i = parse_values(optvalue, value, n, 16)) > currmax)
+		currmax = i;
+	if (optinv && (i = parse_values(optinv, inv_filter, n, 10)) > currmax)
+		currmax = i;
+	if (opterrmask && (i = parse_values(opterrmask, err_mask, n, 16)) > currmax)
+		currmax = i;
 
-	if (currmax > MAXDEV) {
-		printf("More than %d CAN devices!\n", MAXDEV);
+	/* count in options higher than device count ? */
+	if (optind + currmax > argc) {
+		printf("low count of CAN devices!\n");
 		return 1;
 	}
 
+	currmax = n;
 
-	socki = socket(PF_INET, SOCK_STREAM, 0);
-	if (socki < 0) {
-		perror("socket");
-		exit(1);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return 1;
 	}
 
-	inaddr.sin_family = AF_INET;
-	inaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	inaddr.sin_port = htons(port);
-
-	while(bind(socki, (struct sockaddr*)&inaddr, sizeof(inaddr)) < 0) {
-		struct timespec f = {
-			.tv_nsec = 100 * 1000 * 1000,
-		};
-
-		printf(".");fflush(NULL);
-		nanosleep(&f, NULL);
+	/* binary messages are sent when full or after binlatency ms */
+	binbuf = malloc(binbatch + CLB_MAX_RECORD);
+	if (!binbuf) {
+		perror("malloc");
+		return 1;
 	}
 
-	if (listen(socki, 3) != 0) {
-		perror("listen");
-		exit(1);
+	timersrc.type = EV_TIMER;
+	timersrc.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timersrc.fd < 0) {
+		perror("timerfd_create");
+		return 1;
 	}
 
-	while(1) {
-		accsocket = accept(socki, (struct sockaddr*)&clientaddr, &sin_size);
-		if (accsocket > 0) {
-			//printf("accepted\n");
-			if (!fork())
-				break;
-			close(accsocket);
-		}
-		else if (errno != EINTR) {
-			perror("accept");
-			exit(1);
-		}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &timersrc;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, timersrc.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return 1;
 	}
 
 	for (i=0; i<currmax; i++) {
@@ -320,10 +1017,11 @@ int main(int argc, char **argv)
 		      i, argv[optind+i], mask[i], value[i],
 		      inv_filter[i], err_mask[i]);
 
-		if ((s[i] = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+		if ((cansrc[i].fd = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
 			perror("socket");
 			return 1;
 		}
+		cansrc[i].type = EV_CAN;
 
 		if (mask[i] || value[i]) {
 
@@ -337,22 +1035,29 @@ int main(int argc, char **argv)
 			if (inv_filter[i])
 				rfilter.can_id |= CAN_INV_FILTER;
 
-			setsockopt(s[i], SOL_CAN_RAW, CAN_RAW_FILTER,
+			setsockopt(cansrc[i].fd, SOL_CAN_RAW, CAN_RAW_FILTER,
 				   &rfilter, sizeof(rfilter));
 		}
 
 		if (err_mask[i])
-			setsockopt(s[i], SOL_CAN_RAW, CAN_RAW_ERR_FILTER,
+			setsockopt(cansrc[i].fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER,
 				   &err_mask[i], sizeof(err_mask[i]));
 
 		/* try to switch the socket into CAN FD mode */
-		setsockopt(s[i], SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &canfx_on, sizeof(canfx_on));
+		setsockopt(cansrc[i].fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &canfx_on, sizeof(canfx_on));
 
 		/* try to switch the socket into CAN XL mode */
-		setsockopt(s[i], SOL_CAN_RAW, CAN_RAW_XL_FRAMES, &canfx_on, sizeof(canfx_on));
+		setsockopt(cansrc[i].fd, SOL_CAN_RAW, CAN_RAW_XL_FRAMES, &canfx_on, sizeof(canfx_on));
 
 		/* try to enable the CAN XL VCID pass through mode */
-		setsockopt(s[i], SOL_CAN_RAW, CAN_RAW_XL_VCID_OPTS, &vcid_opts, sizeof(vcid_opts));
+		setsockopt(cansrc[i].fd, SOL_CAN_RAW, CAN_RAW_XL_VCID_OPTS, &vcid_opts, sizeof(vcid_opts));
+
+		/* the timestamp of each frame is needed for batched reception */
+		if (setsockopt(cansrc[i].fd, SOL_SOCKET, SO_TIMESTAMP,
+			       &timestamp_on, sizeof(timestamp_on)) < 0) {
+			perror("setsockopt SO_TIMESTAMP");
+			return 1;
+		}
 
 		j = strlen(argv[optind+i]);
 
@@ -368,7 +1073,7 @@ int main(int argc, char **argv)
 
 		if (strcmp(ANYDEV, argv[optind + i]) != 0) {
 			strcpy(ifr.ifr_name, argv[optind+i]);
-			if (ioctl(s[i], SIOCGIFINDEX, &ifr) < 0) {
+			if (ioctl(cansrc[i].fd, SIOCGIFINDEX, &ifr) < 0) {
 				perror("SIOCGIFINDEX");
 				exit(1);
 			}
@@ -376,89 +1081,105 @@ int main(int argc, char **argv)
 		} else
 			addr.can_ifindex = 0; /* any can interface */
 
-		if (bind(s[i], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if (bind(cansrc[i].fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 			perror("bindcan");
 			return 1;
 		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &cansrc[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, cansrc[i].fd, &ev) < 0) {
+			perror("epoll_ctl");
+			return 1;
+		}
 	}
 
-	while (running) {
+	socki = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (socki < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	inaddr.sin_family = AF_INET;
+	inaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	inaddr.sin_port = htons(port);
+
+	while(bind(socki, (struct sockaddr*)&inaddr, sizeof(inaddr)) < 0) {
+		struct timespec f = {
+			.tv_nsec = 100 * 1000 * 1000,
+		};
+
+		printf(".");fflush(NULL);
+		nanosleep(&f, NULL);
+	}
+
+	if (listen(socki, 32) != 0) {
+		perror("listen");
+		exit(1);
+	}
+
+	listensrc.type = EV_LISTEN;
+	listensrc.fd = socki;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listensrc;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, socki, &ev) < 0) {
+		perror("epoll_ctl");
+		return 1;
+	}
 
-		FD_ZERO(&rdfs);
-		for (i=0; i<currmax; i++)
-			FD_SET(s[i], &rdfs);
+	while (running) {
 
-		if ((ret = select(s[currmax-1]+1, &rdfs, NULL, NULL, NULL)) < 0) {
-			//perror("select");
+		nevents = epoll_wait(epfd, events, MAXEVENTS, -1);
+		if (nevents < 0) {
+			//perror("epoll_wait");
 			running = 0;
 			continue;
 		}
 
-		for (i=0; i<currmax; i++) {  /* check all CAN RAW sockets */
-
-			if (FD_ISSET(s[i], &rdfs)) {
-
-				socklen_t len = sizeof(addr);
-				int idx;
-
-				if ((nbytes = recvfrom(s[i], &cu, sizeof(cu), 0,
-						       (struct sockaddr*)&addr, &len)) < 0) {
-					perror("read");
-					return 1;
-				}
-
-				if (nbytes < (int)CANXL_HDR_SIZE + CANXL_MIN_DLEN) {
-					fprintf(stderr, "read: no CAN frame\n");
-					return 1;
-				}
-
-				if (cu.xl.flags & CANXL_XLF) {
-					if (nbytes != (int)CANXL_HDR_SIZE + cu.xl.len) {
-						printf("nbytes = %d\n", nbytes);
-						fprintf(stderr, "read: no CAN XL frame\n");
-						return 1;
-					}
-				} else {
-					/* mark dual-use struct canfd_frame */
-					if (nbytes == CAN_MTU) {
-						cu.fd.flags = 0;
-					} else if (nbytes == CANFD_MTU) {
-						cu.fd.flags |= CANFD_FDF;
-					} else {
-						fprintf(stderr, "read: incomplete CAN CC/FD frame\n");
-						return 1;
-					}
-				}
-
-				if (ioctl(s[i], SIOCGSTAMP, &tv) < 0)
-					perror("SIOCGSTAMP");
-
-
-				idx = idx2dindex(addr.can_ifindex, s[i]);
-
-				sprintf(afrbuf, "(%llu.%06llu) %*s ",
-					(unsigned long long)tv.tv_sec, (unsigned long long)tv.tv_usec, max_devname_len, devname[idx]);
-				snprintf_canframe(afrbuf + strlen(afrbuf), sizeof(afrbuf) - strlen(afrbuf), &cu, 0);
-				strcat(afrbuf, "\n");
-
-				if (write(accsocket, afrbuf, strlen(afrbuf)) < 0) {
-					perror("writeaccsock");
-					return 1;
-				}
-		    
-#if 0
-				/* print CAN frame in log file style to stdout */
-				printf("%s", afrbuf);
-#endif
+		for (i = 0; i < nevents; i++) {
+			struct evsrc *src = events[i].data.ptr;
+
+			switch (src->type) {
+			case EV_LISTEN:
+				client_accept(src->fd);
+				break;
+
+			case EV_CAN:
+				if (can_receive(src->fd) < 0)
+					running = 0;
+				break;
+
+			case EV_TIMER: {
+				__u64 expirations;
+
+				if (read(src->fd, &expirations, sizeof(expirations)) > 0)
+					bin_flush();
+				break;
 			}
 
+			case EV_CLIENT:
+				/* skip clients closed in this round */
+				if (src->fd >= 0)
+					client_input((struct client *)src, events[i].events);
+				break;
+			}
 		}
+
+		clients_free_closed();
 	}
 
+	while (nclients)
+		client_close(clients[0]);
+
+	clients_free_closed();
+
 	for (i=0; i<currmax; i++)
-		close(s[i]);
+		close(cansrc[i].fd);
 
-	close(accsocket);
+	close(socki);
+	close(timersrc.fd);
+	close(epfd);
+	free(binbuf);
 
 	if (signal_num)
 		return 128 + signal_num;
@@ -0,0 +1,756 @@
+// SPDX-License-Identifier: LGPL-2.0-only
+/*
+ * ISOBUS File System Server load generator (isobusfs_bench.c)
+ *
+ * Simulates a number of clients against one file server, each client with
+ * its own J1939 address and socket. Every client repeatedly runs a session:
+ * open a file, read it in chunks with random seeks in between and close it,
+ * or open a directory, list it until the end and close it. All clients run
+ * in one epoll loop and keep exactly one request in flight each.
+ *
+ * The latency of each request is measured from send() to the response and
+ * reported per operation as percentiles, together with the throughput and
+ * the error and timeout counts.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isobusfs_cmn.h"
+#include "isobusfs_cmn_cm.h"
+#include "isobusfs_cmn_fa.h"
+
+#define ISOBUSFS_BENCH_MAX_CLIENTS	200
+#define ISOBUSFS_BENCH_MAX_EVENTS	32
+#define ISOBUSFS_BENCH_POLL_MS		100 /* ms */
+#define ISOBUSFS_BENCH_TIMEOUT_MS	3000 /* ms */
+#define ISOBUSFS_BENCH_DEFAULT_ADDR	0x80
+
+enum isobusfs_bench_op {
+	ISOBUSFS_BENCH_OP_OPEN,
+	ISOBUSFS_BENCH_OP_READ,
+	ISOBUSFS_BENCH_OP_SEEK,
+	ISOBUSFS_BENCH_OP_OPEN_DIR,
+	ISOBUSFS_BENCH_OP_READ_DIR,
+	ISOBUSFS_BENCH_OP_CLOSE,
+	ISOBUSFS_BENCH_OP_MAX,
+};
+
+static const char *isobusfs_bench_op_name[ISOBUSFS_BENCH_OP_MAX] = {
+	[ISOBUSFS_BENCH_OP_OPEN] = "open",
+	[ISOBUSFS_BENCH_OP_READ] = "read",
+	[ISOBUSFS_BENCH_OP_SEEK] = "seek",
+	[ISOBUSFS_BENCH_OP_OPEN_DIR] = "opendir",
+	[ISOBUSFS_BENCH_OP_READ_DIR] = "readdir",
+	[ISOBUSFS_BENCH_OP_CLOSE] = "close",
+};
+
+struct isobusfs_bench_stats {
+	double *lat;		/* ms */
+	unsigned int nlat;
+	unsigned int size;
+	unsigned int errors;
+	unsigned int timeouts;
+	uint64_t bytes;
+};
+
+struct isobusfs_bench_client {
+	int sock;
+	uint8_t addr;
+	uint8_t tan;
+	uint8_t handle;
+	bool is_open;
+	bool is_dir;
+	bool pending;
+	enum isobusfs_bench_op op;	/* the request in flight */
+	struct timespec sent;
+	struct timespec next_ccm;
+	unsigned int reads_left;
+	uint32_t pos;		/* file position after the last response */
+	struct isobusfs_buf_log tx_buf_log;
+};
+
+struct isobusfs_bench_priv {
+	struct sockaddr_can sockname;
+	struct sockaddr_can peername;
+	struct isobusfs_bench_client *clients;
+	unsigned int nclients;
+	int epoll_fd;
+
+	const char *file;
+	const char *dir;
+	unsigned int read_size;
+	unsigned int reads;	/* per file session */
+	unsigned int list_pct;
+	unsigned int seek_pct;
+	unsigned int duration;	/* s */
+
+	struct isobusfs_cm_ccm ccm;
+	struct isobusfs_bench_stats stats[ISOBUSFS_BENCH_OP_MAX];
+	uint8_t rx_buf[ISOBUSFS_MAX_TRANSFER_LENGH];
+};
+
+static volatile sig_atomic_t isobusfs_bench_stop;
+
+static void isobusfs_bench_sig(int sig)
+{
+	isobusfs_bench_stop = 1;
+}
+
+static void isobusfs_bench_record(struct isobusfs_bench_priv *priv,
+				  enum isobusfs_bench_op op,
+				  const struct timespec *start,
+				  const struct timespec *now)
+{
+	struct isobusfs_bench_stats *stats = &priv->stats[op];
+
+	if (stats->nlat == stats->size) {
+		unsigned int size = stats->size ? stats->size * 2 : 1024;
+		double *lat;
+
+		lat = realloc(stats->lat, size * sizeof(*lat));
+		if (!lat)
+			err(EXIT_FAILURE, "can't allocate latency buffer");
+		stats->lat = lat;
+		stats->size = size;
+	}
+
+	stats->lat[stats->nlat++] = (now->tv_sec - start->tv_sec) * 1000.0 +
+		(now->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static int isobusfs_bench_send(struct isobusfs_bench_priv *priv,
+			       struct isobusfs_bench_client *client,
+			       enum isobusfs_bench_op op, void *buf,
+			       size_t len)
+{
+	uint8_t *req = buf;
+	int ret;
+
+	req[1] = ++client->tan;
+
+	ret = isobusfs_send(client->sock, buf, len, &client->tx_buf_log);
+	if (ret < 0) {
+		priv->stats[op].errors++;
+		return ret;
+	}
+
+	client->op = op;
+	client->pending = true;
+	clock_gettime(CLOCK_MONOTONIC, &client->sent);
+
+	return 0;
+}
+
+static int isobusfs_bench_open(struct isobusfs_bench_priv *priv,
+			       struct isobusfs_bench_client *client,
+			       bool is_dir)
+{
+	uint8_t buf[sizeof(struct isobusfs_fa_openf_req) + 256];
+	struct isobusfs_fa_openf_req *req = (void *)buf;
+	const char *name = is_dir ? priv->dir : priv->file;
+	size_t name_len = strlen(name);
+	size_t len = sizeof(*req) + name_len;
+
+	memset(buf, 0xff, sizeof(buf));
+	req->fs_function =
+		isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
+					    ISOBUSFS_FA_F_OPEN_FILE_REQ);
+	req->flags = is_dir ? ISOBUSFS_FA_OPEN_DIR : ISOBUSFS_FA_OPEN_FILE_RO;
+	req->name_len = htole16(name_len);
+	memcpy(req->name, name, name_len);
+
+	if (len < ISOBUSFS_MIN_TRANSFER_LENGH)
+		len = ISOBUSFS_MIN_TRANSFER_LENGH;
+
+	client->is_dir = is_dir;
+	client->pos = 0;
+	client->reads_left = priv->reads;
+
+	return isobusfs_bench_send(priv, client,
+				   is_dir ? ISOBUSFS_BENCH_OP_OPEN_DIR :
+					    ISOBUSFS_BENCH_OP_OPEN,
+				   buf, len);
+}
+
+static int isobusfs_bench_read(struct isobusfs_bench_priv *priv,
+			       struct isobusfs_bench_client *client)
+{
+	struct isobusfs_fa_readf_req req;
+
+	memset(&req, 0xff, sizeof(req));
+	req.fs_function =
+		isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
+					    ISOBUSFS_FA_F_READ_FILE_REQ);
+	req.handle = client->handle;
+	req.count = htole16(priv->read_size);
+
+	return isobusfs_bench_send(priv, client,
+				   client->is_dir ? ISOBUSFS_BENCH_OP_READ_DIR :
+						    ISOBUSFS_BENCH_OP_READ,
+				   &req, sizeof(req));
+}
+
+/* seek back to a random position of the part read so far */
+static int isobusfs_bench_seek(struct isobusfs_bench_priv *priv,
+			       struct isobusfs_bench_client *client)
+{
+	struct isobusfs_fa_seekf_req req;
+
+	req.fs_function =
+		isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
+					    ISOBUSFS_FA_F_SEEK_FILE_REQ);
+	req.handle = client->handle;
+	req.position_mode = ISOBUSFS_FA_SEEK_SET;
+	req.offset = htole32(random() % (client->pos + 1));
+
+	return isobusfs_bench_send(priv, client, ISOBUSFS_BENCH_OP_SEEK,
+				   &req, sizeof(req));
+}
+
+static int isobusfs_bench_close(struct isobusfs_bench_priv *priv,
+				struct isobusfs_bench_client *client)
+{
+	struct isobusfs_close_file_request req;
+
+	memset(&req, 0xff, sizeof(req));
+	req.fs_function =
+		isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
+					    ISOBUSFS_FA_F_CLOSE_FILE_REQ);
+	req.handle = client->handle;
+
+	return isobusfs_bench_send(priv, client, ISOBUSFS_BENCH_OP_CLOSE,
+				   &req, sizeof(req));
+}
+
+/* Issue the next request of the session, or start a new session */
+static void isobusfs_bench_next(struct isobusfs_bench_priv *priv,
+				struct isobusfs_bench_client *client)
+{
+	bool is_dir;
+
+	if (!client->is_open) {
+		if (isobusfs_bench_stop)
+			return;
+
+		is_dir = !priv->file ||
+			 (unsigned int)(random() % 100) < priv->list_pct;
+		isobusfs_bench_open(priv, client, is_dir);
+		return;
+	}
+
+	if (isobusfs_bench_stop || !client->reads_left) {
+		isobusfs_bench_close(priv, client);
+		return;
+	}
+
+	if (!client->is_dir && client->pos &&
+	    (unsigned int)(random() % 100) < priv->seek_pct) {
+		isobusfs_bench_seek(priv, client);
+		return;
+	}
+
+	isobusfs_bench_read(priv, client);
+}
+
+static void isobusfs_bench_res(struct isobusfs_bench_priv *priv,
+			       struct isobusfs_bench_client *client,
+			       const uint8_t *buf, size_t len)
+{
+	struct isobusfs_bench_stats *stats = &priv->stats[client->op];
+	const struct isobusfs_read_file_response *rf = (const void *)buf;
+	const struct isobusfs_fa_openf_res *of = (const void *)buf;
+	const struct isobusfs_fa_seekf_res *sf = (const void *)buf;
+	uint8_t error_code = buf[2];
+	struct timespec now;
+	uint16_t count;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	isobusfs_bench_record(priv, client->op, &client->sent, &now);
+	client->pending = false;
+
+	switch (client->op) {
+	case ISOBUSFS_BENCH_OP_OPEN:
+	case ISOBUSFS_BENCH_OP_OPEN_DIR:
+		if (error_code) {
+			pr_debug("client 0x%02x: open failed: %s", client->addr,
+				 isobusfs_error_to_str(error_code));
+			stats->errors++;
+			break;
+		}
+		client->handle = of->handle;
+		client->is_open = true;
+		break;
+	case ISOBUSFS_BENCH_OP_READ:
+	case ISOBUSFS_BENCH_OP_READ_DIR:
+		if (error_code == ISOBUSFS_ERR_END_OF_FILE) {
+			client->reads_left = 0;
+			break;
+		}
+		if (error_code || len < sizeof(*rf)) {
+			stats->errors++;
+			client->reads_left = 0;
+			break;
+		}
+		count = le16toh(rf->count);
+		stats->bytes += count;
+		client->pos += count;
+		/* directories are listed until the end */
+		if (!client->is_dir)
+			client->reads_left--;
+		break;
+	case ISOBUSFS_BENCH_OP_SEEK:
+		if (error_code) {
+			stats->errors++;
+			break;
+		}
+		client->pos = le32toh(sf->position);
+		break;
+	case ISOBUSFS_BENCH_OP_CLOSE:
+		if (error_code)
+			stats->errors++;
+		client->is_open = false;
+		break;
+	default:
+		break;
+	}
+
+	isobusfs_bench_next(priv, client);
+}
+
+static void isobusfs_bench_rx(struct isobusfs_bench_priv *priv,
+			      struct isobusfs_bench_client *client)
+{
+	ssize_t len;
+
+	while (1) {
+		len = recv(client->sock, priv->rx_buf, sizeof(priv->rx_buf),
+			   MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				pr_warn("client 0x%02x: recv(): %i (%s)",
+					client->addr, errno, strerror(errno));
+			return;
+		}
+
+		if (len < 3 ||
+		    isobusfs_buf_to_cmd(priv->rx_buf) != ISOBUSFS_CG_FILE_ACCESS)
+			continue;
+
+		/* late answer of a timed out request */
+		if (!client->pending || priv->rx_buf[1] != client->tan)
+			continue;
+
+		isobusfs_bench_res(priv, client, priv->rx_buf, len);
+	}
+}
+
+/* Send the client status messages and give up on lost responses */
+static void isobusfs_bench_timers(struct isobusfs_bench_priv *priv)
+{
+	struct timespec now;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i = 0; i < priv->nclients; i++) {
+		struct isobusfs_bench_client *client = &priv->clients[i];
+
+		if (timespec_diff_ms(&client->next_ccm, &now) <= 0) {
+			isobusfs_send(client->sock, &priv->ccm,
+				      sizeof(priv->ccm), &client->tx_buf_log);
+			timespec_add_ms(&client->next_ccm, ISOBUSFS_CM_F_CCM_RATE);
+		}
+
+		/* (re)start clients whose request could not be sent */
+		if (!client->pending) {
+			isobusfs_bench_next(priv, client);
+			continue;
+		}
+
+		if (timespec_diff_ms(&now, &client->sent) < ISOBUSFS_BENCH_TIMEOUT_MS)
+			continue;
+
+		pr_debug("client 0x%02x: %s timed out", client->addr,
+			 isobusfs_bench_op_name[client->op]);
+		priv->stats[client->op].timeouts++;
+		client->pending = false;
+
+		switch (client->op) {
+		case ISOBUSFS_BENCH_OP_OPEN:
+		case ISOBUSFS_BENCH_OP_OPEN_DIR:
+		case ISOBUSFS_BENCH_OP_CLOSE:
+			/* a handle may be left open on the server */
+			client->is_open = false;
+			break;
+		default:
+			client->reads_left = 0;
+			break;
+		}
+
+		isobusfs_bench_next(priv, client);
+	}
+}
+
+static int isobusfs_bench_client_init(struct isobusfs_bench_priv *priv,
+				      struct isobusfs_bench_client *client,
+				      unsigned int idx)
+{
+	struct sockaddr_can addr = priv->sockname;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = idx,
+	};
+	int ret;
+
+	ret = libj1939_open_socket();
+	if (ret < 0)
+		return ret;
+
+	client->sock = ret;
+
+	addr.can_addr.j1939.addr = client->addr;
+	addr.can_addr.j1939.pgn = ISOBUSFS_PGN_FS_TO_CL;
+	ret = libj1939_bind_socket(client->sock, &addr);
+	if (ret < 0)
+		return ret;
+
+	ret = isobusfs_cmn_set_linger(client->sock);
+	if (ret < 0)
+		return ret;
+
+	ret = libj1939_socket_prio(client->sock, ISOBUSFS_PRIO_DEFAULT);
+	if (ret < 0)
+		return ret;
+
+	ret = isobusfs_cmn_connect_socket(client->sock, &priv->peername);
+	if (ret < 0)
+		return ret;
+
+	if (epoll_ctl(priv->epoll_fd, EPOLL_CTL_ADD, client->sock, &ev)) {
+		ret = -errno;
+		pr_err("epoll_ctl(): %i (%s)", ret, strerror(-ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+static int isobusfs_bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double isobusfs_bench_percentile(const double *lat, unsigned int n,
+					unsigned int pct)
+{
+	if (!n)
+		return 0;
+
+	return lat[(n - 1) * pct / 100];
+}
+
+static void isobusfs_bench_report(struct isobusfs_bench_priv *priv,
+				  double secs)
+{
+	struct isobusfs_bench_stats *stats;
+	unsigned int total = 0, failed = 0;
+	uint64_t bytes = 0;
+	int op;
+
+	printf("clients: %u, duration: %.2f s, read size: %u\n",
+	       priv->nclients, secs, priv->read_size);
+	printf("%-8s %8s %7s %8s %9s %9s %9s %9s\n", "op", "count", "errors",
+	       "timeouts", "p50/ms", "p90/ms", "p99/ms", "max/ms");
+
+	for (op = 0; op < ISOBUSFS_BENCH_OP_MAX; op++) {
+		stats = &priv->stats[op];
+		if (!stats->nlat && !stats->errors && !stats->timeouts)
+			continue;
+
+		qsort(stats->lat, stats->nlat, sizeof(*stats->lat),
+		      isobusfs_bench_cmp_double);
+
+		printf("%-8s %8u %7u %8u %9.2f %9.2f %9.2f %9.2f\n",
+		       isobusfs_bench_op_name[op], stats->nlat, stats->errors,
+		       stats->timeouts,
+		       isobusfs_bench_percentile(stats->lat, stats->nlat, 50),
+		       isobusfs_bench_percentile(stats->lat, stats->nlat, 90),
+		       isobusfs_bench_percentile(stats->lat, stats->nlat, 99),
+		       isobusfs_bench_percentile(stats->lat, stats->nlat, 100));
+
+		total += stats->nlat + stats->timeouts;
+		failed += stats->errors + stats->timeouts;
+		bytes += stats->bytes;
+	}
+
+	printf("requests: %.1f/s, failed: %.2f %%, read: %.1f KiB/s\n",
+	       secs > 0 ? total / secs : 0,
+	       total ? 100.0 * failed / total : 0,
+	       secs > 0 ? bytes / 1024.0 / secs : 0);
+}
+
+static int isobusfs_bench_run(struct isobusfs_bench_priv *priv)
+{
+	struct epoll_event events[ISOBUSFS_BENCH_MAX_EVENTS];
+	struct timespec start, end, now;
+	unsigned int i, pending;
+	int nfds, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	end = start;
+	timespec_add_ms(&end, priv->duration * 1000);
+
+	/* announce all clients and start the first sessions */
+	for (i = 0; i < priv->nclients; i++)
+		priv->clients[i].next_ccm = start;
+	isobusfs_bench_timers(priv);
+
+	while (1) {
+		nfds = epoll_wait(priv->epoll_fd, events, ARRAY_SIZE(events),
+				  ISOBUSFS_BENCH_POLL_MS);
+		if (nfds < 0 && errno != EINTR)
+			err(EXIT_FAILURE, "epoll_wait()");
+
+		for (n = 0; n < nfds; n++)
+			isobusfs_bench_rx(priv, &priv->clients[events[n].data.u32]);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!isobusfs_bench_stop && timespec_diff_ms(&now, &end) >= 0)
+			isobusfs_bench_stop = 1;
+
+		isobusfs_bench_timers(priv);
+
+		/* let the sessions close their handles */
+		if (isobusfs_bench_stop) {
+			pending = 0;
+			for (i = 0; i < priv->nclients; i++)
+				pending += priv->clients[i].pending;
+			if (!pending)
+				break;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	isobusfs_bench_report(priv, timespec_diff_ms(&now, &start) / 1000.0);
+
+	return 0;
+}
+
+static void isobusfs_bench_print_help(void)
+{
+	printf("Usage: isobusfs-bench [options]\n");
+	printf("Options:\n");
+	printf("  --interface <interface_name> or -i <interface_name>\n");
+	printf("  --local-address <local_address_hex> or -a <local_address_hex> (address of the first client, Default 0x%02x)\n",
+	       ISOBUSFS_BENCH_DEFAULT_ADDR);
+	printf("  --remote-address <remote_address_hex> or -r <remote_address_hex>\n");
+	printf("  --clients <count> or -c <count> (Default 30, max %d)\n",
+	       ISOBUSFS_BENCH_MAX_CLIENTS);
+	printf("  --duration <seconds> or -t <seconds> (Default 10)\n");
+	printf("  --file <path> or -f <path> (file to read)\n");
+	printf("  --dir <path> or -d <path> (directory to list, Default \".\")\n");
+	printf("  --read-size <bytes> or -s <bytes> (Default 1024)\n");
+	printf("  --reads <count> or -n <count> (reads per file session, Default 16)\n");
+	printf("  --list-percent <pct> or -L <pct> (directory sessions, Default 20)\n");
+	printf("  --seek-percent <pct> or -S <pct> (seeks between reads, Default 10)\n");
+	printf("  --log-level <logging_level> or -l <logging_level> (Default %d)\n",
+	       LOG_LEVEL_INFO);
+	printf("Note: without --file only directories are listed\n");
+}
+
+static int isobusfs_bench_parse_args(struct isobusfs_bench_priv *priv,
+				     int argc, char *argv[])
+{
+	struct sockaddr_can *remote = &priv->peername;
+	struct sockaddr_can *local = &priv->sockname;
+	unsigned int first_addr = ISOBUSFS_BENCH_DEFAULT_ADDR;
+	bool remote_address_set = false;
+	bool interface_set = false;
+	int long_index = 0;
+	unsigned int i;
+	int level;
+	int opt;
+
+	static struct option long_options[] = {
+		{"interface", required_argument, 0, 'i'},
+		{"local-address", required_argument, 0, 'a'},
+		{"remote-address", required_argument, 0, 'r'},
+		{"clients", required_argument, 0, 'c'},
+		{"duration", required_argument, 0, 't'},
+		{"file", required_argument, 0, 'f'},
+		{"dir", required_argument, 0, 'd'},
+		{"read-size", required_argument, 0, 's'},
+		{"reads", required_argument, 0, 'n'},
+		{"list-percent", required_argument, 0, 'L'},
+		{"seek-percent", required_argument, 0, 'S'},
+		{"log-level", required_argument, 0, 'l'},
+		{0, 0, 0, 0}
+	};
+
+	priv->nclients = 30;
+	priv->duration = 10;
+	priv->dir = ".";
+	priv->read_size = 1024;
+	priv->reads = 16;
+	priv->list_pct = 20;
+	priv->seek_pct = 10;
+
+	while ((opt = getopt_long(argc, argv, "i:a:r:c:t:f:d:s:n:L:S:l:",
+				  long_options, &long_index)) != -1) {
+		switch (opt) {
+		case 'i':
+			local->can_ifindex = if_nametoindex(optarg);
+			if (!local->can_ifindex) {
+				pr_err("Interface %s not found. Error: %d (%s)\n",
+				       optarg, errno, strerror(errno));
+				return -EINVAL;
+			}
+			remote->can_ifindex = local->can_ifindex;
+			interface_set = true;
+			break;
+		case 'a':
+			first_addr = strtoul(optarg, NULL, 16);
+			break;
+		case 'r':
+			remote->can_addr.j1939.addr = strtoul(optarg, NULL, 16);
+			remote_address_set = true;
+			break;
+		case 'c':
+			priv->nclients = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			priv->duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			priv->file = optarg;
+			break;
+		case 'd':
+			priv->dir = optarg;
+			break;
+		case 's':
+			priv->read_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			priv->reads = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			priv->list_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			priv->seek_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			level = strtoul(optarg, NULL, 0);
+			if (level < LOG_LEVEL_ERROR || level > LOG_LEVEL_DEBUG)
+				pr_err("invalid debug level %d", level);
+			isobusfs_log_level_set(level);
+			break;
+		default:
+			isobusfs_bench_print_help();
+			return -EINVAL;
+		}
+	}
+
+	if (!interface_set || !remote_address_set) {
+		pr_err("interface and remote address are required");
+		isobusfs_bench_print_help();
+		return -EINVAL;
+	}
+
+	if (!priv->nclients || priv->nclients > ISOBUSFS_BENCH_MAX_CLIENTS ||
+	    first_addr + priv->nclients > J1939_IDLE_ADDR) {
+		pr_err("invalid number of clients %u starting at address 0x%02x",
+		       priv->nclients, first_addr);
+		return -EINVAL;
+	}
+
+	if (!priv->read_size || priv->read_size > ISOBUSFS_MAX_DATA_LENGH ||
+	    !priv->reads) {
+		pr_err("invalid read size or number of reads");
+		return -EINVAL;
+	}
+
+	if ((priv->file && strlen(priv->file) > 255) || strlen(priv->dir) > 255) {
+		pr_err("path too long");
+		return -EINVAL;
+	}
+
+	priv->clients = calloc(priv->nclients, sizeof(*priv->clients));
+	if (!priv->clients)
+		return -ENOMEM;
+
+	for (i = 0; i < priv->nclients; i++) {
+		priv->clients[i].sock = -1;
+		priv->clients[i].addr = first_addr + i;
+		if (priv->clients[i].addr == remote->can_addr.j1939.addr) {
+			pr_err("client address range includes the server address");
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct isobusfs_bench_priv *priv;
+	unsigned int i;
+	int ret;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		err(EXIT_FAILURE, "can't allocate priv");
+
+	libj1939_init_sockaddr_can(&priv->sockname, J1939_NO_PGN);
+	libj1939_init_sockaddr_can(&priv->peername, ISOBUSFS_PGN_CL_TO_FS);
+
+	ret = isobusfs_bench_parse_args(priv, argc, argv);
+	if (ret)
+		return ret;
+
+	ret = libj1939_create_epoll();
+	if (ret < 0)
+		return ret;
+	priv->epoll_fd = ret;
+
+	priv->ccm.fs_function =
+		isobusfs_cg_function_to_buf(ISOBUSFS_CG_CONNECTION_MANAGMENT,
+					    ISOBUSFS_CM_F_FS_STATUS);
+	priv->ccm.version = 2;
+	memset(priv->ccm.reserved, 0xff, sizeof(priv->ccm.reserved));
+
+	for (i = 0; i < priv->nclients; i++) {
+		ret = isobusfs_bench_client_init(priv, &priv->clients[i], i);
+		if (ret)
+			return ret;
+	}
+
+	signal(SIGINT, isobusfs_bench_sig);
+	signal(SIGTERM, isobusfs_bench_sig);
+	srandom(time(NULL));
+
+	ret = isobusfs_bench_run(priv);
+
+	for (i = 0; i < priv->nclients; i++)
+		close(priv->clients[i].sock);
+	for (i = 0; i < ISOBUSFS_BENCH_OP_MAX; i++)
+		free(priv->stats[i].lat);
+	close(priv->epoll_fd);
+	free(priv->clients);
+	free(priv);
+
+	return ret;
+}
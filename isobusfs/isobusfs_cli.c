@@ -20,6 +20,36 @@
  */
 #define ISOBUSFS_CLI_MAX_EVENTS 10
 
+/* expire the events timer with the earliest event timeout */
+static int isobusfs_cli_arm_events_timer(struct isobusfs_priv *priv)
+{
+	struct timespec *first = NULL, now;
+	int64_t delay;
+	size_t i;
+
+	for (i = 0; i < priv->num_events; i++) {
+		struct timespec *timeout = &priv->events[i].timeout;
+
+		if (!first || timeout->tv_sec < first->tv_sec ||
+		    (timeout->tv_sec == first->tv_sec &&
+		     timeout->tv_nsec < first->tv_nsec))
+			first = timeout;
+	}
+
+	if (!first) {
+		libj1939_timer_stop(&priv->cmn, &priv->events_timer);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	/* round up, the event expires after its timeout */
+	delay = timespec_diff_ms(first, &now) + 1;
+	if (delay < 0)
+		delay = 0;
+
+	return libj1939_timer_start(&priv->cmn, &priv->events_timer, delay, 0);
+}
+
 int isobusfs_cli_register_event(struct isobusfs_priv *priv,
 				const struct isobusfs_event *new_event)
 {
@@ -38,7 +68,7 @@ int isobusfs_cli_register_event(struct isobusfs_priv *priv,
 	       sizeof(*new_event));
 	priv->num_events++;
 
-	return 0;
+	return isobusfs_cli_arm_events_timer(priv);
 }
 
 int isobusfs_cli_remove_event(struct isobusfs_priv *priv,
@@ -79,7 +109,7 @@ void isobusfs_cli_prepare_response_event(struct isobusfs_event *event, int sock,
 	event->fs_function = fs_function;
 
 	/* Calculate the timeout */
-	clock_gettime(CLOCK_REALTIME, &current_time);
+	clock_gettime(CLOCK_MONOTONIC, &current_time);
 	timeout_timespec = ms_to_timespec(ISOBUSFS_CLI_DEFAULT_WAIT_TIMEOUT_MS);
 	event->timeout.tv_sec = current_time.tv_sec + timeout_timespec.tv_sec;
 	event->timeout.tv_nsec = current_time.tv_nsec + timeout_timespec.tv_nsec;
@@ -97,14 +127,17 @@ static bool isobusfs_cli_has_event_expired(const struct timespec *timeout)
 {
 	struct timespec now;
 
-	clock_gettime(CLOCK_REALTIME, &now);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 	return now.tv_sec > timeout->tv_sec ||
 		   (now.tv_sec == timeout->tv_sec &&
 		    now.tv_nsec > timeout->tv_nsec);
 }
 
-static void isobusfs_cli_process_expired_events(struct isobusfs_priv *priv)
+static int isobusfs_cli_process_expired_events(struct libj1939_cmn *cmn,
+					       struct libj1939_timer *timer)
 {
+	struct isobusfs_priv *priv = timer->ctx;
+
 	for (size_t i = 0; i < priv->num_events; ++i) {
 		struct isobusfs_event *event = &priv->events[i];
 
@@ -116,6 +149,8 @@ static void isobusfs_cli_process_expired_events(struct isobusfs_priv *priv)
 			i--;
 		}
 	}
+
+	return isobusfs_cli_arm_events_timer(priv);
 }
 
 static int isobusfs_cli_rx_event(struct isobusfs_priv *priv, int sock,
@@ -316,15 +351,9 @@ static int isobusfs_cli_handle_events(struct isobusfs_priv *priv, unsigned int n
 
 static int isobusfs_cli_handle_periodic_tasks(struct isobusfs_priv *priv)
 {
-	/* detect FS timeout */
-	isobusfs_cli_fs_detect_timeout(priv);
-
 	isobusfs_cli_run_self_tests(priv);
 
-	isobusfs_cli_process_expired_events(priv);
-
-	/* this function will send status only if it is proper time to do so */
-	return isobusfs_cli_ccm_send(priv);
+	return 0;
 }
 
 int isobusfs_cli_process_events_and_tasks(struct isobusfs_priv *priv)
@@ -638,7 +667,6 @@ static int isobusfs_cli_parse_args(struct isobusfs_priv *priv, int argc, char *a
 int main(int argc, char *argv[])
 {
 	struct isobusfs_priv *priv;
-	struct timespec ts;
 	int ret;
 
 	priv = malloc(sizeof(*priv));
@@ -660,9 +688,14 @@ int main(int argc, char *argv[])
 
 	isobusfs_cli_ccm_init(priv);
 
-	/* Init next st_next_send_time value to avoid warnings */
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	priv->cmn.next_send_time = ts;
+	ret = libj1939_timers_init(&priv->cmn);
+	if (ret)
+		return ret;
+	libj1939_timer_init(&priv->events_timer,
+			    isobusfs_cli_process_expired_events, priv);
+	ret = isobusfs_cli_ccm_start(priv);
+	if (ret)
+		return ret;
 
 	if (priv->interactive)
 		isobusfs_cli_int_start(priv);
@@ -675,6 +708,7 @@ int main(int argc, char *argv[])
 			break;
 	}
 
+	libj1939_timers_free(&priv->cmn);
 	close(priv->cmn.epoll_fd);
 	free(priv->cmn.epoll_events);
 
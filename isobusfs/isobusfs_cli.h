@@ -12,6 +12,8 @@
 
 #define ISOBUSFS_CLI_MAX_EPOLL_EVENTS		10
 #define ISOBUSFS_CLI_DEFAULT_WAIT_TIMEOUT_MS	1000 /* ms */
+/* Client Connection Maintenance */
+#define ISOBUSFS_CLI_CCM_RATE			2000 /* ms */
 
 enum isobusfs_cli_state {
 	ISOBUSFS_CLI_STATE_CONNECTING,
@@ -62,6 +64,47 @@ enum isobusfs_cli_state {
 
 struct isobusfs_priv;
 
+/* Pipelined file transfer, see isobusfs_cli_fa_bulk_start() */
+#define ISOBUSFS_CLI_BULK_MAX_DEPTH		8
+#define ISOBUSFS_CLI_BULK_DEFAULT_DEPTH		4
+/* slowest expected transfer rate, bytes per ms, to derive the timeouts */
+#define ISOBUSFS_CLI_BULK_MIN_RATE		10
+
+enum isobusfs_cli_bulk_state {
+	ISOBUSFS_CLI_BULK_OPEN,
+	ISOBUSFS_CLI_BULK_TRANSFER,
+	ISOBUSFS_CLI_BULK_CLOSE,
+};
+
+struct isobusfs_cli_bulk {
+	/* set by the caller */
+	const char *remote_path;
+	int fd;			/* local file */
+	bool put;		/* upload instead of download */
+	unsigned int depth;	/* requests in flight */
+	uint16_t chunk;		/* bytes per request */
+	void (*done)(struct isobusfs_priv *priv,
+		     struct isobusfs_cli_bulk *bulk, int error);
+	void *ctx;
+
+	enum isobusfs_cli_bulk_state state;
+	uint8_t handle;
+	/* requests in flight, oldest at head */
+	uint8_t tan[ISOBUSFS_CLI_BULK_MAX_DEPTH];
+	off_t offset[ISOBUSFS_CLI_BULK_MAX_DEPTH];
+	uint16_t count[ISOBUSFS_CLI_BULK_MAX_DEPTH];
+	unsigned int head;
+	unsigned int in_flight;
+	off_t next_offset;
+	bool eof;		/* no more requests to send */
+	int error;
+	uint8_t *buf;		/* data of a write request */
+	uint64_t bytes;
+	uint64_t size;		/* of the local file for put, for progress */
+	struct timespec start;
+	struct timespec last_progress;
+};
+
 typedef int (*isobusfs_event_callback)(struct isobusfs_priv *priv,
 				       struct isobusfs_msg *msg, void *ctx,
 				       int error);
@@ -97,6 +140,8 @@ struct isobusfs_priv {
 
 	bool fs_is_active;
 	struct timespec fs_last_seen;
+	struct libj1939_timer fs_timeout_timer;
+	struct libj1939_timer ccm_timer;
 	uint8_t fs_version;
 	uint8_t fs_max_open_files;
 	uint8_t fs_caps;
@@ -116,14 +161,15 @@ struct isobusfs_priv {
 	struct isobusfs_event *events;
 	uint num_events;
 	uint max_events;
+	/* expires with the earliest event timeout */
+	struct libj1939_timer events_timer;
 
 	enum isobusfs_error error_code;
 };
 
 /* isobusfs_cli_cm.c */
 void isobusfs_cli_ccm_init(struct isobusfs_priv *priv);
-int isobusfs_cli_ccm_send(struct isobusfs_priv *priv);
-void isobusfs_cli_fs_detect_timeout(struct isobusfs_priv *priv);
+int isobusfs_cli_ccm_start(struct isobusfs_priv *priv);
 int isobusfs_cli_rx_cg_cm(struct isobusfs_priv *priv, struct isobusfs_msg *msg);
 int isobusfs_cli_property_req(struct isobusfs_priv *priv);
 int isobusfs_cli_volume_status_req(struct isobusfs_priv *priv,
@@ -178,6 +224,10 @@ int isobusfs_cli_send_and_register_fa_cf_event(struct isobusfs_priv *priv,
 					       uint8_t handle,
 					       isobusfs_event_callback cb,
 					       void *ctx);
+int isobusfs_cli_fa_wf_req(struct isobusfs_priv *priv, uint8_t handle,
+			   const uint8_t *data, uint16_t count);
+int isobusfs_cli_fa_bulk_start(struct isobusfs_priv *priv,
+			       struct isobusfs_cli_bulk *bulk);
 
 /* isobusfs_cli_selftests.c */
 void isobusfs_cli_run_self_tests(struct isobusfs_priv *priv);
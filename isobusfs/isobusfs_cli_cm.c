@@ -76,24 +76,22 @@ void isobusfs_cli_ccm_init(struct isobusfs_priv *priv)
 }
 
 /**
- * isobusfs_cli_ccm_send - send periodic file server status messages
- * @priv: pointer to the isobusfs_priv structure
+ * isobusfs_cli_ccm_send - send periodic client connection maintenance messages
+ * @cmn: pointer to the common J1939 data of the client
+ * @timer: the CCM timer
  *
- * Returns 0 on success, -1 on errors.
+ * Return: 0 on success, -1 on errors.
  */
-int isobusfs_cli_ccm_send(struct isobusfs_priv *priv)
+static int isobusfs_cli_ccm_send(struct libj1939_cmn *cmn,
+				 struct libj1939_timer *timer)
 {
+	struct isobusfs_priv *priv = timer->ctx;
 	int64_t time_diff;
 	int ret;
 
-	/* Test if it is proper time to send next status message. */
-	time_diff = timespec_diff_ms(&priv->cmn.next_send_time,
-				     &priv->cmn.last_time);
-	if (time_diff > ISOBUSFS_CM_F_FS_STATUS_RATE_JITTER) {
-		/* too early to send next message */
-		return 0;
-	}
-
+	/* periodic timers are already moved to the next expiry */
+	time_diff = timespec_diff_ms(&timer->expires, &cmn->last_time) -
+		    timer->period_ms;
 	if (time_diff < -ISOBUSFS_CM_F_FS_STATUS_RATE_JITTER) {
 		pr_warn("too late to send next fs status message: %ld ms",
 			time_diff);
@@ -113,26 +111,55 @@ int isobusfs_cli_ccm_send(struct isobusfs_priv *priv)
 
 	pr_debug("> tx: ccm version: %d", priv->ccm.version);
 
-	priv->cmn.next_send_time = priv->cmn.last_time;
-	timespec_add_ms(&priv->cmn.next_send_time, 2000);
-
 	return 0;
 }
 
-/* detect if FS is timeout */
-void isobusfs_cli_fs_detect_timeout(struct isobusfs_priv *priv)
+/**
+ * isobusfs_cli_fs_detect_timeout - detect if FS is timeout
+ * @cmn: pointer to the common J1939 data of the client
+ * @timer: the FS timeout timer
+ *
+ * The timer is started when the FS is detected and rearmed for the rest of
+ * the time if status messages were received meanwhile.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+static int isobusfs_cli_fs_detect_timeout(struct libj1939_cmn *cmn,
+					  struct libj1939_timer *timer)
 {
+	struct isobusfs_priv *priv = timer->ctx;
 	int64_t time_diff;
 
 	if (!priv->fs_is_active)
-		return;
+		return 0;
 
-	time_diff = timespec_diff_ms(&priv->cmn.last_time,
-				     &priv->fs_last_seen);
-	if (time_diff > ISOBUSFS_FS_TIMEOUT) {
-		pr_debug("file server timeout");
-		priv->fs_is_active = false;
-	}
+	time_diff = timespec_diff_ms(&cmn->last_time, &priv->fs_last_seen);
+	if (time_diff < ISOBUSFS_FS_TIMEOUT)
+		return libj1939_timer_start(cmn, timer,
+					    ISOBUSFS_FS_TIMEOUT - time_diff, 0);
+
+	pr_debug("file server timeout");
+	priv->fs_is_active = false;
+
+	return 0;
+}
+
+/**
+ * isobusfs_cli_ccm_start - start sending periodic CCM messages
+ * @priv: pointer to the isobusfs_priv structure
+ *
+ * The first message is sent from the event loop right away.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+int isobusfs_cli_ccm_start(struct isobusfs_priv *priv)
+{
+	libj1939_timer_init(&priv->ccm_timer, isobusfs_cli_ccm_send, priv);
+	libj1939_timer_init(&priv->fs_timeout_timer,
+			    isobusfs_cli_fs_detect_timeout, priv);
+
+	return libj1939_timer_start(&priv->cmn, &priv->ccm_timer, 0,
+				    ISOBUSFS_CLI_CCM_RATE);
 }
 
 /* activate FS status if was not active till now */
@@ -143,6 +170,8 @@ static void isobusfs_cli_fs_activate(struct isobusfs_priv *priv)
 
 	pr_debug("file server detectet");
 	priv->fs_is_active = true;
+	libj1939_timer_start(&priv->cmn, &priv->fs_timeout_timer,
+			     ISOBUSFS_FS_TIMEOUT, 0);
 }
 
 static int isobusfs_cli_rx_fs_status(struct isobusfs_priv *priv,
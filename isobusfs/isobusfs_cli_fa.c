@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 
@@ -428,3 +429,380 @@ int isobusfs_cli_rx_cg_fa(struct isobusfs_priv *priv,
 
 	return ret;
 }
+
+int isobusfs_cli_fa_wf_req(struct isobusfs_priv *priv, uint8_t handle,
+			   const uint8_t *data, uint16_t count)
+{
+	struct isobusfs_write_file_request *req;
+	size_t req_len = sizeof(*req) + count;
+	int ret;
+
+	if (req_len < ISOBUSFS_MIN_TRANSFER_LENGH)
+		req_len = ISOBUSFS_MIN_TRANSFER_LENGH;
+
+	req = malloc(req_len);
+	if (!req) {
+		pr_err("failed to allocate memory for write file request");
+		return -ENOMEM;
+	}
+
+	/* not used space should be filled with 0xff */
+	memset(req, 0xff, req_len);
+	req->fs_function = isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
+						       ISOBUSFS_FA_F_WRITE_FILE_REQ);
+	req->tan = isobusfs_cli_get_next_tan(priv);
+	req->handle = handle;
+	req->count = htole16(count);
+	memcpy(req->data, data, count);
+
+	ret = isobusfs_send(priv->sock_main, req, req_len, &priv->tx_buf_log);
+	if (ret < 0)
+		pr_warn("failed to send Write File Request: %d (%s)", ret,
+			strerror(-ret));
+	else
+		pr_debug("> tx: Write File Request for handle: %x, size: %d",
+			 handle, count);
+
+	free(req);
+
+	return ret;
+}
+
+/*
+ * Bulk transfer
+ *
+ * Read and Write File requests carry no offset, the server moves the file
+ * position of the handle by the number of bytes transferred. As the
+ * responses come in the order of the requests, the offset of each request
+ * is known in advance and up to @depth requests can be kept in flight. The
+ * response events are registered in the same order, so they are matched in
+ * FIFO order and each one is checked against the TAN of its request.
+ *
+ * A transfer ends when a read returns less than requested (end of file),
+ * or when the local file is sent. On errors no new requests are sent and
+ * the handle is closed after the outstanding requests are answered or
+ * timed out.
+ */
+static int isobusfs_cli_bulk_event_cb(struct isobusfs_priv *priv,
+				      struct isobusfs_msg *msg, void *ctx,
+				      int error);
+
+static int isobusfs_cli_bulk_register(struct isobusfs_priv *priv,
+				      struct isobusfs_cli_bulk *bulk,
+				      uint8_t function, unsigned int timeout_ms)
+{
+	struct isobusfs_event event;
+	int ret;
+
+	event.cb = isobusfs_cli_bulk_event_cb;
+	event.ctx = bulk;
+	isobusfs_cli_prepare_response_event(&event, priv->sock_main,
+					    isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
+									function));
+	/* the requests in front of this one are transferred first */
+	timespec_add_ms(&event.timeout, timeout_ms);
+
+	ret = isobusfs_cli_register_event(priv, &event);
+	if (ret < 0)
+		pr_warn("failed to register bulk transfer event");
+
+	return ret;
+}
+
+static int isobusfs_cli_bulk_send_one(struct isobusfs_priv *priv,
+				      struct isobusfs_cli_bulk *bulk)
+{
+	unsigned int slot = (bulk->head + bulk->in_flight) %
+			    ISOBUSFS_CLI_BULK_MAX_DEPTH;
+	uint16_t count = bulk->chunk;
+	ssize_t len;
+	int ret;
+
+	if (bulk->put) {
+		len = pread(bulk->fd, bulk->buf, bulk->chunk, bulk->next_offset);
+		if (len < 0) {
+			ret = -errno;
+			pr_int("Error: Failed to read local file: %s\n",
+			       strerror(errno));
+			return ret;
+		}
+		if (len == 0) {
+			bulk->eof = true;
+			return 0;
+		}
+		count = len;
+		ret = isobusfs_cli_fa_wf_req(priv, bulk->handle, bulk->buf,
+					     count);
+	} else {
+		ret = isobusfs_cli_fa_rf_req(priv, bulk->handle, count);
+	}
+	if (ret < 0)
+		return ret;
+
+	ret = isobusfs_cli_bulk_register(priv, bulk,
+					 bulk->put ? ISOBUSFS_FA_F_WRITE_FILE_RES :
+						     ISOBUSFS_FA_F_READ_FILE_RES,
+					 (bulk->in_flight + 1) * bulk->chunk /
+					 ISOBUSFS_CLI_BULK_MIN_RATE);
+	if (ret < 0)
+		return ret;
+
+	bulk->tan[slot] = priv->next_tan - 1;
+	bulk->offset[slot] = bulk->next_offset;
+	bulk->count[slot] = count;
+	bulk->next_offset += count;
+	bulk->in_flight++;
+
+	return 0;
+}
+
+static void isobusfs_cli_bulk_progress(struct isobusfs_cli_bulk *bulk,
+				       bool final)
+{
+	struct timespec now;
+	int64_t ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!final && timespec_diff_ms(&now, &bulk->last_progress) < 1000)
+		return;
+
+	bulk->last_progress = now;
+	ms = timespec_diff_ms(&now, &bulk->start);
+	if (ms <= 0)
+		ms = 1;
+
+	if (bulk->put && bulk->size)
+		pr_int("%s: %llu of %llu bytes, %.1f KiB/s\n", bulk->remote_path,
+		       (unsigned long long)bulk->bytes,
+		       (unsigned long long)bulk->size,
+		       bulk->bytes * 1000.0 / 1024 / ms);
+	else
+		pr_int("%s: %llu bytes in %.3f s, %.1f KiB/s\n",
+		       bulk->remote_path, (unsigned long long)bulk->bytes,
+		       ms / 1000.0, bulk->bytes * 1000.0 / 1024 / ms);
+}
+
+static void isobusfs_cli_bulk_finish(struct isobusfs_priv *priv,
+				     struct isobusfs_cli_bulk *bulk)
+{
+	isobusfs_cli_bulk_progress(bulk, true);
+	free(bulk->buf);
+	bulk->buf = NULL;
+	bulk->done(priv, bulk, bulk->error);
+}
+
+/* fill the pipeline, or close the handle when everything is answered */
+static void isobusfs_cli_bulk_next(struct isobusfs_priv *priv,
+				   struct isobusfs_cli_bulk *bulk)
+{
+	int ret;
+
+	while (!bulk->error && !bulk->eof &&
+	       bulk->in_flight < bulk->depth) {
+		ret = isobusfs_cli_bulk_send_one(priv, bulk);
+		if (ret < 0)
+			bulk->error = ret;
+	}
+
+	if (bulk->in_flight)
+		return;
+
+	ret = isobusfs_cli_fa_cf_req(priv, bulk->handle);
+	if (!ret)
+		ret = isobusfs_cli_bulk_register(priv, bulk,
+						 ISOBUSFS_FA_F_CLOSE_FILE_RES,
+						 0);
+	if (ret < 0) {
+		if (!bulk->error)
+			bulk->error = ret;
+		isobusfs_cli_bulk_finish(priv, bulk);
+		return;
+	}
+
+	bulk->state = ISOBUSFS_CLI_BULK_CLOSE;
+}
+
+static void isobusfs_cli_bulk_open_res(struct isobusfs_priv *priv,
+				       struct isobusfs_cli_bulk *bulk,
+				       struct isobusfs_msg *msg)
+{
+	struct isobusfs_fa_openf_res *res =
+		(struct isobusfs_fa_openf_res *)msg->buf;
+
+	if (!isobusfs_cli_tan_is_valid(res->tan, priv) || res->error_code ||
+	    res->handle == ISOBUSFS_FILE_HANDLE_ERROR) {
+		pr_int("Error: Failed to open %s on server: %s\n",
+		       bulk->remote_path, isobusfs_error_to_str(res->error_code));
+		bulk->error = -EIO;
+		isobusfs_cli_bulk_finish(priv, bulk);
+		return;
+	}
+
+	bulk->handle = res->handle;
+	bulk->state = ISOBUSFS_CLI_BULK_TRANSFER;
+	clock_gettime(CLOCK_MONOTONIC, &bulk->start);
+	bulk->last_progress = bulk->start;
+
+	isobusfs_cli_bulk_next(priv, bulk);
+}
+
+static void isobusfs_cli_bulk_data_res(struct isobusfs_priv *priv,
+				       struct isobusfs_cli_bulk *bulk,
+				       struct isobusfs_msg *msg)
+{
+	struct isobusfs_read_file_response *res =
+		(struct isobusfs_read_file_response *)msg->buf;
+	unsigned int slot = bulk->head;
+	uint16_t count;
+	ssize_t len;
+
+	bulk->head = (bulk->head + 1) % ISOBUSFS_CLI_BULK_MAX_DEPTH;
+	bulk->in_flight--;
+
+	if (bulk->error)
+		goto next;
+
+	/* Read and Write File responses share the layout of the header */
+	count = le16toh(res->count);
+	if (res->tan != bulk->tan[slot]) {
+		pr_int("Error: unexpected TAN %d, expected %d\n", res->tan,
+		       bulk->tan[slot]);
+		bulk->error = -EPROTO;
+		goto next;
+	}
+
+	if (res->error_code && res->error_code != ISOBUSFS_ERR_END_OF_FILE) {
+		pr_int("Error: %s failed at offset %lld: %s\n",
+		       bulk->put ? "write" : "read",
+		       (long long)bulk->offset[slot],
+		       isobusfs_error_to_str(res->error_code));
+		bulk->error = -EIO;
+		goto next;
+	}
+
+	if (bulk->put) {
+		if (count != bulk->count[slot]) {
+			pr_int("Error: server wrote %d of %d bytes\n", count,
+			       bulk->count[slot]);
+			bulk->error = -ENOSPC;
+			goto next;
+		}
+	} else {
+		if (count > bulk->count[slot] ||
+		    (size_t)msg->len < sizeof(*res) + count) {
+			bulk->error = -EPROTO;
+			goto next;
+		}
+
+		/* the data of a short read is the last of the file */
+		if (count < bulk->count[slot])
+			bulk->eof = true;
+
+		len = pwrite(bulk->fd, res->data, count, bulk->offset[slot]);
+		if (len != count) {
+			pr_int("Error: Failed to write data to local file.\n");
+			bulk->error = -EIO;
+			goto next;
+		}
+	}
+
+	bulk->bytes += count;
+	isobusfs_cli_bulk_progress(bulk, false);
+
+next:
+	isobusfs_cli_bulk_next(priv, bulk);
+}
+
+static int isobusfs_cli_bulk_event_cb(struct isobusfs_priv *priv,
+				      struct isobusfs_msg *msg, void *ctx,
+				      int error)
+{
+	struct isobusfs_cli_bulk *bulk = ctx;
+	struct isobusfs_close_file_res *cf_res;
+
+	if (error) {
+		pr_int("Error: %s: no response from server: %d\n",
+		       bulk->remote_path, error);
+		if (!bulk->error)
+			bulk->error = error;
+	}
+
+	switch (bulk->state) {
+	case ISOBUSFS_CLI_BULK_OPEN:
+		if (error) {
+			isobusfs_cli_bulk_finish(priv, bulk);
+			break;
+		}
+		isobusfs_cli_bulk_open_res(priv, bulk, msg);
+		break;
+	case ISOBUSFS_CLI_BULK_TRANSFER:
+		if (error) {
+			bulk->head = (bulk->head + 1) % ISOBUSFS_CLI_BULK_MAX_DEPTH;
+			bulk->in_flight--;
+			isobusfs_cli_bulk_next(priv, bulk);
+			break;
+		}
+		isobusfs_cli_bulk_data_res(priv, bulk, msg);
+		break;
+	case ISOBUSFS_CLI_BULK_CLOSE:
+		if (!error) {
+			cf_res = (struct isobusfs_close_file_res *)msg->buf;
+			if (cf_res->error_code && !bulk->error)
+				bulk->error = -EIO;
+		}
+		isobusfs_cli_bulk_finish(priv, bulk);
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * isobusfs_cli_fa_bulk_start - Start a pipelined file transfer
+ * @priv: pointer to the isobusfs_priv structure
+ * @bulk: transfer, with remote_path, fd, put, depth, chunk and done set
+ *
+ * Opens the remote file and keeps up to @bulk->depth Read File (get) or
+ * Write File (put) requests of @bulk->chunk bytes in flight. The local
+ * file @bulk->fd is written or read at the offset of each request.
+ * @bulk->done is called once the transfer is finished or failed.
+ *
+ * Returns 0 if the transfer was started, a negative error code otherwise.
+ */
+int isobusfs_cli_fa_bulk_start(struct isobusfs_priv *priv,
+			       struct isobusfs_cli_bulk *bulk)
+{
+	uint8_t flags = ISOBUSFS_FA_OPEN_FILE_RO;
+	int ret;
+
+	if (!bulk->depth || bulk->depth > ISOBUSFS_CLI_BULK_MAX_DEPTH ||
+	    !bulk->chunk || bulk->chunk > ISOBUSFS_MAX_DATA_LENGH)
+		return -EINVAL;
+
+	if (bulk->put) {
+		bulk->buf = malloc(bulk->chunk);
+		if (!bulk->buf)
+			return -ENOMEM;
+		flags = ISOBUSFS_FA_OPEN_FILE_WO | ISOBUSFS_FA_CREATE_FILE_DIR;
+	}
+
+	bulk->state = ISOBUSFS_CLI_BULK_OPEN;
+	bulk->head = 0;
+	bulk->in_flight = 0;
+	bulk->next_offset = 0;
+	bulk->bytes = 0;
+	bulk->eof = false;
+	bulk->error = 0;
+
+	ret = isobusfs_cli_fa_of_req(priv, bulk->remote_path,
+				     strlen(bulk->remote_path), flags);
+	if (!ret)
+		ret = isobusfs_cli_bulk_register(priv, bulk,
+						 ISOBUSFS_FA_F_OPEN_FILE_RES, 0);
+	if (ret < 0) {
+		free(bulk->buf);
+		bulk->buf = NULL;
+	}
+
+	return ret;
+}
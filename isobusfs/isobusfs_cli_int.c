@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "../libj1939.h"
@@ -437,6 +438,118 @@ static int cmd_get(struct isobusfs_priv *priv, const char *options)
 	return 0;
 }
 
+/* ------ bget/bput commands -------*/
+static void isobusfs_cli_bulk_done(struct isobusfs_priv *priv,
+				   struct isobusfs_cli_bulk *bulk, int error)
+{
+	pr_int("File transfer %s.\n", error ? "failed" : "completed");
+
+	close(bulk->fd);
+	free((char *)bulk->remote_path);
+	free(bulk);
+
+	priv->int_busy = false;
+	isobusfs_cli_promt(priv);
+}
+
+static int isobusfs_cli_bulk_cmd(struct isobusfs_priv *priv,
+				 const char *options, bool put)
+{
+	const char *usage = put ?
+		"Usage: bput <local_path> [remote_path] [depth]\n" :
+		"Usage: bget <remote_path> [local_path] [depth]\n";
+	char *options_copy, *src, *dst, *depth;
+	struct isobusfs_cli_bulk *bulk;
+	struct stat st;
+	int ret;
+
+	/* errors are reported, but do not end the interactive session */
+	if (!options) {
+		pr_int("%s", usage);
+		return 0;
+	}
+
+	options_copy = strdup(options);
+	if (!options_copy) {
+		pr_int("Error: Unable to allocate memory for options processing.\n");
+		return -ENOMEM;
+	}
+
+	src = strtok(options_copy, " ");
+	dst = strtok(NULL, " ");
+	depth = strtok(NULL, " ");
+	if (!src) {
+		pr_int("%s", usage);
+		free(options_copy);
+		return 0;
+	}
+
+	/* default to the file name of the source */
+	if (!dst) {
+		dst = strrchr(src, put ? '/' : '\\');
+		dst = dst ? dst + 1 : src;
+	}
+
+	bulk = calloc(1, sizeof(*bulk));
+	if (!bulk) {
+		pr_int("Error: Unable to allocate memory for transfer.\n");
+		free(options_copy);
+		return -ENOMEM;
+	}
+
+	bulk->put = put;
+	bulk->chunk = ISOBUSFS_MAX_DATA_LENGH;
+	bulk->depth = depth ? strtoul(depth, NULL, 0) :
+			      ISOBUSFS_CLI_BULK_DEFAULT_DEPTH;
+	bulk->done = isobusfs_cli_bulk_done;
+	bulk->remote_path = strdup(put ? dst : src);
+	if (put)
+		bulk->fd = open(src, O_RDONLY);
+	else
+		bulk->fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (bulk->fd < 0 || !bulk->remote_path) {
+		ret = bulk->fd < 0 ? -errno : -ENOMEM;
+		pr_int("Error: Unable to open local file %s: %s\n",
+		       put ? src : dst, strerror(-ret));
+		goto err;
+	}
+
+	if (put && !fstat(bulk->fd, &st))
+		bulk->size = st.st_size;
+
+	ret = isobusfs_cli_fa_bulk_start(priv, bulk);
+	if (ret < 0) {
+		pr_int("Error: Failed to start transfer: %d (%s)\n", ret,
+		       strerror(-ret));
+		goto err;
+	}
+
+	priv->int_busy = true;
+	free(options_copy);
+
+	return 0;
+
+err:
+	if (bulk->fd >= 0)
+		close(bulk->fd);
+	free((char *)bulk->remote_path);
+	free(bulk);
+	free(options_copy);
+
+	return 0;
+}
+
+static int cmd_bget(struct isobusfs_priv *priv, const char *options)
+{
+	return isobusfs_cli_bulk_cmd(priv, options, false);
+}
+
+static int cmd_bput(struct isobusfs_priv *priv, const char *options)
+{
+	return isobusfs_cli_bulk_cmd(priv, options, true);
+}
+
 /* ------ ls command -------*/
 enum isobusfs_cli_ls_state {
 	ISOBUSFS_CLI_LS_STATE_START,
@@ -1037,6 +1150,8 @@ struct command_mapping commands[] = {
 	{"cd", cmd_cd, "change directory"},
 	{"pwd", cmd_pwd, "print name of current/working directory"},
 	{"get", cmd_get, "get file"},
+	{"bget", cmd_bget, "get file, with several read requests in flight"},
+	{"bput", cmd_bput, "put file, with several write requests in flight"},
 	{NULL, NULL, NULL}
 };
 
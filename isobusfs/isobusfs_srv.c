@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <net/if.h>
+#include <sys/inotify.h>
 
 #include <linux/net_tstamp.h>
 
@@ -88,6 +89,22 @@ static int isobusfs_srv_rx_fs(struct isobusfs_srv_priv *priv,
 
 	msg->sock = client->sock;
 
+	/* keep the order of the requests while a job of the client runs */
+	if (client->busy) {
+		if (client->deferred_count >= ISOBUSFS_SRV_MAX_DEFERRED) {
+			pr_warn("%s: too many requests from client 0x%02x",
+				__func__, addr);
+			isobusfs_srv_send_error(priv, msg, ISOBUSFS_ERR_OTHER);
+			return 0;
+		}
+
+		client->deferred[(client->deferred_head + client->deferred_count) %
+				 ISOBUSFS_SRV_MAX_DEFERRED] = msg;
+		client->deferred_count++;
+
+		return ISOBUSFS_SRV_MSG_QUEUED;
+	}
+
 	switch (cg) {
 	case ISOBUSFS_CG_CONNECTION_MANAGMENT:
 		ret = isobusfs_srv_rx_cg_cm(priv, msg);
@@ -109,11 +126,45 @@ static int isobusfs_srv_rx_fs(struct isobusfs_srv_priv *priv,
 	return ret;
 }
 
-static int isobusfs_srv_rx_ack(struct isobusfs_srv_priv *priv,
-			       struct isobusfs_msg *msg)
+/**
+ * isobusfs_srv_client_resume - Handle the requests deferred while busy
+ * @priv: pointer to the server's private data structure
+ * @client: client whose job is done
+ *
+ * Stops as soon as a request starts a new job.
+ */
+void isobusfs_srv_client_resume(struct isobusfs_srv_priv *priv,
+				struct isobusfs_srv_client *client)
 {
+	struct isobusfs_msg *msg;
+	int ret;
+
+	while (!client->busy && client->deferred_count) {
+		msg = client->deferred[client->deferred_head];
+		client->deferred_head = (client->deferred_head + 1) %
+					ISOBUSFS_SRV_MAX_DEFERRED;
+		client->deferred_count--;
+
+		ret = isobusfs_srv_rx_fs(priv, msg);
+		if (ret == ISOBUSFS_SRV_MSG_QUEUED)
+			continue;
+		if (ret < 0)
+			pr_err("unhandled error by rx buf: %i", ret);
+		free(msg);
+	}
+}
+
+static int isobusfs_srv_rx_ack(void *ctx, struct libj1939_rx_msg *msg)
+{
+	struct isobusfs_srv_priv *priv = ctx;
 	enum isobusfs_ack_ctrl ctrl = msg->buf[0];
 
+	if (msg->len < ISOBUSFS_MIN_TRANSFER_LENGH) {
+		pr_warn("ACK is less then min transfer: %zu < %i. Dropping.",
+			msg->len, ISOBUSFS_MIN_TRANSFER_LENGH);
+		return 0;
+	}
+
 	switch (ctrl) {
 	case ISOBUS_ACK_CTRL_ACK:
 		pr_debug("< rx: ACK?????");
@@ -132,75 +183,70 @@ static int isobusfs_srv_rx_ack(struct isobusfs_srv_priv *priv,
 	return 0;
 }
 
-static int isobusfs_srv_rx_buf(struct isobusfs_srv_priv *priv, struct isobusfs_msg *msg)
+static int isobusfs_srv_rx_cl_to_fs(void *ctx, struct libj1939_rx_msg *rx_msg)
 {
-	pgn_t pgn = msg->peername.can_addr.j1939.pgn;
+	struct isobusfs_srv_priv *priv = ctx;
+	struct isobusfs_msg *msg;
 	int ret;
 
-	switch (pgn) {
-	case ISOBUSFS_PGN_CL_TO_FS:
-		ret = isobusfs_srv_rx_fs(priv, msg);
-		break;
-	case ISOBUS_PGN_ACK:
-		ret = isobusfs_srv_rx_ack(priv, msg);
-		break;
-	default:
-		pr_warn("%s: unsupported PGN: %i", __func__, pgn);
-		ret = -EINVAL;
-		break;
+	if (rx_msg->truncated) {
+		pr_warn("request is longer than %i bytes. Dropping.",
+			ISOBUSFS_MAX_TRANSFER_LENGH);
+		return 0;
 	}
 
-	return ret;
-}
-
-static int isobusfs_srv_recv_one(struct isobusfs_srv_priv *priv, int sock)
-{
-	struct isobusfs_msg *msg;
-	int flags = 0;
-	int ret;
-
+	/* the request may be kept by a job, so it needs its own copy */
 	msg = malloc(sizeof(*msg));
 	if (!msg) {
 		pr_err("can't allocate rx msg struct");
-		goto done;
+		return 0;
 	}
+	memcpy(msg->buf, rx_msg->buf, rx_msg->len);
 	msg->buf_size = ISOBUSFS_MAX_TRANSFER_LENGH;
+	msg->len = rx_msg->len;
+	msg->peername = rx_msg->peername;
 	msg->peer_addr_len = sizeof(msg->peername);
-	msg->sock = sock;
-
-	ret = recvfrom(sock, &msg->buf[0], msg->buf_size, flags,
-		       (struct sockaddr *)&msg->peername, &msg->peer_addr_len);
-	if (ret < 0) {
-		pr_err("recvfrom(): %i (%s)", errno, strerror(errno));
-		goto free_msg;
-	}
+	msg->sock = rx_msg->sock;
 
-	if (ret < ISOBUSFS_MIN_TRANSFER_LENGH) {
-		pr_warn("buf is less then min transfer: %i < %i. Dropping.",
-			ret, ISOBUSFS_MIN_TRANSFER_LENGH);
+	if (msg->len < ISOBUSFS_MIN_TRANSFER_LENGH) {
+		pr_warn("buf is less then min transfer: %zi < %i. Dropping.",
+			msg->len, ISOBUSFS_MIN_TRANSFER_LENGH);
 
 		/* TODO: The file server shall respond with Error Code 47
 		 * Malformed Request, if the message is shorter than expected.
 		 */
-		isobusfs_send_nack(priv->sock_nack, msg);
+		if (msg->len)
+			isobusfs_send_nack(priv->sock_nack, msg);
 
 		goto free_msg;
 	}
 
-	msg->len = ret;
-
-	ret = isobusfs_srv_rx_buf(priv, msg);
-	if (ret < 0) {
+	ret = isobusfs_srv_rx_fs(priv, msg);
+	/* the message belongs to a job or waits for one */
+	if (ret == ISOBUSFS_SRV_MSG_QUEUED)
+		return 0;
+	if (ret < 0)
 		pr_err("unhandled error by rx buf: %i", ret);
-		goto free_msg;
-	}
 
 free_msg:
 	free(msg);
-done:
-	return EXIT_SUCCESS;
+
+	return 0;
+}
+
+static int isobusfs_srv_rx_unhandled(void *ctx, struct libj1939_rx_msg *msg)
+{
+	pr_warn("%s: unsupported PGN: %i", __func__,
+		msg->peername.can_addr.j1939.pgn);
+
+	return 0;
 }
 
+static const struct libj1939_rx_handler isobusfs_srv_rx_handlers[] = {
+	{ ISOBUSFS_PGN_CL_TO_FS, isobusfs_srv_rx_cl_to_fs },
+	{ ISOBUS_PGN_ACK, isobusfs_srv_rx_ack },
+};
+
 static int isobusfs_srv_handle_events(struct isobusfs_srv_priv *priv, unsigned int nfds)
 {
 	int ret;
@@ -226,26 +272,26 @@ static int isobusfs_srv_handle_events(struct isobusfs_srv_priv *priv, unsigned i
 			}
 		}
 
+		if (ev->data.fd == priv->inotify_fd) {
+			isobusfs_srv_dir_cache_events(priv);
+			continue;
+		}
+
+		if (ev->data.fd == priv->wq.event_fd) {
+			isobusfs_srv_wq_complete(priv);
+			continue;
+		}
+
 		if (ev->events & POLLIN) {
-			ret = isobusfs_srv_recv_one(priv, ev->data.fd);
-			if (ret) {
-				warn("recv one");
-				return ret;
-			}
+			/* handler errors are logged and not critical */
+			ret = libj1939_rx_dispatch(&priv->rx, ev->data.fd);
+			if (ret < 0)
+				pr_warn("rx dispatch failed: %i", ret);
 		}
 	}
 	return 0;
 }
 
-static int isobusfs_srv_handle_periodic_tasks(struct isobusfs_srv_priv *priv)
-{
-	/* remove timeouted clients */
-	isobusfs_srv_remove_timeouted_clients(priv);
-
-	/* this function will send status only if it is proper time to do so */
-	return isobusfs_srv_fss_send(priv);
-}
-
 static int isobusfs_srv_process_events_and_tasks(struct isobusfs_srv_priv *priv)
 {
 	int ret, nfds;
@@ -260,7 +306,7 @@ static int isobusfs_srv_process_events_and_tasks(struct isobusfs_srv_priv *priv)
 			return ret;
 	}
 
-	return isobusfs_srv_handle_periodic_tasks(priv);
+	return 0;
 }
 
 static int isobusfs_srv_sock_fss_prepare(struct isobusfs_srv_priv *priv)
@@ -391,7 +437,20 @@ static int isobusfs_srv_sock_prepare(struct isobusfs_srv_priv *priv)
 	if (ret < 0)
 		return ret;
 
-	return isobusfs_srv_sock_nack_prepare(priv);
+	ret = isobusfs_srv_sock_nack_prepare(priv);
+	if (ret < 0)
+		return ret;
+
+	/* directory listings are cached until inotify reports a change */
+	priv->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (priv->inotify_fd < 0) {
+		ret = -errno;
+		pr_err("inotify_init1(): %i (%s)", errno, strerror(errno));
+		return ret;
+	}
+
+	return libj1939_add_socket_to_epoll(priv->cmn.epoll_fd,
+					    priv->inotify_fd, EPOLLIN);
 }
 
 static int isobusfs_srv_parse_volume_ext(struct isobusfs_srv_priv *priv,
@@ -487,6 +546,8 @@ static void isobusfs_srv_print_help(void)
 	printf("  --address <local_address_hex> or -a <local_address_hex>\n");
 	printf("  --default-volume <volume_name> or -d <volume_name>\n");
 	printf("  --interface <interface_name> or -i <interface_name>\n");
+	printf("  --io-workers <count> or -j <count> (default: %d, 0: no threads)\n",
+	       ISOBUSFS_SRV_IO_WORKERS);
 	printf("  --log-level <logging_level> or -l <loging_level>\n");
 	printf("  --name <local_name_hex> or -n <local_name_hex>\n");
 	printf("  --removable-volume <volume_name_1,volume_name_2,...> or -r <volume_name_1,volume_name_2,...>\n");
@@ -517,6 +578,7 @@ static int isobusfs_srv_parse_args(struct isobusfs_srv_priv *priv, int argc,
 		{"address", required_argument, NULL, 'a'},
 		{"default-volume", required_argument, NULL, 'd'},
 		{"interface", required_argument, NULL, 'i'},
+		{"io-workers", required_argument, NULL, 'j'},
 		{"log-level", required_argument, NULL, 'l'},
 		{"name", required_argument, NULL, 'n'},
 		{"removable-volume", required_argument, 0, 'r'},
@@ -527,7 +589,7 @@ static int isobusfs_srv_parse_args(struct isobusfs_srv_priv *priv, int argc,
 		{NULL, 0, NULL, 0}
 	};
 
-	while ((opt = getopt_long(argc, argv, "a:d:i:l:n:r:s:v:w:h",
+	while ((opt = getopt_long(argc, argv, "a:d:i:j:l:n:r:s:v:w:h",
 				  long_options, &long_index)) != -1) {
 		switch (opt) {
 		case 'a': {
@@ -554,6 +616,17 @@ static int isobusfs_srv_parse_args(struct isobusfs_srv_priv *priv, int argc,
 			interface_set = true;
 			break;
 		}
+		case 'j': {
+			int workers = atoi(optarg);
+
+			if (workers < 0 || workers > ISOBUSFS_SRV_MAX_IO_WORKERS) {
+				pr_err("Invalid number of I/O workers %d (max %d)",
+				       workers, ISOBUSFS_SRV_MAX_IO_WORKERS);
+				return -EINVAL;
+			}
+			priv->wq.nthreads = workers;
+			break;
+		}
 		case 'l': {
 			level = strtoul(optarg, NULL, 0);
 			if (level < LOG_LEVEL_ERROR || level > LOG_LEVEL_DEBUG)
@@ -750,7 +823,6 @@ static int isobusfs_srv_parse_args(struct isobusfs_srv_priv *priv, int argc,
 int main(int argc, char *argv[])
 {
 	struct isobusfs_srv_priv *priv;
-	struct timespec ts;
 	int ret;
 
 	/* Allocate memory for the private structure */
@@ -765,6 +837,7 @@ int main(int argc, char *argv[])
 	libj1939_init_sockaddr_can(&priv->addr, J1939_NO_PGN);
 
 	priv->server_version = ISOBUSFS_SRV_VERSION;
+	priv->wq.nthreads = ISOBUSFS_SRV_IO_WORKERS;
 	/* Parse command line arguments */
 	ret = isobusfs_srv_parse_args(priv, argc, argv);
 	if (ret)
@@ -779,10 +852,31 @@ int main(int argc, char *argv[])
 	isobusfs_srv_fss_init(priv);
 	/* Initialize client structures */
 	isobusfs_srv_init_clients(priv);
+	isobusfs_srv_init_handles(priv);
+	/* Preallocate Read File response buffers */
+	ret = isobusfs_srv_buf_pool_init(priv);
+	if (ret)
+		return ret;
+	/* Receive the requests in batches */
+	ret = libj1939_rx_init(&priv->rx, ISOBUSFS_SRV_RX_BATCH,
+			       ISOBUSFS_MAX_TRANSFER_LENGH);
+	if (ret)
+		return ret;
+	libj1939_rx_set_handlers(&priv->rx, isobusfs_srv_rx_handlers,
+				 ARRAY_SIZE(isobusfs_srv_rx_handlers),
+				 isobusfs_srv_rx_unhandled, priv);
+	/* Start the workers for blocking file system calls */
+	ret = isobusfs_srv_wq_init(priv);
+	if (ret)
+		return ret;
 
-	/* Init next st_next_send_time value to avoid warnings */
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	priv->cmn.next_send_time = ts;
+	/* File Server Status broadcasts and client timeouts */
+	ret = libj1939_timers_init(&priv->cmn);
+	if (ret)
+		return ret;
+	ret = isobusfs_srv_fss_start(priv);
+	if (ret)
+		return ret;
 
 	/* Start the isobusfsd server */
 	pr_info("Starting isobusfs-srv");
@@ -792,12 +886,18 @@ int main(int argc, char *argv[])
 			break;
 	}
 
+	isobusfs_srv_wq_stop(priv);
+	libj1939_timers_free(&priv->cmn);
+
 	/* Close epoll and control sockets */
 	close(priv->cmn.epoll_fd);
 	free(priv->cmn.epoll_events);
 	close(priv->sock_fss);
 	close(priv->sock_in);
 	close(priv->sock_nack);
+	close(priv->inotify_fd);
+	isobusfs_srv_buf_pool_free(priv);
+	libj1939_rx_free(&priv->rx);
 
 	return ret;
 }
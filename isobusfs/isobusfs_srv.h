@@ -4,6 +4,8 @@
 #ifndef ISOBUSFS_SRV_H
 #define ISOBUSFS_SRV_H
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/epoll.h>
@@ -17,7 +19,20 @@
 #define ISOBUSFS_SRV_MAX_CLIENT_SOCKETS		255
 #define ISOBUSFS_SRV_MAX_EPOLL_EVENTS		(ISOBUSFS_SRV_MAX_CTRL_SOCKETS + \
 						 ISOBUSFS_SRV_MAX_CLIENT_SOCKETS)
+/*
+ * The handle is one byte on the wire and 0xff is reserved, so 255 is the
+ * limit of the protocol. Handles are found by the hash of their path.
+ */
 #define ISOBUSFS_SRV_MAX_OPENED_HANDLES		255
+#define ISOBUSFS_SRV_HANDLE_HASH_SIZE		512 /* power of two */
+/*
+ * Directory listings are kept by path, also after the directory is closed.
+ * Each open directory handle has a listing, of the unused listings the
+ * least recently used ones are dropped beyond ISOBUSFS_SRV_DIR_CACHE_KEEP.
+ */
+#define ISOBUSFS_SRV_DIR_CACHE_KEEP		16
+#define ISOBUSFS_SRV_DIR_CACHE_SIZE		(ISOBUSFS_SRV_MAX_OPENED_HANDLES + \
+						 ISOBUSFS_SRV_DIR_CACHE_KEEP)
 /*
  * ISO 11783-13:2021 standard does not explicitly specify a maximum number of
  * clients that can be supported on the network. However, the ISO 11783 standard
@@ -37,6 +52,28 @@
  * network.
  */
 #define ISOBUSFS_SRV_MAX_CLIENTS			237
+/* clients are stored at the index of their source address */
+#define ISOBUSFS_SRV_CLIENT_TABLE_SIZE		256
+/*
+ * Read File responses are built in per client buffers of the maximal ETP
+ * transfer size. The buffers are taken from a pool on the first Read File
+ * request of a client and returned when the client is removed, so there
+ * is no allocation per request.
+ */
+#define ISOBUSFS_SRV_RES_BUF_SIZE		ISOBUSFS_MAX_TRANSFER_LENGH
+#define ISOBUSFS_SRV_RES_BUF_PREALLOC		4
+/*
+ * Blocking file system calls run in worker threads. A client with a job
+ * in flight is busy, its next requests wait in a queue and are handled in
+ * order after the job is done.
+ */
+#define ISOBUSFS_SRV_IO_WORKERS			2
+#define ISOBUSFS_SRV_MAX_IO_WORKERS		16
+#define ISOBUSFS_SRV_MAX_DEFERRED		16
+/* returned by the rx handlers if they keep the message */
+#define ISOBUSFS_SRV_MSG_QUEUED			1
+/* messages per recvmmsg(), each takes ISOBUSFS_MAX_TRANSFER_LENGH */
+#define ISOBUSFS_SRV_RX_BATCH			8
 
 enum isobusfs_srv_fss_state {
 	ISOBUSFS_SRV_STATE_IDLE = 0, /* send status with 2000ms interval */
@@ -51,10 +88,19 @@ enum isobusfs_srv_fss_state {
 struct isobusfs_srv_client {
 	int sock;
 	struct timespec last_received;
+	/* expires ISOBUSFS_CLIENT_TIMEOUT after the last_received */
+	struct libj1939_timer timeout_timer;
 	uint8_t addr;
 	uint8_t tan;
 	uint8_t version;
 	char current_dir[ISOBUSFS_SRV_MAX_PATH_LEN];
+	/* Read File response buffer from the pool, NULL until first use */
+	uint8_t *res_buf;
+	/* a job of this client is in the work queue */
+	bool busy;
+	struct isobusfs_msg *deferred[ISOBUSFS_SRV_MAX_DEFERRED];
+	unsigned int deferred_head;
+	unsigned int deferred_count;
 };
 
 struct isobusfs_srv_volume {
@@ -66,14 +112,89 @@ struct isobusfs_srv_volume {
 	struct isobusfs_srv_client *clients[ISOBUSFS_SRV_MAX_CLIENTS];
 };
 
+/*
+ * Directory entries encoded as in a Read File response (ISO 11783-13:2021
+ * B.22 - B.26). The listing is built on the first read of a directory
+ * and served from memory until inotify reports a change.
+ */
+struct isobusfs_srv_dir_cache {
+	char *path;		/* NULL if the slot is unused */
+	uint32_t hash;
+	int hash_next;		/* next listing in the hash bucket or -1 */
+	int refcount;		/* directory handles of the path */
+	unsigned long last_used;
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	/* start of each entry in buf, entries[count] == len */
+	uint32_t *entries;
+	unsigned int count;
+	unsigned int entries_size;
+	bool valid;
+	int wd;			/* inotify watch descriptor, 0 if none */
+	unsigned int gen;	/* incremented on each invalidation */
+};
+
 struct isobusfs_srv_handles {
 	char *path;
+	uint32_t hash;
+	int hash_next;		/* next handle in the hash bucket or -1 */
 	int refcount;
 	int fd;
-	off_t offset;
-	int32_t dir_pos;
 	DIR *dir;
-	struct isobusfs_srv_client *clients[ISOBUSFS_SRV_MAX_CLIENTS];
+	struct isobusfs_srv_dir_cache *dir_cache;	/* NULL for files */
+	/* indexed by client address */
+	struct isobusfs_srv_client *clients[ISOBUSFS_SRV_CLIENT_TABLE_SIZE];
+	/*
+	 * position of each client: file offset used with pread(), or the
+	 * index of the next directory entry
+	 */
+	off_t offsets[ISOBUSFS_SRV_CLIENT_TABLE_SIZE];
+};
+
+struct isobusfs_srv_priv;
+
+struct isobusfs_srv_job {
+	struct isobusfs_srv_job *next;
+	/* runs in a worker thread, must not touch the server state */
+	void (*work)(struct isobusfs_srv_job *job);
+	/* runs in the main loop after work() */
+	void (*done)(struct isobusfs_srv_priv *priv,
+		     struct isobusfs_srv_job *job);
+	struct isobusfs_srv_client *client;
+	struct isobusfs_msg *msg;	/* the request, owned by the job */
+
+	/* arguments and results of the blocking calls */
+	int handle;
+	bool is_dir;
+	int flags;
+	int fd;
+	DIR *dir;
+	off_t offset;
+	size_t count;
+	uint8_t *buf;
+	ssize_t result;
+	uint8_t error_code;
+	unsigned int gen;
+	struct isobusfs_srv_dir_cache cache;
+	char path[ISOBUSFS_SRV_MAX_PATH_LEN];
+};
+
+struct isobusfs_srv_wq {
+	pthread_t threads[ISOBUSFS_SRV_MAX_IO_WORKERS];
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct isobusfs_srv_job *head, *tail;	/* pending */
+	struct isobusfs_srv_job *done;		/* finished, LIFO */
+	int event_fd;		/* signals finished jobs to the main loop */
+	bool stop;
+};
+
+struct isobusfs_srv_buf_pool {
+	uint8_t *free[ISOBUSFS_SRV_MAX_CLIENTS];
+	int free_count;
+	int total;
 };
 
 struct isobusfs_srv_priv {
@@ -97,13 +218,15 @@ struct isobusfs_srv_priv {
 	struct isobusfs_cm_fss st; /* file server status message */
 	enum isobusfs_srv_fss_state st_state;
 	struct isobusfs_stats st_msg_stats;
+	struct libj1939_timer fss_timer;
 
 	/* client related variables */
-	struct isobusfs_srv_client clients[ISOBUSFS_SRV_MAX_CLIENTS];
+	struct isobusfs_srv_client clients[ISOBUSFS_SRV_CLIENT_TABLE_SIZE];
 	int clients_count;
 	struct isobusfs_buf_log tx_buf_log;
 
 	struct libj1939_cmn cmn;
+	struct libj1939_rx rx;
 
 	struct isobusfs_srv_volume volumes[ISOBUSFS_SRV_MAX_VOLUMES];
 	int volume_count;
@@ -115,23 +238,46 @@ struct isobusfs_srv_priv {
 
 	struct isobusfs_srv_handles handles[ISOBUSFS_SRV_MAX_OPENED_HANDLES];
 	int handles_count;
+	int handle_hash[ISOBUSFS_SRV_HANDLE_HASH_SIZE];
+	/* stack of unused handles */
+	uint8_t free_handles[ISOBUSFS_SRV_MAX_OPENED_HANDLES];
+	int free_handles_count;
+
+	struct isobusfs_srv_buf_pool res_pool;
+
+	struct isobusfs_srv_dir_cache dir_caches[ISOBUSFS_SRV_DIR_CACHE_SIZE];
+	int dir_cache_hash[ISOBUSFS_SRV_HANDLE_HASH_SIZE];
+	int dir_caches_unused;
+	unsigned long dir_cache_clock;
+	/* invalidates the directory caches */
+	int inotify_fd;
+
+	struct isobusfs_srv_wq wq;
 };
 
+static inline struct isobusfs_srv_priv *
+isobusfs_srv_cmn_to_priv(struct libj1939_cmn *cmn)
+{
+	return (struct isobusfs_srv_priv *)((char *)cmn -
+		offsetof(struct isobusfs_srv_priv, cmn));
+}
+
 /* isobusfs_srv.c */
 int isobusfs_srv_send_error(struct isobusfs_srv_priv *priv,
 			    struct isobusfs_msg *msg, enum isobusfs_error err);
 int isobusfs_srv_sendto(struct isobusfs_srv_priv *priv,
 			struct isobusfs_msg *msg, const void *buf,
 			size_t buf_size);
+void isobusfs_srv_client_resume(struct isobusfs_srv_priv *priv,
+				struct isobusfs_srv_client *client);
 
 /* isobusfs_srv_cm_fss.c */
 void isobusfs_srv_fss_init(struct isobusfs_srv_priv *priv);
-int isobusfs_srv_fss_send(struct isobusfs_srv_priv *priv);
+int isobusfs_srv_fss_start(struct isobusfs_srv_priv *priv);
 
 /* isobusfs_srv_cm.c */
 int isobusfs_srv_rx_cg_cm(struct isobusfs_srv_priv *priv,
 			  struct isobusfs_msg *msg);
-void isobusfs_srv_remove_timeouted_clients(struct isobusfs_srv_priv *priv);
 void isobusfs_srv_init_clients(struct isobusfs_srv_priv *priv);
 struct isobusfs_srv_client *isobusfs_srv_get_client(
 		struct isobusfs_srv_priv *priv, uint8_t addr);
@@ -155,6 +301,15 @@ void isobusfs_srv_set_default_current_dir(struct isobusfs_srv_priv *priv,
 					  struct isobusfs_srv_client *client);
 
 
+/* isobusfs_srv_wq.c */
+int isobusfs_srv_wq_init(struct isobusfs_srv_priv *priv);
+void isobusfs_srv_wq_stop(struct isobusfs_srv_priv *priv);
+struct isobusfs_srv_job *isobusfs_srv_job_alloc(struct isobusfs_srv_client *client,
+						struct isobusfs_msg *msg);
+void isobusfs_srv_job_submit(struct isobusfs_srv_priv *priv,
+			     struct isobusfs_srv_job *job);
+void isobusfs_srv_wq_complete(struct isobusfs_srv_priv *priv);
+
 /* isobusfs_srv_vh.c */
 int isobusfs_srv_rx_cg_vh(struct isobusfs_srv_priv *priv,
 			  struct isobusfs_msg *msg);
@@ -168,6 +323,12 @@ int isobusfs_srv_rx_cg_fa(struct isobusfs_srv_priv *priv,
 			  struct isobusfs_msg *msg);
 void isobusfs_srv_remove_client_from_handles(struct isobusfs_srv_priv *priv,
 					     struct isobusfs_srv_client *client);
+void isobusfs_srv_init_handles(struct isobusfs_srv_priv *priv);
+void isobusfs_srv_dir_cache_events(struct isobusfs_srv_priv *priv);
+int isobusfs_srv_buf_pool_init(struct isobusfs_srv_priv *priv);
+void isobusfs_srv_buf_pool_free(struct isobusfs_srv_priv *priv);
+void isobusfs_srv_put_res_buf(struct isobusfs_srv_priv *priv,
+			      struct isobusfs_srv_client *client);
 
 
 #endif /* ISOBUSFS_SRV_H */
@@ -111,13 +111,14 @@ isobusfs_srv_remove_client_from_volumes(struct isobusfs_srv_priv *priv,
  *
  * This function initializes the clients array in the isobusfs_srv_priv
  * structure by setting the socket value to -1 for each client in the list.
- * This indicates that the clients are not currently connected.
+ * This indicates that the clients are not currently connected. The array
+ * is indexed by the source address of the client.
  */
 void isobusfs_srv_init_clients(struct isobusfs_srv_priv *priv)
 {
 	int i;
 
-	for (i = 0; i < ISOBUSFS_SRV_MAX_CLIENTS; i++)
+	for (i = 0; i < ISOBUSFS_SRV_CLIENT_TABLE_SIZE; i++)
 		priv->clients[i].sock = -1;
 }
 
@@ -126,29 +127,19 @@ void isobusfs_srv_init_clients(struct isobusfs_srv_priv *priv)
  * @priv: Pointer to the isobusfs_srv_priv structure containing clients array
  * @addr: Address of the client to find
  *
- * This function searches for a client in the list of clients using the
- * provided address. If a client with a matching address is found, the
- * function returns a pointer to the corresponding isobusfs_srv_client
- * structure. If no matching client is found, the function returns NULL.
- *
- * Note: The function skips clients with negative socket values.
+ * This function looks up the client at the index of the provided address.
+ * If the client is connected, the function returns a pointer to the
+ * corresponding isobusfs_srv_client structure, otherwise NULL.
  */
 static struct isobusfs_srv_client *isobusfs_srv_find_client(
 				struct isobusfs_srv_priv *priv, uint8_t addr)
 {
-	int i;
-
-	for (i = 0; i < priv->clients_count; i++) {
-		struct isobusfs_srv_client *client = &priv->clients[i];
+	struct isobusfs_srv_client *client = &priv->clients[addr];
 
-		if (client->sock < 0)
-			continue;
-
-		if (client->addr == addr)
-			return &priv->clients[i];
-	}
+	if (client->sock < 0)
+		return NULL;
 
-	return NULL;
+	return client;
 }
 
 /**
@@ -156,34 +147,40 @@ static struct isobusfs_srv_client *isobusfs_srv_find_client(
  * @priv: Pointer to the isobusfs_srv_priv structure containing clients array
  * @client: Pointer to the isobusfs_srv_client structure to be removed
  *
- * This function removes a client from the list of clients, adjusts the
- * clients array, and decrements the clients_count. The function also closes
- * the client's socket.
+ * This function removes a client from the list of clients, clears its
+ * entry, and decrements the clients_count. The function also closes the
+ * client's socket. Other clients stay at their place, so pointers to them
+ * remain valid.
  */
 static void isobusfs_srv_remove_client(struct isobusfs_srv_priv *priv,
 				       struct isobusfs_srv_client *client)
 {
-	int index = client - priv->clients;
-	int i;
+	uint8_t addr = client->addr;
 
 	if (client->sock < 0)
 		return;
 
 	close(client->sock);
 	client->sock = -1;
+	libj1939_timer_stop(&priv->cmn, &client->timeout_timer);
 
 	isobusfs_srv_remove_client_from_handles(priv, client);
 	isobusfs_srv_remove_client_from_volumes(priv, client);
+	isobusfs_srv_put_res_buf(priv, client);
 
-	/* Shift all elements after the removed client to the left by one
-	 * position
-	 */
-	for (i = index; i < priv->clients_count - 1; i++)
-		priv->clients[i] = priv->clients[i + 1];
+	while (client->deferred_count) {
+		free(client->deferred[client->deferred_head]);
+		client->deferred_head = (client->deferred_head + 1) %
+					ISOBUSFS_SRV_MAX_DEFERRED;
+		client->deferred_count--;
+	}
+
+	memset(client, 0, sizeof(*client));
+	client->sock = -1;
 
 	priv->clients_count--;
 
-	pr_debug("client 0x%02x removed", client->addr);
+	pr_debug("client 0x%02x removed", addr);
 }
 
 /**
@@ -262,6 +259,40 @@ close_socket:
 	return ret;
 }
 
+/**
+ * isobusfs_srv_client_timeout - Remove a client that has timed out
+ * @cmn: Pointer to the common J1939 data of the server
+ * @timer: The timeout timer of the client
+ *
+ * The timer is not restarted on every received message. It expires
+ * ISOBUSFS_CLIENT_TIMEOUT after the client was added and is rearmed for the
+ * rest of the time if the client was active meanwhile. A busy client is
+ * still needed by its job and is checked again later.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+static int isobusfs_srv_client_timeout(struct libj1939_cmn *cmn,
+				       struct libj1939_timer *timer)
+{
+	struct isobusfs_srv_client *client = timer->ctx;
+	struct isobusfs_srv_priv *priv = isobusfs_srv_cmn_to_priv(cmn);
+	int64_t time_diff;
+
+	time_diff = timespec_diff_ms(&cmn->last_time, &client->last_received);
+	if (time_diff < ISOBUSFS_CLIENT_TIMEOUT)
+		return libj1939_timer_start(cmn, timer,
+					    ISOBUSFS_CLIENT_TIMEOUT - time_diff,
+					    0);
+
+	if (client->busy)
+		return libj1939_timer_start(cmn, timer,
+					    ISOBUSFS_CLIENT_TIMEOUT, 0);
+
+	isobusfs_srv_remove_client(priv, client);
+
+	return 0;
+}
+
 /**
  * isobusfs_srv_add_client - Add a new client to the server's client list
  * @priv: pointer to the server's private data structure
@@ -285,12 +316,28 @@ static struct isobusfs_srv_client *isobusfs_srv_add_client(
 		return NULL;
 	}
 
-	client = &priv->clients[priv->clients_count];
+	client = &priv->clients[addr];
 	client->addr = addr;
 
 	ret = isobusfs_srv_init_client(priv, client);
-	if (ret < 0)
+	if (ret < 0) {
+		/* the entry is found by address, leave it unused */
+		if (client->sock >= 0)
+			close(client->sock);
+		client->sock = -1;
+		return NULL;
+	}
+
+	client->last_received = priv->cmn.last_time;
+	libj1939_timer_init(&client->timeout_timer, isobusfs_srv_client_timeout,
+			    client);
+	ret = libj1939_timer_start(&priv->cmn, &client->timeout_timer,
+				   ISOBUSFS_CLIENT_TIMEOUT, 0);
+	if (ret < 0) {
+		close(client->sock);
+		client->sock = -1;
 		return NULL;
+	}
 
 	priv->clients_count++;
 	pr_debug("client 0x%02x added", client->addr);
@@ -336,35 +383,6 @@ struct isobusfs_srv_client *isobusfs_srv_get_client_by_msg(
 	return client;
 }
 
-/**
- * isobusfs_srv_remove_timeouted_clients - Remove clients that have timed out
- * @priv: pointer to the server's private data structure
- *
- * This function checks each client in the server's client list to determine
- * if the client has timed out. If a client has timed out, it is removed
- * from the list.
- */
-void isobusfs_srv_remove_timeouted_clients(struct isobusfs_srv_priv *priv)
-{
-	int i;
-
-	for (i = 0; i < priv->clients_count; i++) {
-		struct isobusfs_srv_client *client = &priv->clients[i];
-		int64_t time_diff;
-
-		if (client->sock < 0)
-			continue;
-
-		time_diff = timespec_diff_ms(&priv->cmn.last_time,
-					     &client->last_received);
-
-		if (time_diff > ISOBUSFS_CLIENT_TIMEOUT) {
-			isobusfs_srv_remove_client(priv, client);
-			i--;
-		}
-	}
-}
-
 /**
  * isobusfs_srv_property_res - Send a Get File Server Properties Response
  * @priv: pointer to the server's private data structure
@@ -42,7 +42,7 @@ void isobusfs_srv_fss_init(struct isobusfs_srv_priv *priv)
  * isobusfs_srv_fss_get_rate - Get the rate of File Server Status transmission
  * @priv: Pointer to the private data structure of the ISOBUS file server
  *
- * Returns: the transmission rate of the File Server Status messages depending
+ * Return: the transmission rate of the File Server Status messages depending
  * on the current state of the file server.
  */
 static unsigned int isobusfs_srv_fss_get_rate(struct isobusfs_srv_priv *priv)
@@ -77,25 +77,24 @@ static unsigned int isobusfs_srv_fss_get_rate(struct isobusfs_srv_priv *priv)
 
 /**
  * isobusfs_srv_fss_send - Send periodic File Server Status messages
- * @priv: Pointer to the private data structure of the ISOBUS file server
+ * @cmn: Pointer to the common J1939 data of the server
+ * @timer: The File Server Status timer
+ *
+ * Timer callback, which sends the status message and schedules the next one
+ * depending on the current state of the file server.
  *
- * Returns: 0 if the message was sent successfully, a negative error code
+ * Return: 0 if the message was sent successfully, a negative error code
  * otherwise.
  */
-int isobusfs_srv_fss_send(struct isobusfs_srv_priv *priv)
+static int isobusfs_srv_fss_send(struct libj1939_cmn *cmn,
+				 struct libj1939_timer *timer)
 {
+	struct isobusfs_srv_priv *priv = timer->ctx;
 	unsigned int next_msg_rate;
 	int64_t time_diff;
 	int ret;
 
-	/* Test if it is proper time to send next status message. */
-	time_diff = timespec_diff_ms(&priv->cmn.next_send_time,
-				     &priv->cmn.last_time);
-	if (time_diff > ISOBUSFS_CM_F_FS_STATUS_RATE_JITTER) {
-		/* too early to send next message */
-		return 0;
-	}
-
+	time_diff = timespec_diff_ms(&timer->expires, &cmn->last_time);
 	if (time_diff < -ISOBUSFS_CM_F_FS_STATUS_RATE_JITTER) {
 		pr_warn("too late to send next fs status message: %ld ms",
 			time_diff);
@@ -119,8 +118,21 @@ int isobusfs_srv_fss_send(struct isobusfs_srv_priv *priv)
 
 	/* Calculate time for the next status message */
 	next_msg_rate = isobusfs_srv_fss_get_rate(priv);
-	priv->cmn.next_send_time = priv->cmn.last_time;
-	timespec_add_ms(&priv->cmn.next_send_time, next_msg_rate);
 
-	return 0;
+	return libj1939_timer_start(cmn, timer, next_msg_rate, 0);
+}
+
+/**
+ * isobusfs_srv_fss_start - Start sending File Server Status messages
+ * @priv: Pointer to the private data structure of the ISOBUS file server
+ *
+ * The first message is sent from the event loop right away.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+int isobusfs_srv_fss_start(struct isobusfs_srv_priv *priv)
+{
+	libj1939_timer_init(&priv->fss_timer, isobusfs_srv_fss_send, priv);
+
+	return libj1939_timer_start(&priv->cmn, &priv->fss_timer, 0, 0);
 }
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -13,65 +14,306 @@
 #include "isobusfs_srv.h"
 #include "isobusfs_cmn_fa.h"
 
+int isobusfs_srv_buf_pool_init(struct isobusfs_srv_priv *priv)
+{
+	struct isobusfs_srv_buf_pool *pool = &priv->res_pool;
+	int i;
+
+	for (i = 0; i < ISOBUSFS_SRV_RES_BUF_PREALLOC; i++) {
+		pool->free[i] = malloc(ISOBUSFS_SRV_RES_BUF_SIZE);
+		if (!pool->free[i]) {
+			pr_err("can't allocate response buffers");
+			return -ENOMEM;
+		}
+		pool->free_count++;
+		pool->total++;
+	}
+
+	return 0;
+}
+
+void isobusfs_srv_buf_pool_free(struct isobusfs_srv_priv *priv)
+{
+	struct isobusfs_srv_buf_pool *pool = &priv->res_pool;
+	int i;
+
+	for (i = 0; i < ISOBUSFS_SRV_CLIENT_TABLE_SIZE; i++)
+		isobusfs_srv_put_res_buf(priv, &priv->clients[i]);
+
+	for (i = 0; i < pool->free_count; i++)
+		free(pool->free[i]);
+
+	pool->free_count = 0;
+	pool->total = 0;
+}
+
+/* Get the response buffer of a client, take one from the pool if needed */
+static uint8_t *isobusfs_srv_get_res_buf(struct isobusfs_srv_priv *priv,
+					 struct isobusfs_srv_client *client)
+{
+	struct isobusfs_srv_buf_pool *pool = &priv->res_pool;
+
+	if (client->res_buf)
+		return client->res_buf;
+
+	if (pool->free_count) {
+		client->res_buf = pool->free[--pool->free_count];
+	} else {
+		/* grow the pool, it is bounded by the number of clients */
+		client->res_buf = malloc(ISOBUSFS_SRV_RES_BUF_SIZE);
+		if (!client->res_buf)
+			return NULL;
+		pool->total++;
+	}
+
+	return client->res_buf;
+}
+
+void isobusfs_srv_put_res_buf(struct isobusfs_srv_priv *priv,
+			      struct isobusfs_srv_client *client)
+{
+	struct isobusfs_srv_buf_pool *pool = &priv->res_pool;
+
+	if (!client->res_buf)
+		return;
+
+	pool->free[pool->free_count++] = client->res_buf;
+	client->res_buf = NULL;
+}
+
+/* FNV-1a */
+static uint32_t isobusfs_srv_path_hash(const char *path)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*path) {
+		hash ^= (uint8_t)*path++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+void isobusfs_srv_init_handles(struct isobusfs_srv_priv *priv)
+{
+	int i;
+
+	for (i = 0; i < ISOBUSFS_SRV_HANDLE_HASH_SIZE; i++) {
+		priv->handle_hash[i] = -1;
+		priv->dir_cache_hash[i] = -1;
+	}
+
+	/* hand out the lowest handles first */
+	for (i = 0; i < ISOBUSFS_SRV_MAX_OPENED_HANDLES; i++)
+		priv->free_handles[i] = ISOBUSFS_SRV_MAX_OPENED_HANDLES - 1 - i;
+	priv->free_handles_count = ISOBUSFS_SRV_MAX_OPENED_HANDLES;
+}
+
 static struct isobusfs_srv_handles *
 isobusfs_srv_walk_handles(struct isobusfs_srv_priv *priv, const char *path)
 {
-	unsigned int i;
+	uint32_t hash = isobusfs_srv_path_hash(path);
+	int i;
 
-	for (i = 0; i < ARRAY_SIZE(priv->handles); i++) {
-		if (priv->handles[i].path == NULL)
-			continue;
+	for (i = priv->handle_hash[hash & (ISOBUSFS_SRV_HANDLE_HASH_SIZE - 1)];
+	     i >= 0; i = priv->handles[i].hash_next) {
+		struct isobusfs_srv_handles *hdl = &priv->handles[i];
 
-		if (!strcmp(priv->handles[i].path, path))
-			return &priv->handles[i];
+		if (hdl->hash == hash && !strcmp(hdl->path, path))
+			return hdl;
 	}
 
 	return NULL;
 }
 
+/* Drop the listing, the watch only if no other listing refers to it */
+static void isobusfs_srv_dir_cache_evict(struct isobusfs_srv_priv *priv,
+					 struct isobusfs_srv_dir_cache *cache)
+{
+	int idx = cache - priv->dir_caches;
+	unsigned int i;
+	int *pos;
+
+	pos = &priv->dir_cache_hash[cache->hash & (ISOBUSFS_SRV_HANDLE_HASH_SIZE - 1)];
+	while (*pos != idx)
+		pos = &priv->dir_caches[*pos].hash_next;
+	*pos = cache->hash_next;
+
+	if (cache->wd > 0) {
+		for (i = 0; i < ARRAY_SIZE(priv->dir_caches); i++) {
+			if (&priv->dir_caches[i] != cache &&
+			    priv->dir_caches[i].path &&
+			    priv->dir_caches[i].wd == cache->wd)
+				break;
+		}
+		if (i == ARRAY_SIZE(priv->dir_caches))
+			inotify_rm_watch(priv->inotify_fd, cache->wd);
+	}
+
+	if (!cache->refcount)
+		priv->dir_caches_unused--;
+
+	free(cache->path);
+	free(cache->buf);
+	free(cache->entries);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/* Take the listing of the path, an unused one is reused as it is */
+static struct isobusfs_srv_dir_cache *
+isobusfs_srv_dir_cache_get(struct isobusfs_srv_priv *priv, const char *path)
+{
+	uint32_t hash = isobusfs_srv_path_hash(path);
+	struct isobusfs_srv_dir_cache *cache;
+	int *bucket;
+	int i;
+
+	bucket = &priv->dir_cache_hash[hash & (ISOBUSFS_SRV_HANDLE_HASH_SIZE - 1)];
+	for (i = *bucket; i >= 0; i = priv->dir_caches[i].hash_next) {
+		cache = &priv->dir_caches[i];
+		if (cache->hash == hash && !strcmp(cache->path, path)) {
+			if (!cache->refcount++)
+				priv->dir_caches_unused--;
+			cache->last_used = ++priv->dir_cache_clock;
+			return cache;
+		}
+	}
+
+	/* each handle has one listing, so there is always a free slot */
+	for (i = 0; i < (int)ARRAY_SIZE(priv->dir_caches); i++) {
+		if (!priv->dir_caches[i].path)
+			break;
+	}
+	if (i == (int)ARRAY_SIZE(priv->dir_caches))
+		return NULL;
+
+	cache = &priv->dir_caches[i];
+	cache->path = strdup(path);
+	if (!cache->path)
+		return NULL;
+
+	cache->hash = hash;
+	cache->hash_next = *bucket;
+	*bucket = i;
+	cache->refcount = 1;
+	cache->last_used = ++priv->dir_cache_clock;
+
+	return cache;
+}
+
+/*
+ * Keep the listing after the last handle of the path is closed, as long as
+ * it is valid. Beyond ISOBUSFS_SRV_DIR_CACHE_KEEP unused listings, the
+ * least recently used one is dropped.
+ */
+static void isobusfs_srv_dir_cache_put(struct isobusfs_srv_priv *priv,
+				       struct isobusfs_srv_dir_cache *cache)
+{
+	struct isobusfs_srv_dir_cache *lru = NULL;
+	unsigned int i;
+
+	cache->last_used = ++priv->dir_cache_clock;
+	if (--cache->refcount)
+		return;
+
+	priv->dir_caches_unused++;
+	if (!cache->valid) {
+		isobusfs_srv_dir_cache_evict(priv, cache);
+		return;
+	}
+
+	if (priv->dir_caches_unused <= ISOBUSFS_SRV_DIR_CACHE_KEEP)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(priv->dir_caches); i++) {
+		cache = &priv->dir_caches[i];
+		if (cache->path && !cache->refcount &&
+		    (!lru || cache->last_used < lru->last_used))
+			lru = cache;
+	}
+	isobusfs_srv_dir_cache_evict(priv, lru);
+}
+
 static int isobusfs_srv_add_file(struct isobusfs_srv_priv *priv,
 				 const char *path, int fd, DIR *dir)
 {
-	unsigned int j;
+	struct isobusfs_srv_dir_cache *cache = NULL;
+	struct isobusfs_srv_handles *hdl;
+	int *bucket;
+	char *dup;
+	int j;
 
-	if (priv->handles_count >= (int)ARRAY_SIZE(priv->handles)) {
+	if (!priv->free_handles_count) {
 		pr_err("too many handles");
 		return -ENOSPC;
 	}
 
-	for (j = 0; j < ARRAY_SIZE(priv->handles); j++) {
-		if (priv->handles[j].path == NULL)
-			break;
+	dup = strdup(path);
+	if (!dup)
+		return -ENOMEM;
+
+	if (dir) {
+		cache = isobusfs_srv_dir_cache_get(priv, path);
+		if (!cache) {
+			free(dup);
+			return -ENOMEM;
+		}
 	}
 
-	priv->handles[j].path = strdup(path);
-	priv->handles[j].fd = fd;
-	priv->handles[j].dir = dir;
+	j = priv->free_handles[--priv->free_handles_count];
+	hdl = &priv->handles[j];
+	hdl->path = dup;
+	hdl->fd = fd;
+	hdl->dir = dir;
+	hdl->dir_cache = cache;
+
+	hdl->hash = isobusfs_srv_path_hash(path);
+	bucket = &priv->handle_hash[hdl->hash & (ISOBUSFS_SRV_HANDLE_HASH_SIZE - 1)];
+	hdl->hash_next = *bucket;
+	*bucket = j;
 
 	priv->handles_count++;
 	return j;
 }
 
+/* Close the handle after the last client is gone */
+static void isobusfs_srv_free_handle(struct isobusfs_srv_priv *priv,
+				     struct isobusfs_srv_handles *hdl)
+{
+	int handle = hdl - priv->handles;
+	int *pos;
+
+	pos = &priv->handle_hash[hdl->hash & (ISOBUSFS_SRV_HANDLE_HASH_SIZE - 1)];
+	while (*pos != handle)
+		pos = &priv->handles[*pos].hash_next;
+	*pos = hdl->hash_next;
+
+	if (hdl->dir_cache)
+		isobusfs_srv_dir_cache_put(priv, hdl->dir_cache);
+
+	/* fd will be automatically closed when closedir(3) is called. */
+	if (hdl->dir)
+		closedir(hdl->dir);
+	else
+		close(hdl->fd);
+	free(hdl->path);
+	memset(hdl, 0, sizeof(*hdl));
+
+	priv->free_handles[priv->free_handles_count++] = handle;
+	priv->handles_count--;
+}
+
 static int isobusfs_srv_add_client_to_file(struct isobusfs_srv_handles *file,
 					   struct isobusfs_srv_client *client)
 {
-	unsigned int j;
+	if (file->clients[client->addr] == client)
+		return 0;
 
-	for (j = 0; j < ARRAY_SIZE(file->clients); j++) {
-		if (file->clients[j] == client)
-			return 0;
-	}
+	file->clients[client->addr] = client;
+	file->offsets[client->addr] = 0;
+	file->refcount++;
 
-	for (j = 0; j < ARRAY_SIZE(file->clients); j++) {
-		if (file->clients[j] == NULL) {
-			file->clients[j] = client;
-			file->refcount++;
-			return 0;
-		}
-	}
-
-	pr_err("%s: can't add client to file", __func__);
-	return -ENOENT;
+	return 0;
 }
 
 static int isobusfs_srv_request_file(struct isobusfs_srv_priv *priv,
@@ -105,163 +347,258 @@ isobusfs_srv_get_handle(struct isobusfs_srv_priv *priv, int handle)
 	if (handle < 0 || handle >= (int)ARRAY_SIZE(priv->handles))
 		return NULL;
 
+	if (!priv->handles[handle].path)
+		return NULL;
+
 	return &priv->handles[handle];
 }
 
+/* Index of the client in the client list of the handle, or -1 */
+static int isobusfs_srv_handle_client_idx(struct isobusfs_srv_handles *hdl,
+					  struct isobusfs_srv_client *client)
+{
+	if (hdl->clients[client->addr] != client)
+		return -1;
+
+	return client->addr;
+}
+
 static int isobusfs_srv_release_handle(struct isobusfs_srv_priv *priv,
 				       struct isobusfs_srv_client *client,
 				       int handle)
 {
 	struct isobusfs_srv_handles *hdl = isobusfs_srv_get_handle(priv, handle);
-	unsigned int client_index;
 
 	if (!hdl) {
 		pr_warn("%s: invalid handle %d", __func__, handle);
 		return -ENOENT;
 	}
 
-	/* Find the client in the hdl's client list and remove it */
-	for (client_index = 0; client_index < ARRAY_SIZE(hdl->clients); client_index++) {
-		if (hdl->clients[client_index] == client) {
-			hdl->clients[client_index] = NULL;
-			hdl->refcount--;
-
-			pr_debug("%s: client %p removed from handle %d", __func__, client, handle);
-			/* If refcount is 0, close the hdl and remove it from the list */
-			if (hdl->refcount == 0) {
-				pr_debug("%s: closing handle %d", __func__, handle);
-				/* fd will be automatically closed when
-				 * closedir(3) is called.
-				 */
-				if (hdl->dir)
-					closedir(hdl->dir);
-				else
-					close(hdl->fd);
-				memset(hdl, 0, sizeof(*hdl));
-				priv->handles_count--;
-			}
+	if (hdl->clients[client->addr] != client) {
+		pr_err("%s: client %p not found in handle %d", __func__, client, handle);
+		return -ENOENT;
+	}
 
-			return 0;
-		}
+	hdl->clients[client->addr] = NULL;
+	hdl->refcount--;
+
+	pr_debug("%s: client %p removed from handle %d", __func__, client, handle);
+	/* If refcount is 0, close the hdl and remove it from the list */
+	if (hdl->refcount == 0) {
+		pr_debug("%s: closing handle %d", __func__, handle);
+		isobusfs_srv_free_handle(priv, hdl);
 	}
 
-	pr_err("%s: client %p not found in handle %d", __func__, client, handle);
-	return -ENOENT;
+	return 0;
 }
 
 void isobusfs_srv_remove_client_from_handles(struct isobusfs_srv_priv *priv,
 					   struct isobusfs_srv_client *client)
 {
 	unsigned int handle;
-	unsigned int client_index;
 
-	for (handle = 0; handle < ARRAY_SIZE(priv->handles); handle++) {
+	for (handle = 0; handle < ARRAY_SIZE(priv->handles) &&
+	     priv->handles_count; handle++) {
 		struct isobusfs_srv_handles *hdl = &priv->handles[handle];
 
-		if (hdl->path == NULL)
+		if (hdl->path == NULL || hdl->clients[client->addr] != client)
 			continue;
 
-		for (client_index = 0; client_index < ARRAY_SIZE(hdl->clients); client_index++) {
-			if (hdl->clients[client_index] == client) {
-				hdl->clients[client_index] = NULL;
-				hdl->refcount--;
+		hdl->clients[client->addr] = NULL;
+		hdl->refcount--;
 
-				if (hdl->refcount == 0) {
-					close(hdl->fd);
-					memset(hdl, 0, sizeof(*hdl));
-					priv->handles_count--;
-				}
-
-				break;
-			}
-		}
+		if (hdl->refcount == 0)
+			isobusfs_srv_free_handle(priv, hdl);
 	}
 }
 
-static int isobusfs_srv_fa_open_directory(struct isobusfs_srv_priv *priv,
-					  struct isobusfs_srv_client *client,
-					  const char *path, size_t path_len,
-					  uint8_t *handle)
+static void isobusfs_srv_fa_open_work(struct isobusfs_srv_job *job)
 {
-	char linux_path[ISOBUSFS_SRV_MAX_PATH_LEN];
-	struct isobusfs_srv_handles *hdl;
 	struct stat file_stat;
-	int file_index, fd;
-	DIR *dir;
-	int ret;
 
-	ret = isobusfs_path_to_linux_path(priv, path, path_len, linux_path, sizeof(linux_path));
-	if (ret < 0)
-		return ret;
+	if (job->is_dir) {
+		job->dir = opendir(job->path);
+		if (!job->dir) {
+			pr_err("%s: Error opening directory %s. Error %d (%s)\n",
+			       __func__, job->path, errno, strerror(errno));
+			switch (errno) {
+			case EACCES:
+				job->error_code = ISOBUSFS_ERR_ACCESS_DENIED;
+				break;
+			case ENOENT:
+				job->error_code = ISOBUSFS_ERR_FILE_ORPATH_NOT_FOUND;
+				break;
+			case ENOMEM:
+				job->error_code = ISOBUSFS_ERR_OUT_OF_MEM;
+				break;
+			default:
+				job->error_code = ISOBUSFS_ERR_OTHER;
+			}
+			return;
+		}
 
-	hdl = isobusfs_srv_walk_handles(priv, linux_path);
-	if (hdl) {
-		pr_err("%s: Path %s is already opened\n", __func__, linux_path);
-		return ISOBUSFS_ERR_OTHER;
+		job->fd = dirfd(job->dir);
+		if (job->fd < 0) {
+			pr_err("%s: Error getting file descriptor for directory %s. Error %d (%s)\n",
+			       __func__, job->path, errno, strerror(errno));
+			closedir(job->dir);
+			job->dir = NULL;
+			job->error_code = ISOBUSFS_ERR_OTHER;
+			return;
+		}
+
+		if (fstat(job->fd, &file_stat) < 0 || !S_ISDIR(file_stat.st_mode)) {
+			pr_err("%s: Path %s is not a directory\n", __func__,
+			       job->path);
+			closedir(job->dir);
+			job->dir = NULL;
+			job->fd = -1;
+			job->error_code = ISOBUSFS_ERR_INVALID_ACCESS;
+		}
+
+		return;
 	}
 
-	dir = opendir(linux_path);
-	if (!dir) {
-		pr_err("%s: Error opening directory %s. Error %d (%s)\n",
-		       __func__, linux_path, errno, strerror(errno));
+	job->fd = open(job->path, job->flags);
+	if (job->fd < 0) {
 		switch (errno) {
 		case EACCES:
-			return ISOBUSFS_ERR_ACCESS_DENIED;
+			job->error_code = ISOBUSFS_ERR_ACCESS_DENIED;
+			break;
+		case EINVAL:
+			job->error_code = ISOBUSFS_ERR_INVALID_ACCESS;
+			break;
+		case EMFILE:
+		case ENFILE:
+			job->error_code = ISOBUSFS_ERR_TOO_MANY_FILES_OPEN;
+			break;
 		case ENOENT:
-			return ISOBUSFS_ERR_FILE_ORPATH_NOT_FOUND;
+			job->error_code = ISOBUSFS_ERR_FILE_ORPATH_NOT_FOUND;
+			break;
 		case ENOMEM:
-			return ISOBUSFS_ERR_OUT_OF_MEM;
+			job->error_code = ISOBUSFS_ERR_OUT_OF_MEM;
+			break;
 		default:
-			return ISOBUSFS_ERR_OTHER;
+			job->error_code = ISOBUSFS_ERR_OTHER;
 		}
+		return;
 	}
 
-	fd = dirfd(dir);
-	if (fd < 0) {
-		pr_err("%s: Error getting file descriptor for directory %s. Error %d (%s)\n",
-		       __func__, linux_path, errno, strerror(errno));
-		closedir(dir);
-		return ISOBUSFS_ERR_OTHER;
+	/* Check if the opened path is a regular file */
+	if (fstat(job->fd, &file_stat) < 0) {
+		job->error_code = ISOBUSFS_ERR_OTHER;
+	} else if (!S_ISREG(file_stat.st_mode)) {
+		/* Invalid access (not a regular file) */
+		job->error_code = ISOBUSFS_ERR_INVALID_ACCESS;
+	} else {
+		/* files are usually read in chunks from start to end */
+		posix_fadvise(job->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		return;
 	}
 
-	if (fstat(fd, &file_stat) < 0 || !S_ISDIR(file_stat.st_mode)) {
-		pr_err("%s: Path %s is not a directory\n", __func__,
-		       linux_path);
-		closedir(dir);
-		return ISOBUSFS_ERR_INVALID_ACCESS;
+	close(job->fd);
+	job->fd = -1;
+}
+
+/*
+ * Register the handle for the client. A file opened by another client is
+ * shared, the own fd is not needed then. A directory can be opened once.
+ */
+static uint8_t isobusfs_srv_fa_open_register(struct isobusfs_srv_priv *priv,
+					     struct isobusfs_srv_client *client,
+					     const char *linux_path, bool is_dir,
+					     int fd, DIR *dir, uint8_t *handle)
+{
+	struct isobusfs_srv_handles *hdl;
+	int file_index;
+
+	hdl = isobusfs_srv_walk_handles(priv, linux_path);
+	if (hdl && (is_dir || hdl->dir)) {
+		pr_err("%s: Path %s is already opened\n", __func__, linux_path);
+		goto close_fd;
+	}
+
+	if (hdl) {
+		pr_warn("Handle: %s is already opened by client: %x\n",
+			linux_path, client->addr);
+		if (fd >= 0)
+			close(fd);
+		fd = hdl->fd;
 	}
 
+	/* Request the file, which also handles refcount and client list
+	 * updates
+	 */
 	file_index = isobusfs_srv_request_file(priv, client, linux_path, fd,
 					       dir);
 	if (file_index < 0) {
-		closedir(dir);
-		return file_index;
+		if (hdl)
+			return ISOBUSFS_ERR_OTHER;
+		goto close_fd;
 	}
 
 	*handle = (uint8_t)file_index;
 
 	return 0;
+
+close_fd:
+	if (dir)
+		closedir(dir);
+	else if (fd >= 0)
+		close(fd);
+
+	return hdl ? ISOBUSFS_ERR_OTHER : ISOBUSFS_ERR_TOO_MANY_FILES_OPEN;
 }
 
-static int isobusfs_srv_fa_open_file(struct isobusfs_srv_priv *priv,
-				     struct isobusfs_srv_client *client,
-				     const char *path, size_t path_len,
-				     uint8_t flags, uint8_t *handle)
+static int isobusfs_srv_fa_openf_send(struct isobusfs_srv_priv *priv,
+				      struct isobusfs_msg *msg,
+				      uint8_t error_code, uint8_t handle)
 {
-	char linux_path[ISOBUSFS_SRV_MAX_PATH_LEN];
-	struct isobusfs_srv_handles *hdl;
-	struct stat file_stat;
-	int open_flags = 0;
-	int file_index;
-	int ret, fd;
+	struct isobusfs_fa_openf_req *req =
+		(struct isobusfs_fa_openf_req *)msg->buf;
+	struct isobusfs_fa_openf_res res;
+	int ret;
 
-	ret = isobusfs_path_to_linux_path(priv, path, path_len,
-					  linux_path, sizeof(linux_path));
-	if (ret < 0)
+	res.fs_function =
+		isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
+					    ISOBUSFS_FA_F_OPEN_FILE_RES);
+	res.tan = req->tan;
+	res.error_code = error_code;
+	res.handle = handle;
+	memset(&res.reserved[0], 0xff, sizeof(res.reserved));
+
+	/* send to socket */
+	ret = isobusfs_srv_sendto(priv, msg, &res, sizeof(res));
+	if (ret < 0) {
+		pr_warn("can't send current directory response");
 		return ret;
+	}
 
-	pr_debug("convert ISOBUS FS path to linux path: %.*s -> %s",
-		 path_len, path, linux_path);
+	pr_debug("> tx: Open File Response. Error code: %d (%s).", error_code,
+		 isobusfs_error_to_str(error_code));
+
+	return ret;
+}
+
+static void isobusfs_srv_fa_open_done(struct isobusfs_srv_priv *priv,
+				      struct isobusfs_srv_job *job)
+{
+	uint8_t error_code = job->error_code;
+	uint8_t handle = 0;
+
+	if (!error_code)
+		error_code = isobusfs_srv_fa_open_register(priv, job->client,
+							   job->path,
+							   job->is_dir,
+							   job->fd, job->dir,
+							   &handle);
+
+	isobusfs_srv_fa_openf_send(priv, job->msg, error_code, handle);
+}
+
+static int isobusfs_srv_fa_open_flags(uint8_t flags)
+{
+	int open_flags = 0;
 
 	/* Determine open flags based on the requested access type */
 	switch (flags & ISOBUSFS_FA_OPEN_MASK) {
@@ -277,64 +614,13 @@ static int isobusfs_srv_fa_open_file(struct isobusfs_srv_priv *priv,
 			open_flags |= O_TRUNC;
 		break;
 	default:
-		return ISOBUSFS_ERR_INVALID_ACCESS;
+		return -EINVAL;
 	}
 
 	if (flags & ISOBUSFS_FA_OPEN_APPEND)
 		open_flags |= O_APPEND;
 
-	/* Check if the file is already opened */
-	hdl = isobusfs_srv_walk_handles(priv, linux_path);
-	if (hdl) {
-		pr_warn("Handle: %s is already opened by client: %x\n",
-			linux_path, client->addr);
-		fd = hdl->fd;
-	} else {
-		/* Open the file if not already opened */
-		fd = open(linux_path, open_flags);
-		if (fd < 0) {
-			switch (errno) {
-			case EACCES:
-				return ISOBUSFS_ERR_ACCESS_DENIED;
-			case EINVAL:
-				return ISOBUSFS_ERR_INVALID_ACCESS;
-			case EMFILE:
-			case ENFILE:
-				return ISOBUSFS_ERR_TOO_MANY_FILES_OPEN;
-			case ENOENT:
-				return ISOBUSFS_ERR_FILE_ORPATH_NOT_FOUND;
-			case ENOMEM:
-				return ISOBUSFS_ERR_OUT_OF_MEM;
-			default:
-				return ISOBUSFS_ERR_OTHER;
-			}
-		}
-		/* Check if the opened path is a regular file */
-		if (fstat(fd, &file_stat) < 0) {
-			close(fd);
-			return ISOBUSFS_ERR_OTHER;
-		}
-
-		if (!S_ISREG(file_stat.st_mode)) {
-			close(fd);
-			/* Invalid access (not a regular file) */
-			return ISOBUSFS_ERR_INVALID_ACCESS;
-		}
-	}
-
-	/* Request the file, which also handles refcount and client list 
-	 * updates
-	 */
-	file_index = isobusfs_srv_request_file(priv, client, linux_path, fd,
-					       NULL);
-	if (file_index < 0) {
-		close(fd);
-		return file_index;
-	}
-
-	*handle = (uint8_t)file_index;
-
-	return 0;
+	return open_flags;
 }
 
 static int isobusfs_srv_fa_open_file_req(struct isobusfs_srv_priv *priv,
@@ -344,12 +630,13 @@ static int isobusfs_srv_fa_open_file_req(struct isobusfs_srv_priv *priv,
 		(struct isobusfs_fa_openf_req *)msg->buf;
 	uint16_t name_len = le16toh(req->name_len);
 	struct isobusfs_srv_client *client;
-	struct isobusfs_fa_openf_res res;
+	struct isobusfs_srv_handles *hdl;
+	struct isobusfs_srv_job *job;
 	uint8_t error_code = 0;
 	uint8_t access_type;
 	size_t abs_path_len;
 	uint8_t handle = 0;
-	char *abs_path;
+	char *abs_path = NULL;
 	int ret = 0;
 
 	client = isobusfs_srv_get_client_by_msg(priv, msg);
@@ -372,8 +659,11 @@ static int isobusfs_srv_fa_open_file_req(struct isobusfs_srv_priv *priv,
 
 	abs_path_len = ISOBUSFS_SRV_MAX_PATH_LEN;
 	abs_path = malloc(abs_path_len);
-	if (!abs_path) {
+	job = isobusfs_srv_job_alloc(client, msg);
+	if (!abs_path || !job) {
 		pr_warn("failed to allocate memory");
+		free(abs_path);
+		free(job);
 		return -ENOMEM;
 	}
 
@@ -386,69 +676,91 @@ static int isobusfs_srv_fa_open_file_req(struct isobusfs_srv_priv *priv,
 						    abs_path, abs_path_len);
 	if (ret < 0) {
 		error_code = ISOBUSFS_ERR_FILE_ORPATH_NOT_FOUND;
-		goto send_response;
+		goto free_job;
 	}
 
 	pr_debug("< rx: Open File Request. from client 0x%2x: %.*s. Current directory: %s",
 		 client->addr, req->name_len, req->name, client->current_dir);
 
-	access_type = FIELD_GET(ISOBUSFS_FA_OPEN_MASK, req->flags);
-	if (access_type == ISOBUSFS_FA_OPEN_DIR) {
-		error_code = isobusfs_srv_fa_open_directory(priv, client, abs_path,
-							    abs_path_len, &handle);
-	} else {
-		error_code = isobusfs_srv_fa_open_file(priv, client, abs_path,
-						       abs_path_len, req->flags,
-						       &handle);
+	ret = isobusfs_path_to_linux_path(priv, abs_path, abs_path_len,
+					  job->path, sizeof(job->path));
+	if (ret < 0) {
+		error_code = ISOBUSFS_ERR_FILE_ORPATH_NOT_FOUND;
+		goto free_job;
 	}
 
-send_response:
-	res.fs_function =
-		isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
-					    ISOBUSFS_FA_F_OPEN_FILE_RES);
-	res.tan = req->tan;
-	res.error_code = error_code;
-	res.handle = handle;
-	memset(&res.reserved[0], 0xff, sizeof(res.reserved));
+	pr_debug("convert ISOBUS FS path to linux path: %s -> %s",
+		 abs_path, job->path);
 
-	/* send to socket */
-	ret = isobusfs_srv_sendto(priv, msg, &res, sizeof(res));
-	if (ret < 0) {
-		pr_warn("can't send current directory response");
-		goto err;
+	access_type = FIELD_GET(ISOBUSFS_FA_OPEN_MASK, req->flags);
+	job->is_dir = access_type == ISOBUSFS_FA_OPEN_DIR;
+	if (!job->is_dir) {
+		job->flags = isobusfs_srv_fa_open_flags(req->flags);
+		if (job->flags < 0) {
+			error_code = ISOBUSFS_ERR_INVALID_ACCESS;
+			goto free_job;
+		}
 	}
 
-	pr_debug("> tx: Open File Response. Error code: %d (%s).", error_code,
-		 isobusfs_error_to_str(error_code));
-err:
+	/* nothing to open for a handle which is there already */
+	hdl = isobusfs_srv_walk_handles(priv, job->path);
+	if (hdl) {
+		error_code = isobusfs_srv_fa_open_register(priv, client,
+							   job->path,
+							   job->is_dir, -1,
+							   NULL, &handle);
+		goto free_job;
+	}
+
+	free(abs_path);
+
+	job->work = isobusfs_srv_fa_open_work;
+	job->done = isobusfs_srv_fa_open_done;
+	isobusfs_srv_job_submit(priv, job);
+
+	return ISOBUSFS_SRV_MSG_QUEUED;
+
+free_job:
+	free(job);
+send_response:
+	free(abs_path);
+
+	ret = isobusfs_srv_fa_openf_send(priv, msg, error_code, handle);
 
 	return ret;
 }
 
-static int isobusfs_srv_read_file(struct isobusfs_srv_handles *handle,
-				  uint8_t *buffer, size_t count,
-				  ssize_t *readed_size)
+static int isobusfs_srv_read_errno_to_err(int err)
 {
-	*readed_size = read(handle->fd, buffer, count);
-	if (*readed_size < 0) {
-		switch (errno) {
-		case EBADF:
-			return ISOBUSFS_ERR_INVALID_HANDLE;
-		case EFAULT:
-			return ISOBUSFS_ERR_OUT_OF_MEM;
-		case EIO:
-			return ISOBUSFS_ERR_ON_READ;
-		default:
-			return ISOBUSFS_ERR_OTHER;
-		}
+	switch (err) {
+	case EBADF:
+		return ISOBUSFS_ERR_INVALID_HANDLE;
+	case EFAULT:
+		return ISOBUSFS_ERR_OUT_OF_MEM;
+	case EIO:
+		return ISOBUSFS_ERR_ON_READ;
+	default:
+		return ISOBUSFS_ERR_OTHER;
 	}
+}
 
-	return 0;
+/*
+ * Read from the position of the client. pread() leaves the file offset of
+ * the shared fd alone, so clients reading the same file do not disturb
+ * each other.
+ */
+static void isobusfs_srv_read_file_work(struct isobusfs_srv_job *job)
+{
+	job->result = pread(job->fd, job->buf, job->count, job->offset);
+	if (job->result < 0) {
+		job->error_code = isobusfs_srv_read_errno_to_err(errno);
+		job->result = 0;
+	}
 }
 
 static uint16_t convert_to_file_date(time_t time_val)
 {
-	struct tm *timeinfo = localtime(&time_val);
+	struct tm tm, *timeinfo = localtime_r(&time_val, &tm);
 	int year, month, day;
 
 	if (!timeinfo)
@@ -466,7 +778,7 @@ static uint16_t convert_to_file_date(time_t time_val)
 
 static uint16_t convert_to_file_time(time_t time_val)
 {
-	struct tm *timeinfo = localtime(&time_val);
+	struct tm tm, *timeinfo = localtime_r(&time_val, &tm);
 	int hours, minutes, seconds;
 	uint16_t time;
 
@@ -495,61 +807,82 @@ static int check_access_with_base(const char *base_dir,
 	return access(full_path, mode);
 }
 
-static int isobusfs_srv_read_directory(struct isobusfs_srv_handles *handle,
-				       uint8_t *buffer, size_t count,
-				       ssize_t *readed_size)
+static int isobusfs_srv_dir_cache_grow(struct isobusfs_srv_dir_cache *cache,
+				       size_t entry_len)
 {
-	DIR *dir = handle->dir;
-	struct dirent *entry;
-	size_t pos = 0;
+	if (cache->len + entry_len > cache->size) {
+		size_t size = cache->size ? cache->size * 2 : 4096;
+		uint8_t *buf;
+
+		while (size < cache->len + entry_len)
+			size *= 2;
+		buf = realloc(cache->buf, size);
+		if (!buf)
+			return -ENOMEM;
+		cache->buf = buf;
+		cache->size = size;
+	}
 
-	/*
-	 * Position the directory stream to the previously stored offset (handle->dir_pos).
-	 *
-	 * Handling Changes in Directory Contents:
-	 * - If the directory contents change between reads (e.g., files/directories added or deleted),
-	 *   handle->dir_pos may not point to the expected entry.
-	 * - To ensure consistency, implement checks (e.g., compare inode numbers) to verify the correct
-	 *   entry position.
-	 *
-	 * Detecting End of Directory:
-	 * - If readdir() returns NULL before reaching handle->dir_pos, it indicates the end of the
-	 *   directory with no more entries to read.
-	 * - This situation should be handled appropriately, such as by resetting handle->dir_pos and
-	 *   either returning an error or restarting from the beginning of the directory, depending
-	 *   on the application's requirements.
-	 */
-	for (int i = 0; i < handle->dir_pos &&
-	     (entry = readdir(dir)) != NULL; i++) {
-		/* Iterating to the desired position */
+	/* one more for the end marker */
+	if (cache->count + 2 > cache->entries_size) {
+		unsigned int entries_size = cache->entries_size ?
+			cache->entries_size * 2 : 64;
+		uint32_t *entries;
+
+		entries = realloc(cache->entries,
+				  entries_size * sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+		cache->entries = entries;
+		cache->entries_size = entries_size;
 	}
 
-	/*
-	 * Directory Entry Layout:
-	 * This loop reads directory entries and encodes them into a buffer.
-	 * Each entry in the buffer follows the format specified in ISO 11783-13:2021.
-	 *
-	 * The layout of each directory entry in the buffer is as follows:
-	 * - Byte 1: Filename Length (as per ISO 11783-13:2021 B.22).
-	 *   Represents the length of the filename that follows.
-	 *
-	 * - Byte 2–n: Filename (as per ISO 11783-13:2021 B.23).
-	 *   The actual name of the file or directory.
-	 *
-	 * - Byte n + 1: Attributes (as per ISO 11783-13:2021 B.15).
-	 *
-	 * - Bytes n + 2, n + 3: File Date (as per ISO 11783-13:2021 B.24).
-	 *   Encoded file date, using a 16-bit format derived from file_stat.st_mtime.
-	 *
-	 * - Bytes n + 4, n + 5: File Time (as per ISO 11783-13:2021 B.25).
-	 *   Encoded file time, using a 16-bit format derived from file_stat.st_mtime.
-	 *
-	 * - Bytes n + 6 … n + 9: Size (as per ISO 11783-13:2021 B.26).
-	 *   The size of the file in bytes, encoded in a 32-bit little-endian format.
-	 *
-	 * The handle->dir_pos is incremented after processing each entry, marking
-	 * the current position in the directory stream for subsequent reads.
-	 */
+	return 0;
+}
+
+/*
+ * Directory Entry Layout:
+ * The directory is read once and each entry is encoded into the cache.
+ * Each entry in the buffer follows the format specified in ISO 11783-13:2021.
+ *
+ * The layout of each directory entry in the buffer is as follows:
+ * - Byte 1: Filename Length (as per ISO 11783-13:2021 B.22).
+ *   Represents the length of the filename that follows.
+ *
+ * - Byte 2–n: Filename (as per ISO 11783-13:2021 B.23).
+ *   The actual name of the file or directory.
+ *
+ * - Byte n + 1: Attributes (as per ISO 11783-13:2021 B.15).
+ *
+ * - Bytes n + 2, n + 3: File Date (as per ISO 11783-13:2021 B.24).
+ *   Encoded file date, using a 16-bit format derived from file_stat.st_mtime.
+ *
+ * - Bytes n + 4, n + 5: File Time (as per ISO 11783-13:2021 B.25).
+ *   Encoded file time, using a 16-bit format derived from file_stat.st_mtime.
+ *
+ * - Bytes n + 6 … n + 9: Size (as per ISO 11783-13:2021 B.26).
+ *   The size of the file in bytes, encoded in a 32-bit little-endian format.
+ *
+ * Runs in a worker thread, so the directory is opened again instead of
+ * sharing the DIR stream of the handle.
+ */
+static int isobusfs_srv_dir_list(const char *path,
+				 struct isobusfs_srv_dir_cache *cache)
+{
+	struct dirent *entry;
+	uint8_t *buffer;
+	int ret = 0;
+	DIR *dir;
+	int fd;
+
+	dir = opendir(path);
+	if (!dir)
+		return ISOBUSFS_ERR_ON_READ;
+	fd = dirfd(dir);
+
+	cache->len = 0;
+	cache->count = 0;
+
 	while ((entry = readdir(dir)) != NULL) {
 		size_t entry_name_len, entry_total_len;
 		__le16 file_date, file_time;
@@ -557,10 +890,10 @@ static int isobusfs_srv_read_directory(struct isobusfs_srv_handles *handle,
 		struct stat file_stat;
 		__le32 size;
 
-		if (check_access_with_base(handle->path, entry->d_name, R_OK) != 0)
+		if (check_access_with_base(path, entry->d_name, R_OK) != 0)
 			continue; /* Skip this entry if it's not readable */
 
-		if (fstatat(handle->fd, entry->d_name, &file_stat, 0) < 0)
+		if (fstatat(fd, entry->d_name, &file_stat, 0) < 0)
 			continue; /* Skip this entry on error */
 
 		entry_name_len = strlen(entry->d_name);
@@ -568,36 +901,284 @@ static int isobusfs_srv_read_directory(struct isobusfs_srv_handles *handle,
 			continue;
 
 		entry_total_len = 1 + entry_name_len + 1 + 2 + 2 + 4;
+		if (isobusfs_srv_dir_cache_grow(cache, entry_total_len)) {
+			ret = ISOBUSFS_ERR_OUT_OF_MEM;
+			goto out;
+		}
 
-		if (pos + entry_total_len > count)
-			break;
+		cache->entries[cache->count++] = cache->len;
+		buffer = cache->buf + cache->len;
 
-		buffer[pos++] = (uint8_t)entry_name_len;
+		*buffer++ = (uint8_t)entry_name_len;
 
-		memcpy(buffer + pos, entry->d_name, entry_name_len);
-		pos += entry_name_len;
+		memcpy(buffer, entry->d_name, entry_name_len);
+		buffer += entry_name_len;
 
 		if (S_ISDIR(file_stat.st_mode))
 			attributes |= ISOBUSFS_ATTR_DIRECTORY;
-		if (check_access_with_base(handle->path, entry->d_name, W_OK) != 0)
+		if (check_access_with_base(path, entry->d_name, W_OK) != 0)
 			attributes |= ISOBUSFS_ATTR_READ_ONLY;
-		buffer[pos++] = attributes;
+		*buffer++ = attributes;
 
 		file_date = htole16(convert_to_file_date(file_stat.st_mtime));
-		memcpy(buffer + pos, &file_date, sizeof(file_date));
-		pos += sizeof(file_date);
+		memcpy(buffer, &file_date, sizeof(file_date));
+		buffer += sizeof(file_date);
 
 		file_time = htole16(convert_to_file_time(file_stat.st_mtime));
-		memcpy(buffer + pos, &file_time, sizeof(file_time));
-		pos += sizeof(file_time);
+		memcpy(buffer, &file_time, sizeof(file_time));
+		buffer += sizeof(file_time);
 
 		size = htole32(file_stat.st_size);
-		memcpy(buffer + pos, &size, sizeof(size));
-		pos += sizeof(size);
+		memcpy(buffer, &size, sizeof(size));
+
+		cache->len += entry_total_len;
 	}
 
-	*readed_size = pos;
-	return 0;
+	if (isobusfs_srv_dir_cache_grow(cache, 0)) {
+		ret = ISOBUSFS_ERR_OUT_OF_MEM;
+		goto out;
+	}
+	cache->entries[cache->count] = cache->len;
+
+out:
+	closedir(dir);
+
+	return ret;
+}
+
+/* watch before listing, a change while reading invalidates the listing */
+static void isobusfs_srv_dir_cache_watch(struct isobusfs_srv_priv *priv,
+					 struct isobusfs_srv_dir_cache *cache)
+{
+	int ret;
+
+	if (cache->wd)
+		return;
+
+	ret = inotify_add_watch(priv->inotify_fd, cache->path,
+				IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+				IN_MOVED_TO | IN_MODIFY | IN_ATTRIB |
+				IN_DELETE_SELF | IN_MOVE_SELF);
+	if (ret < 0)
+		pr_warn("%s: can't watch %s: %i (%s)", __func__,
+			cache->path, errno, strerror(errno));
+	else
+		cache->wd = ret;
+}
+
+/*
+ * Replace the listing by a new one. It is only trusted for the next read
+ * if no change was reported since the listing was started (generation
+ * @gen).
+ */
+static void isobusfs_srv_dir_cache_install(struct isobusfs_srv_dir_cache *cache,
+					   struct isobusfs_srv_dir_cache *new,
+					   unsigned int gen)
+{
+	free(cache->buf);
+	free(cache->entries);
+
+	cache->buf = new->buf;
+	cache->len = new->len;
+	cache->size = new->size;
+	cache->entries = new->entries;
+	cache->count = new->count;
+	cache->entries_size = new->entries_size;
+
+	/* without a watch the listing can't be trusted for the next read */
+	cache->valid = cache->wd > 0 && cache->gen == gen;
+
+	new->buf = NULL;
+	new->entries = NULL;
+}
+
+/*
+ * Invalidate the listings of the directories inotify reports changes for,
+ * the unused ones are dropped.
+ */
+void isobusfs_srv_dir_cache_events(struct isobusfs_srv_priv *priv)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	unsigned int i;
+	ssize_t len;
+	char *ptr;
+
+	while (1) {
+		len = read(priv->inotify_fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)ptr;
+
+			for (i = 0; i < ARRAY_SIZE(priv->dir_caches); i++) {
+				struct isobusfs_srv_dir_cache *cache =
+					&priv->dir_caches[i];
+
+				/* on queue overflow (wd == -1) drop all */
+				if (!cache->path ||
+				    (ev->wd != -1 && cache->wd != ev->wd))
+					continue;
+
+				cache->valid = false;
+				cache->gen++;
+				/* the kernel removed the watch */
+				if (ev->mask & IN_IGNORED)
+					cache->wd = 0;
+				if (!cache->refcount)
+					isobusfs_srv_dir_cache_evict(priv, cache);
+			}
+		}
+	}
+}
+
+/*
+ * Copy the entries from the position of the client on, as many as fit into
+ * the response. The position is the index of the next entry and is
+ * advanced by the number of entries sent.
+ */
+static void isobusfs_srv_read_directory(struct isobusfs_srv_handles *handle,
+					int client_idx, uint8_t *buffer,
+					size_t count, ssize_t *readed_size)
+{
+	struct isobusfs_srv_dir_cache *cache = handle->dir_cache;
+	unsigned int first, last;
+
+	*readed_size = 0;
+
+	if (handle->offsets[client_idx] >= cache->count)
+		return;
+
+	first = handle->offsets[client_idx];
+	last = first;
+	while (last < cache->count &&
+	       cache->entries[last + 1] - cache->entries[first] <= count)
+		last++;
+
+	*readed_size = cache->entries[last] - cache->entries[first];
+	memcpy(buffer, cache->buf + cache->entries[first], *readed_size);
+	handle->offsets[client_idx] = last;
+}
+
+static int isobusfs_srv_fa_rf_send(struct isobusfs_srv_priv *priv,
+				   struct isobusfs_msg *msg,
+				   struct isobusfs_read_file_response *res,
+				   uint8_t error_code, ssize_t readed_size)
+{
+	struct isobusfs_fa_readf_req *req =
+		(struct isobusfs_fa_readf_req *)msg->buf;
+	ssize_t send_size;
+	int ret;
+
+	res->fs_function =
+		isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
+					    ISOBUSFS_FA_F_READ_FILE_RES);
+	res->tan = req->tan;
+	res->error_code = error_code;
+	res->count = htole16(readed_size);
+
+	send_size = sizeof(*res) + readed_size;
+	if (send_size < ISOBUSFS_MIN_TRANSFER_LENGH)
+		send_size = ISOBUSFS_MIN_TRANSFER_LENGH;
+
+	/* send to socket */
+	ret = isobusfs_srv_sendto(priv, msg, res, send_size);
+	if (ret < 0) {
+		pr_warn("can't send Read File Response");
+		return ret;
+	}
+
+	pr_debug("> tx: Read File Response. Error code: %d (%s), readed size: %d",
+		 error_code, isobusfs_error_to_str(error_code), readed_size);
+
+	return ret;
+}
+
+/* The handle may be gone while the job was running */
+static struct isobusfs_srv_handles *
+isobusfs_srv_job_handle(struct isobusfs_srv_priv *priv,
+			struct isobusfs_srv_job *job)
+{
+	struct isobusfs_srv_handles *handle;
+
+	handle = isobusfs_srv_get_handle(priv, job->handle);
+	if (!handle || isobusfs_srv_handle_client_idx(handle, job->client) < 0)
+		return NULL;
+
+	return handle;
+}
+
+static void isobusfs_srv_dir_list_work(struct isobusfs_srv_job *job)
+{
+	job->error_code = isobusfs_srv_dir_list(job->path, &job->cache);
+}
+
+static void isobusfs_srv_dir_list_done(struct isobusfs_srv_priv *priv,
+				       struct isobusfs_srv_job *job)
+{
+	struct isobusfs_read_file_response *res =
+		(struct isobusfs_read_file_response *)(job->buf - sizeof(*res));
+	struct isobusfs_srv_handles *handle;
+	uint8_t error_code = job->error_code;
+	ssize_t readed_size = 0;
+	int client_idx;
+
+	/* the slot of a closed handle may be taken by another path */
+	handle = isobusfs_srv_job_handle(priv, job);
+	if (!handle || !handle->dir || strcmp(handle->path, job->path)) {
+		error_code = ISOBUSFS_ERR_INVALID_HANDLE;
+	} else if (!error_code) {
+		isobusfs_srv_dir_cache_install(handle->dir_cache, &job->cache,
+					       job->gen);
+		client_idx = isobusfs_srv_handle_client_idx(handle, job->client);
+		isobusfs_srv_read_directory(handle, client_idx, job->buf,
+					    job->count, &readed_size);
+		if (job->count != 0 && readed_size == 0)
+			error_code = ISOBUSFS_ERR_END_OF_FILE;
+	}
+
+	free(job->cache.buf);
+	free(job->cache.entries);
+
+	isobusfs_srv_fa_rf_send(priv, job->msg, res, error_code, readed_size);
+}
+
+static void isobusfs_srv_read_file_done(struct isobusfs_srv_priv *priv,
+					struct isobusfs_srv_job *job)
+{
+	struct isobusfs_read_file_response *res =
+		(struct isobusfs_read_file_response *)(job->buf - sizeof(*res));
+	struct isobusfs_srv_handles *handle;
+	uint8_t error_code = job->error_code;
+	int client_idx;
+	int ret;
+
+	handle = isobusfs_srv_job_handle(priv, job);
+	if (!handle) {
+		error_code = ISOBUSFS_ERR_INVALID_HANDLE;
+		job->result = 0;
+	} else if (!error_code && job->count != 0 && job->result == 0) {
+		error_code = ISOBUSFS_ERR_END_OF_FILE;
+	}
+
+	ret = isobusfs_srv_fa_rf_send(priv, job->msg, res, error_code,
+				      job->result);
+	if (ret < 0 || !handle)
+		return;
+
+	client_idx = isobusfs_srv_handle_client_idx(handle, job->client);
+	handle->offsets[client_idx] = job->offset + job->result;
+
+	/*
+	 * The (E)TP transfer of this response takes a while on the bus. Let
+	 * the kernel read the next chunk in the meantime, so the next request
+	 * of the client is served from the page cache.
+	 */
+	if (job->result > 0)
+		posix_fadvise(handle->fd, handle->offsets[client_idx],
+			      job->count, POSIX_FADV_WILLNEED);
 }
 
 static int isobusfs_srv_fa_rf_req(struct isobusfs_srv_priv *priv,
@@ -605,17 +1186,20 @@ static int isobusfs_srv_fa_rf_req(struct isobusfs_srv_priv *priv,
 {
 	uint8_t res_fail[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 	struct isobusfs_read_file_response *res;
-	struct isobusfs_srv_handles *handle;
+	struct isobusfs_srv_handles *handle = NULL;
 	struct isobusfs_srv_client *client;
 	struct isobusfs_fa_readf_req *req;
+	struct isobusfs_srv_job *job;
 	ssize_t readed_size = 0;
 	uint8_t error_code = 0;
-	ssize_t send_size;
-	int ret = 0;
+	int client_idx;
+	uint8_t *buf;
+	int ret;
 	int count;
 
 	req = (struct isobusfs_fa_readf_req *)msg->buf;
 	count = le16toh(req->count);
+	res = (struct isobusfs_read_file_response *)&res_fail[0];
 
 	pr_debug("< rx: Read File Request. tan: %d, handle: %d, count: %d",
 		 req->tan, req->handle, count);
@@ -630,14 +1214,6 @@ static int isobusfs_srv_fa_rf_req(struct isobusfs_srv_priv *priv,
 	if (count > ISOBUSFS_MAX_DATA_LENGH)
 		count = ISOBUSFS_MAX_DATA_LENGH;
 
-	res = malloc(sizeof(*res) + count);
-	if (!res) {
-		pr_warn("failed to allocate memory");
-		res = (struct isobusfs_read_file_response *)&res_fail[0];
-		error_code = ISOBUSFS_ERR_OUT_OF_MEM;
-		goto send_response;
-	}
-
 	client = isobusfs_srv_get_client_by_msg(priv, msg);
 	if (!client) {
 		pr_warn("client not found");
@@ -645,131 +1221,129 @@ static int isobusfs_srv_fa_rf_req(struct isobusfs_srv_priv *priv,
 		goto send_response;
 	}
 
+	buf = isobusfs_srv_get_res_buf(priv, client);
+	if (!buf) {
+		pr_warn("failed to allocate memory");
+		error_code = ISOBUSFS_ERR_OUT_OF_MEM;
+		goto send_response;
+	}
+	res = (struct isobusfs_read_file_response *)buf;
+
 	handle = isobusfs_srv_get_handle(priv, req->handle);
-	if (!handle) {
+	client_idx = handle ? isobusfs_srv_handle_client_idx(handle, client) : -1;
+	if (client_idx < 0) {
 		pr_warn("failed to find file with handle: %x", req->handle);
 		error_code = ISOBUSFS_ERR_FILE_ORPATH_NOT_FOUND;
+		goto send_response;
 	}
 
-	/* Determine whether to read a file or a directory */
-	if (handle->dir) {
-		ret = isobusfs_srv_read_directory(handle, res->data, count,
-						  &readed_size);
-	} else {
-		ret = isobusfs_srv_read_file(handle, res->data, count,
-					     &readed_size);
+	/* an unchanged directory is served from memory */
+	if (handle->dir && handle->dir_cache->valid) {
+		isobusfs_srv_read_directory(handle, client_idx, res->data,
+					    count, &readed_size);
+		if (count != 0 && readed_size == 0)
+			error_code = ISOBUSFS_ERR_END_OF_FILE;
+		goto send_response;
 	}
 
-	if (ret < 0) {
-		error_code = ret;
-		readed_size = 0;
-	} else if (count != 0 && readed_size == 0) {
-		error_code = ISOBUSFS_ERR_END_OF_FILE;
+	job = isobusfs_srv_job_alloc(client, msg);
+	if (!job) {
+		pr_warn("failed to allocate memory");
+		error_code = ISOBUSFS_ERR_OUT_OF_MEM;
+		goto send_response;
 	}
 
-send_response:
-	res->fs_function =
-		isobusfs_cg_function_to_buf(ISOBUSFS_CG_FILE_ACCESS,
-					    ISOBUSFS_FA_F_READ_FILE_RES);
-	res->tan = req->tan;
-	res->error_code = error_code;
-	res->count = htole16(readed_size);
-
-	send_size = sizeof(*res) + readed_size;
-	if (send_size < ISOBUSFS_MIN_TRANSFER_LENGH)
-		send_size = ISOBUSFS_MIN_TRANSFER_LENGH;
+	job->handle = req->handle;
+	job->count = count;
+	job->buf = res->data;
 
-	/* send to socket */
-	ret = isobusfs_srv_sendto(priv, msg, res, send_size);
-	if (ret < 0) {
-		pr_warn("can't send Read File Response");
-		goto free_res;
+	if (handle->dir) {
+		isobusfs_srv_dir_cache_watch(priv, handle->dir_cache);
+		job->gen = handle->dir_cache->gen;
+		strncpy(job->path, handle->path, sizeof(job->path) - 1);
+		job->work = isobusfs_srv_dir_list_work;
+		job->done = isobusfs_srv_dir_list_done;
+	} else {
+		job->fd = handle->fd;
+		job->offset = handle->offsets[client_idx];
+		job->work = isobusfs_srv_read_file_work;
+		job->done = isobusfs_srv_read_file_done;
 	}
 
-	pr_debug("> tx: Read File Response. Error code: %d (%s), readed size: %d",
-		 error_code, isobusfs_error_to_str(error_code), readed_size);
+	isobusfs_srv_job_submit(priv, job);
+
+	return ISOBUSFS_SRV_MSG_QUEUED;
+
+send_response:
+	ret = isobusfs_srv_fa_rf_send(priv, msg, res, error_code, readed_size);
 
-free_res:
-	free(res);
 	return ret;
 }
 
 static int isobusfs_srv_seek(struct isobusfs_srv_priv *priv,
-			     struct isobusfs_srv_handles *handle, int32_t offset,
-			     uint8_t position_mode)
+			     struct isobusfs_srv_handles *handle, int client_idx,
+			     int32_t offset, uint8_t position_mode)
 {
-	int whence;
+	struct stat file_stat;
 	off_t offs;
 
 	switch (position_mode) {
 	case ISOBUSFS_FA_SEEK_SET:
-		whence = SEEK_SET;
 		if (offset < 0) {
 			pr_warn("Invalid offset. Offset must be positive.");
 			return ISOBUSFS_ERR_INVALID_REQUESTED_LENGHT;
 		}
+		offs = offset;
 		break;
 	case ISOBUSFS_FA_SEEK_CUR:
-		whence = SEEK_CUR;
-		if (offset < 0 && handle->offset < -offset) {
+		if (offset < 0 && handle->offsets[client_idx] < -offset) {
 			pr_warn("Invalid offset. Negative offset is too big.");
 			return ISOBUSFS_ERR_INVALID_REQUESTED_LENGHT;
 		}
+		offs = handle->offsets[client_idx] + offset;
 		break;
 	case ISOBUSFS_FA_SEEK_END:
-		whence = SEEK_END;
 		if (offset > 0) {
 			pr_warn("Invalid offset. Offset must be negative");
 			return ISOBUSFS_ERR_INVALID_REQUESTED_LENGHT;
 		}
+		if (fstat(handle->fd, &file_stat) < 0) {
+			pr_warn("Failed to seek file");
+			return ISOBUSFS_ERR_INVALID_HANDLE;
+		}
+		if (file_stat.st_size < -offset) {
+			pr_warn("Invalid offset. Negative offset is too big.");
+			return ISOBUSFS_ERR_INVALID_REQUESTED_LENGHT;
+		}
+		offs = file_stat.st_size + offset;
 		break;
 	default:
 		pr_warn("invalid position mode");
 		return ISOBUSFS_ERR_OTHER;
 	}
 
-	/* seek file */
-	offs = lseek(handle->fd, offset, whence);
-	if (offs < 0) {
-		pr_warn("Failed to seek file");
-
-		switch (offs) {
-		case EBADF:
-			return ISOBUSFS_ERR_INVALID_HANDLE;
-		case EINVAL:
-			return ISOBUSFS_ERR_INVALID_REQUESTED_LENGHT;
-		case ENXIO:
-			return ISOBUSFS_ERR_END_OF_FILE;
-		case EOVERFLOW:
-			return ISOBUSFS_ERR_OUT_OF_MEM;
-		case ESPIPE:
-			return ISOBUSFS_ERR_ACCESS_DENIED;
-		default:
-			return ISOBUSFS_ERR_OTHER;
-		}
-	}
-
-	handle->offset = offs;
+	/* the position is per client, the shared fd is accessed by pread() */
+	handle->offsets[client_idx] = offs;
 
 	return ISOBUSFS_ERR_SUCCESS;
 }
 
-static int isobusfs_srv_seek_directory(struct isobusfs_srv_handles *handle,
-				       int32_t offset)
+static int isobusfs_srv_seek_directory(struct isobusfs_srv_priv *priv,
+				       struct isobusfs_srv_handles *handle,
+				       int client_idx, int32_t offset)
 {
-	DIR *dir = fdopendir(handle->fd);
-
-	if (!dir)
-		return ISOBUSFS_ERR_OTHER;
+	if (offset < 0)
+		return ISOBUSFS_ERR_END_OF_FILE;
 
-	rewinddir(dir);
-
-	for (int32_t i = 0; i < offset; i++) {
-		if (readdir(dir) == NULL)
-			return ISOBUSFS_ERR_END_OF_FILE;
-	}
+	/*
+	 * Without a listing the offset is checked by the next read, listing
+	 * the directory here would block the main loop.
+	 */
+	if (handle->dir_cache->valid &&
+	    (uint32_t)offset > handle->dir_cache->count)
+		return ISOBUSFS_ERR_END_OF_FILE;
 
-	handle->dir_pos = offset;
+	handle->offsets[client_idx] = offset;
 
 	return ISOBUSFS_ERR_SUCCESS;
 }
@@ -782,6 +1356,7 @@ static int isobusfs_srv_fa_sf_req(struct isobusfs_srv_priv *priv,
 	struct isobusfs_fa_seekf_req *req;
 	struct isobusfs_srv_handles *handle;
 	int32_t offset_out = 0;
+	int client_idx;
 	uint8_t error_code = 0;
 	int ret;
 
@@ -797,20 +1372,23 @@ static int isobusfs_srv_fa_sf_req(struct isobusfs_srv_priv *priv,
 	}
 
 	handle = isobusfs_srv_get_handle(priv, req->handle);
-	if (!handle) {
+	client_idx = handle ? isobusfs_srv_handle_client_idx(handle, client) : -1;
+	if (client_idx < 0) {
 		pr_warn("failed to find handle: %x", req->handle);
 		error_code = ISOBUSFS_ERR_INVALID_HANDLE;
 		goto send_response;
 	}
 
 	if (handle->dir) {
-		error_code = isobusfs_srv_seek_directory(handle,
+		error_code = isobusfs_srv_seek_directory(priv, handle,
+							 client_idx,
 							 le32toh(req->offset));
-		res.position = htole32(handle->dir_pos);
+		res.position = htole32(handle->offsets[client_idx]);
 	} else {
-		error_code = isobusfs_srv_seek(priv, handle, le32toh(req->offset),
+		error_code = isobusfs_srv_seek(priv, handle, client_idx,
+					       le32toh(req->offset),
 					       req->position_mode);
-		res.position = htole32(handle->offset);
+		res.position = htole32(handle->offsets[client_idx]);
 	}
 
 send_response:
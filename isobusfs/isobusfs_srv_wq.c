@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: LGPL-2.0-only
+/*
+ * ISOBUS File System Server work queue (isobusfs_srv_wq.c)
+ *
+ * Blocking file system calls (open, read, readdir, stat) of the File Access
+ * requests run in a small pool of worker threads. The protocol state stays
+ * single threaded: a job carries copies of everything the worker needs,
+ * and the result is handled by the done() callback of the job in the main
+ * loop, which is woken up by an eventfd. With zero workers the jobs are
+ * executed synchronously.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "isobusfs_srv.h"
+
+static void *isobusfs_srv_wq_worker(void *arg)
+{
+	struct isobusfs_srv_priv *priv = arg;
+	struct isobusfs_srv_wq *wq = &priv->wq;
+	struct isobusfs_srv_job *job;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&wq->lock);
+	while (1) {
+		while (!wq->stop && !wq->head)
+			pthread_cond_wait(&wq->cond, &wq->lock);
+		if (wq->stop)
+			break;
+
+		job = wq->head;
+		wq->head = job->next;
+		if (!wq->head)
+			wq->tail = NULL;
+		pthread_mutex_unlock(&wq->lock);
+
+		job->work(job);
+
+		pthread_mutex_lock(&wq->lock);
+		job->next = wq->done;
+		wq->done = job;
+		if (write(wq->event_fd, &one, sizeof(one)) != sizeof(one))
+			pr_err("can't signal finished job: %i (%s)", errno,
+			       strerror(errno));
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	return NULL;
+}
+
+int isobusfs_srv_wq_init(struct isobusfs_srv_priv *priv)
+{
+	struct isobusfs_srv_wq *wq = &priv->wq;
+	int ret, i;
+
+	wq->event_fd = -1;
+	if (!wq->nthreads)
+		return 0;
+
+	wq->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wq->event_fd < 0) {
+		ret = -errno;
+		pr_err("eventfd(): %i (%s)", errno, strerror(errno));
+		return ret;
+	}
+
+	ret = libj1939_add_socket_to_epoll(priv->cmn.epoll_fd, wq->event_fd,
+					   EPOLLIN);
+	if (ret < 0) {
+		close(wq->event_fd);
+		wq->event_fd = -1;
+		return ret;
+	}
+
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+
+	for (i = 0; i < wq->nthreads; i++) {
+		ret = pthread_create(&wq->threads[i], NULL,
+				     isobusfs_srv_wq_worker, priv);
+		if (ret) {
+			pr_err("can't create worker thread: %i (%s)", ret,
+			       strerror(ret));
+			wq->nthreads = i;
+			return -ret;
+		}
+	}
+
+	return 0;
+}
+
+void isobusfs_srv_wq_stop(struct isobusfs_srv_priv *priv)
+{
+	struct isobusfs_srv_wq *wq = &priv->wq;
+	int i;
+
+	if (!wq->nthreads)
+		return;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = true;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->nthreads; i++)
+		pthread_join(wq->threads[i], NULL);
+
+	close(wq->event_fd);
+}
+
+struct isobusfs_srv_job *isobusfs_srv_job_alloc(struct isobusfs_srv_client *client,
+						struct isobusfs_msg *msg)
+{
+	struct isobusfs_srv_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+
+	job->client = client;
+	job->msg = msg;
+	job->fd = -1;
+
+	return job;
+}
+
+static void isobusfs_srv_job_finish(struct isobusfs_srv_priv *priv,
+				    struct isobusfs_srv_job *job)
+{
+	struct isobusfs_srv_client *client = job->client;
+
+	job->done(priv, job);
+
+	free(job->msg);
+	free(job);
+
+	/* handle the requests which came in meanwhile */
+	client->busy = false;
+	isobusfs_srv_client_resume(priv, client);
+}
+
+/*
+ * Queue a job. The job owns the request message from now on and the client
+ * is busy until the job is done.
+ */
+void isobusfs_srv_job_submit(struct isobusfs_srv_priv *priv,
+			     struct isobusfs_srv_job *job)
+{
+	struct isobusfs_srv_wq *wq = &priv->wq;
+
+	job->client->busy = true;
+
+	if (!wq->nthreads) {
+		job->work(job);
+		isobusfs_srv_job_finish(priv, job);
+		return;
+	}
+
+	job->next = NULL;
+	pthread_mutex_lock(&wq->lock);
+	if (wq->tail)
+		wq->tail->next = job;
+	else
+		wq->head = job;
+	wq->tail = job;
+	pthread_cond_signal(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* Called from the main loop if the eventfd is readable */
+void isobusfs_srv_wq_complete(struct isobusfs_srv_priv *priv)
+{
+	struct isobusfs_srv_wq *wq = &priv->wq;
+	struct isobusfs_srv_job *job, *done = NULL, *next;
+	uint64_t cnt;
+
+	if (read(wq->event_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		pr_warn("can't read eventfd: %i (%s)", errno, strerror(errno));
+
+	pthread_mutex_lock(&wq->lock);
+	job = wq->done;
+	wq->done = NULL;
+	pthread_mutex_unlock(&wq->lock);
+
+	/* restore the completion order */
+	for (; job; job = next) {
+		next = job->next;
+		job->next = done;
+		done = job;
+	}
+
+	for (job = done; job; job = next) {
+		next = job->next;
+		isobusfs_srv_job_finish(priv, job);
+	}
+}
@@ -42,7 +42,9 @@
  *
  */
 
+#include <errno.h>
 #include <libgen.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,24 +53,44 @@
 #include <unistd.h>
 
 #include <net/if.h>
-#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
-#include <linux/sockios.h>
 
+#include "isotpreasm.h"
+#include "lib.h"
 #include "terminal.h"
 
 #define NO_CAN_ID 0xFFFFFFFFU
+#define MAX_CHANNELS 2048 /* CAN IDs in PDU mode */
+
+#if (IFNAMSIZ != 16)
+#error "IFNAMSIZ value does not to DEVSZ calculation!"
+#endif
+
+#define DEVSZ 22 /* IFNAMSZ + 6 */
+#define TIMESZ sizeof("(1345212884.318850)   ")
+#define BUFSZ (TIMESZ + DEVSZ + AFRSZ)
+
+/* adapt sscanf() functions below on error */
+#if (AFRSZ != 6300)
+#error "AFRSZ value does not fit sscanf restrictions!"
+#endif
+#if (DEVSZ != 22)
+#error "DEVSZ value does not fit sscanf restrictions!"
+#endif
 
 const char fc_info [4][9] = { "CTS", "WT", "OVFLW", "reserved" };
 const int canfd_on = 1;
 
+static volatile int running = 1;
+
 void print_usage(char *prg)
 {
 	fprintf(stderr, "\nUsage: %s [options] <CAN interface>\n", prg);
+	fprintf(stderr, "       %s [options] -l <logfile> [<CAN interface>]\n", prg);
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "         -s <can_id>  (source can_id. Use 8 digits for extended IDs)\n");
 	fprintf(stderr, "         -d <can_id>  (destination can_id. Use 8 digits for extended IDs)\n");
@@ -79,7 +101,15 @@ void print_usage(char *prg)
 	fprintf(stderr, "         -a           (print data also in ASCII-chars)\n");
 	fprintf(stderr, "         -t <type>    (timestamp: (a)bsolute/(d)elta/(z)ero/(A)bsolute w date)\n");
 	fprintf(stderr, "         -u           (print uds messages)\n");
+	fprintf(stderr, "         -r           (print reassembled PDUs instead of CAN frames)\n");
+	fprintf(stderr, "         -l <file>    (read a candump log file - '-' for stdin)\n");
 	fprintf(stderr, "\nCAN IDs and addresses are given and expected in hexadecimal values.\n");
+	fprintf(stderr, "\nWith -r the -s/-d CAN IDs are optional. Without them all CAN IDs are\n");
+	fprintf(stderr, "reassembled and the ID pairs are learned from the flow control frames.\n");
+	fprintf(stderr, "Together with -u the UDS responses show their response time (rt) and\n");
+	fprintf(stderr, "a summary of all services is printed at the end. Multi frame PDUs show\n");
+	fprintf(stderr, "their transfer time (tt). With -l the CAN frames are read from a candump\n");
+	fprintf(stderr, "log file instead of a CAN interface, optionally only from <CAN interface>.\n");
 	fprintf(stderr, "\nUDS output contains a flag which provides information about the type of the \n");
 	fprintf(stderr, "message.\n\n");
 	fprintf(stderr, "Flags:\n");
@@ -194,6 +224,334 @@ void print_uds_message(int service, int nrc)
 	printf("%s %s", flag, service_name);
 }
 
+void print_timestamp(int timestamp, struct timeval *tv, struct timeval *last_tv)
+{
+	switch (timestamp) {
+	case 'a': /* absolute with timestamp */
+		printf("(%llu.%06llu) ", (unsigned long long)tv->tv_sec, (unsigned long long)tv->tv_usec);
+		break;
+
+	case 'A': /* absolute with date */
+	{
+		struct tm tm;
+		char timestring[25];
+
+		tm = *localtime(&tv->tv_sec);
+		strftime(timestring, 24, "%Y-%m-%d %H:%M:%S",
+			 &tm);
+		printf("(%s.%06llu) ", timestring, (unsigned long long)tv->tv_usec);
+	} break;
+
+	case 'd': /* delta */
+	case 'z': /* starting with zero */
+	{
+		struct timeval diff;
+
+		if (last_tv->tv_sec == 0) /* first init */
+			*last_tv = *tv;
+		diff.tv_sec = tv->tv_sec - last_tv->tv_sec;
+		diff.tv_usec = tv->tv_usec - last_tv->tv_usec;
+		if (diff.tv_usec < 0)
+			diff.tv_sec--, diff.tv_usec += 1000000;
+		if (diff.tv_sec < 0)
+			diff.tv_sec = diff.tv_usec = 0;
+		printf("(%llu.%06llu) ", (unsigned long long)diff.tv_sec,
+		       (unsigned long long)diff.tv_usec);
+
+		if (timestamp == 'd')
+			*last_tv = *tv; /* update for delta calculation */
+	} break;
+
+	default: /* no timestamp output */
+		break;
+	}
+}
+
+/*
+ * PDU mode (-r)
+ *
+ * The PDUs are reassembled per CAN ID in a fixed size channel table.
+ * Without -s/-d every CAN ID gets its own channel and the CAN ID pairs
+ * are learned from the FC frames. A UDS response is assigned to the
+ * latest pending request with the same service - preferably on the peer
+ * CAN ID - to calculate the response time from the end of the request to
+ * the start of the response. A final response completes the request.
+ * Requests to the broadcast CAN ID (-b, or the ISO 15765-4 functional
+ * CAN IDs 0x7DF and 0x18DB33F1) stay pending for the responses of all
+ * ECUs.
+ */
+
+struct uds_request {
+	int sid;		/* -1 = no request pending */
+	int broadcast;		/* sent to the functional CAN ID */
+	struct timeval tv;	/* end of the request */
+};
+
+struct uds_stats {
+	unsigned long requests;
+	unsigned long responses;
+	unsigned long nrcs;
+	unsigned long pending;	/* NRC 0x78 responsePending */
+	unsigned long long sum;
+	unsigned long long min;
+	unsigned long long max;
+};
+
+static struct isotp_rx_table rxtab;
+static struct uds_request *requests;
+static canid_t bcast_id = NO_CAN_ID;
+static struct uds_stats uds_stats[256];
+static unsigned long pdus, pdu_errors;
+
+static int is_uds_response(int sid)
+{
+	return (sid >= 0x50 && sid <= 0x7F) || (sid >= 0xC3 && sid <= 0xC8);
+}
+
+static int is_broadcast(canid_t id)
+{
+	return id == bcast_id || id == 0x7DF || id == (0x18DB33F1 | CAN_EFF_FLAG);
+}
+
+static void pdu_init(int ext, canid_t src, canid_t dst, canid_t bst)
+{
+	unsigned int i;
+
+	bcast_id = bst;
+
+	if (isotp_rx_init(&rxtab, MAX_CHANNELS, ext)) {
+		perror("isotp_rx_init");
+		exit(1);
+	}
+
+	requests = calloc(rxtab.size, sizeof(*requests));
+	if (!requests) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < rxtab.size; i++)
+		requests[i].sid = -1;
+
+	for (i = 0; i < 256; i++)
+		uds_stats[i].min = ~0ULL;
+
+	if (src == NO_CAN_ID) {
+		rxtab.auto_add = 1;
+		return;
+	}
+
+	isotp_rx_add(&rxtab, src, dst)->user = 1;
+	isotp_rx_add(&rxtab, dst, src)->user = 2;
+	if (bst != NO_CAN_ID)
+		isotp_rx_add(&rxtab, bst, ISOTP_RX_NO_ID)->user = 3;
+}
+
+static void pdu_free(void)
+{
+	isotp_rx_free(&rxtab);
+	free(requests);
+}
+
+/* find the request of a response and return the response time in usecs */
+static long long uds_response_time(struct isotp_rx_chan *chan, int sid, int final)
+{
+	struct isotp_rx_chan *peer;
+	struct uds_request *req = NULL;
+	unsigned int i;
+	long long usecs;
+
+	/* a 7F response without the service, -1 also marks the idle slots */
+	if (sid < 0)
+		return -1;
+
+	/* the peer is only known after a FC frame or from -s/-d */
+	peer = chan->peer != ISOTP_RX_NO_ID ? isotp_rx_lookup(&rxtab, chan->peer) : NULL;
+	if (peer && requests[peer - rxtab.chan].sid == sid) {
+		req = &requests[peer - rxtab.chan];
+	} else {
+		for (i = 0; i < rxtab.size; i++) {
+			if (requests[i].sid != sid)
+				continue;
+			if (!req || isotp_rx_usecs(&req->tv, &requests[i].tv))
+				req = &requests[i];
+		}
+	}
+
+	if (!req)
+		return -1;
+
+	usecs = isotp_rx_usecs(&req->tv, &chan->first);
+
+	/* broadcast requests are answered by several ECUs */
+	if (final && !req->broadcast)
+		req->sid = -1;
+
+	return usecs;
+}
+
+static void handle_pdu(struct isotp_rx_chan *chan, int color, int timestamp,
+		       struct timeval *last_tv, int uds_output, int asc,
+		       const char *ifname)
+{
+	struct uds_stats *st;
+	unsigned char *data = chan->buf;
+	long long rt = -1;
+	int sid = data[0];
+	int nrc = chan->len > 2 ? data[2] : 0;
+	int req_sid;
+	unsigned int i;
+
+	pdus++;
+
+	if (uds_output && is_uds_response(sid)) {
+		req_sid = sid == 0x7F ? (chan->len > 1 ? data[1] : -1) : sid - 0x40;
+		rt = uds_response_time(chan, req_sid, !(sid == 0x7F && nrc == 0x78));
+
+		if (req_sid >= 0 && rt >= 0) {
+			st = &uds_stats[req_sid];
+			if (sid == 0x7F && nrc == 0x78) {
+				st->pending++;
+			} else {
+				st->responses++;
+				if (sid == 0x7F)
+					st->nrcs++;
+				st->sum += rt;
+				if ((unsigned long long)rt < st->min)
+					st->min = rt;
+				if ((unsigned long long)rt > st->max)
+					st->max = rt;
+			}
+		}
+	} else if (uds_output) {
+		requests[chan - rxtab.chan].sid = sid;
+		requests[chan - rxtab.chan].broadcast = is_broadcast(chan->id);
+		requests[chan - rxtab.chan].tv = chan->last;
+		uds_stats[sid].requests++;
+	}
+
+	if (color) {
+		if (chan->user == 1)
+			printf("%s", FGRED);
+		else if (chan->user == 2)
+			printf("%s", FGBLUE);
+		else if (chan->user == 3)
+			printf("%s", FGGREEN);
+	}
+
+	if (timestamp)
+		print_timestamp(timestamp, &chan->last, last_tv);
+
+	if (chan->id & CAN_EFF_FLAG)
+		printf(" %s  %8X", ifname, chan->id & CAN_EFF_MASK);
+	else
+		printf(" %s  %3X", ifname, chan->id & CAN_SFF_MASK);
+
+	if (rxtab.ext)
+		printf("{%02X}", chan->addr);
+
+	printf("  [PDU] ln: %-4u ", chan->len);
+
+	if (uds_output) {
+		print_uds_message(sid, nrc);
+		if (rt >= 0)
+			printf(" rt: %.3f ms", rt / 1000.0);
+		printf(" ");
+	}
+
+	if (chan->cfs)
+		printf("tt: %.3f ms ", isotp_rx_usecs(&chan->first, &chan->last) / 1000.0);
+
+	printf("data:");
+	for (i = 0; i < chan->len; i++)
+		printf(" %02X", data[i]);
+
+	if (asc) {
+		printf("  -  '");
+		for (i = 0; i < chan->len; i++)
+			printf("%c", (data[i] > 0x1F && data[i] < 0x7F) ? data[i] : '.');
+		printf("'");
+	}
+
+	if (color)
+		printf("%s", ATTRESET);
+	printf("\n");
+}
+
+static void pdu_error(struct isotp_rx_chan *chan, const char *ifname)
+{
+	pdu_errors++;
+
+	if (chan->id & CAN_EFF_FLAG)
+		printf(" %s  %8X", ifname, chan->id & CAN_EFF_MASK);
+	else
+		printf(" %s  %3X", ifname, chan->id & CAN_SFF_MASK);
+
+	printf("  [ERR] ln: %u/%u %s\n", chan->rcvd, chan->len, chan->err);
+}
+
+static void print_uds_stats(void)
+{
+	struct uds_stats *st;
+	int sid;
+
+	printf("\n%lu PDUs, %lu transfer errors\n", pdus, pdu_errors);
+	printf("SID requests responses  NRCs pending   min ms   avg ms   max ms  service\n");
+
+	for (sid = 0; sid < 256; sid++) {
+		st = &uds_stats[sid];
+		if (!st->requests && !st->responses)
+			continue;
+
+		printf(" %02X %8lu %9lu %5lu %7lu", sid, st->requests,
+		       st->responses, st->nrcs, st->pending);
+		if (st->responses)
+			printf(" %8.3f %8.3f %8.3f  ", st->min / 1000.0,
+			       st->sum / 1000.0 / st->responses, st->max / 1000.0);
+		else
+			printf(" %8s %8s %8s  ", "-", "-", "-");
+		print_uds_message(sid, 0);
+		printf("\n");
+	}
+}
+
+/* read the next CAN frame from a candump log file, returns 0 at EOF */
+static int read_logframe(FILE *infile, struct canfd_frame *frame,
+			 struct timeval *tv, char *device)
+{
+	static char buf[BUFSZ], afrbuf[AFRSZ];
+	unsigned long long sec, usec;
+	cu_t cu;
+	int mtu;
+
+	while (fgets(buf, BUFSZ - 1, infile)) {
+		if (buf[0] != '(')
+			continue;
+
+		if (sscanf(buf, "(%llu.%llu) %21s %6299s", &sec, &usec, device, afrbuf) != 4)
+			continue;
+
+		mtu = parse_canframe(afrbuf, &cu);
+		if (mtu != CAN_MTU && mtu != CANFD_MTU)
+			continue;
+
+		/* struct can_frame is a subset of struct canfd_frame */
+		memset(frame, 0, sizeof(*frame));
+		memcpy(frame, &cu.fd, mtu);
+		tv->tv_sec = sec;
+		tv->tv_usec = usec;
+
+		return mtu;
+	}
+
+	return 0;
+}
+
+static void sigterm(int signo)
+{
+	running = 0;
+}
+
 int main(int argc, char **argv)
 {
 	int s;
@@ -219,12 +577,30 @@ int main(int argc, char **argv)
 	unsigned long fflen = 0;
 	struct timeval tv, last_tv;
 	unsigned int n_pci;
-	int opt;
+	int reasm = 0;
+	char *logfile = NULL;
+	FILE *infile = NULL;
+	char device[DEVSZ];
+	char *ifname = NULL;
+	struct isotp_rx_chan *chan;
+	struct timeval last_expire = { 0 };
+	struct sigaction sa = { 0 };
+	char ctrl[CMSG_SPACE(sizeof(struct timeval))];
+	struct iovec iov = {
+		.iov_base = &frame,
+		.iov_len = sizeof(frame),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	struct cmsghdr *cmsg;
+	int ev, opt;
 
 	last_tv.tv_sec  = 0;
 	last_tv.tv_usec = 0;
 
-	while ((opt = getopt(argc, argv, "s:d:b:ax:X:ct:u?")) != -1) {
+	while ((opt = getopt(argc, argv, "s:d:b:ax:X:ct:url:?")) != -1) {
 		switch (opt) {
 		case 's':
 			src = strtoul(optarg, NULL, 16);
@@ -282,6 +658,14 @@ int main(int argc, char **argv)
 		        uds_output = 1;
 			break;
 
+		case 'r':
+			reasm = 1;
+			break;
+
+		case 'l':
+			logfile = optarg;
+			break;
+
 		case '?':
 			print_usage(basename(argv[0]));
 			exit(0);
@@ -300,11 +684,37 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
-	if ((argc - optind) != 1 || src == NO_CAN_ID || dst == NO_CAN_ID) {
+	if ((argc - optind) > 1 || (!logfile && (argc - optind) != 1) ||
+	    (src == NO_CAN_ID) != (dst == NO_CAN_ID) ||
+	    (!reasm && src == NO_CAN_ID)) {
 		print_usage(basename(argv[0]));
 		exit(0);
 	}
 
+	if (argc - optind == 1)
+		ifname = argv[optind];
+
+	if (reasm)
+		pdu_init(ext, src, dst, bst);
+
+	sa.sa_handler = sigterm;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	if (logfile) {
+		if (!strcmp(logfile, "-")) {
+			infile = stdin;
+		} else {
+			infile = fopen(logfile, "r");
+			if (!infile) {
+				perror(logfile);
+				return 1;
+			}
+		}
+		s = -1;
+		goto read_frames;
+	}
+
 	if ((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
 		perror("socket");
 		return 1;
@@ -337,11 +747,20 @@ int main(int argc, char **argv)
 		rfilter[2].can_mask = (CAN_SFF_MASK|CAN_EFF_FLAG|CAN_RTR_FLAG);
 	}
 
-	if (bst != NO_CAN_ID)
+	if (src == NO_CAN_ID)
+		; /* all CAN IDs */
+	else if (bst != NO_CAN_ID)
 		setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
 	else
 		setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter) - sizeof(rfilter[0]));
 
+	/* get the timestamps together with the frames */
+	i = 1;
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &i, sizeof(i)) < 0) {
+		perror("setsockopt SO_TIMESTAMP");
+		return 1;
+	}
+
 	addr.can_family = AF_CAN;
 	addr.can_ifindex = if_nametoindex(argv[optind]);
 	if (!addr.can_ifindex) {
@@ -354,16 +773,45 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	while (1) {
-		nbytes = read(s, &frame, sizeof(frame));
-		if (nbytes < 0) {
-			perror("read");
-			return 1;
-		}
-		if (nbytes != CAN_MTU && nbytes != CANFD_MTU) {
-			fprintf(stderr, "read: incomplete CAN frame %zu %d\n", sizeof(frame), nbytes);
-			return 1;
+	/* no output buffering for live data */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+ read_frames:
+	while (running) {
+		if (infile) {
+			nbytes = read_logframe(infile, &frame, &tv, device);
+			if (!nbytes)
+				break;
+
+			if (ifname && strcmp(ifname, device))
+				continue;
+
+			if (src != NO_CAN_ID && frame.can_id != src &&
+			    frame.can_id != dst && frame.can_id != bst)
+				continue;
+		} else {
+			msg.msg_control = ctrl;
+			msg.msg_controllen = sizeof(ctrl);
+
+			nbytes = recvmsg(s, &msg, 0);
+			if (nbytes < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("read");
+				return 1;
+			}
+			if (nbytes != CAN_MTU && nbytes != CANFD_MTU) {
+				fprintf(stderr, "read: incomplete CAN frame %zu %d\n", sizeof(frame), nbytes);
+				return 1;
+			}
+
+			for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET &&
+				    cmsg->cmsg_type == SO_TIMESTAMP)
+					memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+			}
 		}
+
 		if (frame.can_id == src && ext && !extany &&
 		    extaddr != frame.data[0])
 			continue;
@@ -372,6 +820,23 @@ int main(int argc, char **argv)
 		    rx_extaddr != frame.data[0])
 			continue;
 
+		if (reasm) {
+			ev = isotp_rx_frame(&rxtab, &frame, &tv, &chan);
+			if (ev & ISOTP_RX_ERROR)
+				pdu_error(chan, infile ? device : ifname);
+			if (ev & ISOTP_RX_PDU)
+				handle_pdu(chan, color, timestamp, &last_tv,
+					   uds_output, asc, infile ? device : ifname);
+
+			/* check for timed out transfers in the frame time */
+			if (isotp_rx_usecs(&last_expire, &tv) >= 100000) {
+				while ((chan = isotp_rx_expire(&rxtab, &tv)))
+					pdu_error(chan, infile ? device : ifname);
+				last_expire = tv;
+			}
+			continue;
+		}
+
 		if (color) {
 			if (frame.can_id == src)
 				printf("%s", FGRED);
@@ -381,55 +846,13 @@ int main(int argc, char **argv)
 				printf("%s", FGGREEN);
 		}
 
-		if (timestamp) {
-			ioctl(s, SIOCGSTAMP, &tv);
-
-			switch (timestamp) {
-			case 'a': /* absolute with timestamp */
-				printf("(%llu.%06llu) ", (unsigned long long)tv.tv_sec, (unsigned long long)tv.tv_usec);
-				break;
-
-			case 'A': /* absolute with date */
-			{
-				struct tm tm;
-				char timestring[25];
-
-				tm = *localtime(&tv.tv_sec);
-				strftime(timestring, 24, "%Y-%m-%d %H:%M:%S",
-					 &tm);
-				printf("(%s.%06llu) ", timestring, (unsigned long long)tv.tv_usec);
-			} break;
-
-			case 'd': /* delta */
-			case 'z': /* starting with zero */
-			{
-				struct timeval diff;
-
-				if (last_tv.tv_sec == 0) /* first init */
-					last_tv = tv;
-				diff.tv_sec = tv.tv_sec - last_tv.tv_sec;
-				diff.tv_usec = tv.tv_usec - last_tv.tv_usec;
-				if (diff.tv_usec < 0)
-					diff.tv_sec--, diff.tv_usec += 1000000;
-				if (diff.tv_sec < 0)
-					diff.tv_sec = diff.tv_usec = 0;
-				printf("(%llu.%06llu) ", (unsigned long long)diff.tv_sec,
-				       (unsigned long long)diff.tv_usec);
-
-				if (timestamp == 'd')
-					last_tv =
-						tv; /* update for delta calculation */
-			} break;
-
-			default: /* no timestamp output */
-				break;
-			}
-		}
+		/* nothing is printed without -t */
+		print_timestamp(timestamp, &tv, &last_tv);
 
 			if (frame.can_id & CAN_EFF_FLAG)
-				printf(" %s  %8X", argv[optind], frame.can_id & CAN_EFF_MASK);
+				printf(" %s  %8X", infile ? device : ifname, frame.can_id & CAN_EFF_MASK);
 			else
-				printf(" %s  %3X", argv[optind], frame.can_id & CAN_SFF_MASK);
+				printf(" %s  %3X", infile ? device : ifname, frame.can_id & CAN_SFF_MASK);
 
 			if (ext)
 				printf("{%02X}", frame.data[0]);
@@ -531,10 +954,18 @@ int main(int argc, char **argv)
 			if (color)
 				printf("%s", ATTRESET);
 			printf("\n");
-			fflush(stdout);
 	}
 
-	close(s);
+	if (reasm && uds_output)
+		print_uds_stats();
+
+	if (reasm)
+		pdu_free();
+
+	if (infile && infile != stdin)
+		fclose(infile);
+	if (s >= 0)
+		close(s);
 
 	return 0;
 }
@@ -42,7 +42,10 @@
  *
  */
 
+#include <errno.h>
 #include <libgen.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -56,12 +59,19 @@
 #include <sys/types.h>
 
 #include <linux/can.h>
+#include <linux/can/isotp.h>
 #include <linux/can/raw.h>
 #include <linux/sockios.h>
 
+#include "canframelen.h"
+
 #define NO_CAN_ID 0xFFFFFFFFU
 #define PERCENTRES 2 /* resolution in percent for bargraph */
 #define NUMBAR (100/PERCENTRES) /* number of bargraph elements */
+#define BUFSIZE 65536 /* max. PDU length */
+#define MAXLIST 32 /* max. number of values in a parameter list */
+#define SEQWIN 256 /* max. outstanding PDUs + 1 */
+#define ZERO_STRING "ZERO"
 
 void print_usage(char *prg)
 {
@@ -72,7 +82,30 @@ void print_usage(char *prg)
 	fprintf(stderr, "         -d <can_id>  (destination can_id. Use 8 digits for extended IDs)\n");
 	fprintf(stderr, "         -x <addr>    (extended addressing mode)\n");
 	fprintf(stderr, "         -X <addr>    (extended addressing mode (rx addr))\n");
+	fprintf(stderr, "\nActive benchmark options:\n");
+	fprintf(stderr, "         -G           (generator: send PDUs and measure the returned PDUs)\n");
+	fprintf(stderr, "         -R           (responder: return received PDUs. Swap -s/-d of the generator)\n");
+	fprintf(stderr, "         -A           (loopback: generator and responder on one interface)\n");
+	fprintf(stderr, "         -l <lens>    (PDU lengths. Default: 8,64,512,4095)\n");
+	fprintf(stderr, "         -b <bs>      (blocksize(s) in the FC frames. Default: 0)\n");
+	fprintf(stderr, "         -m <stmin>   (STmin value(s) in the FC frames. Default: 0)\n");
+	fprintf(stderr, "         -D <dls>     (CAN FD tx_dl value(s) 8..64. 0 = CAN 2.0. Default: 0)\n");
+	fprintf(stderr, "         -B           (set the CAN FD bitrate switch)\n");
+	fprintf(stderr, "         -t <time ns> (frame transmit time (N_As) in nanosecs) (*)\n");
+	fprintf(stderr, "         -n <count>   (PDUs per configuration. Default: 100)\n");
+	fprintf(stderr, "         -w <num>     (max. outstanding PDUs. Default: 1)\n");
+	fprintf(stderr, "         -a           (return only the first 4 bytes of each PDU)\n");
+	fprintf(stderr, "         -o <ms>      (timeout for outstanding PDUs. Default: 1000)\n");
+	fprintf(stderr, "         -c           (print results as CSV)\n");
 	fprintf(stderr, "\nCAN IDs and addresses are given and expected in hexadecimal values.\n");
+	fprintf(stderr, "Lists are comma separated. <bs> and <stmin> are hexadecimal values.\n");
+	fprintf(stderr, "Lists of -b/-m/-D are only supported in loopback mode (-A).\n");
+	fprintf(stderr, "(*) = Use '-t %s' to set N_As to zero for Linux version 5.18+\n", ZERO_STRING);
+	fprintf(stderr, "\nWithout -G/-R/-A the PDU transfers of the given CAN IDs are visualised.\n");
+	fprintf(stderr, "The benchmark prints one line per configuration with the goodput (payload\n");
+	fprintf(stderr, "bytes of both directions per second), the round trip time of the PDUs in\n");
+	fprintf(stderr, "usecs and the bus efficiency (payload bits / CAN frame bits on the bus).\n");
+	fprintf(stderr, "\nExample: %s -A -s 7E0 -d 7E8 -l 7,62,4095 -D 0,64 -n 1000 -c vcan0\n", prg);
 	fprintf(stderr, "\n");
 }
 
@@ -88,6 +121,567 @@ unsigned int getdigits(unsigned int value)
 	return digits;
 }
 
+/*
+ * Active benchmark (-G/-R/-A)
+ *
+ * The generator sends numbered PDUs over a CAN_ISOTP socket and the
+ * responder returns them unchanged (or only their first 4 bytes with -a).
+ * With -A both ends run in this process with swapped CAN IDs, so every
+ * parameter list can be swept on a single (virtual) CAN interface.
+ *
+ * The PDU content is generated from the sequence number, which allows to
+ * check every returned PDU and to detect lost and stale PDUs. A CAN_RAW
+ * socket counts the CAN frames of both CAN IDs to calculate the bus load
+ * of each run (worst case bit stuffing, see canframelen.h).
+ */
+
+static volatile int perf_running = 1;
+
+static unsigned int lens[MAXLIST] = { 8, 64, 512, 4095 };
+static unsigned int nlens = 4;
+static unsigned int bss[MAXLIST] = { 0 };
+static unsigned int nbss = 1;
+static unsigned int stmins[MAXLIST] = { 0 };
+static unsigned int nstmins = 1;
+static unsigned int dls[MAXLIST] = { 0 };
+static unsigned int ndls = 1;
+
+struct perf_cfg {
+	canid_t src;
+	canid_t dst;
+	int ext;
+	int extaddr;
+	int rx_ext;
+	int rx_extaddr;
+	unsigned int count;
+	unsigned int window;
+	unsigned int timeout;
+	unsigned int frame_txtime;
+	int brs;
+	int ack;
+	int csv;
+};
+
+struct perf_result {
+	unsigned int len;
+	unsigned int bs;
+	unsigned int stmin;
+	unsigned int dl;
+	unsigned long pdus;
+	unsigned long lost;
+	unsigned long errors;
+	unsigned long long bytes;
+	unsigned long long frames;
+	unsigned long long bits;
+	double secs;
+};
+
+static void perf_sigterm(int signo)
+{
+	perf_running = 0;
+}
+
+/* parse a comma separated list of values into list[] */
+static unsigned int parse_list(const char *arg, int base, unsigned int *list,
+			       unsigned int min, unsigned int max)
+{
+	const char *p = arg;
+	unsigned int n = 0;
+	unsigned long val;
+	char *end;
+
+	do {
+		val = strtoul(p, &end, base);
+		if (end == p || (*end && *end != ',') || val < min || val > max) {
+			fprintf(stderr, "invalid value list '%s' (%u..%u)\n",
+				arg, min, max);
+			exit(1);
+		}
+
+		if (n == MAXLIST) {
+			fprintf(stderr, "too many values in '%s' (max %d)\n",
+				arg, MAXLIST);
+			exit(1);
+		}
+
+		list[n++] = val;
+		p = end + 1;
+	} while (*end);
+
+	return n;
+}
+
+static int valid_tx_dl(unsigned int dl)
+{
+	switch (dl) {
+	case 0:
+	case 8:
+	case 12:
+	case 16:
+	case 20:
+	case 24:
+	case 32:
+	case 48:
+	case 64:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int open_isotp(int ifindex, const struct perf_cfg *cfg, int responder,
+		      unsigned int bs, unsigned int stmin, unsigned int dl)
+{
+	struct sockaddr_can addr = { 0 };
+	struct can_isotp_options opts = { 0 };
+	struct can_isotp_fc_options fcopts = { 0 };
+	struct can_isotp_ll_options llopts = { 0 };
+	int tx_ext = cfg->extaddr;
+	int rx_ext = cfg->rx_ext ? cfg->rx_extaddr : cfg->extaddr;
+	int s;
+
+	s = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP);
+	if (s < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (cfg->ext) {
+		opts.flags |= CAN_ISOTP_EXTEND_ADDR | CAN_ISOTP_RX_EXT_ADDR;
+		opts.ext_address = responder ? rx_ext : tx_ext;
+		opts.rx_ext_address = responder ? tx_ext : rx_ext;
+	}
+	opts.frame_txtime = cfg->frame_txtime;
+
+	fcopts.bs = bs;
+	fcopts.stmin = stmin;
+
+	if (setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts)) < 0 ||
+	    setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fcopts, sizeof(fcopts)) < 0) {
+		perror("setsockopt");
+		close(s);
+		return -1;
+	}
+
+	if (dl) {
+		llopts.mtu = CANFD_MTU;
+		llopts.tx_dl = dl;
+		llopts.tx_flags = cfg->brs ? CANFD_BRS : 0;
+
+		if (setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &llopts, sizeof(llopts)) < 0) {
+			perror("link layer sockopt");
+			close(s);
+			return -1;
+		}
+	}
+
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifindex;
+	addr.can_addr.tp.tx_id = responder ? cfg->dst : cfg->src;
+	addr.can_addr.tp.rx_id = responder ? cfg->src : cfg->dst;
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/* CAN_RAW socket that sees the frames of both directions */
+static int open_counter(int ifindex, const struct perf_cfg *cfg)
+{
+	struct sockaddr_can addr = { 0 };
+	struct can_filter rfilter[2];
+	int canfd_on = 1;
+	int rcvbuf = 1024 * 1024;
+	canid_t id[2] = { cfg->src, cfg->dst };
+	int s, i;
+
+	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (s < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &canfd_on, sizeof(canfd_on));
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	for (i = 0; i < 2; i++) {
+		if (id[i] & CAN_EFF_FLAG) {
+			rfilter[i].can_id = id[i] & (CAN_EFF_MASK | CAN_EFF_FLAG);
+			rfilter[i].can_mask = CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+		} else {
+			rfilter[i].can_id = id[i] & CAN_SFF_MASK;
+			rfilter[i].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+		}
+	}
+
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
+
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifindex;
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/* read all pending frames of the counter socket (res == NULL discards) */
+static void count_frames(int s, struct perf_result *res)
+{
+	struct canfd_frame frame;
+	ssize_t nbytes;
+
+	while ((nbytes = recv(s, &frame, sizeof(frame), MSG_DONTWAIT)) > 0) {
+		if (!res || (nbytes != CAN_MTU && nbytes != CANFD_MTU))
+			continue;
+
+		res->frames++;
+		res->bits += can_frame_length(&frame, CFL_WORSTCASE, nbytes);
+	}
+}
+
+static void fill_pdu(unsigned char *buf, unsigned int len, unsigned long seq)
+{
+	unsigned int i = 0;
+
+	if (len >= 4) {
+		buf[0] = seq >> 24;
+		buf[1] = seq >> 16;
+		buf[2] = seq >> 8;
+		buf[3] = seq;
+		i = 4;
+	}
+
+	for (; i < len; i++)
+		buf[i] = seq + i;
+}
+
+static unsigned long long ts_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000ULL + b->tv_nsec - a->tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* run one configuration: gs = generator, rs = local responder or -1 */
+static int perf_run(const struct perf_cfg *cfg, int gs, int rs, int cs,
+		    unsigned int len, unsigned long long *rtt,
+		    struct perf_result *res)
+{
+	static unsigned char txbuf[BUFSIZE], rxbuf[BUFSIZE], expbuf[BUFSIZE];
+	struct timespec stamp[SEQWIN], start, now;
+	struct pollfd pfd[3];
+	unsigned int retlen = cfg->ack && len > 4 ? 4 : len;
+	unsigned long sent = 0, next_rx = 0, k;
+	ssize_t nbytes;
+	int ret;
+
+	res->len = len;
+	res->pdus = res->lost = res->errors = 0;
+	res->bytes = res->frames = res->bits = 0;
+
+	pfd[0].fd = gs;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = cs;
+	pfd[1].events = POLLIN;
+	pfd[2].fd = rs;
+	pfd[2].events = POLLIN;
+
+	count_frames(cs, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	now = start;
+
+	while (perf_running && (sent < cfg->count || next_rx < sent)) {
+		if (sent < cfg->count && sent - next_rx < cfg->window) {
+			fill_pdu(txbuf, len, sent);
+			clock_gettime(CLOCK_MONOTONIC, &stamp[sent % SEQWIN]);
+
+			nbytes = write(gs, txbuf, len);
+			if (nbytes < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("write");
+				return -1;
+			}
+			sent++;
+			continue;
+		}
+
+		ret = poll(pfd, rs < 0 ? 2 : 3, cfg->timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return -1;
+		}
+
+		if (!ret) {
+			/* the outstanding PDUs did not come back */
+			res->lost += sent - next_rx;
+			next_rx = sent;
+			continue;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			count_frames(cs, res);
+
+		if (rs >= 0 && pfd[2].revents & POLLIN) {
+			nbytes = read(rs, rxbuf, sizeof(rxbuf));
+			if (nbytes > 0) {
+				if (cfg->ack && nbytes > 4)
+					nbytes = 4;
+				if (write(rs, rxbuf, nbytes) < 0 && errno != EINTR) {
+					perror("write");
+					return -1;
+				}
+			}
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		nbytes = read(gs, rxbuf, sizeof(rxbuf));
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			return -1;
+		}
+
+		/* find the outstanding PDU by its sequence number */
+		for (k = next_rx; k < sent; k++) {
+			if (len >= 4 && rxbuf[0] == (unsigned char)(k >> 24) &&
+			    rxbuf[1] == (unsigned char)(k >> 16) &&
+			    rxbuf[2] == (unsigned char)(k >> 8) &&
+			    rxbuf[3] == (unsigned char)k)
+				break;
+			if (len < 4 && rxbuf[0] == (unsigned char)k)
+				break;
+		}
+
+		if (k == sent || (size_t)nbytes != retlen) {
+			res->errors++;
+			continue;
+		}
+
+		fill_pdu(expbuf, len, k);
+		if (memcmp(rxbuf, expbuf, retlen)) {
+			res->errors++;
+			continue;
+		}
+
+		res->lost += k - next_rx;
+		next_rx = k + 1;
+		rtt[res->pdus++] = ts_diff_ns(&stamp[k % SEQWIN], &now);
+		res->bytes += len + retlen;
+	}
+
+	res->secs = ts_diff_ns(&start, &now) / 1e9;
+
+	/* catch the frames that are still on their way to the counter */
+	pfd[1].revents = 0;
+	while (poll(&pfd[1], 1, 10) > 0)
+		count_frames(cs, res);
+
+	return 0;
+}
+
+static void print_header(const struct perf_cfg *cfg)
+{
+	if (cfg->csv)
+		printf("len,bs,stmin,fd,dl,brs,pdus,lost,errors,secs,goodput,pdus_per_sec,"
+		       "rtt_min_us,rtt_p50_us,rtt_p99_us,rtt_max_us,frames,frames_per_pdu,bus_eff\n");
+	else
+		printf("#  len  bs stmin fd dl brs   pdus  lost   err     secs   goodput    pdu/s"
+		       "  rtt_min  rtt_p50  rtt_p99  rtt_max   frames frm/pdu  eff\n");
+}
+
+static void print_result(const struct perf_cfg *cfg, struct perf_result *res,
+			 unsigned long long *rtt)
+{
+	const char *fmt;
+	double goodput = 0, rate = 0, eff = 0, fpp = 0;
+	double rmin = 0, p50 = 0, p99 = 0, rmax = 0;
+
+	if (res->pdus) {
+		qsort(rtt, res->pdus, sizeof(*rtt), cmp_ull);
+		rmin = rtt[0] / 1e3;
+		p50 = rtt[(res->pdus - 1) * 50 / 100] / 1e3;
+		p99 = rtt[(res->pdus - 1) * 99 / 100] / 1e3;
+		rmax = rtt[res->pdus - 1] / 1e3;
+		fpp = (double)res->frames / res->pdus;
+	}
+
+	if (res->secs > 0) {
+		goodput = res->bytes / res->secs;
+		rate = res->pdus / res->secs;
+	}
+
+	if (res->bits)
+		eff = res->bytes * 8.0 / res->bits;
+
+	if (cfg->csv)
+		fmt = "%u,%u,0x%02X,%d,%u,%d,%lu,%lu,%lu,%.6f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu,%.2f,%.3f\n";
+	else
+		fmt = "%6u %3u  0x%02X %2d %2u %3d %6lu %5lu %5lu %8.3f %9.0f %8.1f %8.1f %8.1f %8.1f %8.1f %8llu %7.2f %.3f\n";
+
+	printf(fmt, res->len, res->bs, res->stmin, res->dl ? 1 : 0,
+	       res->dl ? res->dl : CAN_MAX_DLEN, res->dl ? cfg->brs : 0,
+	       res->pdus, res->lost, res->errors, res->secs, goodput, rate,
+	       rmin, p50, p99, rmax, res->frames, fpp, eff);
+	fflush(stdout);
+}
+
+/* return the received PDUs (or their first 4 bytes) to the generator */
+static int respond(int ifindex, const struct perf_cfg *cfg)
+{
+	static unsigned char buf[BUFSIZE];
+	unsigned long pdus = 0;
+	ssize_t nbytes;
+	int s;
+
+	s = open_isotp(ifindex, cfg, 1, bss[0], stmins[0], dls[0]);
+	if (s < 0)
+		return 1;
+
+	while (perf_running) {
+		nbytes = read(s, buf, sizeof(buf));
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			close(s);
+			return 1;
+		}
+
+		if (cfg->ack && nbytes > 4)
+			nbytes = 4;
+
+		if (write(s, buf, nbytes) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			close(s);
+			return 1;
+		}
+		pdus++;
+	}
+
+	close(s);
+	fprintf(stderr, "%lu PDUs returned\n", pdus);
+
+	return 0;
+}
+
+static int generate(int ifindex, const struct perf_cfg *cfg, int loopback)
+{
+	struct perf_result res;
+	unsigned long long *rtt;
+	unsigned int d, b, m, l;
+	int gs, rs = -1, cs;
+	int ret = 0;
+
+	rtt = malloc(cfg->count * sizeof(*rtt));
+	if (!rtt) {
+		perror("malloc");
+		return 1;
+	}
+
+	cs = open_counter(ifindex, cfg);
+	if (cs < 0) {
+		free(rtt);
+		return 1;
+	}
+
+	print_header(cfg);
+
+	for (d = 0; d < ndls; d++) {
+		for (b = 0; b < nbss; b++) {
+			for (m = 0; m < nstmins; m++) {
+				gs = open_isotp(ifindex, cfg, 0, bss[b], stmins[m], dls[d]);
+				if (gs < 0) {
+					ret = 1;
+					goto out;
+				}
+
+				if (loopback) {
+					rs = open_isotp(ifindex, cfg, 1, bss[b], stmins[m], dls[d]);
+					if (rs < 0) {
+						close(gs);
+						ret = 1;
+						goto out;
+					}
+				}
+
+				res.bs = bss[b];
+				res.stmin = stmins[m];
+				res.dl = dls[d];
+
+				for (l = 0; l < nlens && perf_running; l++) {
+					if (perf_run(cfg, gs, rs, cs, lens[l], rtt, &res)) {
+						ret = 1;
+						break;
+					}
+					print_result(cfg, &res, rtt);
+				}
+
+				close(gs);
+				if (rs >= 0)
+					close(rs);
+
+				if (ret || !perf_running)
+					goto out;
+			}
+		}
+	}
+ out:
+	close(cs);
+	free(rtt);
+
+	return ret;
+}
+
+static int perf(const char *ifname, struct perf_cfg *cfg, int mode)
+{
+	struct sigaction sa = { 0 };
+	int ifindex;
+
+	if (mode != 'A' && (nbss > 1 || nstmins > 1 || ndls > 1)) {
+		fprintf(stderr, "value lists for -b/-m/-D are only supported in loopback mode (-A)\n");
+		return 1;
+	}
+
+	sa.sa_handler = perf_sigterm;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	ifindex = if_nametoindex(ifname);
+	if (!ifindex) {
+		perror("if_nametoindex");
+		return 1;
+	}
+
+	if (mode == 'R')
+		return respond(ifindex, cfg);
+
+	return generate(ifindex, cfg, mode == 'A');
+}
+
 int main(int argc, char **argv)
 {
 	fd_set rdfs;
@@ -116,9 +710,15 @@ int main(int argc, char **argv)
 	struct timeval start_tv, end_tv, diff_tv, timeo;
 	unsigned int n_pci;
 	unsigned int sn, last_sn = 0;
+	struct perf_cfg cfg = {
+		.count = 100,
+		.window = 1,
+		.timeout = 1000,
+	};
+	int mode = 0;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "s:d:x:X:?")) != -1) {
+	while ((opt = getopt(argc, argv, "s:d:x:X:GRAl:b:m:D:Bt:n:w:ao:c?")) != -1) {
 		switch (opt) {
 		case 's':
 			src = strtoul(optarg, NULL, 16);
@@ -142,6 +742,65 @@ int main(int argc, char **argv)
 			rx_extaddr = strtoul(optarg, NULL, 16) & 0xFF;
 			break;
 
+		case 'G':
+		case 'R':
+		case 'A':
+			mode = opt;
+			break;
+
+		case 'l':
+			nlens = parse_list(optarg, 10, lens, 1, BUFSIZE - 1);
+			break;
+
+		case 'b':
+			nbss = parse_list(optarg, 16, bss, 0, 0xFF);
+			break;
+
+		case 'm':
+			nstmins = parse_list(optarg, 16, stmins, 0, 0xFF);
+			break;
+
+		case 'D':
+			ndls = parse_list(optarg, 10, dls, 0, CANFD_MAX_DLEN);
+			for (i = 0; i < (int)ndls; i++) {
+				if (!valid_tx_dl(dls[i])) {
+					fprintf(stderr, "invalid CAN FD tx_dl %u\n", dls[i]);
+					exit(1);
+				}
+			}
+			break;
+
+		case 'B':
+			cfg.brs = 1;
+			break;
+
+		case 't':
+			if (!strncmp(optarg, ZERO_STRING, strlen(ZERO_STRING)))
+				cfg.frame_txtime = CAN_ISOTP_FRAME_TXTIME_ZERO;
+			else
+				cfg.frame_txtime = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			cfg.count = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'w':
+			cfg.window = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'a':
+			cfg.ack = 1;
+			break;
+
+		case 'o':
+			cfg.timeout = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'c':
+			cfg.csv = 1;
+			break;
+
 		case '?':
 			print_usage(basename(argv[0]));
 			exit(0);
@@ -160,6 +819,22 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
+	if (mode) {
+		if (!cfg.count || !cfg.window || cfg.window >= SEQWIN || !cfg.timeout) {
+			fprintf(stderr, "invalid count, window (1..%d) or timeout\n", SEQWIN - 1);
+			exit(1);
+		}
+
+		cfg.src = src;
+		cfg.dst = dst;
+		cfg.ext = ext || rx_ext;
+		cfg.extaddr = extaddr;
+		cfg.rx_ext = rx_ext;
+		cfg.rx_extaddr = rx_extaddr;
+
+		return perf(argv[optind], &cfg, mode);
+	}
+
 	if ((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
 		perror("socket");
 		return 1;
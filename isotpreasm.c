@@ -0,0 +1,336 @@
+/* SPDX-License-Identifier: (GPL-2.0-only OR BSD-3-Clause) */
+/*
+ * isotpreasm.c - userspace ISO15765-2 reassembly from CAN frames
+ *
+ * Send feedback to <linux-can@vger.kernel.org>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "isotpreasm.h"
+
+#define DEFAULT_TIMEOUT 1000000 /* N_Cr 1s */
+
+/* flow status of FC frames */
+#define FS_CTS 0
+#define FS_WAIT 1
+#define FS_OVFLW 2
+
+unsigned long long isotp_rx_usecs(const struct timeval *from, const struct timeval *to)
+{
+	long long usecs;
+
+	usecs = (to->tv_sec - from->tv_sec) * 1000000LL + to->tv_usec - from->tv_usec;
+
+	return usecs > 0 ? usecs : 0;
+}
+
+static unsigned int hash_id(const struct isotp_rx_table *t, canid_t id)
+{
+	return (id * 0x9E3779B1U) >> 16 & (t->size - 1);
+}
+
+int isotp_rx_init(struct isotp_rx_table *t, unsigned int size, int ext)
+{
+	unsigned int i;
+
+	memset(t, 0, sizeof(*t));
+
+	/* keep the table at most half full for short probe sequences */
+	for (t->size = 16; t->size < 2 * size; t->size <<= 1)
+		;
+
+	t->chan = calloc(t->size, sizeof(*t->chan));
+	if (!t->chan)
+		return -1;
+
+	for (i = 0; i < t->size; i++)
+		t->chan[i].id = ISOTP_RX_NO_ID;
+
+	t->ext = ext;
+	t->timeout = DEFAULT_TIMEOUT;
+
+	return 0;
+}
+
+void isotp_rx_free(struct isotp_rx_table *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->size; i++)
+		free(t->chan[i].buf);
+
+	free(t->chan);
+	t->chan = NULL;
+}
+
+struct isotp_rx_chan *isotp_rx_lookup(struct isotp_rx_table *t, canid_t id)
+{
+	unsigned int i;
+
+	for (i = hash_id(t, id); t->chan[i].id != ISOTP_RX_NO_ID; i = (i + 1) & (t->size - 1)) {
+		if (t->chan[i].id == id)
+			return &t->chan[i];
+	}
+
+	return NULL;
+}
+
+struct isotp_rx_chan *isotp_rx_add(struct isotp_rx_table *t, canid_t id, canid_t peer)
+{
+	struct isotp_rx_chan *chan;
+	unsigned int i;
+
+	chan = isotp_rx_lookup(t, id);
+	if (chan) {
+		if (peer != ISOTP_RX_NO_ID)
+			chan->peer = peer;
+		return chan;
+	}
+
+	if (2 * (t->used + 1) > t->size)
+		return NULL;
+
+	for (i = hash_id(t, id); t->chan[i].id != ISOTP_RX_NO_ID; i = (i + 1) & (t->size - 1))
+		;
+
+	chan = &t->chan[i];
+	chan->id = id;
+	chan->peer = peer;
+	t->used++;
+
+	return chan;
+}
+
+static int reserve(struct isotp_rx_chan *chan, unsigned int len)
+{
+	unsigned char *buf;
+	unsigned int size = 64;
+
+	if (len <= chan->bufsize)
+		return 0;
+
+	while (size < len)
+		size <<= 1;
+
+	buf = realloc(chan->buf, size);
+	if (!buf)
+		return -1;
+
+	chan->buf = buf;
+	chan->bufsize = size;
+
+	return 0;
+}
+
+/* abort a running transfer, returns ISOTP_RX_ERROR if there was one */
+static int abort_rx(struct isotp_rx_chan *chan, const char *err)
+{
+	if (chan->state == ISOTP_RX_IDLE)
+		return 0;
+
+	chan->state = ISOTP_RX_IDLE;
+	chan->err = err;
+	chan->errors++;
+
+	return ISOTP_RX_ERROR;
+}
+
+/* assign a FC frame to the transfer of the peer channel */
+static int handle_fc(struct isotp_rx_table *t, struct isotp_rx_chan *fc_chan,
+		     const unsigned char *data, int len, const struct timeval *tv,
+		     struct isotp_rx_chan **chanp)
+{
+	struct isotp_rx_chan *chan = t->last_ff;
+
+	/* learn the CAN ID pair from a FC that answers a FF */
+	if (fc_chan->peer == ISOTP_RX_NO_ID && t->auto_add && chan &&
+	    chan != fc_chan && chan->peer == ISOTP_RX_NO_ID &&
+	    chan->state == ISOTP_RX_WAIT_FC && !chan->fcs) {
+		chan->peer = fc_chan->id;
+		fc_chan->peer = chan->id;
+	}
+
+	if (fc_chan->peer == ISOTP_RX_NO_ID)
+		return 0;
+
+	chan = isotp_rx_lookup(t, fc_chan->peer);
+	if (!chan || chan->state != ISOTP_RX_WAIT_FC || len < 3)
+		return 0;
+
+	chan->fc_wait += isotp_rx_usecs(&chan->fc_req, tv);
+	chan->fc_req = *tv;
+	chan->fcs++;
+
+	switch (data[0] & 0x0F) {
+	case FS_CTS:
+		chan->state = ISOTP_RX_CF;
+		chan->bs = data[1];
+		chan->bs_cnt = 0;
+		break;
+
+	case FS_WAIT:
+		break;
+
+	default:
+		*chanp = chan;
+		return abort_rx(chan, "flow control overflow");
+	}
+
+	return 0;
+}
+
+int isotp_rx_frame(struct isotp_rx_table *t, const struct canfd_frame *cf,
+		   const struct timeval *tv, struct isotp_rx_chan **chanp)
+{
+	struct isotp_rx_chan *chan;
+	const unsigned char *data = cf->data + t->ext;
+	int len = cf->len - t->ext;
+	unsigned int pdulen, n;
+	int ret = 0;
+
+	*chanp = NULL;
+
+	if (len < 1 || cf->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))
+		return 0;
+
+	chan = isotp_rx_lookup(t, cf->can_id);
+	if (!chan) {
+		if (!t->auto_add)
+			return 0;
+
+		chan = isotp_rx_add(t, cf->can_id, ISOTP_RX_NO_ID);
+		if (!chan)
+			return 0;
+	}
+
+	if (t->ext)
+		chan->addr = cf->data[0];
+
+	switch (data[0] >> 4) {
+	case 0: /* SF */
+		pdulen = data[0] & 0x0F;
+		n = 1;
+		if (!pdulen && len > 1) {
+			/* CAN FD escape sequence */
+			pdulen = data[1];
+			n = 2;
+		}
+
+		if (!pdulen || pdulen > len - n || reserve(chan, pdulen))
+			return 0;
+
+		ret = abort_rx(chan, "interrupted by SF");
+		memcpy(chan->buf, data + n, pdulen);
+		chan->len = chan->rcvd = pdulen;
+		chan->cfs = 0;
+		chan->first = chan->last = *tv;
+		chan->fc_wait = 0;
+		chan->fcs = 0;
+		chan->pdus++;
+		*chanp = chan;
+
+		return ret | ISOTP_RX_PDU;
+
+	case 1: /* FF */
+		if (len < 2)
+			return 0;
+
+		pdulen = (data[0] & 0x0F) << 8 | data[1];
+		n = 2;
+		if (!pdulen && len >= 6) {
+			/* escape sequence for PDUs > 4095 bytes */
+			pdulen = data[2] << 24 | data[3] << 16 | data[4] << 8 | data[5];
+			n = 6;
+		}
+
+		ret = abort_rx(chan, "interrupted by FF");
+
+		if (pdulen <= (unsigned int)len - n || pdulen > ISOTP_RX_MAX_PDU ||
+		    reserve(chan, pdulen)) {
+			chan->err = "invalid FF length";
+			chan->errors++;
+			*chanp = chan;
+			return ISOTP_RX_ERROR;
+		}
+
+		memcpy(chan->buf, data + n, len - n);
+		chan->len = pdulen;
+		chan->rcvd = len - n;
+		chan->cfs = 0;
+		chan->sn = 1;
+		chan->bs = 0;
+		chan->bs_cnt = 0;
+		chan->first = chan->last = chan->fc_req = *tv;
+		chan->fc_wait = 0;
+		chan->fcs = 0;
+		chan->state = ISOTP_RX_WAIT_FC;
+		t->last_ff = chan;
+		break;
+
+	case 2: /* CF */
+		if (chan->state == ISOTP_RX_IDLE)
+			return 0;
+
+		/* FC frames might not be visible - accept CFs anyway */
+		if ((data[0] & 0x0F) != chan->sn) {
+			ret = abort_rx(chan, "wrong sequence number");
+			break;
+		}
+
+		n = chan->len - chan->rcvd;
+		if (n > (unsigned int)len - 1)
+			n = len - 1;
+
+		memcpy(chan->buf + chan->rcvd, data + 1, n);
+		chan->rcvd += n;
+		chan->cfs++;
+		chan->sn = (chan->sn + 1) & 0x0F;
+		chan->last = *tv;
+
+		if (chan->rcvd == chan->len) {
+			chan->state = ISOTP_RX_IDLE;
+			chan->pdus++;
+			ret = ISOTP_RX_PDU;
+		} else if (chan->bs && ++chan->bs_cnt == chan->bs) {
+			chan->state = ISOTP_RX_WAIT_FC;
+			chan->fc_req = *tv;
+		} else {
+			chan->state = ISOTP_RX_CF;
+		}
+		break;
+
+	case 3: /* FC */
+		return handle_fc(t, chan, data, len, tv, chanp);
+
+	default:
+		return 0;
+	}
+
+	if (ret)
+		*chanp = chan;
+
+	return ret;
+}
+
+/* return the next channel with a timed out transfer or NULL at the end */
+struct isotp_rx_chan *isotp_rx_expire(struct isotp_rx_table *t, const struct timeval *now)
+{
+	struct isotp_rx_chan *chan;
+
+	while (t->scan < t->size) {
+		chan = &t->chan[t->scan++];
+
+		if (chan->state != ISOTP_RX_IDLE &&
+		    isotp_rx_usecs(&chan->last, now) > t->timeout) {
+			abort_rx(chan, "timeout");
+			return chan;
+		}
+	}
+
+	t->scan = 0;
+
+	return NULL;
+}
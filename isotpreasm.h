@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: (GPL-2.0-only OR BSD-3-Clause) */
+/*
+ * isotpreasm.h - userspace ISO15765-2 reassembly from CAN frames
+ *
+ * Send feedback to <linux-can@vger.kernel.org>
+ *
+ */
+
+#ifndef ISOTPREASM_H
+#define ISOTPREASM_H
+
+#include <linux/can.h>
+#include <sys/time.h>
+
+/*
+ * A channel holds the reassembly state of the PDUs that are sent with
+ * one CAN ID. The channels live in a fixed size hash table which is
+ * allocated once. When the CAN ID of the flow control (FC) frames of a
+ * channel is known (peer), the FC frames are assigned to the transfer to
+ * measure the time the sender had to wait for them. With auto_add the
+ * peer is learned from the first FC frame that answers a FF.
+ *
+ * isotp_rx_frame() returns a mask of ISOTP_RX_PDU and ISOTP_RX_ERROR.
+ * ISOTP_RX_ERROR reports an aborted transfer (chan->err) and may come
+ * together with ISOTP_RX_PDU when a new single frame interrupted it.
+ * The PDU in chan->buf is valid until the next frame of the channel.
+ */
+
+#define ISOTP_RX_MAX_PDU (64 * 1024)
+#define ISOTP_RX_NO_ID 0xFFFFFFFFU
+
+/* return values of isotp_rx_frame() */
+#define ISOTP_RX_PDU 0x01
+#define ISOTP_RX_ERROR 0x02
+
+/* channel states */
+enum {
+	ISOTP_RX_IDLE,
+	ISOTP_RX_WAIT_FC,
+	ISOTP_RX_CF,
+};
+
+struct isotp_rx_chan {
+	canid_t id;		/* CAN ID of the data frames */
+	canid_t peer;		/* CAN ID of the FC frames or ISOTP_RX_NO_ID */
+	int state;
+	int user;		/* free for the application */
+	unsigned char addr;	/* extended address of the last frame */
+	unsigned char sn;	/* expected sequence number */
+	unsigned char bs;	/* block size of the last FC */
+	unsigned char bs_cnt;	/* CFs since the last FC */
+	unsigned int len;	/* PDU length */
+	unsigned int rcvd;	/* received bytes of the PDU */
+	unsigned int cfs;	/* CFs of the PDU (0 for SF) */
+	unsigned char *buf;
+	unsigned int bufsize;
+	const char *err;
+	struct timeval first;	/* SF/FF reception */
+	struct timeval last;	/* last frame of the PDU */
+	struct timeval fc_req;	/* start of the FC wait time */
+	unsigned long long fc_wait; /* usecs waited for FC frames */
+	unsigned int fcs;	/* FC frames of this PDU */
+	unsigned long pdus;
+	unsigned long errors;
+};
+
+struct isotp_rx_table {
+	struct isotp_rx_chan *chan;
+	unsigned int size;	/* power of two */
+	unsigned int used;
+	unsigned int scan;	/* position of isotp_rx_expire() */
+	struct isotp_rx_chan *last_ff; /* channel of the latest FF */
+	int ext;		/* extended addressing (first data byte) */
+	int auto_add;		/* create channels for unknown CAN IDs */
+	unsigned long timeout;	/* usecs between frames of a PDU (N_Cr) */
+};
+
+int isotp_rx_init(struct isotp_rx_table *t, unsigned int size, int ext);
+void isotp_rx_free(struct isotp_rx_table *t);
+struct isotp_rx_chan *isotp_rx_lookup(struct isotp_rx_table *t, canid_t id);
+struct isotp_rx_chan *isotp_rx_add(struct isotp_rx_table *t, canid_t id, canid_t peer);
+int isotp_rx_frame(struct isotp_rx_table *t, const struct canfd_frame *cf,
+		   const struct timeval *tv, struct isotp_rx_chan **chanp);
+struct isotp_rx_chan *isotp_rx_expire(struct isotp_rx_table *t, const struct timeval *now);
+unsigned long long isotp_rx_usecs(const struct timeval *from, const struct timeval *to);
+
+#endif
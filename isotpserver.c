@@ -13,6 +13,16 @@
  *
  * Valid ISO 15625-2 PDUs have a length from 1-4095 bytes.
  *
+ * All clients are served by a single process. Each client connection is
+ * an ISO-TP session with its own CAN_ISOTP socket. The addressing of the
+ * session can be negotiated by sending a setup line before the first PDU
+ * which uses the ISO-TP options of the command line, e.g.
+ *
+ * -s 7E0 -d 7E8 -L 72:64:0 can1
+ *
+ * The server answers with "+OK" or "-ERR <reason>". Without a setup line
+ * the session uses the addressing given on the command line.
+ *
  * Authors:
  * Andre Naujoks (the socket server stuff)
  * Oliver Hartkopp (the rest)
@@ -57,6 +67,7 @@
  *
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <libgen.h>
 #include <signal.h>
@@ -68,11 +79,11 @@
 
 #include <net/if.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
-#include <sys/wait.h>
 
 #include <linux/can.h>
 #include <linux/can/isotp.h>
@@ -82,32 +93,219 @@
 /* allow PDUs greater 4095 bytes according ISO 15765-2:2015 */
 #define MAX_PDU_LENGTH 6000
 
-int b64hex(char *asc, unsigned char *bin, int len)
+/* '<' + MAX_PDU_LENGTH * 2 + '>' + '\n' */
+#define MAX_ASCII_LENGTH (MAX_PDU_LENGTH * 2 + 3)
+
+/* size of the buffer for reading the ASCII HEX stream from the TCP socket */
+#define TCP_RXBUF_SIZE 65536
+
+/* isotp->tcp ASCII messages which are not yet sent to the client */
+#define TCP_TXBUF_SIZE (4 * MAX_ASCII_LENGTH)
+
+#define MAXEVENTS 64
+#define SETUP_MAXLEN 256
+#define SETUP_MAXTOKENS 32
+
+#define ISOTP_OPTS "s:d:x:p:P:b:m:w:t:L:"
+
+#define HEX_INVALID 0xFF
+
+static const char hexchars[] = "0123456789ABCDEF";
+static unsigned char hexval[256];
+
+enum {
+	EV_LISTEN,
+	EV_TCP,
+	EV_ISOTP,
+};
+
+struct session;
+
+/* event source referenced by epoll_event.data.ptr */
+struct evsrc {
+	int type;
+	int fd;
+	struct session *session;
+	unsigned int events; /* current epoll event mask */
+};
+
+struct isotp_config {
+	canid_t tx_id;
+	canid_t rx_id;
+	char ifname[IFNAMSIZ];
+	struct can_isotp_options opts;
+	struct can_isotp_fc_options fcopts;
+	struct can_isotp_ll_options llopts;
+};
+
+/* state of the streaming '<[data]+>' parser for the tcp->isotp path */
+struct pdu_parser {
+	int in_pdu;		/* '<' seen, waiting for '>' */
+	int valid;		/* no invalid character in the current PDU */
+	int nibbles;		/* number of decoded nibbles in pdu[] */
+	unsigned char pdu[MAX_PDU_LENGTH];
+};
+
+struct session {
+	struct evsrc tcp;
+	struct evsrc isotp;
+	struct session *next;
+	struct session *next_closed;
+	int active;		/* ISO-TP socket is set up */
+	int closed;
+	struct sockaddr_in peer;
+	struct isotp_config cfg;
+	struct timespec start;
+
+	/* tcp -> isotp */
+	unsigned char inbuf[TCP_RXBUF_SIZE];
+	int inoff;
+	int inlen;
+	struct pdu_parser parser;
+	int pdu_pending;	/* complete PDU waiting for the isotp socket */
+
+	/* isotp -> tcp */
+	char outbuf[TCP_TXBUF_SIZE];
+	int outoff;
+	int outlen;
+
+	unsigned long long tx_pdus;	/* tcp -> isotp */
+	unsigned long long tx_bytes;
+	unsigned long long rx_pdus;	/* isotp -> tcp */
+	unsigned long long rx_bytes;
+};
+
+static struct session *sessions;
+
+/* closed sessions may still be referenced by pending epoll events */
+static struct session *closed_sessions;
+
+static struct isotp_config defcfg;
+static int have_defcfg;
+
+static int epfd;
+static int verbose;
+static volatile int dump_stats;
+
+static void init_hexval(void)
+{
+	int i;
+
+	memset(hexval, HEX_INVALID, sizeof(hexval));
+
+	for (i = 0; i < 10; i++)
+		hexval['0' + i] = i;
+
+	for (i = 0; i < 6; i++) {
+		hexval['A' + i] = 10 + i;
+		hexval['a' + i] = 10 + i;
+	}
+}
+
+/*
+ * Encode the PDU as '<[data]+>\n' into buf which has to provide space for
+ * len * 2 + 3 bytes. Returns the length of the encoded message.
+ */
+static int encode_pdu(char *buf, const unsigned char *data, int len)
 {
+	char *ptr = buf;
 	int i;
 
+	*ptr++ = '<';
+
 	for (i = 0; i < len; i++) {
-		if (!sscanf(asc+(i*2), "%2hhx", bin+i))
-			return 1;	
+		*ptr++ = hexchars[data[i] >> 4];
+		*ptr++ = hexchars[data[i] & 0x0F];
+	}
+
+	*ptr++ = '>';
+	*ptr++ = '\n';
+
+	return ptr - buf;
+}
+
+/*
+ * Feed the TCP stream from *pos up to end into the parser until a complete
+ * PDU is found. Returns the length of the PDU in p->pdu and advances *pos
+ * behind the PDU or returns 0 when all data is consumed. Incomplete PDUs
+ * are kept in the parser state until the next call.
+ */
+static int parse_pdu(struct pdu_parser *p, const unsigned char **pos,
+		     const unsigned char *end)
+{
+	const unsigned char *ptr = *pos;
+	unsigned char val;
+
+	while (ptr < end) {
+		if (!p->in_pdu) {
+			/* skip everything up to the next message start */
+			ptr = memchr(ptr, '<', end - ptr);
+			if (!ptr) {
+				ptr = end;
+				break;
+			}
+
+			ptr++;
+			p->in_pdu = 1;
+			p->valid = 1;
+			p->nibbles = 0;
+			continue;
+		}
+
+		val = hexval[*ptr];
+
+		if (val != HEX_INVALID) {
+			ptr++;
+
+			/* PDU too long => drop it and wait for the next '<' */
+			if (p->nibbles >= MAX_PDU_LENGTH * 2) {
+				p->in_pdu = 0;
+				continue;
+			}
+
+			if (p->nibbles & 1)
+				p->pdu[p->nibbles >> 1] |= val;
+			else
+				p->pdu[p->nibbles >> 1] = val << 4;
+
+			p->nibbles++;
+			continue;
+		}
+
+		if (*ptr++ != '>') {
+			p->valid = 0;
+			continue;
+		}
+
+		p->in_pdu = 0;
+
+		/* must be an even number of nibbles and at least one data byte <XX> */
+		if (!p->valid || !p->nibbles || p->nibbles & 1)
+			continue;
+
+		*pos = ptr;
+		return p->nibbles >> 1;
 	}
+
+	*pos = ptr;
 	return 0;
 }
 
-void childdied(int i)
+static void sigusr1(int signo)
 {
-	wait(NULL);
+	dump_stats = 1;
 }
 
 void print_usage(char *prg)
 {
-	fprintf(stderr, "\nUsage: %s -l <port> -s <can_id> -d <can_id> [options] <CAN interface>\n", prg);
+	fprintf(stderr, "\nUsage: %s -l <port> [-s <can_id> -d <can_id>] [options] [<CAN interface>]\n", prg);
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "ip addressing:\n");
 	fprintf(stderr, "         -l <port>    * (local port for the server)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "isotp addressing:\n");
-	fprintf(stderr, "         -s <can_id>  * (source can_id. Use 8 digits for extended IDs)\n");
-	fprintf(stderr, "         -d <can_id>  * (destination can_id. Use 8 digits for extended IDs)\n");
+	fprintf(stderr, "         -s <can_id>    (source can_id. Use 8 digits for extended IDs)\n");
+	fprintf(stderr, "         -d <can_id>    (destination can_id. Use 8 digits for extended IDs)\n");
 	fprintf(stderr, "         -x <addr>[:<rxaddr>]  (extended addressing / opt. separate rxaddr)\n");
 	fprintf(stderr, "         -L <mtu>:<tx_dl>:<tx_flags>  (link layer options for CAN FD)\n");
 	fprintf(stderr, "\n");
@@ -123,141 +321,601 @@ void print_usage(char *prg)
 	fprintf(stderr, "tx path:\n (config, which changes local tx settings)\n");
 	fprintf(stderr, "         -t <time ns>  (transmit time in nanosecs)\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "         -v            (verbose: print PDUs and session counters)\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "(* = mandatory option)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "All values except for '-l' and '-t' are expected in hexadecimal values.\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "The isotp addressing and the CAN interface are the defaults for clients\n");
+	fprintf(stderr, "which do not send a setup line with the isotp options, e.g.\n");
+	fprintf(stderr, "  -s 7E0 -d 7E8 -L 72:64:0 can1\n");
+	fprintf(stderr, "Send SIGUSR1 to print the counters of all sessions.\n");
+	fprintf(stderr, "\n");
 }
 
-int main(int argc, char **argv)
+/* parse one of the ISOTP_OPTS into cfg - returns -1 on invalid values */
+static int parse_isotp_opt(int opt, char *optarg, struct isotp_config *cfg)
 {
-	extern int optind, opterr, optopt;
+	struct can_isotp_options *opts = &cfg->opts;
+	int elements;
+
+	switch (opt) {
+	case 's':
+		cfg->tx_id = strtoul(optarg, NULL, 16);
+		if (strlen(optarg) > 7)
+			cfg->tx_id |= CAN_EFF_FLAG;
+		break;
+
+	case 'd':
+		cfg->rx_id = strtoul(optarg, NULL, 16);
+		if (strlen(optarg) > 7)
+			cfg->rx_id |= CAN_EFF_FLAG;
+		break;
+
+	case 'x':
+		elements = sscanf(optarg, "%hhx:%hhx",
+				  &opts->ext_address,
+				  &opts->rx_ext_address);
+
+		if (elements == 1)
+			opts->flags |= CAN_ISOTP_EXTEND_ADDR;
+		else if (elements == 2)
+			opts->flags |= (CAN_ISOTP_EXTEND_ADDR | CAN_ISOTP_RX_EXT_ADDR);
+		else
+			return -1;
+		break;
+
+	case 'p':
+		elements = sscanf(optarg, "%hhx:%hhx",
+				  &opts->txpad_content,
+				  &opts->rxpad_content);
+
+		if (elements == 1)
+			opts->flags |= CAN_ISOTP_TX_PADDING;
+		else if (elements == 2)
+			opts->flags |= (CAN_ISOTP_TX_PADDING | CAN_ISOTP_RX_PADDING);
+		else if (sscanf(optarg, ":%hhx", &opts->rxpad_content) == 1)
+			opts->flags |= CAN_ISOTP_RX_PADDING;
+		else
+			return -1;
+		break;
+
+	case 'P':
+		if (optarg[0] == 'l')
+			opts->flags |= CAN_ISOTP_CHK_PAD_LEN;
+		else if (optarg[0] == 'c')
+			opts->flags |= CAN_ISOTP_CHK_PAD_DATA;
+		else if (optarg[0] == 'a')
+			opts->flags |= (CAN_ISOTP_CHK_PAD_LEN | CAN_ISOTP_CHK_PAD_DATA);
+		else
+			return -1;
+		break;
+
+	case 'b':
+		cfg->fcopts.bs = strtoul(optarg, NULL, 16) & 0xFF;
+		break;
+
+	case 'm':
+		cfg->fcopts.stmin = strtoul(optarg, NULL, 16) & 0xFF;
+		break;
+
+	case 'w':
+		cfg->fcopts.wftmax = strtoul(optarg, NULL, 16) & 0xFF;
+		break;
+
+	case 't':
+		opts->frame_txtime = strtoul(optarg, NULL, 10);
+		break;
+
+	case 'L':
+		if (sscanf(optarg, "%hhu:%hhu:%hhu",
+			   &cfg->llopts.mtu,
+			   &cfg->llopts.tx_dl,
+			   &cfg->llopts.tx_flags) != 3)
+			return -1;
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse the setup line of a client into cfg which is initialized with the
+ * command line defaults. Returns an error message for the client or NULL.
+ */
+static const char *parse_setup(char *line, struct isotp_config *cfg)
+{
+	char *tokv[SETUP_MAXTOKENS + 2];
+	int tokc = 0;
+	char *ptr;
 	int opt;
 
-	int sl, sa, sc; /* (L)isten, (A)ccept, (C)AN sockets */ 
-	struct sockaddr_in  saddr, clientaddr;
+	tokv[tokc++] = "isotpserver";
+	for (ptr = strtok(line, " \t\r\n"); ptr; ptr = strtok(NULL, " \t\r\n")) {
+		if (tokc > SETUP_MAXTOKENS)
+			return "too many options";
+		tokv[tokc++] = ptr;
+	}
+	tokv[tokc] = NULL;
+
+	/* restart getopt() for each setup line */
+	optind = 0;
+	opterr = 0;
+	while ((opt = getopt(tokc, tokv, ISOTP_OPTS)) != -1) {
+		if (opt == '?' || parse_isotp_opt(opt, optarg, cfg))
+			return "invalid option";
+	}
+
+	if (optind == tokc - 1) {
+		if (strlen(tokv[optind]) >= IFNAMSIZ)
+			return "invalid interface name";
+		strcpy(cfg->ifname, tokv[optind]);
+	} else if (optind != tokc) {
+		return "invalid arguments";
+	}
+
+	if (cfg->tx_id == NO_CAN_ID || cfg->rx_id == NO_CAN_ID || !cfg->ifname[0])
+		return "missing addressing";
+
+	return NULL;
+}
+
+static void set_events(struct evsrc *src, unsigned int events)
+{
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = src,
+	};
+
+	if (src->fd < 0 || src->events == events)
+		return;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, src->fd, &ev) < 0)
+		perror("epoll_ctl");
+
+	src->events = events;
+}
+
+/* enable the event sources that can make progress */
+static void session_update_events(struct session *s)
+{
+	unsigned int events = 0;
+
+	/* stop reading from TCP while a PDU waits for the isotp socket */
+	if (!s->pdu_pending)
+		events |= EPOLLIN | EPOLLRDHUP;
+	if (s->outlen)
+		events |= EPOLLOUT;
+
+	set_events(&s->tcp, events);
+
+	if (!s->active)
+		return;
+
+	events = 0;
+
+	/* stop reading from isotp while the TCP client does not read */
+	if (s->outlen <= TCP_TXBUF_SIZE - MAX_ASCII_LENGTH)
+		events |= EPOLLIN;
+	if (s->pdu_pending)
+		events |= EPOLLOUT;
+
+	set_events(&s->isotp, events);
+}
+
+static void print_session(struct session *s, const char *state)
+{
+	struct timespec now;
+	char addr[INET_ADDRSTRLEN];
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - s->start.tv_sec) +
+		(now.tv_nsec - s->start.tv_nsec) / 1000000000.0;
+
+	inet_ntop(AF_INET, &s->peer.sin_addr, addr, sizeof(addr));
+
+	fprintf(stderr, "%s:%u %s %s %X>%X: TCP>CAN %llu PDUs %llu bytes, "
+		"CAN>TCP %llu PDUs %llu bytes, %.1f s\n",
+		addr, ntohs(s->peer.sin_port), state,
+		s->active ? s->cfg.ifname : "-",
+		s->cfg.tx_id & CAN_EFF_MASK, s->cfg.rx_id & CAN_EFF_MASK,
+		s->tx_pdus, s->tx_bytes, s->rx_pdus, s->rx_bytes, secs);
+}
+
+static void session_close(struct session *s)
+{
+	struct session **pp;
+
+	if (s->closed)
+		return;
+
+	if (verbose)
+		print_session(s, "closed");
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, s->tcp.fd, NULL);
+	close(s->tcp.fd);
+
+	if (s->active) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, s->isotp.fd, NULL);
+		close(s->isotp.fd);
+	}
+
+	for (pp = &sessions; *pp != s; pp = &(*pp)->next)
+		;
+	*pp = s->next;
+
+	s->closed = 1;
+	s->next_closed = closed_sessions;
+	closed_sessions = s;
+}
+
+static void session_reply(struct session *s, const char *msg)
+{
+	int len = strlen(msg);
+
+	if (s->outoff + s->outlen + len > TCP_TXBUF_SIZE)
+		return;
+
+	memcpy(s->outbuf + s->outoff + s->outlen, msg, len);
+	s->outlen += len;
+}
+
+/* open the CAN_ISOTP socket of the session - returns an error message */
+static const char *session_setup(struct session *s)
+{
+	struct isotp_config *cfg = &s->cfg;
 	struct sockaddr_can caddr;
-	static struct can_isotp_options opts;
-	static struct can_isotp_fc_options fcopts;
-	static struct can_isotp_ll_options llopts;
-	socklen_t sin_size = sizeof(clientaddr);
-	socklen_t caddrlen = sizeof(caddr);
+	struct epoll_event ev;
+	int sc;
 
-	struct sigaction signalaction;
-	sigset_t sigset;
+	memset(&caddr, 0, sizeof(caddr));
+	caddr.can_family = AF_CAN;
+	caddr.can_addr.tp.tx_id = cfg->tx_id;
+	caddr.can_addr.tp.rx_id = cfg->rx_id;
+	caddr.can_ifindex = if_nametoindex(cfg->ifname);
+	if (!caddr.can_ifindex)
+		return "unknown interface";
 
-	fd_set readfds;
+	sc = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_ISOTP);
+	if (sc < 0)
+		return strerror(errno);
 
-	int i;
-	int nbytes;
+	setsockopt(sc, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &cfg->opts, sizeof(cfg->opts));
+	setsockopt(sc, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &cfg->fcopts, sizeof(cfg->fcopts));
 
-	int local_port = 0;
-	int verbose = 0;
+	if (cfg->llopts.tx_dl &&
+	    setsockopt(sc, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &cfg->llopts, sizeof(cfg->llopts)) < 0)
+		goto out_err;
 
-	int idx = 0; /* index in txmsg[] */
+	if (bind(sc, (struct sockaddr *)&caddr, sizeof(caddr)) < 0)
+		goto out_err;
 
-	unsigned char msg[MAX_PDU_LENGTH + 1];   /* isotp socket message buffer (4095 + test_for_too_long_byte)*/
-	char rxmsg[MAX_PDU_LENGTH * 2 + 4]; /* isotp->tcp ASCII message buffer (4095*2 + < > \n null) */
-	char txmsg[MAX_PDU_LENGTH * 2 + 3]; /* tcp->isotp ASCII message buffer (4095*2 + < > null) */
+	s->isotp.type = EV_ISOTP;
+	s->isotp.fd = sc;
+	s->isotp.session = s;
+	s->isotp.events = EPOLLIN;
 
-	/* mark missing mandatory commandline options as missing */
-	caddr.can_addr.tp.tx_id = caddr.can_addr.tp.rx_id = NO_CAN_ID;
+	ev.events = s->isotp.events;
+	ev.data.ptr = &s->isotp;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sc, &ev) < 0)
+		goto out_err;
 
-	while ((opt = getopt(argc, argv, "l:s:d:x:p:P:b:m:w:t:L:v?")) != -1) {
-		switch (opt) {
-		case 'l':
-			local_port = strtoul(optarg, NULL, 10);
-			break;
+	s->active = 1;
 
-		case 's':
-			caddr.can_addr.tp.tx_id = strtoul(optarg, NULL, 16);
-			if (strlen(optarg) > 7)
-				caddr.can_addr.tp.tx_id |= CAN_EFF_FLAG;
-			break;
+	return NULL;
 
-		case 'd':
-			caddr.can_addr.tp.rx_id = strtoul(optarg, NULL, 16);
-			if (strlen(optarg) > 7)
-				caddr.can_addr.tp.rx_id |= CAN_EFF_FLAG;
-			break;
+ out_err:
+	close(sc);
+	return strerror(errno);
+}
 
-		case 'x':
-		{
-			int elements = sscanf(optarg, "%hhx:%hhx",
-					      &opts.ext_address,
-					      &opts.rx_ext_address);
-
-			if (elements == 1)
-				opts.flags |= CAN_ISOTP_EXTEND_ADDR;
-			else if (elements == 2)
-				opts.flags |= (CAN_ISOTP_EXTEND_ADDR | CAN_ISOTP_RX_EXT_ADDR);
-			else {
-				printf("incorrect extended addr values '%s'.\n", optarg);
-				print_usage(basename(argv[0]));
-				exit(0);
-			}
+/* send the pending PDU from the parser to the isotp socket */
+static void session_send_pdu(struct session *s)
+{
+	int len = s->parser.nibbles >> 1;
+
+	if (send(s->isotp.fd, s->parser.pdu, len, 0) < 0) {
+		/* the isotp socket is still busy with the previous PDU */
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+
+		if (verbose)
+			perror("write to isotp socket");
+	} else {
+		s->tx_pdus++;
+		s->tx_bytes += len;
+	}
+
+	s->pdu_pending = 0;
+}
+
+/* forward all complete PDUs from the TCP input buffer */
+static void session_process_input(struct session *s)
+{
+	const unsigned char *ptr;
+	int len;
+
+	while (!s->pdu_pending && s->inoff < s->inlen) {
+		ptr = s->inbuf + s->inoff;
+		len = parse_pdu(&s->parser, &ptr, s->inbuf + s->inlen);
+		s->inoff = ptr - s->inbuf;
+
+		if (!len)
 			break;
+
+		if (verbose) {
+			char txmsg[MAX_ASCII_LENGTH];
+
+			printf("TCP>CAN %.*s",
+			       encode_pdu(txmsg, s->parser.pdu, len), txmsg);
 		}
 
-		case 'p':
-		{
-			int elements = sscanf(optarg, "%hhx:%hhx",
-					      &opts.txpad_content,
-					      &opts.rxpad_content);
-
-			if (elements == 1)
-				opts.flags |= CAN_ISOTP_TX_PADDING;
-			else if (elements == 2)
-				opts.flags |= (CAN_ISOTP_TX_PADDING | CAN_ISOTP_RX_PADDING);
-			else if (sscanf(optarg, ":%hhx", &opts.rxpad_content) == 1)
-				opts.flags |= CAN_ISOTP_RX_PADDING;
-			else {
-				printf("incorrect padding values '%s'.\n", optarg);
-				print_usage(basename(argv[0]));
-				exit(0);
-			}
-			break;
+		s->pdu_pending = 1;
+		session_send_pdu(s);
+	}
+
+	if (s->inoff == s->inlen)
+		s->inoff = s->inlen = 0;
+}
+
+/* handle the optional setup line - returns -1 when the session is closed */
+static int session_negotiate(struct session *s)
+{
+	const char *err;
+	char *ptr;
+	int i;
+
+	/* skip empty lines */
+	for (i = 0; i < s->inlen && strchr(" \t\r\n", s->inbuf[i]); i++)
+		;
+
+	if (i == s->inlen) {
+		s->inlen = 0;
+		return 0;
+	}
+
+	s->cfg = defcfg;
+
+	if (s->inbuf[i] == '<') {
+		/* no setup line => use the command line addressing */
+		err = have_defcfg ? NULL : "missing addressing";
+	} else {
+		ptr = memchr(s->inbuf + i, '\n', s->inlen - i);
+		if (!ptr) {
+			if (s->inlen < SETUP_MAXLEN)
+				return 0;
+			err = "setup line too long";
+		} else {
+			*ptr = 0;
+			s->inoff = ptr + 1 - (char *)s->inbuf;
+			err = parse_setup((char *)s->inbuf + i, &s->cfg);
 		}
+	}
 
-		case 'P':
-			if (optarg[0] == 'l')
-				opts.flags |= CAN_ISOTP_CHK_PAD_LEN;
-			else if (optarg[0] == 'c')
-				opts.flags |= CAN_ISOTP_CHK_PAD_DATA;
-			else if (optarg[0] == 'a')
-				opts.flags |= (CAN_ISOTP_CHK_PAD_LEN | CAN_ISOTP_CHK_PAD_DATA);
-			else {
-				printf("unknown padding check option '%c'.\n", optarg[0]);
-				print_usage(basename(argv[0]));
-				exit(0);
-			}
-			break;
+	if (!err)
+		err = session_setup(s);
 
-		case 'b':
-			fcopts.bs = strtoul(optarg, NULL, 16) & 0xFF;
-			break;
+	if (err) {
+		char addr[INET_ADDRSTRLEN];
 
-		case 'm':
-			fcopts.stmin = strtoul(optarg, NULL, 16) & 0xFF;
-			break;
+		inet_ntop(AF_INET, &s->peer.sin_addr, addr, sizeof(addr));
+		fprintf(stderr, "%s:%u: %s\n", addr, ntohs(s->peer.sin_port), err);
 
-		case 'w':
-			fcopts.wftmax = strtoul(optarg, NULL, 16) & 0xFF;
-			break;
+		/* best effort as the session is closed */
+		send(s->tcp.fd, "-ERR ", 5, MSG_DONTWAIT | MSG_NOSIGNAL);
+		send(s->tcp.fd, err, strlen(err), MSG_DONTWAIT | MSG_NOSIGNAL);
+		send(s->tcp.fd, "\n", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+		session_close(s);
+		return -1;
+	}
 
-		case 't':
-			opts.frame_txtime = strtoul(optarg, NULL, 10);
-			break;
+	if (s->inoff)
+		session_reply(s, "+OK\n");
 
-		case 'L':
-			if (sscanf(optarg, "%hhu:%hhu:%hhu",
-				   &llopts.mtu,
-				   &llopts.tx_dl,
-				   &llopts.tx_flags) != 3) {
-				printf("unknown link layer options '%s'.\n", optarg);
-				print_usage(basename(argv[0]));
-				exit(0);
+	if (verbose)
+		print_session(s, "opened");
+
+	return 0;
+}
+
+static void session_flush(struct session *s)
+{
+	ssize_t nbytes;
+
+	while (s->outlen) {
+		nbytes = send(s->tcp.fd, s->outbuf + s->outoff, s->outlen,
+			      MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				session_close(s);
+			return;
+		}
+
+		s->outoff += nbytes;
+		s->outlen -= nbytes;
+	}
+
+	s->outoff = 0;
+}
+
+static void tcp_event(struct session *s, unsigned int events)
+{
+	ssize_t nbytes;
+
+	if (events & EPOLLOUT) {
+		session_flush(s);
+		if (s->closed)
+			return;
+	}
+
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		session_close(s);
+		return;
+	}
+
+	if (events & (EPOLLIN | EPOLLRDHUP) && !s->pdu_pending) {
+		nbytes = recv(s->tcp.fd, s->inbuf + s->inlen,
+			      TCP_RXBUF_SIZE - s->inlen, MSG_DONTWAIT);
+		if (nbytes < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+
+		if (nbytes < 1) {
+			session_close(s);
+			return;
+		}
+
+		s->inlen += nbytes;
+
+		if (!s->active && session_negotiate(s))
+			return;
+
+		if (s->active)
+			session_process_input(s);
+	}
+
+	session_flush(s);
+	if (!s->closed)
+		session_update_events(s);
+}
+
+static void isotp_event(struct session *s, unsigned int events)
+{
+	unsigned char msg[MAX_PDU_LENGTH + 1]; /* + test_for_too_long_byte */
+	int nbytes;
+
+	/* ISO-TP protocol errors (e.g. timeouts) terminate the session */
+	if (events & EPOLLERR) {
+		if (verbose) {
+			socklen_t optlen = sizeof(nbytes);
+
+			getsockopt(s->isotp.fd, SOL_SOCKET, SO_ERROR, &nbytes, &optlen);
+			fprintf(stderr, "isotp socket: %s\n", strerror(nbytes));
+		}
+		session_close(s);
+		return;
+	}
+
+	if (events & EPOLLOUT && s->pdu_pending) {
+		session_send_pdu(s);
+		if (!s->pdu_pending)
+			session_process_input(s);
+	}
+
+	if (events & EPOLLIN) {
+		/* read all PDUs that fit into the TCP output buffer */
+		while (s->outlen <= TCP_TXBUF_SIZE - MAX_ASCII_LENGTH) {
+			nbytes = recv(s->isotp.fd, msg, sizeof(msg), MSG_DONTWAIT);
+			if (nbytes < 0 && errno == EAGAIN)
+				break;
+
+			if (nbytes < 1 || nbytes > MAX_PDU_LENGTH) {
+				if (verbose)
+					perror("read from isotp socket");
+				session_close(s);
+				return;
 			}
+
+			nbytes = encode_pdu(s->outbuf + s->outoff + s->outlen,
+					    msg, nbytes);
+
+			if (verbose)
+				printf("CAN>TCP %.*s", nbytes,
+				       s->outbuf + s->outoff + s->outlen);
+
+			s->outlen += nbytes;
+			s->rx_pdus++;
+			s->rx_bytes += (nbytes - 3) / 2;
+
+			/* make room at the end of the buffer */
+			if (s->outoff + s->outlen > TCP_TXBUF_SIZE - MAX_ASCII_LENGTH) {
+				memmove(s->outbuf, s->outbuf + s->outoff, s->outlen);
+				s->outoff = 0;
+			}
+		}
+	}
+
+	session_flush(s);
+	if (!s->closed)
+		session_update_events(s);
+}
+
+static void session_accept(int sl)
+{
+	struct sockaddr_in clientaddr;
+	socklen_t sin_size = sizeof(clientaddr);
+	struct epoll_event ev;
+	struct session *s;
+	int sa;
+
+	sa = accept4(sl, (struct sockaddr *)&clientaddr, &sin_size,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sa < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+			perror("accept");
+		return;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		perror("calloc");
+		close(sa);
+		return;
+	}
+
+	s->peer = clientaddr;
+	s->tcp.type = EV_TCP;
+	s->tcp.fd = sa;
+	s->tcp.session = s;
+	s->tcp.events = EPOLLIN | EPOLLRDHUP;
+	s->isotp.fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+
+	ev.events = s->tcp.events;
+	ev.data.ptr = &s->tcp;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sa, &ev) < 0) {
+		perror("epoll_ctl");
+		close(sa);
+		free(s);
+		return;
+	}
+
+	s->next = sessions;
+	sessions = s;
+}
+
+int main(int argc, char **argv)
+{
+	extern int optind, opterr, optopt;
+	int opt;
+
+	int sl; /* (L)isten socket */
+	struct sockaddr_in saddr;
+	struct epoll_event events[MAXEVENTS];
+	struct epoll_event ev;
+	struct evsrc listensrc;
+	struct session *s;
+
+	struct sigaction signalaction;
+	sigset_t sigset;
+
+	int nevents, i;
+
+	int local_port = 0;
+
+	/* mark missing mandatory commandline options as missing */
+	defcfg.tx_id = defcfg.rx_id = NO_CAN_ID;
+
+	while ((opt = getopt(argc, argv, "l:" ISOTP_OPTS "v?")) != -1) {
+		switch (opt) {
+		case 'l':
+			local_port = strtoul(optarg, NULL, 10);
 			break;
 
 		case 'v':
@@ -270,27 +928,50 @@ int main(int argc, char **argv)
 			break;
 
 		default:
-			fprintf(stderr, "Unknown option %c\n", opt);
-			print_usage(basename(argv[0]));
-			exit(1);
+			if (parse_isotp_opt(opt, optarg, &defcfg)) {
+				printf("incorrect value '%s' for option '%c'.\n",
+				       optarg, opt);
+				print_usage(basename(argv[0]));
+				exit(0);
+			}
 			break;
 		}
 	}
 
-	if ((argc - optind != 1) || (local_port == 0) ||
-	    (caddr.can_addr.tp.tx_id == NO_CAN_ID) ||
-	    (caddr.can_addr.tp.rx_id == NO_CAN_ID)) {
+	if (argc - optind == 1) {
+		if (strlen(argv[optind]) >= IFNAMSIZ) {
+			printf("name of CAN device '%s' is too long!\n", argv[optind]);
+			return 1;
+		}
+		strcpy(defcfg.ifname, argv[optind]);
+	}
+
+	have_defcfg = defcfg.ifname[0] && defcfg.tx_id != NO_CAN_ID &&
+		defcfg.rx_id != NO_CAN_ID;
+
+	/* the default addressing is optional but needs to be complete */
+	if ((argc - optind > 1) || (local_port == 0) ||
+	    (!have_defcfg && (defcfg.ifname[0] || defcfg.tx_id != NO_CAN_ID ||
+			      defcfg.rx_id != NO_CAN_ID))) {
 		print_usage(basename(argv[0]));
 		exit(1);
 	}
-  
+
+	init_hexval();
+
 	sigemptyset(&sigset);
-	signalaction.sa_handler = &childdied;
+	signalaction.sa_handler = &sigusr1;
 	signalaction.sa_mask = sigset;
 	signalaction.sa_flags = 0;
-	sigaction(SIGCHLD, &signalaction, NULL);  /* signal for dying child */
+	sigaction(SIGUSR1, &signalaction, NULL);  /* print session counters */
 
-	if((sl = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	if((sl = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
 		perror("inetsocket");
 		exit(1);
 	}
@@ -309,133 +990,66 @@ int main(int argc, char **argv)
 		nanosleep(&f, NULL);
 	}
 
-	if (listen(sl, 3) != 0) {
+	if (listen(sl, 32) != 0) {
 		perror("listen");
 		exit(1);
 	}
 
-	while (1) { 
-		sa = accept(sl,(struct sockaddr *)&clientaddr, &sin_size);
-		if (sa > 0 ){
-			if (!fork())
-				break;
-			close(sa);
-		}
-		else {
-			if (errno != EINTR) {
-				/*
-				 * If the cause for the error was NOT the
-				 * signal from a dying child => give an error
-				 */
-				perror("accept");
-				exit(1);
-			}
-		}
-	}
-
-	if ((sc = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP)) < 0) {
-		perror("socket");
-		exit(1);
-	}
-
-	setsockopt(sc, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts));
-	setsockopt(sc, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fcopts, sizeof(fcopts));
-
-	if (llopts.tx_dl) {
-		if (setsockopt(sc, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &llopts, sizeof(llopts)) < 0) {
-			perror("link layer sockopt");
-			exit(1);
-		}
-	}
-
-	caddr.can_family = AF_CAN;
-	caddr.can_ifindex = if_nametoindex(argv[optind]);
-	if (!caddr.can_ifindex) {
-		perror("if_nametoindex");
-		exit(1);
-	}
-
-	if (bind(sc, (struct sockaddr *)&caddr, caddrlen) < 0) {
-		perror("bind");
+	listensrc.type = EV_LISTEN;
+	listensrc.fd = sl;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listensrc;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sl, &ev) < 0) {
+		perror("epoll_ctl");
 		exit(1);
 	}
 
 	while (1) {
 
-		FD_ZERO(&readfds);
-		FD_SET(sc, &readfds);
-		FD_SET(sa, &readfds);
-
-		select((sc > sa)?sc+1:sa+1, &readfds, NULL, NULL, NULL);
-
-		if (FD_ISSET(sc, &readfds)) {
-
-
-			nbytes = read(sc, &msg, MAX_PDU_LENGTH + 1);
-
-			if (nbytes < 1 || nbytes > MAX_PDU_LENGTH) {
-				perror("read from isotp socket");
-				exit(1);
+		nevents = epoll_wait(epfd, events, MAXEVENTS, -1);
+		if (nevents < 0) {
+			if (errno != EINTR) {
+				perror("epoll_wait");
+				break;
 			}
-
-			rxmsg[0] = '<';
-
-			for ( i = 0; i < nbytes; i++)
-				sprintf(rxmsg + 1 + 2*i, "%02X", msg[i]);
-
-			/* finalize string for sending */
-			strcat(rxmsg, ">\n");
-
-			if (verbose)
-				printf("CAN>TCP %s", rxmsg);
-
-			send(sa, rxmsg, strlen(rxmsg), 0);
+			nevents = 0;
 		}
 
+		if (dump_stats) {
+			dump_stats = 0;
+			for (s = sessions; s; s = s->next)
+				print_session(s, s->active ? "active" : "setup");
+		}
 
-		if (FD_ISSET(sa, &readfds)) {
-
-			if (read(sa, txmsg+idx, 1) < 1) {
-				perror("read from tcp/ip socket");
-				exit(1);
-			}
-
-			if (!idx) {
-				if (txmsg[0] == '<')
-					idx = 1;
-
-				continue;
-			}
-
-			/* max len is 4095*2 + '<' + '>' = 8192. The buffer index starts with 0 */
-			if (idx > MAX_PDU_LENGTH * 2 + 1) {
-				idx = 0;
-				continue;
-			}
+		for (i = 0; i < nevents; i++) {
+			struct evsrc *src = events[i].data.ptr;
 
-			if (txmsg[idx] != '>') {
-				idx++;
+			if (src->type == EV_LISTEN) {
+				session_accept(src->fd);
 				continue;
 			}
 
-			txmsg[idx+1] = 0;
-			idx = 0;
-
-			/* must be an even number of bytes and at least one data byte <XX> */
-			if (strlen(txmsg) < 4 || strlen(txmsg) % 2)
+			if (src->session->closed)
 				continue;
 
-			if (verbose)
-				printf("TCP>CAN %s\n", txmsg);
+			if (src->type == EV_TCP)
+				tcp_event(src->session, events[i].events);
+			else
+				isotp_event(src->session, events[i].events);
+		}
 
-			nbytes = (strlen(txmsg)-2)/2;
-			if (b64hex(txmsg+1, msg, nbytes) == 0)
-				send(sc, msg, nbytes, 0);
+		while (closed_sessions) {
+			s = closed_sessions;
+			closed_sessions = s->next_closed;
+			free(s);
 		}
 	}
 
-	close(sc);
-	close(sa);
+	while (sessions)
+		session_close(sessions);
+
+	close(sl);
+	close(epfd);
 
 	return 0;
 }
@@ -43,6 +43,7 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,12 +56,17 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "isotpreasm.h"
 #include "terminal.h"
 #include <linux/can.h>
 #include <linux/can/isotp.h>
+#include <linux/can/raw.h>
 #include <linux/sockios.h>
 
 #define NO_CAN_ID 0xFFFFFFFFU
+#define MAXPAIRS 1024
+#define BATCH 64 /* CAN frames per recvmmsg() */
+#define EXPIRE_USECS 100000 /* check for timed out transfers */
 
 #define FORMAT_HEX 1
 #define FORMAT_ASCII 2
@@ -79,13 +85,20 @@ void print_usage(char *prg)
 	fprintf(stderr, "         -f <format>  (1 = HEX, 2 = ASCII, 3 = HEX & ASCII - default: %d)\n", FORMAT_DEFAULT);
 	fprintf(stderr, "         -L           (set link layer options for CAN FD)\n");
 	fprintf(stderr, "         -h <len>     (head: print only first <len> bytes)\n");
+	fprintf(stderr, "         -P <pairs>   (monitor many channels: <src>[-<srcmax>]:<dst>[,...])\n");
+	fprintf(stderr, "         -T <ms>      (-P timeout between frames of a PDU - default: 1000)\n");
 	fprintf(stderr, "\nCAN IDs and addresses are given and expected in hexadecimal values.\n");
+	fprintf(stderr, "\nWith -P the PDUs of all pairs are reassembled in userspace from a single\n");
+	fprintf(stderr, "CAN_RAW socket and printed with the transfer time from the FF to the last CF\n");
+	fprintf(stderr, "and the time waited for FC frames. A range <src>-<srcmax>:<dst> pairs the\n");
+	fprintf(stderr, "IDs src+n with dst+n. -x enables extended addressing without an address\n");
+	fprintf(stderr, "check, -s/-d/-X/-L are not used. Example: -P 7E0-7E7:7E8,18DA10F1:18DAF110\n");
 	fprintf(stderr, "\n");
 }
 
 void printbuf(unsigned char *buffer, int nbytes, int color, int timestamp,
 	      int format, struct timeval *tv, struct timeval *last_tv,
-	      canid_t src, int socket, char *candevice, int head)
+	      canid_t src, char *candevice, int head, const char *info)
 {
 	int i;
 
@@ -96,8 +109,6 @@ void printbuf(unsigned char *buffer, int nbytes, int color, int timestamp,
 		printf("%s", FGBLUE);
 
 	if (timestamp) {
-		ioctl(socket, SIOCGSTAMP, tv);
-
 		switch (timestamp) {
 
 		case 'a': /* absolute with timestamp */
@@ -141,7 +152,10 @@ void printbuf(unsigned char *buffer, int nbytes, int color, int timestamp,
 	}
 
 	/* the source socket gets pdu data from the destination id */
-	printf(" %s  %03X  [%d]  ", candevice, src & CAN_EFF_MASK, nbytes);
+	if (src & CAN_EFF_FLAG)
+		printf(" %s  %8X  [%d]  ", candevice, src & CAN_EFF_MASK, nbytes);
+	else
+		printf(" %s  %03X  [%d]  ", candevice, src & CAN_SFF_MASK, nbytes);
 	if (format & FORMAT_HEX) {
 		for (i=0; i<nbytes; i++) {
 			printf("%02X ", buffer[i]);
@@ -168,6 +182,9 @@ void printbuf(unsigned char *buffer, int nbytes, int color, int timestamp,
 			printf(" ... ");
 	}
 
+	if (info)
+		printf("  %s", info);
+
 	if (color)
 		printf("%s", ATTRESET);
 
@@ -175,6 +192,243 @@ void printbuf(unsigned char *buffer, int nbytes, int color, int timestamp,
 	fflush(stdout);
 }
 
+static canid_t pair_src[MAXPAIRS];
+static canid_t pair_dst[MAXPAIRS];
+static int npairs;
+
+/* parse a hex CAN ID - more than 7 digits select an extended ID */
+static int parse_canid(const char *p, char **end, canid_t *id)
+{
+	*id = strtoul(p, end, 16);
+	if (*end == p)
+		return -1;
+
+	if (*end - p > 7)
+		*id |= CAN_EFF_FLAG;
+
+	return 0;
+}
+
+/* <src>[-<srcmax>]:<dst>[,...] */
+static int parse_pairs(char *arg)
+{
+	canid_t src, srcmax, dst;
+	char *p = arg, *end;
+
+	do {
+		if (parse_canid(p, &end, &src))
+			return -1;
+
+		srcmax = src;
+		if (*end == '-' && parse_canid(end + 1, &end, &srcmax))
+			return -1;
+
+		if (*end != ':' || parse_canid(end + 1, &end, &dst))
+			return -1;
+
+		if (*end && *end != ',')
+			return -1;
+
+		if (srcmax < src || srcmax - src >= (canid_t)(MAXPAIRS - npairs)) {
+			fprintf(stderr, "too many ISO-TP channels (max %d)\n", MAXPAIRS);
+			return -1;
+		}
+
+		for (; src <= srcmax; src++, dst++) {
+			pair_src[npairs] = src;
+			pair_dst[npairs] = dst;
+			npairs++;
+		}
+
+		p = end + 1;
+	} while (*end);
+
+	return 0;
+}
+
+static void print_pdu(struct isotp_rx_chan *chan, int color, int timestamp,
+		      int format, struct timeval *last_tv, char *candevice, int head)
+{
+	struct timeval tv = chan->last;
+	char info[80];
+
+	if (chan->cfs) {
+		snprintf(info, sizeof(info), "(%u CF in %.3f ms, %u FC after %.3f ms)",
+			 chan->cfs, isotp_rx_usecs(&chan->first, &chan->last) / 1000.0,
+			 chan->fcs, chan->fc_wait / 1000.0);
+	}
+
+	printbuf(chan->buf, chan->len, color ? chan->user : 0, timestamp,
+		 format, &tv, last_tv, chan->id, candevice, head,
+		 chan->cfs ? info : NULL);
+}
+
+static void print_error(struct isotp_rx_chan *chan, char *candevice)
+{
+	if (chan->id & CAN_EFF_FLAG)
+		printf(" %s  %8X", candevice, chan->id & CAN_EFF_MASK);
+	else
+		printf(" %s  %03X", candevice, chan->id & CAN_SFF_MASK);
+	printf("  [%u/%u]  ISO-TP error: %s\n", chan->rcvd, chan->len, chan->err);
+	fflush(stdout);
+}
+
+/* reassemble the PDUs of all pairs from one CAN_RAW socket */
+static int sniff_pairs(char *candevice, int ext, unsigned long timeout,
+		       int color, int timestamp, int format, int head)
+{
+	static struct canfd_frame frames[BATCH];
+	static char ctrl[BATCH][CMSG_SPACE(sizeof(struct timeval))];
+	struct mmsghdr msgs[BATCH];
+	struct iovec iov[BATCH];
+	struct isotp_rx_table tab;
+	struct isotp_rx_chan *chan;
+	struct can_filter *rfilter;
+	struct sockaddr_can addr = { 0 };
+	struct timeval tv, now, last_tv = { 0 }, last_expire = { 0 };
+	struct cmsghdr *cmsg;
+	fd_set rdfs;
+	int canfd_on = 1, one = 1;
+	int s, i, n, ev;
+	int r = 1;
+
+	if (isotp_rx_init(&tab, 2 * npairs, ext)) {
+		perror("isotp_rx_init");
+		return 1;
+	}
+	tab.timeout = timeout * 1000;
+
+	rfilter = calloc(2 * npairs, sizeof(*rfilter));
+	if (!rfilter) {
+		perror("calloc");
+		goto out_tab;
+	}
+
+	for (i = 0; i < npairs; i++) {
+		chan = isotp_rx_add(&tab, pair_src[i], pair_dst[i]);
+		chan->user = 1;
+		chan = isotp_rx_add(&tab, pair_dst[i], pair_src[i]);
+		chan->user = 2;
+
+		rfilter[2 * i].can_id = pair_src[i];
+		rfilter[2 * i + 1].can_id = pair_dst[i];
+	}
+
+	for (i = 0; i < 2 * npairs; i++) {
+		if (rfilter[i].can_id & CAN_EFF_FLAG)
+			rfilter[i].can_mask = CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+		else
+			rfilter[i].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+	}
+
+	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (s < 0) {
+		perror("socket");
+		goto out_filter;
+	}
+
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &canfd_on, sizeof(canfd_on));
+
+	/* too many filters for the kernel are checked by the channel lookup */
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, rfilter, 2 * npairs * sizeof(*rfilter));
+
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof(one)) < 0) {
+		perror("setsockopt SO_TIMESTAMP");
+		goto out_sock;
+	}
+
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = if_nametoindex(candevice);
+	if (!addr.can_ifindex) {
+		perror("if_nametoindex");
+		goto out_sock;
+	}
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		goto out_sock;
+	}
+
+	for (i = 0; i < BATCH; i++) {
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = sizeof(frames[i]);
+		memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (1) {
+		struct timeval timeo = { 0, EXPIRE_USECS };
+
+		FD_ZERO(&rdfs);
+		FD_SET(s, &rdfs);
+		FD_SET(0, &rdfs);
+
+		if (select(s + 1, &rdfs, NULL, NULL, &timeo) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("select");
+			goto out_sock;
+		}
+
+		if (FD_ISSET(0, &rdfs)) {
+			getchar();
+			printf("quit due to keyboard input.\n");
+			break;
+		}
+
+		if (FD_ISSET(s, &rdfs)) {
+			for (i = 0; i < BATCH; i++) {
+				msgs[i].msg_hdr.msg_control = ctrl[i];
+				msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+			}
+
+			n = recvmmsg(s, msgs, BATCH, MSG_DONTWAIT, NULL);
+			if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("recvmmsg");
+				goto out_sock;
+			}
+
+			for (i = 0; i < n; i++) {
+				if (msgs[i].msg_len != CAN_MTU && msgs[i].msg_len != CANFD_MTU)
+					continue;
+
+				gettimeofday(&tv, NULL);
+				for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg;
+				     cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+					if (cmsg->cmsg_level == SOL_SOCKET &&
+					    cmsg->cmsg_type == SO_TIMESTAMP)
+						memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+				}
+
+				ev = isotp_rx_frame(&tab, &frames[i], &tv, &chan);
+				if (ev & ISOTP_RX_ERROR)
+					print_error(chan, candevice);
+				if (ev & ISOTP_RX_PDU)
+					print_pdu(chan, color, timestamp, format,
+						  &last_tv, candevice, head);
+			}
+		}
+
+		gettimeofday(&now, NULL);
+		if (isotp_rx_usecs(&last_expire, &now) >= EXPIRE_USECS) {
+			while ((chan = isotp_rx_expire(&tab, &now)))
+				print_error(chan, candevice);
+			last_expire = now;
+		}
+	}
+
+	r = 0;
+ out_sock:
+	close(s);
+ out_filter:
+	free(rfilter);
+ out_tab:
+	isotp_rx_free(&tab);
+
+	return r;
+}
+
 int main(int argc, char **argv)
 {
 	fd_set rdfs;
@@ -193,11 +447,12 @@ int main(int argc, char **argv)
 	canid_t dst = NO_CAN_ID;
 	extern int optind, opterr, optopt;
 	static struct timeval tv, last_tv;
+	unsigned long timeout = 1000;
 
 	unsigned char buffer[4096];
 	int nbytes;
 
-	while ((opt = getopt(argc, argv, "s:d:x:X:h:ct:f:L?")) != -1) {
+	while ((opt = getopt(argc, argv, "s:d:x:X:h:ct:f:LP:T:?")) != -1) {
 		switch (opt) {
 		case 's':
 			src = strtoul(optarg, NULL, 16);
@@ -235,6 +490,19 @@ int main(int argc, char **argv)
 			head = atoi(optarg);
 			break;
 
+		case 'P':
+			if (parse_pairs(optarg)) {
+				fprintf(stderr, "invalid ISO-TP channel list '%s'\n", optarg);
+				print_usage(basename(argv[0]));
+				r = 1;
+				goto out;
+			}
+			break;
+
+		case 'T':
+			timeout = strtoul(optarg, NULL, 10);
+			break;
+
 		case 'c':
 			color = 1;
 			break;
@@ -260,6 +528,12 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (npairs && (argc - optind) == 1) {
+		r = sniff_pairs(argv[optind], !!(opts.flags & CAN_ISOTP_EXTEND_ADDR),
+				timeout, color, timestamp, format, head);
+		goto out;
+	}
+
 	if ((argc - optind) != 1 || src == NO_CAN_ID || dst == NO_CAN_ID) {
 		print_usage(basename(argv[0]));
 		r = 1;
@@ -377,8 +651,10 @@ int main(int argc, char **argv)
 				r = 1;
 				goto out;
 			}
+			if (timestamp)
+				ioctl(s, SIOCGSTAMP, &tv);
 			printbuf(buffer, nbytes, color?2:0, timestamp, format,
-				 &tv, &last_tv, dst, s, if_name, head);
+				 &tv, &last_tv, dst, if_name, head, NULL);
 		}
 
 		if (FD_ISSET(t, &rdfs)) {
@@ -392,8 +668,10 @@ int main(int argc, char **argv)
 				r = 1;
 				goto out;
 			}
+			if (timestamp)
+				ioctl(t, SIOCGSTAMP, &tv);
 			printbuf(buffer, nbytes, color?1:0, timestamp, format,
-				 &tv, &last_tv, src, t, if_name, head);
+				 &tv, &last_tv, src, if_name, head, NULL);
 		}
 	}
 
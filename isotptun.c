@@ -51,15 +51,20 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <net/if.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -75,11 +80,69 @@
 #define DEFAULT_NAME "ctun%d"
 
 /* stay on 4095 bytes for the max. PDU length which is still much more than the standard ethernet MTU */
-#define MAX_PDU_LENGTH 4095
-#define BUF_LEN (MAX_PDU_LENGTH + 1)
+#define DEFAULT_PDU_LENGTH 4095
+
+/* max. IP packet size - needs the ISO 15765-2:2016 32 bit FF_DL */
+#define MAX_PDU_LENGTH 65535
+
+#define MAX_QUEUES 16
+
+enum {
+	EV_STOP,
+	EV_TUN,
+	EV_ISOTP,
+};
+
+struct tun_stats {
+	/* tun -> isotp */
+	unsigned long long tx_packets;
+	unsigned long long tx_bytes;
+	unsigned long long tx_pdu_bytes; /* after header compression */
+	unsigned long long tx_dropped;
+	unsigned long long tx_lat_sum; /* usecs from tun read to isotp send */
+	unsigned long long tx_lat_max;
+	/* isotp -> tun */
+	unsigned long long rx_packets;
+	unsigned long long rx_bytes;
+	unsigned long long rx_pdu_bytes;
+	unsigned long long rx_dropped;
+};
+
+struct hc_state;
+
+/* one tun queue with its ISO-TP channel served by one thread */
+struct channel {
+	int idx;
+	int s; /* isotp socket */
+	int t; /* tun queue fd */
+	int ep;
+	pthread_t thread;
+	unsigned char *txbuf; /* tun -> isotp */
+	unsigned char *rxbuf; /* isotp -> tun */
+	unsigned char *hctxbuf; /* compressed tx PDU */
+	unsigned char *hcrxbuf; /* decompressed rx packet */
+	struct hc_state *hc; /* header compression enabled */
+	unsigned char *txpdu; /* txbuf, hcbuf or control message */
+	unsigned char ctrl[4];
+	int txlen;
+	int txiplen; /* length of the IP packet in txpdu */
+	int tx_pending; /* txpdu waits for the isotp socket */
+	struct timespec txstamp;
+	unsigned int isotp_events;
+	struct tun_stats stats; /* written by the channel thread only */
+};
 
 static volatile int running = 1;
 static volatile sig_atomic_t signal_num;
+static volatile sig_atomic_t show_stats;
+
+static struct channel channels[MAX_QUEUES];
+static int nchannels = 1;
+static int max_pdu = DEFAULT_PDU_LENGTH;
+static int stopfd;
+static struct timespec stats_ts;
+static int verbose;
+static int fatal;
 
 static void fake_syslog(int priority, const char *format, ...)
 {
@@ -119,12 +182,23 @@ void print_usage(char *prg)
 	fprintf(stderr, "         -b <bs>       (blocksize. 0 = off)\n");
 	fprintf(stderr, "         -m <val>      (STmin in ms/ns. See spec.)\n");
 	fprintf(stderr, "         -w <num>      (max. wait frame transmissions.)\n");
+	fprintf(stderr, "         -M <len>      (max. PDU length and MTU of the netdevice. Default: %d)\n", DEFAULT_PDU_LENGTH);
+	fprintf(stderr, "         -q <num>      (number of tun queues / ISO-TP channels. Default: 1)\n");
+	fprintf(stderr, "         -S <secs>     (print throughput and latency counters every <secs>)\n");
+	fprintf(stderr, "         -z            (enable IP/UDP/TCP header compression if the peer supports it)\n");
+	fprintf(stderr, "         -B <secs>[:<payload>]  (benchmark header compression on the CAN interface)\n");
 	fprintf(stderr, "         -D            (daemonize to background when tun device created)\n");
 	fprintf(stderr, "         -h            (half duplex mode.)\n");
 	fprintf(stderr, "         -v            (verbose mode. Print symbols for tunneled msgs.)\n");
 	fprintf(stderr, "\nCAN IDs and addresses are given and expected in hexadecimal values.\n");
 	fprintf(stderr, "Use e.g. 'ifconfig ctun0 123.123.123.1 pointopoint 123.123.123.2 up'\n");
 	fprintf(stderr, "to create a point-to-point IP connection on CAN.\n");
+	fprintf(stderr, "\nWith '-q <num>' the tun device is created with multiple queues and the\n");
+	fprintf(stderr, "ISO-TP channel of queue n uses the CAN IDs <can_id> + n on both sides.\n");
+	fprintf(stderr, "PDUs above 4095 bytes need the isotp module parameter 'max_pdu_size'.\n");
+	fprintf(stderr, "The counters are also printed on SIGUSR1.\n");
+	fprintf(stderr, "\nThe benchmark sends synthetic UDP/TCP packets with <payload> bytes\n");
+	fprintf(stderr, "(default: 32) from <can_id> to <can_id> on e.g. a vcan interface.\n");
 	fprintf(stderr, "\n");
 }
 
@@ -134,26 +208,1143 @@ void sigterm(int signo)
 	signal_num = signo;
 }
 
+void sigusr1(int signo)
+{
+	show_stats = 1;
+}
+
+static unsigned long long elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000ULL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void print_stats(void)
+{
+	static struct tun_stats last[MAX_QUEUES];
+	struct tun_stats cur;
+	unsigned long long us;
+	double secs;
+	int i;
+
+	us = elapsed_us(&stats_ts);
+	clock_gettime(CLOCK_MONOTONIC, &stats_ts);
+	secs = us / 1000000.0;
+
+	for (i = 0; i < nchannels; i++) {
+		/* read unlocked - the counters are only used for this output */
+		cur = channels[i].stats;
+
+		syslogger(LOG_INFO,
+			  "queue %d: tx %llu pkts %llu bytes (%llu PDU bytes) %llu dropped %.0f B/s lat avg %llu max %llu us, "
+			  "rx %llu pkts %llu bytes (%llu PDU bytes) %llu dropped %.0f B/s",
+			  i, cur.tx_packets, cur.tx_bytes, cur.tx_pdu_bytes,
+			  cur.tx_dropped, (cur.tx_bytes - last[i].tx_bytes) / secs,
+			  cur.tx_packets ? cur.tx_lat_sum / cur.tx_packets : 0,
+			  cur.tx_lat_max,
+			  cur.rx_packets, cur.rx_bytes, cur.rx_pdu_bytes,
+			  cur.rx_dropped, (cur.rx_bytes - last[i].rx_bytes) / secs);
+
+		last[i] = cur;
+	}
+}
+
+/*
+ * Header compression for IP over ISO-TP
+ *
+ * IPv4 (without options and fragmentation) and IPv6 (without extension
+ * headers) packets with UDP or TCP are replaced by a compressed PDU that
+ * refers to a per flow context. The first byte of a tunneled PDU is the
+ * IP version nibble for uncompressed packets (0x4X/0x6X) or one of the
+ * HC_* types:
+ *
+ * HC_HELLO <version> <flags>        compression supported (HC_HELLO_REQ: please answer)
+ * HC_IR    <cid> <msn> <ip packet>  initialize/refresh context cid
+ * HC_CO    <cid> <msn> <mask> [fields] <l4 checksum> <payload>
+ * HC_NACK  <cid>                    context cid is unknown or out of sync
+ *
+ * A CO packet contains the IPv4 ID when it is not incremented by one and
+ * the TCP fields selected by the mask. Sequence and ack numbers are sent
+ * as variable length deltas. The lengths and the IPv4 header checksum are
+ * reconstructed by the decompressor. The message sequence number (msn)
+ * detects lost packets which would break the delta decoding. In this case
+ * the decompressor sends a NACK and the compressor sends an IR. Contexts
+ * are also refreshed every HC_REFRESH_PKTS packets or HC_REFRESH_MS.
+ */
+#define HC_HELLO 0xF0
+#define HC_IR 0xF1
+#define HC_CO 0xF2
+#define HC_NACK 0xF3
+
+#define HC_VERSION 1
+#define HC_HELLO_REQ 0x01
+
+/* CO field mask */
+#define HC_IPID 0x01
+#define HC_SEQ 0x02
+#define HC_ACK 0x04
+#define HC_FLAGS 0x08
+#define HC_WIN 0x10
+#define HC_URG 0x20
+#define HC_OPTS 0x40
+
+#define HC_MAX_CTX 16
+#define HC_MAXHDR (40 + 60) /* IPv6 + TCP with options */
+#define HC_IR_OVERHEAD 3
+#define HC_REFRESH_PKTS 64
+#define HC_REFRESH_MS 2000
+#define HC_HELLO_MS 1000
+
+struct hc_ctx {
+	int valid;
+	int resync;	/* compressor: NACK received, decompressor: NACK sent */
+	unsigned char hdr[HC_MAXHDR]; /* headers of the last packet */
+	int iphlen;
+	int l4hlen;
+	int proto;
+	unsigned char msn;
+	unsigned int count;	/* packets since the last IR */
+	struct timespec refresh; /* time of the last IR */
+	unsigned long lru;
+};
+
+struct hc_state {
+	int peer;		/* the peer decompresses our packets */
+	int hello_pending;	/* send a HELLO with hello_flags */
+	unsigned char hello_flags;
+	unsigned int nacks;	/* bitmask of cids to send a NACK for */
+	unsigned long lru_clock;
+	struct hc_ctx comp[HC_MAX_CTX];
+	struct hc_ctx decomp[HC_MAX_CTX];
+};
+
+static inline int get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline void put16(unsigned char *p, unsigned int val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+}
+
+static inline __u32 get32(const unsigned char *p)
+{
+	return ((__u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void put32(unsigned char *p, __u32 val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static unsigned char *put_varint(unsigned char *p, __u32 val)
+{
+	while (val >= 0x80) {
+		*p++ = val | 0x80;
+		val >>= 7;
+	}
+	*p++ = val;
+
+	return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p,
+				       const unsigned char *end, __u32 *val)
+{
+	int shift;
+
+	*val = 0;
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		*val |= (__u32)(*p & 0x7F) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+
+	return NULL;
+}
+
+static void ipv4_checksum(unsigned char *hdr)
+{
+	__u32 sum = 0;
+	int i;
+
+	put16(hdr + 10, 0);
+	for (i = 0; i < 20; i += 2)
+		sum += get16(hdr + i);
+
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+
+	put16(hdr + 10, ~sum & 0xFFFF);
+}
+
+/* check if the packet can be compressed and get its header lengths */
+static int hc_parse(const unsigned char *pkt, int len, struct hc_ctx *h)
+{
+	const unsigned char *l4;
+
+	if (len < 20)
+		return -1;
+
+	switch (pkt[0] >> 4) {
+	case 4:
+		/* no options, no fragments */
+		if (pkt[0] != 0x45 || get16(pkt + 2) != len ||
+		    get16(pkt + 6) & 0x3FFF)
+			return -1;
+		h->iphlen = 20;
+		h->proto = pkt[9];
+		break;
+
+	case 6:
+		if (len < 40 || get16(pkt + 4) + 40 != len)
+			return -1;
+		h->iphlen = 40;
+		h->proto = pkt[6];
+		break;
+
+	default:
+		return -1;
+	}
+
+	l4 = pkt + h->iphlen;
+
+	switch (h->proto) {
+	case IPPROTO_UDP:
+		if (len < h->iphlen + 8 || get16(l4 + 4) != len - h->iphlen)
+			return -1;
+		h->l4hlen = 8;
+		break;
+
+	case IPPROTO_TCP:
+		if (len < h->iphlen + 20)
+			return -1;
+		h->l4hlen = (l4[12] >> 4) * 4;
+		if (h->l4hlen < 20 || len < h->iphlen + h->l4hlen)
+			return -1;
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/* compare the fields which do not change within a flow */
+static int hc_same_flow(const struct hc_ctx *ctx, const unsigned char *pkt,
+			const struct hc_ctx *h)
+{
+	const unsigned char *hdr = ctx->hdr;
+
+	if (ctx->iphlen != h->iphlen || ctx->proto != h->proto)
+		return 0;
+
+	if (h->iphlen == 20) {
+		/* version, TOS, flags, TTL, protocol, addresses */
+		if (memcmp(hdr, pkt, 2) || memcmp(hdr + 6, pkt + 6, 4) ||
+		    memcmp(hdr + 12, pkt + 12, 8))
+			return 0;
+	} else {
+		/* version, traffic class, flow label, next header, hop limit, addresses */
+		if (memcmp(hdr, pkt, 4) || memcmp(hdr + 6, pkt + 6, 34))
+			return 0;
+	}
+
+	/* ports */
+	return !memcmp(hdr + h->iphlen, pkt + h->iphlen, 4);
+}
+
+static void hc_init(struct hc_state *hc)
+{
+	memset(hc, 0, sizeof(*hc));
+	hc->hello_pending = 1;
+	hc->hello_flags = HC_HELLO_REQ;
+}
+
+/* get the next control message to send - returns its length or 0 */
+static int hc_control(struct hc_state *hc, unsigned char *buf)
+{
+	int cid;
+
+	if (hc->hello_pending) {
+		buf[0] = HC_HELLO;
+		buf[1] = HC_VERSION;
+		buf[2] = hc->hello_flags;
+		hc->hello_pending = 0;
+		return 3;
+	}
+
+	for (cid = 0; cid < HC_MAX_CTX; cid++) {
+		if (hc->nacks & (1U << cid)) {
+			hc->nacks &= ~(1U << cid);
+			buf[0] = HC_NACK;
+			buf[1] = cid;
+			return 2;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Compress the IP packet into out which provides outsize bytes. Returns
+ * the length of the compressed PDU or 0 when the packet has to be sent
+ * uncompressed.
+ */
+static int hc_compress(struct hc_state *hc, const unsigned char *pkt, int len,
+		       unsigned char *out, int outsize)
+{
+	struct hc_ctx h, *ctx = NULL;
+	const unsigned char *l4, *cl4;
+	unsigned char *p, *maskp;
+	unsigned char mask = 0;
+	int hdrlen, cid;
+
+	if (!hc->peer || hc_parse(pkt, len, &h))
+		return 0;
+
+	hdrlen = h.iphlen + h.l4hlen;
+
+	for (cid = 0; cid < HC_MAX_CTX; cid++) {
+		if (hc->comp[cid].valid && hc_same_flow(&hc->comp[cid], pkt, &h)) {
+			ctx = &hc->comp[cid];
+			break;
+		}
+	}
+
+	if (!ctx) {
+		/* replace the least recently used context */
+		ctx = &hc->comp[0];
+		for (cid = 1; cid < HC_MAX_CTX; cid++) {
+			if (hc->comp[cid].lru < ctx->lru)
+				ctx = &hc->comp[cid];
+		}
+		ctx->valid = 0;
+	}
+
+	cid = ctx - hc->comp;
+	ctx->lru = ++hc->lru_clock;
+
+	if (!ctx->valid || ctx->resync || ctx->count >= HC_REFRESH_PKTS ||
+	    elapsed_us(&ctx->refresh) >= HC_REFRESH_MS * 1000ULL) {
+		if (len + HC_IR_OVERHEAD > outsize)
+			return 0;
+
+		ctx->msn++;
+		out[0] = HC_IR;
+		out[1] = cid;
+		out[2] = ctx->msn;
+		memcpy(out + HC_IR_OVERHEAD, pkt, len);
+
+		ctx->valid = 1;
+		ctx->resync = 0;
+		ctx->count = 0;
+		ctx->iphlen = h.iphlen;
+		ctx->l4hlen = h.l4hlen;
+		ctx->proto = h.proto;
+		memcpy(ctx->hdr, pkt, hdrlen);
+		clock_gettime(CLOCK_MONOTONIC, &ctx->refresh);
+
+		return len + HC_IR_OVERHEAD;
+	}
+
+	/* worst case CO header and the payload */
+	if (4 + 2 + 5 + 5 + 2 + 2 + 2 + h.l4hlen + len - hdrlen > outsize)
+		return 0;
+
+	ctx->msn++;
+	p = out;
+	*p++ = HC_CO;
+	*p++ = cid;
+	*p++ = ctx->msn;
+	maskp = p++;
+
+	if (h.iphlen == 20 && get16(pkt + 4) != ((get16(ctx->hdr + 4) + 1) & 0xFFFF)) {
+		mask |= HC_IPID;
+		memcpy(p, pkt + 4, 2);
+		p += 2;
+	}
+
+	l4 = pkt + h.iphlen;
+	cl4 = ctx->hdr + h.iphlen;
+
+	if (h.proto == IPPROTO_TCP) {
+		if (get32(l4 + 4) != get32(cl4 + 4)) {
+			mask |= HC_SEQ;
+			p = put_varint(p, get32(l4 + 4) - get32(cl4 + 4));
+		}
+		if (get32(l4 + 8) != get32(cl4 + 8)) {
+			mask |= HC_ACK;
+			p = put_varint(p, get32(l4 + 8) - get32(cl4 + 8));
+		}
+		/* data offset and flags */
+		if (memcmp(l4 + 12, cl4 + 12, 2)) {
+			mask |= HC_FLAGS;
+			memcpy(p, l4 + 12, 2);
+			p += 2;
+		}
+		if (memcmp(l4 + 14, cl4 + 14, 2)) {
+			mask |= HC_WIN;
+			memcpy(p, l4 + 14, 2);
+			p += 2;
+		}
+		if (memcmp(l4 + 18, cl4 + 18, 2)) {
+			mask |= HC_URG;
+			memcpy(p, l4 + 18, 2);
+			p += 2;
+		}
+		if (h.l4hlen > 20 && (h.l4hlen != ctx->l4hlen ||
+				      memcmp(l4 + 20, cl4 + 20, h.l4hlen - 20))) {
+			mask |= HC_OPTS;
+			memcpy(p, l4 + 20, h.l4hlen - 20);
+			p += h.l4hlen - 20;
+		}
+		memcpy(p, l4 + 16, 2);
+	} else {
+		memcpy(p, l4 + 6, 2);
+	}
+	p += 2;
+
+	*maskp = mask;
+
+	memcpy(p, pkt + hdrlen, len - hdrlen);
+	p += len - hdrlen;
+
+	ctx->count++;
+	ctx->l4hlen = h.l4hlen;
+	memcpy(ctx->hdr, pkt, hdrlen);
+
+	return p - out;
+}
+
+/* request a context refresh from the peer */
+static int hc_nack(struct hc_state *hc, struct hc_ctx *ctx, int cid)
+{
+	if (!ctx->resync) {
+		ctx->resync = 1;
+		hc->nacks |= 1U << cid;
+	}
+
+	return -1;
+}
+
+/*
+ * Handle a received PDU with a HC_* type. Returns the length of the
+ * decompressed IP packet in out, 0 for control messages or -1 for PDUs
+ * that have to be dropped.
+ */
+static int hc_decompress(struct hc_state *hc, const unsigned char *pdu, int len,
+			 unsigned char *out, int outsize)
+{
+	const unsigned char *p = pdu + 3;
+	const unsigned char *end = pdu + len;
+	struct hc_ctx h, *ctx;
+	unsigned char *l4;
+	unsigned char mask;
+	int cid, hdrlen, optlen;
+	__u32 delta;
+
+	if (len < 2)
+		return -1;
+
+	switch (pdu[0]) {
+	case HC_HELLO:
+		if (len < 3 || pdu[1] != HC_VERSION)
+			return -1;
+
+		/* the peer (re)started => all its contexts are gone */
+		if (pdu[2] & HC_HELLO_REQ) {
+			for (cid = 0; cid < HC_MAX_CTX; cid++)
+				hc->comp[cid].valid = 0;
+			hc->hello_pending = 1;
+			hc->hello_flags = 0;
+		}
+		hc->peer = 1;
+		return 0;
+
+	case HC_NACK:
+		if (pdu[1] < HC_MAX_CTX)
+			hc->comp[pdu[1]].resync = 1;
+		return 0;
+
+	case HC_IR:
+	case HC_CO:
+		break;
+
+	default:
+		return -1;
+	}
+
+	cid = pdu[1];
+	if (len < 3 || cid >= HC_MAX_CTX)
+		return -1;
+
+	ctx = &hc->decomp[cid];
+
+	if (pdu[0] == HC_IR) {
+		len -= HC_IR_OVERHEAD;
+		if (len > outsize || hc_parse(p, len, &h))
+			return -1;
+
+		ctx->valid = 1;
+		ctx->resync = 0;
+		ctx->iphlen = h.iphlen;
+		ctx->l4hlen = h.l4hlen;
+		ctx->proto = h.proto;
+		ctx->msn = pdu[2];
+		memcpy(ctx->hdr, p, h.iphlen + h.l4hlen);
+		memcpy(out, p, len);
+		return len;
+	}
+
+	/* lost packets break the delta decoding */
+	if (!ctx->valid || ctx->resync ||
+	    pdu[2] != (unsigned char)(ctx->msn + 1))
+		return hc_nack(hc, ctx, cid);
+
+	if (p >= end)
+		return -1;
+	mask = *p++;
+
+	/* nothing is written to out before it is known to fit */
+	hdrlen = ctx->iphlen + ctx->l4hlen;
+	if (hdrlen > outsize)
+		return -1;
+	memcpy(out, ctx->hdr, hdrlen);
+	l4 = out + ctx->iphlen;
+
+	if (ctx->iphlen == 20) {
+		if (mask & HC_IPID) {
+			if (end - p < 2)
+				return -1;
+			memcpy(out + 4, p, 2);
+			p += 2;
+		} else {
+			put16(out + 4, get16(out + 4) + 1);
+		}
+	}
+
+	if (ctx->proto == IPPROTO_TCP) {
+		if (mask & HC_SEQ) {
+			p = get_varint(p, end, &delta);
+			if (!p)
+				return -1;
+			put32(l4 + 4, get32(l4 + 4) + delta);
+		}
+		if (mask & HC_ACK) {
+			p = get_varint(p, end, &delta);
+			if (!p)
+				return -1;
+			put32(l4 + 8, get32(l4 + 8) + delta);
+		}
+		if (mask & HC_FLAGS) {
+			if (end - p < 2)
+				return -1;
+			memcpy(l4 + 12, p, 2);
+			p += 2;
+		}
+		if (mask & HC_WIN) {
+			if (end - p < 2)
+				return -1;
+			memcpy(l4 + 14, p, 2);
+			p += 2;
+		}
+		if (mask & HC_URG) {
+			if (end - p < 2)
+				return -1;
+			memcpy(l4 + 18, p, 2);
+			p += 2;
+		}
+
+		/* the data offset may have changed with the flags */
+		optlen = (l4[12] >> 4) * 4 - 20;
+		if (optlen < 0 || ctx->iphlen + 20 + optlen > HC_MAXHDR ||
+		    ctx->iphlen + 20 + optlen > outsize)
+			return -1;
+
+		if (mask & HC_OPTS) {
+			if (end - p < optlen)
+				return -1;
+			memcpy(l4 + 20, p, optlen);
+			p += optlen;
+		} else if (optlen && optlen != ctx->l4hlen - 20) {
+			/* changed options have to be sent */
+			return -1;
+		}
+
+		hdrlen = ctx->iphlen + 20 + optlen;
+		if (end - p < 2)
+			return -1;
+		memcpy(l4 + 16, p, 2);
+	} else {
+		if (end - p < 2)
+			return -1;
+		memcpy(l4 + 6, p, 2);
+	}
+	p += 2;
+
+	len = hdrlen + (end - p);
+	if (len > outsize)
+		return -1;
+
+	memcpy(out + hdrlen, p, end - p);
+
+	if (ctx->iphlen == 20) {
+		put16(out + 2, len);
+		ipv4_checksum(out);
+	} else {
+		put16(out + 4, len - 40);
+	}
+
+	if (ctx->proto == IPPROTO_UDP)
+		put16(l4 + 4, len - ctx->iphlen);
+
+	ctx->msn++;
+	ctx->l4hlen = hdrlen - ctx->iphlen;
+	memcpy(ctx->hdr, out, hdrlen);
+
+	return len;
+}
+
+static void set_isotp_events(struct channel *ch)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = EV_ISOTP,
+	};
+
+	/* wait for the completion of the running transmission */
+	if (ch->tx_pending)
+		ev.events |= EPOLLOUT;
+
+	if (ch->isotp_events == ev.events)
+		return;
+
+	if (epoll_ctl(ch->ep, EPOLL_CTL_MOD, ch->s, &ev) < 0)
+		perror_syslog("epoll_ctl");
+
+	ch->isotp_events = ev.events;
+}
+
+/* forward tun packets until the isotp socket is busy - returns -1 on errors */
+static int tun_to_isotp(struct channel *ch)
+{
+	unsigned long long lat;
+	int nbytes;
+
+	while (1) {
+		if (ch->tx_pending) {
+			if (send(ch->s, ch->txpdu, ch->txlen, 0) < 0) {
+				/* the previous PDU is still being transmitted */
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 0;
+
+				if (ch->txiplen) {
+					ch->stats.tx_dropped++;
+					if (verbose)
+						printf(":");
+				}
+			} else if (ch->txiplen) {
+				lat = elapsed_us(&ch->txstamp);
+				ch->stats.tx_packets++;
+				ch->stats.tx_bytes += ch->txiplen;
+				ch->stats.tx_pdu_bytes += ch->txlen;
+				ch->stats.tx_lat_sum += lat;
+				if (lat > ch->stats.tx_lat_max)
+					ch->stats.tx_lat_max = lat;
+				if (verbose)
+					printf(".");
+			}
+
+			if (verbose)
+				fflush(stdout);
+
+			ch->tx_pending = 0;
+		}
+
+		/* control messages of the header compression go first */
+		if (ch->hc) {
+			nbytes = hc_control(ch->hc, ch->ctrl);
+			if (nbytes) {
+				ch->txpdu = ch->ctrl;
+				ch->txlen = nbytes;
+				ch->txiplen = 0;
+				ch->tx_pending = 1;
+				continue;
+			}
+		}
+
+		nbytes = read(ch->t, ch->txbuf, max_pdu + 1);
+		if (nbytes < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			perror_syslog("read tunfd");
+			return -1;
+		}
+
+		if (nbytes > max_pdu) {
+			ch->stats.tx_dropped++;
+			continue;
+		}
+
+		ch->txpdu = ch->txbuf;
+		ch->txlen = nbytes;
+		ch->txiplen = nbytes;
+
+		if (ch->hc) {
+			int len = hc_compress(ch->hc, ch->txbuf, nbytes,
+					      ch->hctxbuf, max_pdu);
+
+			if (len) {
+				ch->txpdu = ch->hctxbuf;
+				ch->txlen = len;
+			}
+		}
+
+		ch->tx_pending = 1;
+		clock_gettime(CLOCK_MONOTONIC, &ch->txstamp);
+	}
+}
+
+/* forward all received PDUs to the tun device - returns -1 on errors */
+static int isotp_to_tun(struct channel *ch)
+{
+	unsigned char *pkt;
+	int nbytes, len, ret;
+
+	while (1) {
+		nbytes = recv(ch->s, ch->rxbuf, max_pdu + 1, MSG_DONTWAIT);
+		if (nbytes < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			perror_syslog("read isotp socket");
+			return -1;
+		}
+
+		if (nbytes > max_pdu)
+			return -1;
+
+		pkt = ch->rxbuf;
+		len = nbytes;
+
+		/* no valid IP version => header compression */
+		if (ch->hc && nbytes && ch->rxbuf[0] >= HC_HELLO) {
+			len = hc_decompress(ch->hc, ch->rxbuf, nbytes,
+					    ch->hcrxbuf, max_pdu);
+			if (!len)
+				continue;
+
+			if (len < 0) {
+				ch->stats.rx_dropped++;
+				continue;
+			}
+
+			pkt = ch->hcrxbuf;
+		}
+
+		ret = write(ch->t, pkt, len);
+		if (ret < 0) {
+			ch->stats.rx_dropped++;
+		} else {
+			ch->stats.rx_packets++;
+			ch->stats.rx_bytes += len;
+			ch->stats.rx_pdu_bytes += nbytes;
+		}
+
+		if (verbose) {
+			if (ret < 0 && errno == EAGAIN)
+				printf(";");
+			else
+				printf(",");
+			fflush(stdout);
+		}
+	}
+}
+
+static void *channel_thread(void *arg)
+{
+	struct channel *ch = arg;
+	struct epoll_event events[3];
+	int nevents, i, ret, timeout;
+
+	while (running) {
+		/* send pending control messages of the header compression */
+		if (ch->hc && !ch->tx_pending &&
+		    (ch->hc->hello_pending || ch->hc->nacks) &&
+		    tun_to_isotp(ch) < 0)
+			goto out_fatal;
+
+		set_isotp_events(ch);
+
+		/* repeat the HELLO until the peer answers */
+		timeout = (ch->hc && !ch->hc->peer) ? HC_HELLO_MS : -1;
+
+		nevents = epoll_wait(ch->ep, events, 3, timeout);
+		if (nevents < 0) {
+			if (errno == EINTR)
+				continue;
+			perror_syslog("epoll_wait");
+			break;
+		}
+
+		if (!nevents) {
+			ch->hc->hello_pending = 1;
+			ch->hc->hello_flags = HC_HELLO_REQ;
+		}
+
+		for (i = 0; i < nevents; i++) {
+			ret = 0;
+
+			switch (events[i].data.u32) {
+			case EV_STOP:
+				return NULL;
+
+			case EV_ISOTP:
+				if (events[i].events & EPOLLOUT)
+					ret = tun_to_isotp(ch);
+				if (!ret && events[i].events & (EPOLLIN | EPOLLERR))
+					ret = isotp_to_tun(ch);
+				break;
+
+			case EV_TUN:
+				if (!ch->tx_pending)
+					ret = tun_to_isotp(ch);
+				break;
+			}
+
+			if (ret < 0)
+				goto out_fatal;
+		}
+	}
+
+	return NULL;
+
+ out_fatal:
+	/* terminate the whole tunnel like before with one channel */
+	fatal = 1;
+	kill(getpid(), SIGTERM);
+
+	return NULL;
+}
+
+static int channel_epoll(struct channel *ch)
+{
+	struct epoll_event ev;
+
+	ch->ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ch->ep < 0) {
+		perror_syslog("epoll_create1");
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = EV_STOP;
+	if (epoll_ctl(ch->ep, EPOLL_CTL_ADD, stopfd, &ev) < 0)
+		goto out_err;
+
+	/*
+	 * The tun queue is edge triggered as it is drained until the isotp
+	 * socket gets busy. The remaining packets are read when the isotp
+	 * socket signals the end of the transmission with EPOLLOUT.
+	 */
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u32 = EV_TUN;
+	if (epoll_ctl(ch->ep, EPOLL_CTL_ADD, ch->t, &ev) < 0)
+		goto out_err;
+
+	ch->isotp_events = EPOLLIN;
+	ev.events = ch->isotp_events;
+	ev.data.u32 = EV_ISOTP;
+	if (epoll_ctl(ch->ep, EPOLL_CTL_ADD, ch->s, &ev) < 0)
+		goto out_err;
+
+	return 0;
+
+ out_err:
+	perror_syslog("epoll_ctl");
+	return -1;
+}
+
+/* number of CAN frames for a PDU including one flow control frame */
+static int can_frames(int len, int dl, int ext)
+{
+	int sf = (dl > 8 ? dl - 2 : dl - 1) - ext;
+	int ff = (len > 4095 ? dl - 6 : dl - 2) - ext;
+	int cf = dl - 1 - ext;
+
+	if (len <= sf)
+		return 1;
+
+	return 2 + (len - ff + cf - 1) / cf;
+}
+
+/* synthetic packet n of the benchmark - alternating UDP and TCP flows */
+static int bench_packet(unsigned char *pkt, unsigned int n, int payload)
+{
+	int flow = n % 4;
+	int tcp = flow & 1;
+	int hdrlen = 20 + (tcp ? 20 : 8);
+	unsigned char *l4 = pkt + 20;
+	int i;
+
+	memset(pkt, 0, hdrlen);
+	pkt[0] = 0x45;
+	put16(pkt + 2, hdrlen + payload);
+	put16(pkt + 4, n / 4);
+	pkt[6] = 0x40; /* DF */
+	pkt[8] = 64;
+	pkt[9] = tcp ? IPPROTO_TCP : IPPROTO_UDP;
+	put32(pkt + 12, 0xC0A80001);
+	put32(pkt + 16, 0xC0A80002);
+	ipv4_checksum(pkt);
+
+	put16(l4, 40000 + flow);
+	put16(l4 + 2, 5000);
+
+	if (tcp) {
+		put32(l4 + 4, 1000 + (n / 4) * payload);
+		put32(l4 + 8, 2000);
+		l4[12] = 5 << 4;
+		l4[13] = 0x18; /* PSH, ACK */
+		put16(l4 + 14, 64240);
+		put16(l4 + 16, n * 7 + 1); /* checksum is not checked */
+	} else {
+		put16(l4 + 4, 8 + payload);
+		put16(l4 + 6, n * 7 + 1);
+	}
+
+	/* the packet number identifies the received packet */
+	put32(pkt + hdrlen, n);
+	for (i = 4; i < payload; i++)
+		pkt[hdrlen + i] = n + i;
+
+	return hdrlen + payload;
+}
+
+struct bench_result {
+	unsigned long long sent;
+	unsigned long long received;
+	unsigned long long errors;
+	unsigned long long payload_bytes;
+	unsigned long long pdu_bytes;
+	unsigned long long frames;
+	double secs;
+};
+
+/* check the received PDUs - returns -1 on socket errors */
+static int bench_receive(int rx, struct hc_state *hc, int payload,
+			 struct bench_result *res)
+{
+	unsigned char pdu[MAX_PDU_LENGTH + 1];
+	unsigned char pkt[MAX_PDU_LENGTH];
+	unsigned char ref[MAX_PDU_LENGTH];
+	unsigned char *data;
+	int nbytes, len;
+
+	while (1) {
+		nbytes = recv(rx, pdu, sizeof(pdu), MSG_DONTWAIT);
+		if (nbytes < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			perror("read isotp socket");
+			return -1;
+		}
+
+		data = pdu;
+		len = nbytes;
+
+		if (hc && nbytes && pdu[0] >= HC_HELLO) {
+			len = hc_decompress(hc, pdu, nbytes, pkt, sizeof(pkt));
+			if (!len)
+				continue;
+			data = pkt;
+		}
+
+		if (len < payload ||
+		    bench_packet(ref, get32(data + len - payload), payload) != len ||
+		    memcmp(ref, data, len)) {
+			res->errors++;
+			continue;
+		}
+
+		res->received++;
+		res->payload_bytes += payload;
+	}
+}
+
+static int bench_run(int tx, int rx, int secs, int payload, int compress,
+		     int dl, int ext, struct bench_result *res)
+{
+	static struct hc_state txhc, rxhc;
+	unsigned char pkt[MAX_PDU_LENGTH];
+	unsigned char pdu[MAX_PDU_LENGTH];
+	struct timespec start;
+	unsigned char *data;
+	int len, pdulen, i;
+
+	memset(res, 0, sizeof(*res));
+	hc_init(&txhc);
+	hc_init(&rxhc);
+	txhc.peer = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (running && elapsed_us(&start) < secs * 1000000ULL) {
+		len = bench_packet(pkt, res->sent, payload);
+
+		data = pkt;
+		pdulen = len;
+
+		if (compress) {
+			i = hc_compress(&txhc, pkt, len, pdu, sizeof(pdu));
+			if (i) {
+				data = pdu;
+				pdulen = i;
+			}
+		}
+
+		if (send(tx, data, pdulen, 0) < 0) {
+			perror("write isotp socket");
+			return -1;
+		}
+
+		res->sent++;
+		res->pdu_bytes += pdulen;
+		res->frames += can_frames(pdulen, dl, ext);
+
+		if (bench_receive(rx, compress ? &rxhc : NULL, payload, res))
+			return -1;
+	}
+
+	/* wait for the PDUs in flight */
+	for (i = 0; i < 100 && res->received + res->errors < res->sent; i++) {
+		struct timespec ts = {
+			.tv_nsec = 10 * 1000 * 1000,
+		};
+
+		nanosleep(&ts, NULL);
+		if (bench_receive(rx, compress ? &rxhc : NULL, payload, res))
+			return -1;
+	}
+
+	res->secs = elapsed_us(&start) / 1000000.0;
+
+	return 0;
+}
+
+static void bench_print(const char *name, struct bench_result *res)
+{
+	printf("%-12s %llu sent, %llu received, %llu errors, %.0f pkts/s, goodput %.0f B/s, "
+	       "avg PDU %.1f bytes, %.2f CAN frames/pkt\n",
+	       name, res->sent, res->received, res->errors,
+	       res->received / res->secs, res->payload_bytes / res->secs,
+	       res->sent ? (double)res->pdu_bytes / res->sent : 0,
+	       res->sent ? (double)res->frames / res->sent : 0);
+}
+
+/*
+ * Send synthetic UDP and TCP packets through two ISO-TP sockets on the
+ * same CAN interface (e.g. vcan) without and with header compression.
+ */
+static int bench(struct sockaddr_can *addr, struct can_isotp_options *opts,
+		 struct can_isotp_fc_options *fcopts,
+		 struct can_isotp_ll_options *llopts, int secs, int payload)
+{
+	struct can_isotp_options rxopts = *opts;
+	struct sockaddr_can rxaddr = *addr;
+	struct bench_result raw, hc;
+	int dl = llopts->tx_dl ? llopts->tx_dl : CAN_MAX_DLEN;
+	int ext = (opts->flags & CAN_ISOTP_EXTEND_ADDR) ? 1 : 0;
+	int tx, rx;
+
+	/* the receiving side of the tunnel */
+	rxaddr.can_addr.tp.tx_id = addr->can_addr.tp.rx_id;
+	rxaddr.can_addr.tp.rx_id = addr->can_addr.tp.tx_id;
+	if (opts->flags & CAN_ISOTP_RX_EXT_ADDR) {
+		rxopts.ext_address = opts->rx_ext_address;
+		rxopts.rx_ext_address = opts->ext_address;
+	}
+
+	if ((tx = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP)) < 0 ||
+	    (rx = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP)) < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	setsockopt(tx, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, opts, sizeof(*opts));
+	setsockopt(rx, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &rxopts, sizeof(rxopts));
+	setsockopt(tx, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, fcopts, sizeof(*fcopts));
+	setsockopt(rx, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, fcopts, sizeof(*fcopts));
+
+	if (llopts->tx_dl &&
+	    (setsockopt(tx, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, llopts, sizeof(*llopts)) < 0 ||
+	     setsockopt(rx, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, llopts, sizeof(*llopts)) < 0)) {
+		perror("link layer sockopt");
+		return 1;
+	}
+
+	if (bind(tx, (struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+	    bind(rx, (struct sockaddr *)&rxaddr, sizeof(rxaddr)) < 0) {
+		perror("bind");
+		return 1;
+	}
+
+	printf("%d bytes payload, %d seconds per run, CAN frame data length %d\n",
+	       payload, secs, dl);
+
+	if (bench_run(tx, rx, secs, payload, 0, dl, ext, &raw))
+		return 1;
+	bench_print("uncompressed", &raw);
+
+	if (bench_run(tx, rx, secs, payload, 1, dl, ext, &hc))
+		return 1;
+	bench_print("compressed", &hc);
+
+	if (raw.payload_bytes && raw.frames)
+		printf("header compression: goodput %+.1f%%, CAN frames/pkt %+.1f%%\n",
+		       (hc.payload_bytes / hc.secs * raw.secs / raw.payload_bytes - 1) * 100,
+		       ((double)hc.frames / hc.sent * raw.sent / raw.frames - 1) * 100);
+
+	close(tx);
+	close(rx);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
-	fd_set rdfs;
 	int s, t;
 	struct sockaddr_can addr;
 	struct ifreq ifr;
 	static struct can_isotp_options opts;
 	static struct can_isotp_fc_options fcopts;
 	static struct can_isotp_ll_options llopts;
-	int opt, ret;
+	int opt;
 	extern int optind, opterr, optopt;
-	static int verbose;
-	unsigned char buffer[BUF_LEN];
 	static char name[sizeof(ifr.ifr_name)] = DEFAULT_NAME;
-	int nbytes;
 	int run_as_daemon = 0;
+	int set_mtu = 0;
+	int compress = 0;
+	int bench_secs = 0;
+	int bench_payload = 32;
+	int stats_interval = 0;
+	struct channel *ch;
+	sigset_t sigset;
+	int i;
 
 	addr.can_addr.tp.tx_id = addr.can_addr.tp.rx_id = NO_CAN_ID;
 
-	while ((opt = getopt(argc, argv, "s:d:n:x:p:P:t:b:m:whL:vD?")) != -1) {
+	while ((opt = getopt(argc, argv, "s:d:n:x:p:P:t:b:m:whL:M:q:S:zB:vD?")) != -1) {
 		switch (opt) {
 		case 's':
 			addr.can_addr.tp.tx_id = strtoul(optarg, NULL, 16);
@@ -260,6 +1451,40 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'M':
+			max_pdu = strtoul(optarg, NULL, 10);
+			if (max_pdu < 68 || max_pdu > MAX_PDU_LENGTH) {
+				fprintf(stderr, "max. PDU length has to be 68 .. %d.\n", MAX_PDU_LENGTH);
+				exit(EXIT_FAILURE);
+			}
+			set_mtu = 1;
+			break;
+
+		case 'q':
+			nchannels = strtoul(optarg, NULL, 10);
+			if (nchannels < 1 || nchannels > MAX_QUEUES) {
+				fprintf(stderr, "number of queues has to be 1 .. %d.\n", MAX_QUEUES);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'S':
+			stats_interval = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'z':
+			compress = 1;
+			break;
+
+		case 'B':
+			if (sscanf(optarg, "%d:%d", &bench_secs, &bench_payload) < 1 ||
+			    bench_secs < 1 || bench_payload < 4) {
+				fprintf(stderr, "incorrect benchmark values '%s'.\n", optarg);
+				print_usage(basename(argv[0]));
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'v':
 			verbose = 1;
 			break;
@@ -283,63 +1508,119 @@ int main(int argc, char **argv)
 
 	if ((argc - optind != 1) ||
 	    (addr.can_addr.tp.tx_id == NO_CAN_ID) ||
-	    (addr.can_addr.tp.rx_id == NO_CAN_ID)) {
+	    (addr.can_addr.tp.rx_id == NO_CAN_ID) ||
+	    (bench_secs && bench_payload > max_pdu - 40)) {
 		print_usage(basename(argv[0]));
 		exit(EXIT_FAILURE);
 	}
-  
+
 	if (!run_as_daemon)
 		syslogger = fake_syslog;
 
 	/* Initialize the logging interface */
 	openlog(DAEMON_NAME, LOG_PID, LOG_LOCAL5);
 
-	if ((s = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP)) < 0) {
-		perror_syslog("socket");
-		exit(EXIT_FAILURE);
-	}
-
-	setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts));
-	setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fcopts, sizeof(fcopts));
-
-	if (llopts.tx_dl) {
-		if (setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &llopts, sizeof(llopts)) < 0) {
-			perror_syslog("link layer sockopt");
-			exit(EXIT_FAILURE);
-		}
-	}
-
 	addr.can_family = AF_CAN;
 	addr.can_ifindex = if_nametoindex(argv[optind]);
 	if (!addr.can_ifindex) {
 		perror_syslog("if_nametoindex");
-		close(s);
 		exit(EXIT_FAILURE);
 	}
 
-	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror_syslog("bind");
-		close(s);
-		exit(EXIT_FAILURE);
+	if (bench_secs) {
+		signal(SIGTERM, sigterm);
+		signal(SIGINT, sigterm);
+		return bench(&addr, &opts, &fcopts, &llopts, bench_secs, bench_payload);
 	}
 
-	if ((t = open("/dev/net/tun", O_RDWR)) < 0) {
-		perror_syslog("open tunfd");
-		close(s);
-		close(t);
-		exit(EXIT_FAILURE);
+	for (i = 0; i < nchannels; i++) {
+		ch = &channels[i];
+		ch->idx = i;
+
+		ch->txbuf = malloc(max_pdu + 1);
+		ch->rxbuf = malloc(max_pdu + 1);
+		if (!ch->txbuf || !ch->rxbuf) {
+			perror_syslog("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+		if (compress) {
+			ch->hc = malloc(sizeof(*ch->hc));
+			ch->hctxbuf = malloc(max_pdu + 1);
+			ch->hcrxbuf = malloc(max_pdu + 1);
+			if (!ch->hc || !ch->hctxbuf || !ch->hcrxbuf) {
+				perror_syslog("malloc");
+				exit(EXIT_FAILURE);
+			}
+			hc_init(ch->hc);
+		}
+
+		if ((s = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK, CAN_ISOTP)) < 0) {
+			perror_syslog("socket");
+			exit(EXIT_FAILURE);
+		}
+
+		setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts));
+		setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fcopts, sizeof(fcopts));
+
+		if (llopts.tx_dl) {
+			if (setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &llopts, sizeof(llopts)) < 0) {
+				perror_syslog("link layer sockopt");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			perror_syslog("bind");
+			close(s);
+			exit(EXIT_FAILURE);
+		}
+
+		/* consecutive CAN IDs for the ISO-TP channels of the queues */
+		addr.can_addr.tp.tx_id++;
+		addr.can_addr.tp.rx_id++;
+
+		if ((t = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0) {
+			perror_syslog("open tunfd");
+			close(s);
+			exit(EXIT_FAILURE);
+		}
+
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+		if (nchannels > 1)
+			ifr.ifr_flags |= IFF_MULTI_QUEUE;
+
+		/* string termination is ensured at commandline option handling */
+		strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
+
+		if (ioctl(t, TUNSETIFF, (void *) &ifr) < 0) {
+			perror_syslog("ioctl tunfd");
+			close(s);
+			close(t);
+			exit(EXIT_FAILURE);
+		}
+
+		/* the other queues attach to the device created by the first one */
+		if (!i)
+			memcpy(name, ifr.ifr_name, sizeof(name));
+
+		ch->s = s;
+		ch->t = t;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-	/* string termination is ensured at commandline option handling */
-	strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
+	if (set_mtu) {
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
 
-	if (ioctl(t, TUNSETIFF, (void *) &ifr) < 0) {
-		perror_syslog("ioctl tunfd");
-		close(s);
-		close(t);
-		exit(EXIT_FAILURE);
+		memset(&ifr, 0, sizeof(ifr));
+		memcpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
+		ifr.ifr_mtu = max_pdu;
+
+		if (fd < 0 || ioctl(fd, SIOCSIFMTU, &ifr) < 0)
+			perror_syslog("set MTU");
+
+		if (fd >= 0)
+			close(fd);
 	}
 
 	/* Now the tun device exists. We can daemonize to let the
@@ -354,57 +1635,71 @@ int main(int argc, char **argv)
 	signal(SIGTERM, sigterm);
 	signal(SIGHUP, sigterm);
 	signal(SIGINT, sigterm);
+	signal(SIGUSR1, sigusr1);
 
-	while (running) {
+	stopfd = eventfd(0, EFD_CLOEXEC);
+	if (stopfd < 0) {
+		perror_syslog("eventfd");
+		exit(EXIT_FAILURE);
+	}
 
-		FD_ZERO(&rdfs);
-		FD_SET(s, &rdfs);
-		FD_SET(t, &rdfs);
+	/* the signals are handled by the main thread only */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGTERM);
+	sigaddset(&sigset, SIGHUP);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
-		if ((ret = select(t+1, &rdfs, NULL, NULL, NULL)) < 0) {
-			perror_syslog("select");
-			continue;
+	for (i = 0; i < nchannels; i++) {
+		ch = &channels[i];
+
+		if (channel_epoll(ch) ||
+		    pthread_create(&ch->thread, NULL, channel_thread, ch)) {
+			syslogger(LOG_ERR, "failed to start queue %d", i);
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (FD_ISSET(s, &rdfs)) {
-			nbytes = read(s, buffer, BUF_LEN);
-			if (nbytes < 0) {
-				perror_syslog("read isotp socket");
-				return -1;
-			}
-			if (nbytes > MAX_PDU_LENGTH)
-				return -1;
-			ret = write(t, buffer, nbytes);
-			if (verbose) {
-				if (ret < 0 && errno == EAGAIN)
-					printf(";");
-				else
-					printf(",");
-				fflush(stdout);
-			}
+	pthread_sigmask(SIG_UNBLOCK, &sigset, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &stats_ts);
+
+	while (running) {
+		if (stats_interval) {
+			struct timespec ts = {
+				.tv_sec = stats_interval,
+			};
+
+			if (!nanosleep(&ts, NULL))
+				show_stats = 1;
+		} else {
+			pause();
 		}
 
-		if (FD_ISSET(t, &rdfs)) {
-			nbytes = read(t, buffer, BUF_LEN);
-			if (nbytes < 0) {
-				perror_syslog("read tunfd");
-				return -1;
-			}
-			if (nbytes > MAX_PDU_LENGTH)
-				return -1;
-			ret = write(s, buffer, nbytes);
-			if (verbose) {
-				if (ret < 0 && errno == EAGAIN)
-					printf(":");
-				else
-					printf(".");
-				fflush(stdout);
-			}
+		if (show_stats && running) {
+			show_stats = 0;
+			print_stats();
 		}
 	}
 
-	close(s);
-	close(t);
+	/* wake up and terminate all channel threads */
+	if (eventfd_write(stopfd, 1))
+		perror_syslog("eventfd_write");
+
+	for (i = 0; i < nchannels; i++) {
+		pthread_join(channels[i].thread, NULL);
+		close(channels[i].s);
+		close(channels[i].t);
+		close(channels[i].ep);
+	}
+
+	if (stats_interval)
+		print_stats();
+
+	close(stopfd);
+
+	if (fatal)
+		return EXIT_FAILURE;
 
 	if (signal_num)
 		return 128 + signal_num;
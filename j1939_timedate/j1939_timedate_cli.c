@@ -28,16 +28,17 @@ struct j1939_timedate_cli_priv {
 	struct j1939_timedate_stats stats;
 
 	struct libj1939_cmn cmn;
-	struct timespec wait_until_time;
+	struct libj1939_rx rx;
+	struct libj1939_timer wait_timer;
 
 	bool utc;
 	bool broadcast;
 	bool done;
 };
 
-static void print_time_date_packet(struct j1939_timedate_cli_priv *priv,
-				   const struct j1939_timedate_msg *msg)
+static int print_time_date_packet(void *ctx, struct libj1939_rx_msg *msg)
 {
+	struct j1939_timedate_cli_priv *priv = ctx;
 	const struct j1939_time_date_packet *tdp =
 		(const struct j1939_time_date_packet *)msg->buf;
 	char timezone_offset[] = "+00:00 (Local Time)";
@@ -47,10 +48,15 @@ static void print_time_date_packet(struct j1939_timedate_cli_priv *priv,
 	double actual_seconds;
 	double actual_day;
 
-	if (msg->len < (int)sizeof(*tdp)) {
-		pr_warn("received too short time and date packet: %zi",
+	if (msg->len < 3) {
+		pr_warn("received too short message: %zu", msg->len);
+		return -EINVAL;
+	}
+
+	if (msg->len < sizeof(*tdp)) {
+		pr_warn("received too short time and date packet: %zu",
 			msg->len);
-		return;
+		return 0;
 	}
 
 	actual_year = 1985 + tdp->year;
@@ -102,69 +108,24 @@ static void print_time_date_packet(struct j1939_timedate_cli_priv *priv,
 
 	if (!priv->broadcast)
 		priv->done = true;
-}
 
-static int j1939_timedate_cli_rx_buf(struct j1939_timedate_cli_priv *priv,
-				     struct j1939_timedate_msg *msg)
-{
-	pgn_t pgn = msg->peername.can_addr.j1939.pgn;
-	int ret = 0;
-
-	switch (pgn) {
-	case J1939_PGN_TD:
-		print_time_date_packet(priv, msg);
-		break;
-	default:
-		pr_warn("%s: unsupported PGN: %x", __func__, pgn);
-		/* Not a critical error */
-		break;
-	}
-
-	return ret;
+	return 0;
 }
 
-static int j1939_timedate_cli_rx_one(struct j1939_timedate_cli_priv *priv,
-				     int sock)
+static int j1939_timedate_cli_rx_unhandled(void *ctx,
+					   struct libj1939_rx_msg *msg)
 {
-	struct j1939_timedate_msg *msg;
-	int flags = 0;
-	int ret;
-
-	msg = malloc(sizeof(*msg));
-	if (!msg) {
-		pr_err("can't allocate rx msg struct\n");
-		return -ENOMEM;
-	}
-	msg->buf_size = J1939_TIMEDATE_MAX_TRANSFER_LENGH;
-	msg->peer_addr_len = sizeof(msg->peername);
-	msg->sock = sock;
-
-	ret = recvfrom(sock, &msg->buf[0], msg->buf_size, flags,
-		       (struct sockaddr *)&msg->peername, &msg->peer_addr_len);
-
-	if (ret < 0) {
-		ret = -errno;
-		pr_warn("recvfrom() failed: %i %s", ret, strerror(-ret));
-		return ret;
-	}
-
-	if (ret < 3) {
-		pr_warn("received too short message: %i", ret);
-		return -EINVAL;
-	}
-
-	msg->len = ret;
-
-	ret = j1939_timedate_cli_rx_buf(priv, msg);
-	if (ret < 0) {
-		pr_warn("failed to process rx buf: %i (%s)\n", ret,
-			strerror(ret));
-		return ret;
-	}
+	pr_warn("%s: unsupported PGN: %x", __func__,
+		msg->peername.can_addr.j1939.pgn);
 
+	/* Not a critical error */
 	return 0;
 }
 
+static const struct libj1939_rx_handler j1939_timedate_cli_rx_handlers[] = {
+	{ J1939_PGN_TD, print_time_date_packet },
+};
+
 static int j1939_timedate_cli_handle_events(struct j1939_timedate_cli_priv *priv,
 					    unsigned int nfds)
 {
@@ -180,8 +141,8 @@ static int j1939_timedate_cli_handle_events(struct j1939_timedate_cli_priv *priv
 		}
 
 		if (ev->events & POLLIN) {
-			ret = j1939_timedate_cli_rx_one(priv, ev->data.fd);
-			if (ret) {
+			ret = libj1939_rx_dispatch(&priv->rx, ev->data.fd);
+			if (ret < 0) {
 				warn("recv one");
 				return ret;
 			}
@@ -207,6 +168,16 @@ static int j1939_timedate_cli_process_events_and_tasks(struct j1939_timedate_cli
 	return 0;
 }
 
+static int j1939_timedate_cli_wait_done(struct libj1939_cmn *cmn,
+					struct libj1939_timer *timer)
+{
+	struct j1939_timedate_cli_priv *priv = timer->ctx;
+
+	priv->done = true;
+
+	return 0;
+}
+
 static int j1939_timedate_cli_send_req(struct j1939_timedate_cli_priv *priv)
 {
 	struct sockaddr_can addr = priv->peername;
@@ -444,8 +415,6 @@ static int j1939_timedate_cli_parse_args(struct j1939_timedate_cli_priv *priv, i
 int main(int argc, char *argv[])
 {
 	struct j1939_timedate_cli_priv *priv;
-	struct timespec ts;
-	int64_t time_diff;
 	int ret;
 
 	priv = malloc(sizeof(*priv));
@@ -465,11 +434,24 @@ int main(int argc, char *argv[])
 	if (ret)
 		return ret;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	priv->cmn.next_send_time = ts;
-	priv->wait_until_time = priv->cmn.next_send_time;
+	ret = libj1939_rx_init(&priv->rx, J1939_TIMEDATE_RX_BATCH,
+			       J1939_TIMEDATE_MAX_TRANSFER_LENGH);
+	if (ret)
+		return ret;
+	libj1939_rx_set_handlers(&priv->rx, j1939_timedate_cli_rx_handlers,
+				 ARRAY_SIZE(j1939_timedate_cli_rx_handlers),
+				 j1939_timedate_cli_rx_unhandled, priv);
+
+	ret = libj1939_timers_init(&priv->cmn);
+	if (ret)
+		return ret;
+
 	/* Wait one second to collect all responses by default */
-	timespec_add_ms(&priv->wait_until_time, 1000);
+	libj1939_timer_init(&priv->wait_timer, j1939_timedate_cli_wait_done,
+			    priv);
+	ret = libj1939_timer_start(&priv->cmn, &priv->wait_timer, 1000, 0);
+	if (ret)
+		return ret;
 
 	ret = j1939_timedate_cli_send_req(priv);
 	if (ret)
@@ -482,13 +464,10 @@ int main(int argc, char *argv[])
 
 		if (priv->done)
 			break;
-
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-		time_diff = timespec_diff_ms(&priv->wait_until_time, &ts);
-		if (time_diff < 0)
-			break;
 	}
 
+	libj1939_timers_free(&priv->cmn);
+	libj1939_rx_free(&priv->rx);
 	close(priv->cmn.epoll_fd);
 	free(priv->cmn.epoll_events);
 
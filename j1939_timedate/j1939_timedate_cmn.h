@@ -27,6 +27,8 @@
 #define J1939_TIMEDATE_PRIO_DEFAULT		6
 
 #define J1939_TIMEDATE_MAX_TRANSFER_LENGH	8
+/* messages per recvmmsg() */
+#define J1939_TIMEDATE_RX_BATCH			16
 
 struct j1939_timedate_stats {
 	int err;
@@ -35,15 +37,6 @@ struct j1939_timedate_stats {
 	uint32_t send;
 };
 
-struct j1939_timedate_msg {
-	uint8_t buf[J1939_TIMEDATE_MAX_TRANSFER_LENGH];
-	size_t buf_size;
-	ssize_t len; /* length of received message */
-	struct sockaddr_can peername;
-	socklen_t peer_addr_len;
-	int sock;
-};
-
 struct j1939_timedate_err_msg {
 	struct sock_extended_err *serr;
 	struct scm_timestamping *tss;
@@ -27,6 +27,7 @@ struct j1939_timedate_srv_priv {
 	struct j1939_timedate_stats stats;
 
 	struct libj1939_cmn cmn;
+	struct libj1939_rx rx;
 };
 
 static void gmtime_to_j1939_pgn_65254_td(struct j1939_time_date_packet *tdp)
@@ -162,9 +163,15 @@ static int j1939_timedate_srv_send_res(struct j1939_timedate_srv_priv *priv,
 }
 
 // check if the received message is a request for the time and date
-static int j1939_timedate_srv_process_request(struct j1939_timedate_srv_priv *priv,
-					       struct j1939_timedate_msg *msg)
+static int j1939_timedate_srv_process_request(void *ctx,
+					       struct libj1939_rx_msg *msg)
 {
+	struct j1939_timedate_srv_priv *priv = ctx;
+
+	if (msg->len < 3) {
+		pr_warn("received too short message: %zu", msg->len);
+		return -EINVAL;
+	}
 
 	if (msg->buf[0] != (J1939_PGN_TD & 0xff) ||
 	    msg->buf[1] != ((J1939_PGN_TD >> 8) & 0xff) ||
@@ -176,65 +183,20 @@ static int j1939_timedate_srv_process_request(struct j1939_timedate_srv_priv *pr
 	return j1939_timedate_srv_send_res(priv, &msg->peername);
 }
 
-static int j1939_timedate_srv_rx_buf(struct j1939_timedate_srv_priv *priv, struct j1939_timedate_msg *msg)
-{
-	pgn_t pgn = msg->peername.can_addr.j1939.pgn;
-	int ret = 0;
-
-	switch (pgn) {
-	case J1939_PGN_REQUEST_PGN:
-		ret = j1939_timedate_srv_process_request(priv, msg);
-		break;
-	default:
-		pr_warn("%s: unsupported PGN: %x", __func__, pgn);
-		/* Not a critical error */
-		break;
-	}
-
-	return ret;
-}
-
-static int j1939_timedate_srv_rx_one(struct j1939_timedate_srv_priv *priv, int sock)
+static int j1939_timedate_srv_rx_unhandled(void *ctx,
+					   struct libj1939_rx_msg *msg)
 {
-	struct j1939_timedate_msg *msg;
-	int flags = 0;
-	int ret;
-
-	msg = malloc(sizeof(*msg));
-	if (!msg) {
-		pr_err("can't allocate rx msg struct\n");
-		return -ENOMEM;
-	}
-	msg->buf_size = J1939_TIMEDATE_MAX_TRANSFER_LENGH;
-	msg->peer_addr_len = sizeof(msg->peername);
-	msg->sock = sock;
-
-	ret = recvfrom(sock, &msg->buf[0], msg->buf_size, flags,
-		       (struct sockaddr *)&msg->peername, &msg->peer_addr_len);
-
-	if (ret < 0) {
-		ret = -errno;
-		pr_warn("recvfrom() failed: %i %s", ret, strerror(-ret));
-		return ret;
-	}
-
-	if (ret < 3) {
-		pr_warn("received too short message: %i", ret);
-		return -EINVAL;
-	}
-
-	msg->len = ret;
-
-	ret = j1939_timedate_srv_rx_buf(priv, msg);
-	if (ret < 0) {
-		pr_warn("failed to process rx buf: %i (%s)\n", ret,
-			strerror(ret));
-		return ret;
-	}
+	pr_warn("%s: unsupported PGN: %x", __func__,
+		msg->peername.can_addr.j1939.pgn);
 
+	/* Not a critical error */
 	return 0;
 }
 
+static const struct libj1939_rx_handler j1939_timedate_srv_rx_handlers[] = {
+	{ J1939_PGN_REQUEST_PGN, j1939_timedate_srv_process_request },
+};
+
 static int j1939_timedate_srv_handle_events(struct j1939_timedate_srv_priv *priv,
 					    unsigned int nfds)
 {
@@ -250,8 +212,8 @@ static int j1939_timedate_srv_handle_events(struct j1939_timedate_srv_priv *priv
 		}
 
 		if (ev->events & POLLIN) {
-			ret = j1939_timedate_srv_rx_one(priv, ev->data.fd);
-			if (ret) {
+			ret = libj1939_rx_dispatch(&priv->rx, ev->data.fd);
+			if (ret < 0) {
 				warn("recv one");
 				return ret;
 			}
@@ -411,7 +373,6 @@ static int j1939_timedate_srv_parse_args(struct j1939_timedate_srv_priv *priv,
 int main(int argc, char *argv[])
 {
 	struct j1939_timedate_srv_priv *priv;
-	struct timespec ts;
 	int ret;
 
 	priv = malloc(sizeof(*priv));
@@ -426,19 +387,25 @@ int main(int argc, char *argv[])
 	if (ret)
 		return ret;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	priv->cmn.next_send_time = ts;
-
 	ret = j1939_timedate_srv_sock_prepare(priv);
 	if (ret)
 		return ret;
 
+	ret = libj1939_rx_init(&priv->rx, J1939_TIMEDATE_RX_BATCH,
+			       J1939_TIMEDATE_MAX_TRANSFER_LENGH);
+	if (ret)
+		return ret;
+	libj1939_rx_set_handlers(&priv->rx, j1939_timedate_srv_rx_handlers,
+				 ARRAY_SIZE(j1939_timedate_srv_rx_handlers),
+				 j1939_timedate_srv_rx_unhandled, priv);
+
 	while (1) {
 		ret = j1939_timedate_srv_process_events_and_tasks(priv);
 		if (ret)
 			break;
 	}
 
+	libj1939_rx_free(&priv->rx);
 	close(priv->cmn.epoll_fd);
 	free(priv->cmn.epoll_events);
 
@@ -23,27 +23,33 @@
 #include <linux/can.h>
 #include <linux/can/j1939.h>
 #include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <unistd.h>
 
 #include "libj1939.h"
 
 static const char help_msg[] =
 	"j1939acd: An SAE J1939 address claiming daemon" "\n"
-	"Usage: j1939acd [options] NAME [INTF]" "\n"
+	"Usage: j1939acd [options] [NAME [INTF]]" "\n"
 	"Options:\n"
 	"  -v, --verbose		Increase verbosity" "\n"
 	"  -r, --range=RANGE	Ranges of source addresses" "\n"
 	"			e.g. 80,50-100,200-210 (defaults to 0-253)" "\n"
-	"  -c, --cache=FILE	Cache file to save/restore the source address" "\n"
+	"  -c, --cache=FILE	Cache file to save/restore the source addresses" "\n"
 	"  -a, --address=ADDRESS	Start with Source Address ADDRESS" "\n"
+	"  -C, --claim=NAME[:INTF[:RANGE]]" "\n"
+	"			Claim an address for another NAME, may be repeated" "\n"
 	"\n"
 	"NAME is the 64bit nodename" "\n"
+	"INTF defaults to can0, RANGE to the one of -r" "\n"
+	"ADDRESS applies to the NAME given without -C" "\n"
 	"\n"
 	"Examples:" "\n"
 	"j1939acd -r 100,80-120 -c /tmp/1122334455667788.jacd 1122334455667788" "\n"
 	"j1939acd -r 100,80-120 -c /tmp/1122334455667788.jacd 1122334455667788 vcan0" "\n"
+	"j1939acd -c /tmp/gw.jacd -C 1122334455667788:vcan0:80-90 -C 1122334455667799:vcan1" "\n"
 	;
 
 #ifdef _GNU_SOURCE
@@ -53,13 +59,14 @@ static struct option long_opts[] = {
 	{ "range", required_argument, NULL, 'r', },
 	{ "cache", required_argument, NULL, 'c', },
 	{ "address", required_argument, NULL, 'a', },
+	{ "claim", required_argument, NULL, 'C', },
 	{ },
 };
 #else
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "vr:c:a:?";
+static const char optstring[] = "vr:c:a:C:?";
 
 /* byte swap functions */
 static inline int host_is_little_endian(void)
@@ -95,61 +102,160 @@ static inline int must_warn(int ret)
 	return 1;
 }
 
-/* global variables */
-static char default_range[] = "0x80-0xfd";
-static const char default_intf[] = "can0";
+#define ACD_RX_BATCH	32
+#define ACD_HASH_BITS	8
+#define ACD_REQ_PENDING_MS	1250
+#define ACD_RETRY_MS	50
 
-static struct {
-	int verbose;
-	const char *cachefile;
+/* address flags */
+#define F_USE	0x01
+#define F_SEEN	0x02
 
+struct acd_bus;
+
+/* one NAME that claims an address on one bus */
+struct acd_claim {
+	struct acd_claim *next;		/* all claims, in command line order */
+	struct acd_claim *bus_next;	/* claims on the same bus */
+	struct acd_bus *bus;
 	const char *intf;
-	char *ranges;
+	const char *ranges;		/* NULL for the ranges of -r */
 	uint64_t name;
+	uint8_t flags[J1939_IDLE_ADDR];	/* F_USE */
+	int sock;			/* bound to name, for sending */
 	uint8_t current_sa;
 	uint8_t last_sa;
-	volatile sig_atomic_t signal_num;
-	int sig_alrm;
-	int sig_usr1;
+	bool req;			/* request to current_sa received */
 	int state;
 		#define STATE_INITIAL 0
-		#define STATE_REQ_SENT 1
-		#define STATE_REQ_PENDING 2 /* wait 1250 msec for first claim */
-		#define STATE_OPERATIONAL 3
+		#define STATE_REQ_PENDING 1 /* wait 1250 msec for first claim */
+		#define STATE_OPERATIONAL 2
+		#define STATE_FAILED 3 /* no address left, cannot claim */
+	struct libj1939_timer timer;
+};
+
+/* the view of one interface, shared by all claims on it */
+struct acd_bus {
+	struct acd_bus *next;
+	const char *intf;
+	int ifindex;
+	int sock;			/* promiscuous, for receiving */
+	struct libj1939_rx rx;
+	struct acd_claim *claims;
+	bool req_all;			/* global request received */
+
+	/*
+	 * Claimed NAMEs by address. The addresses with a NAME are linked
+	 * into hash chains by hash_next, so that the address of a NAME is
+	 * found without scanning the table.
+	 */
+	uint64_t name[J1939_IDLE_ADDR /* =254 */];
+	uint8_t flags[J1939_IDLE_ADDR];	/* F_SEEN */
+	uint8_t hash_next[J1939_IDLE_ADDR];
+	uint8_t hash[1 << ACD_HASH_BITS];
+};
+
+/* global variables */
+static char default_range[] = "0x80-0xfd";
+static const char default_intf[] = "can0";
+
+static struct {
+	int verbose;
+	const char *cachefile;
+
+	const char *ranges;
+	struct acd_claim *claims;
+	struct acd_bus *buses;
+	int claims_num;
+	int buses_num;
+	int failed_num;
+	struct libj1939_cmn cmn;
+	int signal_fd;
+	int signal_num;
 } s = {
-	.intf = default_intf,
 	.ranges = default_range,
-	.current_sa = J1939_IDLE_ADDR,
-	.last_sa = J1939_NO_ADDR,
 };
 
-struct {
-	uint64_t name;
-	int flags;
-		#define F_USE	0x01
-		#define F_SEEN	0x02
-} addr[J1939_IDLE_ADDR /* =254 */];
+/* hash table of the claimed NAMEs */
+static inline unsigned int hash_name(uint64_t name)
+{
+	return (name * 0x9e3779b97f4a7c15ULL) >> (64 - ACD_HASH_BITS);
+}
 
 /* lookup by name */
-static int lookup_name(uint64_t name)
+static int lookup_name(struct acd_bus *bus, uint64_t name)
 {
 	int j;
 
-	for (j = 0; j < J1939_IDLE_ADDR; ++j) {
-		if (addr[j].name == name)
+	for (j = bus->hash[hash_name(name)]; j < J1939_IDLE_ADDR;
+	     j = bus->hash_next[j]) {
+		if (bus->name[j] == name)
 			return j;
 	}
 	return J1939_IDLE_ADDR;
+}
 
+static void forget_name(struct acd_bus *bus, int sa)
+{
+	uint8_t *pj;
+
+	for (pj = &bus->hash[hash_name(bus->name[sa])]; *pj < J1939_IDLE_ADDR;
+	     pj = &bus->hash_next[*pj]) {
+		if (*pj == sa) {
+			*pj = bus->hash_next[sa];
+			break;
+		}
+	}
+	bus->name[sa] = 0;
+	bus->hash_next[sa] = J1939_IDLE_ADDR;
+}
+
+static void update_name(struct acd_bus *bus, int sa, uint64_t name)
+{
+	unsigned int h;
+	int j;
+
+	j = lookup_name(bus, name);
+	if (j == sa)
+		return;
+	if (j < J1939_IDLE_ADDR)
+		/* update cache */
+		forget_name(bus, j);
+	if (bus->name[sa])
+		forget_name(bus, sa);
+
+	h = hash_name(name);
+	bus->name[sa] = name;
+	bus->hash_next[sa] = bus->hash[h];
+	bus->hash[h] = sa;
+}
+
+/*
+ * Our claims on a bus. There are only a few of them, a gateway claims
+ * for a handful of virtual ECUs.
+ */
+static struct acd_claim *lookup_claim(struct acd_bus *bus, uint64_t name)
+{
+	struct acd_claim *claim;
+
+	for (claim = bus->claims; claim; claim = claim->bus_next) {
+		if (claim->name == name)
+			return claim;
+	}
+	return NULL;
 }
 
 /* parse address range */
-static int parse_range(char *str)
+static int parse_range(struct acd_claim *claim, const char *ranges)
 {
-	char *tok, *endp;
+	char *str, *tok, *endp;
 	int a0, ae;
 	int j, cnt;
 
+	str = strdup(ranges);
+	if (!str)
+		err(1, "strdup");
+
 	cnt = 0;
 	for (tok = strtok(str, ",;"); tok; tok = strtok(NULL, ",;")) {
 		a0 = ae = strtoul(tok, &endp, 0);
@@ -166,9 +272,10 @@ static int parse_range(char *str)
 		for (j = a0; j <= ae; ++j, ++cnt) {
 			if (j == J1939_IDLE_ADDR)
 				break;
-			addr[j].flags |= F_USE;
+			claim->flags[j] |= F_USE;
 		}
 	}
+	free(str);
 	return cnt;
 }
 
@@ -186,7 +293,23 @@ static const struct j1939_filter filt[] = {
 	},
 };
 
-static int open_socket(const char *device, uint64_t name)
+/*
+ * The claim sockets only send, everything is received on the bus socket.
+ * J1939 sockets don't implement shutdown(), so a filter on the PGN bit
+ * that no received PGN has keeps their receive queues empty.
+ */
+static const struct j1939_filter nofilt[] = {
+	{
+		.pgn = J1939_NO_PGN,
+		.pgn_mask = J1939_NO_PGN,
+	},
+};
+
+/*
+ * Without a name, the socket is opened promiscuous to receive the claims
+ * and requests to all addresses on the bus. With a name, it only sends.
+ */
+static int open_socket(int ifindex, uint64_t name)
 {
 	int ret, sock;
 	int value;
@@ -194,10 +317,10 @@ static int open_socket(const char *device, uint64_t name)
 		.can_family = AF_CAN,
 		.can_addr.j1939 = {
 			.name = name,
-			.addr = J1939_IDLE_ADDR,
+			.addr = name ? J1939_IDLE_ADDR : J1939_NO_ADDR,
 			.pgn = J1939_NO_PGN,
 		},
-		.can_ifindex = if_nametoindex(device),
+		.can_ifindex = ifindex,
 	};
 
 	if (s.verbose)
@@ -207,9 +330,14 @@ static int open_socket(const char *device, uint64_t name)
 		err(1, "socket(j1939)");
 
 	if (s.verbose)
-		fprintf(stderr, "- setsockopt(, SOL_CAN_J1939, SO_J1939_FILTER, <filter>, %zd);\n", sizeof(filt));
-	ret = setsockopt(sock, SOL_CAN_J1939, SO_J1939_FILTER,
-			&filt, sizeof(filt));
+		fprintf(stderr, "- setsockopt(, SOL_CAN_J1939, SO_J1939_FILTER, <filter>, %zd);\n",
+			name ? sizeof(nofilt) : sizeof(filt));
+	if (name)
+		ret = setsockopt(sock, SOL_CAN_J1939, SO_J1939_FILTER,
+				&nofilt, sizeof(nofilt));
+	else
+		ret = setsockopt(sock, SOL_CAN_J1939, SO_J1939_FILTER,
+				&filt, sizeof(filt));
 	if (ret < 0)
 		err(1, "setsockopt filter");
 
@@ -221,6 +349,15 @@ static int open_socket(const char *device, uint64_t name)
 	if (ret < 0)
 		err(1, "setsockopt set broadcast");
 
+	if (!name) {
+		if (s.verbose)
+			fprintf(stderr, "- setsockopt(, SOL_CAN_J1939, SO_J1939_PROMISC, %d, %zd);\n", value, sizeof(value));
+		ret = setsockopt(sock, SOL_CAN_J1939, SO_J1939_PROMISC,
+				&value, sizeof(value));
+		if (ret < 0)
+			err(1, "setsockopt set promisc");
+	}
+
 	if (s.verbose)
 		fprintf(stderr, "- bind(, %s, %zi);\n", libj1939_addr2str(&saddr), sizeof(saddr));
 	ret = bind(sock, (void *)&saddr, sizeof(saddr));
@@ -230,7 +367,7 @@ static int open_socket(const char *device, uint64_t name)
 }
 
 /* real IO function */
-static int repeat_address(int sock, uint64_t name)
+static int repeat_address(struct acd_claim *claim)
 {
 	int ret;
 	uint8_t dat[8];
@@ -242,37 +379,44 @@ static int repeat_address(int sock, uint64_t name)
 		},
 	};
 
-	memcpy(dat, &name, 8);
+	memcpy(dat, &claim->name, 8);
 	if (!host_is_little_endian())
 		bswap(dat, 8);
 	if (s.verbose)
-		fprintf(stderr, "- send(, %" PRId64 ", 8, 0);\n", name);
-	ret = sendto(sock, dat, sizeof(dat), 0, (const struct sockaddr *)&saddr,
-		     sizeof(saddr));
+		fprintf(stderr, "- send(, %" PRId64 ", 8, 0);\n", claim->name);
+	ret = sendto(claim->sock, dat, sizeof(dat), 0,
+		     (const struct sockaddr *)&saddr, sizeof(saddr));
 	if (must_warn(ret))
-		fprintf(stderr, "send address claim for 0x%02x\n", s.last_sa);
+		fprintf(stderr, "send address claim for 0x%02x\n", claim->last_sa);
+	if (ret < 0)
+		/* try again */
+		libj1939_timer_start(&s.cmn, &claim->timer, ACD_RETRY_MS, 0);
 	return ret;
 }
-static int claim_address(int sock, uint64_t name, int sa)
+
+static int claim_address(struct acd_claim *claim, int sa)
 {
 	int ret;
 	struct sockaddr_can saddr = {
 		.can_family = AF_CAN,
 		.can_addr.j1939 = {
-			.name = name,
+			.name = claim->name,
 			.addr = sa,
 			.pgn = J1939_NO_PGN,
 		},
-		.can_ifindex = if_nametoindex(s.intf),
+		.can_ifindex = claim->bus->ifindex,
 	};
 
 	if (s.verbose)
 		fprintf(stderr, "- bind(, %s, %zi);\n", libj1939_addr2str(&saddr), sizeof(saddr));
-	ret = bind(sock, (void *)&saddr, sizeof(saddr));
+	ret = bind(claim->sock, (void *)&saddr, sizeof(saddr));
 	if (ret < 0)
 		err(1, "rebind with sa 0x%02x", sa);
-	s.last_sa = sa;
-	return repeat_address(sock, name);
+	claim->last_sa = sa;
+	/* keep our other claims away from this address */
+	if (sa < J1939_IDLE_ADDR)
+		update_name(claim->bus, sa, claim->name);
+	return repeat_address(claim);
 }
 
 static int request_addresses(int sock)
@@ -294,21 +438,33 @@ static int request_addresses(int sock)
 }
 
 /* real policy */
-static int choose_new_sa(uint64_t name, int sa)
+static int addr_is_taken(struct acd_claim *claim, int sa)
+{
+	struct acd_claim *other;
+
+	/* never contest our own claims */
+	other = lookup_claim(claim->bus, claim->bus->name[sa]);
+	return other && other != claim;
+}
+
+static int choose_new_sa(struct acd_claim *claim, int sa)
 {
+	struct acd_bus *bus = claim->bus;
+	uint64_t name = claim->name;
 	int j, cnt;
 
 	/* test current entry */
-	if ((sa < J1939_IDLE_ADDR) && (addr[sa].flags & F_USE)) {
+	if ((sa < J1939_IDLE_ADDR) && (claim->flags[sa] & F_USE) &&
+	    !addr_is_taken(claim, sa)) {
 		j = sa;
-		if (!addr[j].name || (addr[j].name == name) || (addr[j].name > name))
+		if (!bus->name[j] || (bus->name[j] == name) || (bus->name[j] > name))
 			return j;
 	}
 	/* take first empty spot */
 	for (j = 0; j < J1939_IDLE_ADDR; ++j) {
-		if (!(addr[j].flags & F_USE))
+		if (!(claim->flags[j] & F_USE))
 			continue;
-		if (!addr[j].name || (addr[j].name == name))
+		if (!bus->name[j] || (bus->name[j] == name))
 			return j;
 	}
 
@@ -321,91 +477,408 @@ static int choose_new_sa(uint64_t name, int sa)
 	for (cnt = 0; cnt < J1939_IDLE_ADDR; ++j, ++cnt) {
 		if (j >= J1939_IDLE_ADDR)
 			j = 0;
-		if (!(addr[j].flags & F_USE))
+		if (!(claim->flags[j] & F_USE))
 			continue;
-		if (name < addr[j].name)
+		if (name < bus->name[j] && !addr_is_taken(claim, j))
 			return j;
 	}
 	return J1939_IDLE_ADDR;
 }
 
-/* signa handling */
-static void sighandler(int sig, siginfo_t *info, void *vp)
+/* give up, but keep answering requests with 'cannot claim' */
+static void fail_claim(struct acd_claim *claim)
 {
-	switch (sig) {
-	case SIGINT:
-	case SIGTERM:
-		s.signal_num = sig;
+	fprintf(stdout, "%s:%016llx: no address left\n", claim->intf,
+		(long long)claim->name);
+	libj1939_timer_stop(&s.cmn, &claim->timer);
+	/* put J1939_IDLE_ADDR in cache file */
+	claim->current_sa = J1939_IDLE_ADDR;
+	claim->state = STATE_FAILED;
+	++s.failed_num;
+	claim_address(claim, J1939_IDLE_ADDR);
+}
+
+static int claim_timer(struct libj1939_cmn *cmn, struct libj1939_timer *timer)
+{
+	struct acd_claim *claim = timer->ctx;
+	int sa;
+
+	switch (claim->state) {
+	case STATE_REQ_PENDING:
+		/* claim addr */
+		sa = choose_new_sa(claim, claim->current_sa);
+		if (sa == J1939_IDLE_ADDR) {
+			fail_claim(claim);
+			break;
+		}
+		claim->state = STATE_OPERATIONAL;
+		claim_address(claim, sa);
 		break;
-	case SIGALRM:
-		s.sig_alrm = 1;
+	case STATE_OPERATIONAL:
+	case STATE_FAILED:
+		repeat_address(claim);
 		break;
-	case SIGUSR1:
-		s.sig_usr1 = 1;
+	}
+	return 0;
+}
+
+/* received messages of one bus */
+static int rx_request(void *ctx, struct libj1939_rx_msg *msg)
+{
+	struct acd_bus *bus = ctx;
+	struct acd_claim *claim;
+	const uint8_t *dat = msg->buf;
+	int pgn;
+
+	if (msg->len < 3)
+		return 0;
+	pgn = dat[0] + (dat[1] << 8) + ((dat[2] & 0x03) << 16);
+	if (pgn != J1939_PGN_ADDRESS_CLAIMED)
+		/* not interested */
+		return 0;
+
+	/* answered once per batch, see answer_requests() */
+	if (msg->dst_addr >= J1939_IDLE_ADDR) {
+		bus->req_all = true;
+		return 0;
+	}
+	for (claim = bus->claims; claim; claim = claim->bus_next) {
+		if (claim->current_sa == msg->dst_addr)
+			claim->req = true;
+	}
+	return 0;
+}
+
+static int rx_address_claimed(void *ctx, struct libj1939_rx_msg *msg)
+{
+	struct acd_bus *bus = ctx;
+	struct acd_claim *claim;
+	uint64_t name = msg->peername.can_addr.j1939.name;
+	int sa = msg->peername.can_addr.j1939.addr;
+
+	if (sa >= J1939_IDLE_ADDR) {
+		sa = lookup_name(bus, name);
+		if (sa < J1939_IDLE_ADDR)
+			forget_name(bus, sa);
+		return 0;
+	}
+
+	update_name(bus, sa, name);
+	bus->flags[sa] |= F_SEEN;
+
+	claim = lookup_claim(bus, name);
+	if (claim) {
+		/* ourselves */
+		claim->current_sa = sa;
+		if (s.verbose)
+			fprintf(stderr, "- %s:%016llx: claimed 0x%02x\n",
+				claim->intf, (long long)claim->name, sa);
+		return 0;
+	}
+
+	for (claim = bus->claims; claim; claim = claim->bus_next) {
+		if (sa != claim->current_sa)
+			continue;
+		if (s.verbose)
+			fprintf(stderr, "- %s:%016llx: address collision for 0x%02x\n",
+				claim->intf, (long long)claim->name, sa);
+		if (claim->name > name) {
+			sa = choose_new_sa(claim, sa);
+			if (sa == J1939_IDLE_ADDR) {
+				fail_claim(claim);
+				break;
+			}
+		}
+		claim_address(claim, sa);
 		break;
 	}
+	return 0;
 }
 
-static void install_signal(int sig)
+static int rx_address_commanded(void *ctx, struct libj1939_rx_msg *msg)
+{
+	struct acd_bus *bus = ctx;
+	struct acd_claim *claim;
+	uint64_t cmd_name;
+	uint8_t dat[9];
+
+	if (msg->len < sizeof(dat))
+		return 0;
+	memcpy(dat, msg->buf, sizeof(dat));
+	if (!host_is_little_endian())
+		bswap(dat, 8);
+	memcpy(&cmd_name, dat, 8);
+
+	claim = lookup_claim(bus, cmd_name);
+	if (!claim)
+		return 0;
+	if (claim->state == STATE_FAILED) {
+		claim->state = STATE_OPERATIONAL;
+		--s.failed_num;
+	}
+	claim_address(claim, dat[8]);
+	return 0;
+}
+
+static const struct libj1939_rx_handler rx_handlers[] = {
+	{ J1939_PGN_REQUEST, rx_request },
+	{ J1939_PGN_ADDRESS_CLAIMED, rx_address_claimed },
+	{ J1939_PGN_ADDRESS_COMMANDED, rx_address_commanded },
+};
+
+/*
+ * Requests for address claimed often come in bursts, e.g. from every node
+ * that joins the bus at power up. Each claim answers all requests of one
+ * receive batch with a single address claimed message.
+ */
+static void answer_requests(struct acd_bus *bus)
+{
+	struct acd_claim *claim;
+
+	for (claim = bus->claims; claim; claim = claim->bus_next) {
+		if (!bus->req_all && !claim->req)
+			continue;
+		claim->req = false;
+		if (claim->state == STATE_OPERATIONAL ||
+		    claim->state == STATE_FAILED)
+			claim_address(claim, claim->current_sa);
+	}
+	bus->req_all = false;
+}
+
+static void handle_bus(struct acd_bus *bus)
 {
 	int ret;
-	struct sigaction sigact = {
-		.sa_sigaction = sighandler,
-		.sa_flags = SA_SIGINFO,
-	};
 
-	sigfillset(&sigact.sa_mask);
-	ret = sigaction(sig, &sigact, NULL);
-	if (ret < 0)
-		err(1, "sigaction for signal %i", sig);
+	ret = libj1939_rx_dispatch(&bus->rx, bus->sock);
+	if (ret < 0) {
+		errno = -ret;
+		err(1, "recvmmsg() on %s", bus->intf);
+	}
+	answer_requests(bus);
+}
+
+/* setup */
+static struct acd_claim *add_claim(const char *intf, uint64_t name,
+				   const char *ranges)
+{
+	struct acd_claim *claim;
+
+	claim = calloc(1, sizeof(*claim));
+	if (!claim)
+		err(1, "calloc");
+	claim->intf = intf;
+	claim->name = name;
+	claim->ranges = ranges;
+	claim->current_sa = J1939_IDLE_ADDR;
+	claim->last_sa = J1939_NO_ADDR;
+	claim->sock = -1;
+	libj1939_timer_init(&claim->timer, claim_timer, claim);
+	++s.claims_num;
+	return claim;
+}
+
+/* NAME[:INTF[:RANGE]] */
+static struct acd_claim *parse_claim(char *spec)
+{
+	const char *intf = default_intf, *ranges = NULL;
+	char *str;
+	uint64_t name;
+
+	name = strtoull(spec, &str, 16);
+	if (*str == ':') {
+		intf = ++str;
+		str = strchr(str, ':');
+		if (str) {
+			*str = 0;
+			ranges = str + 1;
+		}
+	} else if (*str) {
+		name = 0;
+	}
+	if (!name || !*intf)
+		errx(1, "bad claim '%s'", spec);
+	return add_claim(intf, name, ranges);
 }
 
-static void schedule_itimer(int msec)
+static struct acd_bus *get_bus(const char *intf)
+{
+	struct acd_bus *bus;
+	int j;
+
+	for (bus = s.buses; bus; bus = bus->next) {
+		if (!strcmp(bus->intf, intf))
+			return bus;
+	}
+
+	bus = calloc(1, sizeof(*bus));
+	if (!bus)
+		err(1, "calloc");
+	bus->intf = intf;
+	bus->ifindex = if_nametoindex(intf);
+	if (!bus->ifindex)
+		err(1, "if_nametoindex(%s)", intf);
+	for (j = 0; j < J1939_IDLE_ADDR; ++j)
+		bus->hash_next[j] = J1939_IDLE_ADDR;
+	memset(bus->hash, J1939_IDLE_ADDR, sizeof(bus->hash));
+	bus->next = s.buses;
+	s.buses = bus;
+	++s.buses_num;
+	return bus;
+}
+
+static void open_bus(struct acd_bus *bus)
 {
 	int ret;
-	struct itimerval val = { 0 };
 
-	val.it_value.tv_sec = msec / 1000;
-	val.it_value.tv_usec = (msec % 1000) * 1000;
+	bus->sock = open_socket(bus->ifindex, 0);
+	ret = libj1939_rx_init(&bus->rx, ACD_RX_BATCH, 9);
+	if (ret < 0) {
+		errno = -ret;
+		err(1, "rx buffers");
+	}
+	libj1939_rx_set_handlers(&bus->rx, rx_handlers,
+				 sizeof(rx_handlers) / sizeof(rx_handlers[0]),
+				 NULL, bus);
+	ret = libj1939_add_socket_to_epoll(s.cmn.epoll_fd, bus->sock,
+					   EPOLLIN);
+	if (ret < 0) {
+		errno = -ret;
+		err(1, "epoll_ctl()");
+	}
+}
 
-	s.sig_alrm = 0;
-	do {
-		ret = setitimer(ITIMER_REAL, &val, NULL);
-	} while ((ret < 0) && (errno == EINTR));
+/* one request for all claims on the bus */
+static void start_bus(struct acd_bus *bus)
+{
+	struct acd_claim *claim;
+	int ret;
+
+	ret = request_addresses(bus->claims->sock);
 	if (ret < 0)
-		err(1, "setitimer %i msec", msec);
+		err(1, "could not sent initial request");
+
+	if (s.verbose)
+		fprintf(stderr, "- %s: request sent, pending for %u ms\n",
+			bus->intf, ACD_REQ_PENDING_MS);
+	for (claim = bus->claims; claim; claim = claim->bus_next) {
+		claim->state = STATE_REQ_PENDING;
+		ret = libj1939_timer_start(&s.cmn, &claim->timer,
+					   ACD_REQ_PENDING_MS, 0);
+		if (ret < 0) {
+			errno = -ret;
+			err(1, "timer");
+		}
+	}
+}
+
+static void open_events(void)
+{
+	sigset_t mask;
+	int ret;
+
+	ret = libj1939_create_epoll();
+	if (ret < 0) {
+		errno = -ret;
+		err(1, "epoll_create1()");
+	}
+	s.cmn.epoll_fd = ret;
+	/* buses, signals and timers */
+	s.cmn.epoll_events_size = s.buses_num + 2;
+	s.cmn.epoll_events = calloc(s.cmn.epoll_events_size,
+				    sizeof(struct epoll_event));
+	if (!s.cmn.epoll_events)
+		err(1, "calloc");
+
+	ret = libj1939_timers_init(&s.cmn);
+	if (ret < 0) {
+		errno = -ret;
+		err(1, "timerfd");
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+		err(1, "sigprocmask");
+	s.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (s.signal_fd < 0)
+		err(1, "signalfd");
+	ret = libj1939_add_socket_to_epoll(s.cmn.epoll_fd, s.signal_fd,
+					   EPOLLIN);
+	if (ret < 0) {
+		errno = -ret;
+		err(1, "epoll_ctl()");
+	}
 }
 
 /* dump status */
-static inline int addr_status_mine(int sa)
+static inline int addr_status_mine(struct acd_bus *bus, int sa)
 {
-	if (sa == s.current_sa)
-		return '*';
-	if (addr[sa].flags & F_USE)
-		return '+';
-	return '-';
+	struct acd_claim *claim;
+	int ret = '-';
+
+	for (claim = bus->claims; claim; claim = claim->bus_next) {
+		if (sa == claim->current_sa)
+			return '*';
+		if (claim->flags[sa] & F_USE)
+			ret = '+';
+	}
+	return ret;
 }
 
 static void dump_status(void)
 {
-	int j;
+	struct acd_bus *bus;
+	int j, mine;
 
-	for (j = 0; j < J1939_IDLE_ADDR; ++j) {
-		if (!addr[j].flags && !addr[j].name)
-			continue;
-		fprintf(stdout, "%02x: %c", j, addr_status_mine(j));
-		if (addr[j].name)
-			fprintf(stdout, " %016llx", (long long)addr[j].name);
-		else
-			fprintf(stdout, " -");
-		fprintf(stdout, "\n");
+	for (bus = s.buses; bus; bus = bus->next) {
+		if (s.buses_num > 1)
+			fprintf(stdout, "%s:\n", bus->intf);
+		for (j = 0; j < J1939_IDLE_ADDR; ++j) {
+			mine = addr_status_mine(bus, j);
+			if (mine == '-' && !bus->flags[j] && !bus->name[j])
+				continue;
+			fprintf(stdout, "%02x: %c", j, mine);
+			if (bus->name[j])
+				fprintf(stdout, " %016llx", (long long)bus->name[j]);
+			else
+				fprintf(stdout, " -");
+			fprintf(stdout, "\n");
+		}
 	}
 	fflush(stdout);
 }
 
-/* cache file */
+/* signal handling */
+static void handle_signals(void)
+{
+	struct signalfd_siginfo info;
+
+	while (read(s.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+		case SIGINT:
+		case SIGTERM:
+			s.signal_num = info.ssi_signo;
+			break;
+		case SIGUSR1:
+			dump_status();
+			break;
+		}
+	}
+}
+
+/*
+ * cache file
+ *
+ * One line "SA INTF NAME" per claim. A line with only SA, as written by
+ * older versions, belongs to the first claim.
+ */
 static void save_cache(void)
 {
+	struct acd_claim *claim;
 	FILE *fp;
 	time_t t;
 
@@ -418,16 +891,21 @@ static void save_cache(void)
 	time(&t);
 	fprintf(fp, "# saved on %s\n", ctime(&t));
 	fprintf(fp, "\n");
-	fprintf(fp, "0x%02x\n", s.current_sa);
+	for (claim = s.claims; claim; claim = claim->next)
+		fprintf(fp, "0x%02x %s %016llx\n", claim->current_sa,
+			claim->intf, (long long)claim->name);
 	fclose(fp);
 }
 
 static void restore_cache(void)
 {
+	struct acd_claim *claim;
 	FILE *fp;
-	int ret;
+	int ret, sa;
 	char *endp;
 	char *line = 0;
+	char intf[IFNAMSIZ];
+	unsigned long long name;
 	size_t sz = 0;
 
 	if (!s.cachefile)
@@ -444,10 +922,16 @@ static void restore_cache(void)
 			continue;
 		if (line[0] == '#')
 			continue;
-		ret = strtoul(line, &endp, 0);
-		if ((endp > line) && (ret >= 0) && (ret <= J1939_IDLE_ADDR)) {
-			s.current_sa = ret;
-			break;
+		sa = strtoul(line, &endp, 0);
+		if ((endp <= line) || (sa < 0) || (sa > J1939_IDLE_ADDR))
+			continue;
+		if (sscanf(endp, "%15s %llx", intf, &name) != 2) {
+			s.claims->current_sa = sa;
+			continue;
+		}
+		for (claim = s.claims; claim; claim = claim->next) {
+			if (claim->name == name && !strcmp(claim->intf, intf))
+				claim->current_sa = sa;
 		}
 	}
 	fclose(fp);
@@ -458,13 +942,13 @@ static void restore_cache(void)
 /* main */
 int main(int argc, char *argv[])
 {
-	int ret, sock, sock_rx, pgn, sa, opt;
-	socklen_t slen;
-	uint8_t dat[9];
-	struct sockaddr_can saddr;
-	uint64_t cmd_name;
+	struct acd_claim *claim, **pclaim;
+	struct acd_bus *bus;
+	int ret, opt, n, nfds;
+	int start_sa = J1939_IDLE_ADDR;
 
 	/* argument parsing */
+	pclaim = &s.claims;
 	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) != -1)
 		switch (opt) {
 		case 'v':
@@ -477,7 +961,11 @@ int main(int argc, char *argv[])
 			s.ranges = optarg;
 			break;
 		case 'a':
-			s.current_sa = strtoul(optarg, 0, 0);
+			start_sa = strtoul(optarg, 0, 0);
+			break;
+		case 'C':
+			*pclaim = parse_claim(optarg);
+			pclaim = &(*pclaim)->next;
 			break;
 		default:
 			fputs(help_msg, stderr);
@@ -485,154 +973,86 @@ int main(int argc, char *argv[])
 			break;
 		}
 
-	if (argv[optind])
-		s.name = strtoull(argv[optind++], 0, 16);
-	if (argv[optind])
-		s.intf = argv[optind++];
+	if (argv[optind]) {
+		/* the NAME without -C comes first, for old cache files */
+		claim = add_claim(default_intf, strtoull(argv[optind++], 0, 16),
+				  NULL);
+		if (argv[optind])
+			claim->intf = argv[optind++];
+		claim->current_sa = start_sa;
+		claim->next = s.claims;
+		s.claims = claim;
+	}
 
 	/* args done */
 
+	if (!s.claims)
+		errx(1, "bad arguments");
+
 	restore_cache();
 
-	ret = parse_range(s.ranges);
-	if (!ret)
-		err(1, "no addresses in range");
+	for (claim = s.claims; claim; claim = claim->next) {
+		if (!claim->name)
+			errx(1, "bad arguments");
+		ret = parse_range(claim, claim->ranges ? claim->ranges : s.ranges);
+		if (!ret)
+			err(1, "no addresses in range");
+
+		if ((claim->current_sa < J1939_IDLE_ADDR) &&
+		    !(claim->flags[claim->current_sa] & F_USE)) {
+			if (s.verbose)
+				fprintf(stderr, "- forget saved address 0x%02x\n", claim->current_sa);
+			claim->current_sa = J1939_IDLE_ADDR;
+		}
 
-	if ((s.current_sa < J1939_IDLE_ADDR) && !(addr[s.current_sa].flags & F_USE)) {
+		bus = get_bus(claim->intf);
+		if (lookup_claim(bus, claim->name))
+			errx(1, "%s:%016llx claimed twice", claim->intf,
+			     (long long)claim->name);
+		claim->bus = bus;
+		claim->bus_next = bus->claims;
+		bus->claims = claim;
+	}
+
+	open_events();
+	for (bus = s.buses; bus; bus = bus->next)
+		open_bus(bus);
+	for (claim = s.claims; claim; claim = claim->next) {
 		if (s.verbose)
-			fprintf(stderr, "- forget saved address 0x%02x\n", s.current_sa);
-		s.current_sa = J1939_IDLE_ADDR;
+			fprintf(stderr, "- ready for %s:%016llx\n", claim->intf, (long long)claim->name);
+		claim->sock = open_socket(claim->bus->ifindex, claim->name);
 	}
+	for (bus = s.buses; bus; bus = bus->next)
+		start_bus(bus);
 
-	if (s.verbose)
-		fprintf(stderr, "- ready for %s:%016llx\n", s.intf, (long long)s.name);
-	if (!s.intf || !s.name)
-		err(1, "bad arguments");
-	ret = sock = open_socket(s.intf, s.name);
-	sock_rx = open_socket(s.intf, s.name);
-
-	install_signal(SIGTERM);
-	install_signal(SIGINT);
-	install_signal(SIGALRM);
-	install_signal(SIGUSR1);
-	install_signal(SIGUSR2);
-
-	while (!s.signal_num) {
-		if (s.sig_usr1) {
-			s.sig_usr1 = 0;
-			dump_status();
-		}
-		switch (s.state) {
-		case STATE_INITIAL:
-			ret = request_addresses(sock);
-			if (ret < 0)
-				err(1, "could not sent initial request");
-			s.state = STATE_REQ_SENT;
-			break;
-		case STATE_REQ_PENDING:
-			if (!s.sig_alrm)
-				break;
-			s.sig_alrm = 0;
-			/* claim addr */
-			sa = choose_new_sa(s.name, s.current_sa);
-			if (sa == J1939_IDLE_ADDR)
-				err(1, "no free address to use");
-			ret = claim_address(sock, s.name, sa);
-			if (ret < 0)
-				schedule_itimer(50);
-			s.state = STATE_OPERATIONAL;
-			break;
-		case STATE_OPERATIONAL:
-			if (s.sig_alrm) {
-				s.sig_alrm = 0;
-				ret = repeat_address(sock, s.name);
-				if (ret < 0)
-					schedule_itimer(50);
-			}
-			break;
+	while (!s.signal_num && s.failed_num < s.claims_num) {
+		ret = libj1939_prepare_for_events(&s.cmn, &nfds, false);
+		if (ret < 0) {
+			errno = -ret;
+			err(1, "epoll_wait()");
 		}
 
-		slen = sizeof(saddr);
-		ret = recvfrom(sock_rx, dat, sizeof(dat), 0, (void *)&saddr, &slen);
-		if (ret < 0) {
-			if (EINTR == errno)
+		for (n = 0; n < nfds; ++n) {
+			int fd = s.cmn.epoll_events[n].data.fd;
+
+			if (fd == s.signal_fd) {
+				handle_signals();
 				continue;
-			err(1, "recvfrom()");
-		}
-		switch (saddr.can_addr.j1939.pgn) {
-		case J1939_PGN_REQUEST:
-			if (ret < 3)
-				break;
-			pgn = dat[0] + (dat[1] << 8) + ((dat[2] & 0x03) << 16);
-			if (pgn != J1939_PGN_ADDRESS_CLAIMED)
-				/* not interested */
-				break;
-			if (s.state == STATE_REQ_SENT) {
-				if (s.verbose)
-					fprintf(stderr, "- request sent, pending for 1250 ms\n");
-				schedule_itimer(1250);
-				s.state = STATE_REQ_PENDING;
-			} else if (s.state == STATE_OPERATIONAL) {
-				ret = claim_address(sock, s.name, s.current_sa);
-				if (ret < 0)
-					schedule_itimer(50);
-			}
-			break;
-		case J1939_PGN_ADDRESS_CLAIMED:
-			if (saddr.can_addr.j1939.addr >= J1939_IDLE_ADDR) {
-				sa = lookup_name(saddr.can_addr.j1939.name);
-				if (sa < J1939_IDLE_ADDR)
-					addr[sa].name = 0;
-				break;
 			}
-			sa = lookup_name(saddr.can_addr.j1939.name);
-			if ((sa != saddr.can_addr.j1939.addr) && (sa < J1939_IDLE_ADDR))
-				/* update cache */
-				addr[sa].name = 0;
-
-			/* shortcut */
-			sa = saddr.can_addr.j1939.addr;
-			addr[sa].name = saddr.can_addr.j1939.name;
-			addr[sa].flags |= F_SEEN;
-
-			if (s.name == saddr.can_addr.j1939.name) {
-				/* ourselves, disable itimer */
-				s.current_sa = sa;
-				if (s.verbose)
-					fprintf(stderr, "- claimed 0x%02x\n", sa);
-			} else if (sa == s.current_sa) {
-				if (s.verbose)
-					fprintf(stderr, "- address collision for 0x%02x\n", sa);
-				if (s.name > saddr.can_addr.j1939.name) {
-					sa = choose_new_sa(s.name, sa);
-					if (sa == J1939_IDLE_ADDR) {
-						fprintf(stdout, "no address left");
-						/* put J1939_IDLE_ADDR in cache file */
-						s.current_sa = sa;
-						goto done;
-					}
-				}
-				ret = claim_address(sock, s.name, sa);
-				if (ret < 0)
-					schedule_itimer(50);
-			}
-			break;
-		case J1939_PGN_ADDRESS_COMMANDED:
-			if (!host_is_little_endian())
-				bswap(dat, 8);
-			memcpy(&cmd_name, dat, 8);
-			if (cmd_name == s.name) {
-				ret = claim_address(sock, s.name, dat[8]);
-				if (ret < 0)
-					schedule_itimer(50);
+			for (bus = s.buses; bus; bus = bus->next) {
+				if (fd == bus->sock)
+					handle_bus(bus);
 			}
-			break;
 		}
 	}
-done:
+
 	if (s.verbose)
 		fprintf(stderr, "- shutdown\n");
-	claim_address(sock, s.name, J1939_IDLE_ADDR);
+	for (claim = s.claims; claim; claim = claim->next) {
+		/* the failed ones did already announce it */
+		if (claim->state != STATE_FAILED)
+			claim_address(claim, J1939_IDLE_ADDR);
+	}
 	save_cache();
 
 	if (s.signal_num)
@@ -9,6 +9,8 @@
 #include <inttypes.h>
 #include <net/if.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,11 +22,18 @@
 #include <linux/net_tstamp.h>
 #include <linux/netlink.h>
 #include <linux/socket.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #include "libj1939.h"
 
 #define J1939_MAX_ETP_PACKET_SIZE (7 * 0x00ffffff)
 #define JCAT_BUF_SIZE (1000 * 1024)
+#define JCAT_SOCKBUF (4 * 64 * 1024) /* four 64 KiB ETP sessions */
+#define JCAT_TS_RING 256 /* SCHED timestamps of the outstanding sessions */
+#define JCAT_BENCH_MAX_SIZES 32
+#define JCAT_BENCH_REPEAT 100
+#define JCAT_BENCH_RX_WAIT 1000 /* ms to wait for the last messages */
 
 /*
  * min()/max()/clamp() macros that also do
@@ -50,14 +59,21 @@ struct j1939cat_stats {
 	uint64_t dst_name;
 };
 
+/* a SCHED timestamp, the tskey tells if the ring slot was reused */
+struct j1939cat_sched {
+	uint32_t tskey;
+	struct timespec ts;
+};
+
 struct j1939cat_priv {
 	int sock;
 	int infile;
 	int outfile;
 	size_t max_transfer;
 	unsigned long repeat;
-	unsigned long round;
 	int todo_prio;
+	size_t sockbuf;
+	unsigned int window;
 
 	bool valid_peername;
 	bool todo_recv;
@@ -74,8 +90,40 @@ struct j1939cat_priv {
 	struct scm_timestamping *tss;
 	struct j1939cat_stats stats;
 	int32_t last_dpo;
+
+	/* transfer statistics */
+	uint32_t tx_sessions;
+	uint32_t tx_done;
+	uint32_t aborted;
+	uint64_t bytes;
+	unsigned long msgs;
+	struct timespec start;
+	struct timespec last;
+	struct j1939cat_sched sched_ts[JCAT_TS_RING];
+	struct timespec rts_ts;
+
+	/* receive path */
+	uint8_t *rxbuf;
+	size_t rxbuf_size;
+
+	/* benchmark */
+	bool quiet;
+	size_t bench_sizes[JCAT_BENCH_MAX_SIZES];
+	unsigned int bench_nsizes;
+	double *lat;
+	unsigned long nlat;
+};
+
+struct j1939cat_bench_rx {
+	int sock;
+	int stop_fd;
+	size_t buf_size;
+	unsigned long msgs;
+	uint64_t bytes;
 };
 
+static volatile sig_atomic_t jcat_running = 1;
+
 static const char help_msg[] =
 	"j1939cat: netcat-like tool for j1939\n"
 	"Usage: j1939cat [options] FROM TO\n"
@@ -88,14 +136,23 @@ static const char help_msg[] =
 	"		With this option send() will be used with MSG_DONTWAIT flag.\n"
 	" -R <count>	Set send repeat count. Default: 1\n"
 	" -B		Allow to send and receive broadcast packets.\n"
+	" -b <size>	SO_SNDBUF/SO_RCVBUF size. 0 = kernel default. Default: 262144\n"
+	" -w <count>	Max. outstanding send sessions. Default: 0 (no limit)\n"
+	" -T <sizes>	Benchmark: send -R (default: 100) sessions of each of the comma\n"
+	"		separated sizes from FROM to a receiver on TO in this process\n"
+	"		with max. -w (default: 1) outstanding sessions.\n"
+	"\n"
+	"Regular input files are sent from a memory mapping.\n"
+	"Transfer statistics and the timing of each session are printed to stderr.\n"
 	"\n"
 	"Example:\n"
 	"j1939cat -i some_file_to_send  can0:0x80 :0x90,0x12300\n"
 	"j1939cat can0:0x90 -r > /tmp/some_file_to_receive\n"
+	"j1939cat -T 8,1785,65536 -R 1000 vcan0:0x80 :0x90,0x12300 > bench.csv\n"
 	"\n"
 	;
 
-static const char optstring[] = "?hi:vs:rp:P:R:B";
+static const char optstring[] = "?hi:vs:rp:P:R:Bb:w:T:";
 
 static ssize_t j1939cat_send_one(struct j1939cat_priv *priv, int out_fd,
 			     const void *buf, size_t buf_size)
@@ -136,7 +193,7 @@ static void j1939cat_print_timestamp(struct j1939cat_priv *priv, const char *nam
 {
 	struct j1939cat_stats *stats = &priv->stats;
 
-	if (!(cur->tv_sec | cur->tv_nsec))
+	if (!(cur->tv_sec | cur->tv_nsec) || priv->quiet)
 		return;
 
 	fprintf(stderr, "  %s: %llu s %llu us (seq=%03u, send=%07u)",
@@ -146,6 +203,54 @@ static void j1939cat_print_timestamp(struct j1939cat_priv *priv, const char *nam
 	fprintf(stderr, "\n");
 }
 
+static double j1939cat_ts_diff(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* an ACKed session: SCHED (start of the session) to ACK timestamp */
+static void j1939cat_session_done(struct j1939cat_priv *priv, struct timespec *ack)
+{
+	struct j1939cat_stats *stats = &priv->stats;
+	struct j1939cat_sched *sched = &priv->sched_ts[stats->tskey % JCAT_TS_RING];
+	double secs;
+
+	priv->tx_done++;
+
+	/*
+	 * With more than JCAT_TS_RING sessions in flight (-w 0) the slot may
+	 * hold a later session, drop the sample instead of a wrong latency.
+	 */
+	if (!(sched->ts.tv_sec | sched->ts.tv_nsec) ||
+	    sched->tskey != stats->tskey)
+		return;
+
+	secs = j1939cat_ts_diff(&sched->ts, ack);
+	sched->ts.tv_sec = sched->ts.tv_nsec = 0;
+
+	if (priv->lat) {
+		priv->lat[priv->nlat++] = secs;
+		return;
+	}
+
+	fprintf(stderr, "  session %u: %u bytes in %.3f ms", stats->tskey,
+		stats->total, secs * 1000);
+	if (secs > 0)
+		fprintf(stderr, " (%.0f byte/s)", stats->total / secs);
+	fprintf(stderr, "\n");
+}
+
+static void j1939cat_print_summary(struct j1939cat_priv *priv, const char *what)
+{
+	double secs = j1939cat_ts_diff(&priv->start, &priv->last);
+
+	fprintf(stderr, "%s %" PRIu64 " bytes in %lu sessions (%u aborted) in %.3f s",
+		what, priv->bytes, priv->msgs, priv->aborted, secs);
+	if (secs > 0)
+		fprintf(stderr, ": %.0f byte/s", priv->bytes / secs);
+	fprintf(stderr, "\n");
+}
+
 static const char *j1939cat_tstype_to_str(int tstype)
 {
 	switch (tstype) {
@@ -228,8 +333,17 @@ static int j1939cat_extract_serr(struct j1939cat_priv *priv)
 		j1939cat_print_timestamp(priv, j1939cat_tstype_to_str(serr->ee_info),
 				     &tss->ts[0]);
 
-		if (serr->ee_info == SCM_TSTAMP_SCHED)
+		if (serr->ee_info == SCM_TSTAMP_SCHED) {
+			struct j1939cat_sched *sched =
+				&priv->sched_ts[stats->tskey % JCAT_TS_RING];
+
+			sched->tskey = stats->tskey;
+			sched->ts = tss->ts[0];
 			return -EINTR;
+		}
+
+		if (serr->ee_info == SCM_TSTAMP_ACK)
+			j1939cat_session_done(priv, &tss->ts[0]);
 		return 0;
 	case SO_EE_ORIGIN_LOCAL:
 		/*
@@ -250,12 +364,15 @@ static int j1939cat_extract_serr(struct j1939cat_priv *priv)
 		switch (serr->ee_info) {
 		case J1939_EE_INFO_TX_ABORT:
 			j1939cat_print_timestamp(priv, "TX ABT", &tss->ts[0]);
+			priv->aborted++;
+			priv->tx_done++;
 			warnx("serr: tx error: %i, %s", serr->ee_errno,
 			      strerror(serr->ee_errno));
 			return serr->ee_errno;
 		case J1939_EE_INFO_RX_RTS:
 			stats->tskey = serr->ee_data;
 			j1939cat_print_timestamp(priv, "RX RTS", &tss->ts[0]);
+			priv->rts_ts = tss->ts[0];
 			fprintf(stderr, "  total size: %u, pgn=0x%05x, sa=0x%02x, da=0x%02x src_name=0x%08" PRIx64 ", dst_name=0x%08" PRIx64 ")\n",
 				stats->total, stats->pgn,  stats->sa, stats->da,
 				stats->src_name, stats->dst_name);
@@ -271,6 +388,8 @@ static int j1939cat_extract_serr(struct j1939cat_priv *priv)
 			return 0;
 		case J1939_EE_INFO_RX_ABORT:
 			j1939cat_print_timestamp(priv, "RX ABT", &tss->ts[0]);
+			priv->aborted++;
+			priv->rts_ts.tv_sec = priv->rts_ts.tv_nsec = 0;
 			warnx("serr: rx error: %i, %s", serr->ee_errno,
 			      strerror(serr->ee_errno));
 			return serr->ee_errno;
@@ -337,27 +456,31 @@ static int j1939cat_recv_err(struct j1939cat_priv *priv)
 	return 0;
 }
 
+/* send one buffer as one (E)TP session */
 static int j1939cat_send_loop(struct j1939cat_priv *priv, int out_fd, char *buf,
 			  size_t buf_size)
 {
-	struct j1939cat_stats *stats = &priv->stats;
 	ssize_t count;
 	char *tmp_buf = buf;
-	unsigned int events = POLLOUT | POLLERR;
-	bool tx_done = false;
 
 	count = buf_size;
 
-	while (!tx_done) {
+	while (count) {
 		ssize_t num_sent = 0;
 
 		if (priv->polltimeout) {
+			unsigned int events = POLLERR;
 			struct pollfd fds = {
 				.fd = priv->sock,
-				.events = events,
 			};
 			int ret;
 
+			/* keep at most 'window' sessions in the socket */
+			if (!priv->window ||
+			    priv->tx_sessions - priv->tx_done < priv->window)
+				events |= POLLOUT;
+			fds.events = events;
+
 			ret = poll(&fds, 1, priv->polltimeout);
 			if (ret == -1) {
 				if (errno == EINTR)
@@ -378,8 +501,6 @@ static int j1939cat_send_loop(struct j1939cat_priv *priv, int out_fd, char *buf,
 					continue;
 				if (ret)
 					return ret;
-				if ((priv->repeat - 1) == stats->tskey)
-					tx_done = true;
 			}
 
 			if (fds.revents & POLLOUT) {
@@ -400,13 +521,42 @@ static int j1939cat_send_loop(struct j1939cat_priv *priv, int out_fd, char *buf,
 			     __func__);
 			return -EINVAL;
 		}
-		if (!count) {
-			if (priv->repeat == priv->round)
-				events = POLLERR;
-			else
-				tx_done = true;
+	}
+
+	priv->tx_sessions++;
+	priv->msgs++;
+	priv->bytes += buf_size;
+
+	return 0;
+}
+
+/* wait for the ACK or abort of all sent sessions */
+static int j1939cat_wait_done(struct j1939cat_priv *priv)
+{
+	struct pollfd fds = {
+		.fd = priv->sock,
+		.events = POLLERR,
+	};
+	int ret;
+
+	if (!priv->polltimeout)
+		return 0;
+
+	while (priv->tx_done < priv->tx_sessions) {
+		ret = poll(&fds, 1, priv->polltimeout);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
 		}
+		if (!ret)
+			return -ETIME;
+
+		ret = j1939cat_recv_err(priv);
+		if (ret && ret != -EINTR)
+			return ret;
 	}
+
 	return 0;
 }
 
@@ -496,10 +646,33 @@ static size_t j1939cat_get_file_size(int fd)
 	return offset;
 }
 
+/* send the memory mapped file without copying it through a buffer */
+static int j1939cat_send_mapped(struct j1939cat_priv *priv, const char *data,
+				size_t size)
+{
+	size_t offset, chunk;
+	unsigned long i;
+	int ret;
+
+	for (i = 0; i < priv->repeat; i++) {
+		for (offset = 0; offset < size; offset += chunk) {
+			chunk = min(priv->max_transfer, size - offset);
+
+			ret = j1939cat_send_loop(priv, priv->sock,
+						 (char *)data + offset, chunk);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
 static int j1939cat_send(struct j1939cat_priv *priv)
 {
 	unsigned int size = 0;
 	unsigned int i;
+	void *data;
 	int ret = 0;
 
 	if (priv->todo_filesize)
@@ -508,74 +681,117 @@ static int j1939cat_send(struct j1939cat_priv *priv)
 	if (!size)
 		return EXIT_FAILURE;
 
-	for (i = 0; i < priv->repeat; i++) {
-		priv->round++;
-		ret = j1939cat_sendfile(priv, priv->sock, priv->infile, NULL, size);
-		if (ret)
-			break;
+	clock_gettime(CLOCK_MONOTONIC, &priv->start);
+
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, priv->infile, 0);
+	if (data != MAP_FAILED) {
+		madvise(data, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+		ret = j1939cat_send_mapped(priv, data, size);
+		munmap(data, size);
+	} else {
+		for (i = 0; i < priv->repeat; i++) {
+			ret = j1939cat_sendfile(priv, priv->sock, priv->infile, NULL, size);
+			if (ret)
+				break;
 
-		if (lseek(priv->infile, 0, SEEK_SET) == -1)
-			err(1, "%s lseek() start\n", __func__);
+			if (lseek(priv->infile, 0, SEEK_SET) == -1)
+				err(1, "%s lseek() start\n", __func__);
+		}
 	}
 
+	if (!ret)
+		ret = j1939cat_wait_done(priv);
+
+	clock_gettime(CLOCK_MONOTONIC, &priv->last);
+	j1939cat_print_summary(priv, "sent");
+
 	return ret;
 }
 
-static int j1939cat_recv_one(struct j1939cat_priv *priv, uint8_t *buf, size_t buf_size)
+static int j1939cat_recv_one(struct j1939cat_priv *priv)
 {
+	struct timespec now;
 	int ret;
 
-	ret = recv(priv->sock, buf, buf_size, 0);
+	/*
+	 * A J1939 socket can't report the length of a message before
+	 * receiving it, so the buffer holds the largest transfer.
+	 */
+	ret = recv(priv->sock, priv->rxbuf, priv->rxbuf_size, 0);
 	if (ret < 0) {
+		if (errno == EINTR)
+			return EXIT_SUCCESS;
 		warn("recvf()");
 		return EXIT_FAILURE;
 	}
 
-	ret = write(priv->outfile, buf, ret);
+	ret = write(priv->outfile, priv->rxbuf, ret);
 	if (ret < 0) {
 		warn("write stdout()");
 		return EXIT_FAILURE;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &priv->last);
+	if (!priv->msgs)
+		priv->start = priv->last;
+	priv->msgs++;
+	priv->bytes += ret;
+
+	/* (E)TP session: RTS to complete message */
+	if (priv->rts_ts.tv_sec | priv->rts_ts.tv_nsec) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		fprintf(stderr, "  session: %i bytes in %.3f ms\n", ret,
+			j1939cat_ts_diff(&priv->rts_ts, &now) * 1000);
+		priv->rts_ts.tv_sec = priv->rts_ts.tv_nsec = 0;
+	}
+
 	return EXIT_SUCCESS;
 }
 
+static void j1939cat_sigterm(int signo)
+{
+	jcat_running = 0;
+}
+
 static int j1939cat_recv(struct j1939cat_priv *priv)
 {
 	unsigned int events = POLLIN | POLLERR;
+	struct sigaction sa = { 0 };
 	int ret = EXIT_SUCCESS;
-	size_t buf_size;
-	uint8_t *buf;
 
-	buf_size = priv->max_transfer;
-	buf = malloc(buf_size);
-	if (!buf) {
+	sa.sa_handler = j1939cat_sigterm;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	priv->rxbuf_size = priv->max_transfer;
+	priv->rxbuf = malloc(priv->rxbuf_size);
+	if (!priv->rxbuf) {
 		warn("can't allocate rx buf");
-		return EXIT_FAILURE;;
+		return EXIT_FAILURE;
 	}
 
 	priv->last_dpo = -1;
 
-	while (priv->todo_recv) {
+	while (priv->todo_recv && jcat_running) {
 		if (priv->polltimeout) {
 			struct pollfd fds = {
 				.fd = priv->sock,
 				.events = events,
 			};
-			int ret;
 
 			ret = poll(&fds, 1, priv->polltimeout);
 			if (ret == -1) {
 				if (errno == EINTR)
 					continue;
-				else
-					return -errno;
+				ret = -errno;
+				break;
 			}
 			if (!ret)
 				continue;
 			if (!(fds.revents & events)) {
 				warn("%s: something else is wrong %x %x", __func__, fds.revents, events);
-				return -EIO;
+				ret = -EIO;
+				break;
 			}
 
 			if (fds.revents & POLLERR) {
@@ -583,22 +799,248 @@ static int j1939cat_recv(struct j1939cat_priv *priv)
 				if (ret == -EINTR)
 					continue;
 				if (ret)
-					return ret;
+					break;
 			}
 
 			if (fds.revents & POLLIN) {
-				ret = j1939cat_recv_one(priv, buf, buf_size);
-				if (ret < 0)
+				ret = j1939cat_recv_one(priv);
+				if (ret)
 					break;
 			}
 		} else {
-			ret = j1939cat_recv_one(priv, buf, buf_size);
+			ret = j1939cat_recv_one(priv);
 			if (ret)
 				break;
 		}
 	}
 
+	j1939cat_print_summary(priv, "received");
+	free(priv->rxbuf);
+
+	return ret;
+}
+
+static void *j1939cat_bench_rx_thread(void *arg)
+{
+	struct j1939cat_bench_rx *rx = arg;
+	struct pollfd fds[] = {
+		{
+			.fd = rx->sock,
+			.events = POLLIN,
+		}, {
+			.fd = rx->stop_fd,
+			.events = POLLIN,
+		},
+	};
+	uint8_t *buf;
+	ssize_t len;
+
+	buf = malloc(rx->buf_size);
+	if (!buf)
+		err(EXIT_FAILURE, "can't allocate receive buffer");
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll()");
+		}
+		if (fds[1].revents)
+			break;
+
+		len = recv(rx->sock, buf, rx->buf_size, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err(EXIT_FAILURE, "recv()");
+		}
+
+		__atomic_add_fetch(&rx->bytes, len, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&rx->msgs, 1, __ATOMIC_RELEASE);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/* the receiving end of the benchmark: bound to the TO address */
+static int j1939cat_bench_rx_open(struct j1939cat_priv *priv)
+{
+	struct sockaddr_can addr = priv->peername;
+	int value;
+	int sock;
+
+	if (!addr.can_ifindex)
+		addr.can_ifindex = priv->sockname.can_ifindex;
+	addr.can_addr.j1939.pgn = J1939_NO_PGN;
+
+	sock = socket(PF_CAN, SOCK_DGRAM, CAN_J1939);
+	if (sock < 0)
+		err(EXIT_FAILURE, "socket(j1939)");
+
+	if (priv->sockbuf) {
+		value = priv->sockbuf;
+		if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0)
+			err(EXIT_FAILURE, "set socket buffer size %zu", priv->sockbuf);
+	}
+
+	if (priv->todo_broadcast) {
+		value = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &value, sizeof(value)) < 0)
+			err(EXIT_FAILURE, "setsockopt: failed to set broadcast");
+	}
+
+	if (bind(sock, (void *)&addr, sizeof(addr)) < 0)
+		err(EXIT_FAILURE, "bind() receiver");
+
+	return sock;
+}
+
+static int j1939cat_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double j1939cat_percentile(const double *val, unsigned long n,
+				  unsigned int pct)
+{
+	unsigned long i;
+
+	if (!n)
+		return 0;
+
+	i = (n * pct + 99) / 100;
+	if (i)
+		i--;
+
+	return val[i];
+}
+
+static void j1939cat_bench_print(struct j1939cat_priv *priv, size_t size,
+				 double secs, unsigned long rx_msgs)
+{
+	unsigned int acked = priv->tx_done - priv->aborted;
+
+	qsort(priv->lat, priv->nlat, sizeof(*priv->lat), j1939cat_cmp_double);
+
+	printf("%zu,%u,%u,%u,%lu,%.6f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,%.4f\n",
+	       size, priv->tx_sessions, acked, priv->aborted, rx_msgs, secs,
+	       secs > 0 ? acked * size / secs : 0,
+	       priv->nlat ? priv->lat[0] * 1000 : 0,
+	       j1939cat_percentile(priv->lat, priv->nlat, 50) * 1000,
+	       j1939cat_percentile(priv->lat, priv->nlat, 90) * 1000,
+	       j1939cat_percentile(priv->lat, priv->nlat, 99) * 1000,
+	       priv->nlat ? priv->lat[priv->nlat - 1] * 1000 : 0,
+	       priv->tx_sessions ?
+	       (double)priv->aborted / priv->tx_sessions : 0);
+	fflush(stdout);
+}
+
+/*
+ * Send 'repeat' sessions of every size to a receiver in this process and
+ * print one CSV line per size. The latency of a session is the time from
+ * its SCHED to its ACK timestamp, the goodput is based on the wall clock
+ * time of all sessions of that size.
+ */
+static int j1939cat_bench(struct j1939cat_priv *priv)
+{
+	struct j1939cat_bench_rx rx = { 0 };
+	struct sigaction sa = { 0 };
+	unsigned long rx_start, rx_msgs;
+	size_t max_size = 0;
+	pthread_t thread;
+	uint64_t stop = 1;
+	unsigned int i;
+	char *buf;
+	int ret = EXIT_SUCCESS;
+
+	if (!priv->valid_peername ||
+	    priv->peername.can_addr.j1939.pgn == J1939_NO_PGN)
+		errx(EXIT_FAILURE, "benchmark needs a TO address with PGN");
+	if (!priv->polltimeout)
+		errx(EXIT_FAILURE, "benchmark needs a poll timeout");
+
+	for (i = 0; i < priv->bench_nsizes; i++)
+		if (priv->bench_sizes[i] > max_size)
+			max_size = priv->bench_sizes[i];
+
+	buf = malloc(max_size);
+	priv->lat = calloc(priv->repeat, sizeof(*priv->lat));
+	if (!buf || !priv->lat)
+		err(EXIT_FAILURE, "can't allocate benchmark buffers");
+	for (i = 0; i < max_size; i++)
+		buf[i] = i;
+
+	rx.sock = j1939cat_bench_rx_open(priv);
+	rx.buf_size = max_size;
+	rx.stop_fd = eventfd(0, 0);
+	if (rx.stop_fd < 0)
+		err(EXIT_FAILURE, "eventfd()");
+	if (pthread_create(&thread, NULL, j1939cat_bench_rx_thread, &rx))
+		errx(EXIT_FAILURE, "can't create receive thread");
+
+	priv->quiet = true;
+	sa.sa_handler = j1939cat_sigterm;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	printf("size,sessions,acked,aborted,received,secs,goodput,"
+	       "lat_min_ms,lat_p50_ms,lat_p90_ms,lat_p99_ms,lat_max_ms,abort_rate\n");
+
+	for (i = 0; i < priv->bench_nsizes && jcat_running; i++) {
+		size_t size = priv->bench_sizes[i];
+		struct timespec start, end;
+		int wait;
+
+		priv->tx_sessions = priv->tx_done = priv->aborted = 0;
+		priv->nlat = 0;
+		rx_start = __atomic_load_n(&rx.msgs, __ATOMIC_ACQUIRE);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		/* aborts (ret > 0) are counted, go on with the next session */
+		while (priv->tx_sessions < priv->repeat && jcat_running) {
+			ret = j1939cat_send_loop(priv, priv->sock, buf, size);
+			if (ret < 0)
+				break;
+		}
+		if (ret >= 0) {
+			do
+				ret = j1939cat_wait_done(priv);
+			while (ret > 0);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (ret < 0) {
+			warnx("size %zu: %s", size, strerror(-ret));
+			ret = EXIT_FAILURE;
+		}
+
+		/* the receiver may still be busy with the last messages */
+		for (wait = 0; wait < JCAT_BENCH_RX_WAIT; wait++) {
+			rx_msgs = __atomic_load_n(&rx.msgs, __ATOMIC_ACQUIRE) - rx_start;
+			if (rx_msgs >= priv->tx_done - priv->aborted)
+				break;
+			usleep(1000);
+		}
+
+		j1939cat_bench_print(priv, size, j1939cat_ts_diff(&start, &end),
+				     rx_msgs);
+		if (ret)
+			break;
+	}
+
+	if (write(rx.stop_fd, &stop, sizeof(stop)) != sizeof(stop))
+		err(EXIT_FAILURE, "write(eventfd)");
+	pthread_join(thread, NULL);
+
+	close(rx.stop_fd);
+	close(rx.sock);
+	free(priv->lat);
 	free(buf);
+
 	return ret;
 }
 
@@ -643,6 +1085,16 @@ static int j1939cat_sock_prepare(struct j1939cat_priv *priv)
 		       (char *) &sock_opt, sizeof(sock_opt)))
 		err(1, "setsockopt timestamping");
 
+	/* room for several queued 64 KiB class (E)TP sessions */
+	if (priv->sockbuf) {
+		value = priv->sockbuf;
+		if (setsockopt(priv->sock, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0 ||
+		    setsockopt(priv->sock, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0) {
+			warn("set socket buffer size %zu", priv->sockbuf);
+			return EXIT_FAILURE;
+		}
+	}
+
 	if (priv->todo_broadcast) {
 		ret = setsockopt(priv->sock, SOL_SOCKET, SO_BROADCAST,
 				 &priv->todo_broadcast,
@@ -676,8 +1128,26 @@ static int j1939cat_sock_prepare(struct j1939cat_priv *priv)
 	return EXIT_SUCCESS;
 }
 
+static int j1939cat_parse_sizes(struct j1939cat_priv *priv, char *list)
+{
+	char *tok, *end;
+
+	priv->bench_nsizes = 0;
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		unsigned long size = strtoul(tok, &end, 0);
+
+		if (*end || !size || size > J1939_MAX_ETP_PACKET_SIZE ||
+		    priv->bench_nsizes >= JCAT_BENCH_MAX_SIZES)
+			return -EINVAL;
+		priv->bench_sizes[priv->bench_nsizes++] = size;
+	}
+
+	return priv->bench_nsizes ? 0 : -EINVAL;
+}
+
 static int j1939cat_parse_args(struct j1939cat_priv *priv, int argc, char *argv[])
 {
+	char *endp;
 	int opt;
 
 	/* argument parsing */
@@ -710,14 +1180,34 @@ static int j1939cat_parse_args(struct j1939cat_priv *priv, int argc, char *argv[
 			priv->todo_connect = 1;
 			break;
 		case 'R':
-			priv->repeat = strtoul(optarg, NULL, 0);
-			if (priv->repeat < 1)
-				err(EXIT_FAILURE,
-				    "send/repeat count can't be less then 1\n");
+			priv->repeat = strtoul(optarg, &endp, 0);
+			/* 0 stands for "unset" below, never take it from here */
+			if (endp == optarg || *endp || priv->repeat < 1)
+				errx(EXIT_FAILURE,
+				     "send/repeat count can't be less then 1");
 			break;
 		case 'B':
 			priv->todo_broadcast = 1;
 			break;
+		case 'b':
+			priv->sockbuf = strtoul(optarg, &endp, 0);
+			if (endp == optarg || *endp || *optarg == '-' ||
+			    priv->sockbuf > INT32_MAX / 2)
+				errx(EXIT_FAILURE,
+				     "invalid socket buffer size '%s'", optarg);
+			break;
+		case 'w':
+			priv->window = strtoul(optarg, &endp, 0);
+			if (endp == optarg || *endp || *optarg == '-' ||
+			    priv->window >= JCAT_TS_RING)
+				errx(EXIT_FAILURE,
+				     "invalid window '%s', max. %u outstanding sessions",
+				     optarg, JCAT_TS_RING - 1);
+			break;
+		case 'T':
+			if (j1939cat_parse_sizes(priv, optarg))
+				errx(EXIT_FAILURE, "invalid size list '%s'", optarg);
+			break;
 		case 'h': /*fallthrough*/
 		default:
 			fputs(help_msg, stderr);
@@ -755,7 +1245,7 @@ int main(int argc, char *argv[])
 	priv->outfile = STDOUT_FILENO;
 	priv->max_transfer = J1939_MAX_ETP_PACKET_SIZE;
 	priv->polltimeout = 100000;
-	priv->repeat = 1;
+	priv->sockbuf = JCAT_SOCKBUF;
 
 	libj1939_init_sockaddr_can(&priv->sockname, J1939_NO_PGN);
 	libj1939_init_sockaddr_can(&priv->peername, J1939_NO_PGN);
@@ -764,11 +1254,23 @@ int main(int argc, char *argv[])
 	if (ret)
 		return ret;
 
+	/* unset: one session at a time so the latency is not queueing time */
+	if (priv->bench_nsizes) {
+		if (!priv->repeat)
+			priv->repeat = JCAT_BENCH_REPEAT;
+		if (!priv->window)
+			priv->window = 1;
+	} else if (!priv->repeat) {
+		priv->repeat = 1;
+	}
+
 	ret = j1939cat_sock_prepare(priv);
 	if (ret)
 		return ret;
 
-	if (priv->todo_recv)
+	if (priv->bench_nsizes)
+		ret = j1939cat_bench(priv);
+	else if (priv->todo_recv)
 		ret = j1939cat_recv(priv);
 	else
 		ret = j1939cat_send(priv);
@@ -10,8 +10,10 @@
  * as published by the Free Software Foundation
  */
 
+#include <endian.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +21,8 @@
 
 #include <err.h>
 #include <getopt.h>
+#include <net/if.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -26,17 +30,66 @@
 
 #include "libj1939.h"
 
+#define BATCH 32		/* messages per recvmmsg() */
+#define MAX_IFS 64
+#define LOGBUF_SIZE (1024 * 1024)
+
+/*
+ * Binary log: a header followed by records, all fields little endian.
+ * A LOG_REC_IF record (payload: interface name) is written before the
+ * first message of an interface, so the converter needs no access to
+ * the interfaces of the capturing system.
+ */
+#define LOG_MAGIC "J1939SPY"
+#define LOG_VERSION 1
+
+enum {
+	LOG_REC_MSG,
+	LOG_REC_IF,
+};
+
+/* message flags */
+#define F_TIME		0x01
+#define F_DST_ADDR	0x02
+#define F_DST_NAME	0x04
+#define F_TRUNC		0x08
+
+struct log_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct log_rec {
+	uint64_t sec;
+	uint32_t usec;
+	uint32_t pgn;
+	uint64_t src_name;
+	uint64_t dst_name;
+	uint32_t ifindex;
+	uint32_t len;		/* payload bytes following the record */
+	uint8_t type;
+	uint8_t flags;
+	uint8_t src_addr;
+	uint8_t dst_addr;
+	uint8_t priority;
+	uint8_t reserved[3];
+} __attribute__((packed));
+
 /*
  * getopt
  */
 static const char help_msg[] =
 	"j1939spy: An SAE J1939 spy utility" "\n"
 	"Usage: j1939spy [OPTION...] [[IFACE:][NAME|SA][,PGN]]" "\n"
+	"       j1939spy -r FILE [-t...]" "\n"
 	"Options:\n"
 	"  -P, --promisc		Run in promiscuous mode" "\n"
 	"			(= receive traffic not for this ECU)" "\n"
 	"  -b, --block=SIZE	Use a receive buffer of SIZE (default 1024)" "\n"
 	"  -t, --time[=a|d|z|A]	Show time: (a)bsolute, (d)elta, (z)ero, (A)bsolute w date" "\n"
+	"  -w, --write=FILE	Write a binary log to FILE ('-' for stdout)" "\n"
+	"  -r, --read=FILE	Convert the binary log FILE to text ('-' for stdin)" "\n"
 	;
 
 #ifdef _GNU_SOURCE
@@ -45,13 +98,30 @@ static struct option long_opts[] = {
 	{ "promisc", no_argument, NULL, 'P', },
 	{ "block", required_argument, NULL, 'b', },
 	{ "time", optional_argument, NULL, 't', },
+	{ "write", required_argument, NULL, 'w', },
+	{ "read", required_argument, NULL, 'r', },
 	{ },
 };
 #else
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "vPb:t::?";
+static const char optstring[] = "vPb:t::w:r:?";
+
+/* one received or logged message */
+struct spy_msg {
+	struct timeval tv;
+	int ifindex;
+	uint32_t pgn;
+	uint64_t src_name;
+	uint64_t dst_name;
+	uint8_t src_addr;
+	uint8_t dst_addr;
+	uint8_t priority;
+	uint8_t flags;
+	unsigned int len;
+	const uint8_t *data;
+};
 
 /*
  * static variables
@@ -61,6 +131,10 @@ static struct {
 	int promisc;
 	int time;
 	int pkt_len;
+	const char *write_file;
+	const char *read_file;
+	FILE *log;
+	struct timeval tref;
 } s = {
 	.pkt_len = 1024,
 	.addr.can_addr.j1939 = {
@@ -70,36 +144,323 @@ static struct {
 	},
 };
 
+static struct {
+	int ifindex;
+	char name[IF_NAMESIZE];
+} ifs[MAX_IFS];
+static unsigned int nifs;
+
+static volatile sig_atomic_t running = 1;
+
 /*
  * useful buffers
  */
 static const int ival_1 = 1;
 
-static char ctrlmsg[
-	  CMSG_SPACE(sizeof(struct timeval))
-	+ CMSG_SPACE(sizeof(uint8_t)) /* dest addr */
-	+ CMSG_SPACE(sizeof(uint64_t)) /* dest name */
-	+ CMSG_SPACE(sizeof(uint8_t)) /* priority */
-	];
-static struct iovec iov;
-static struct msghdr msg;
-static struct cmsghdr *cmsg;
-static uint8_t *buf;
+#define CTRLMSG_SIZE (CMSG_SPACE(sizeof(struct timeval)) \
+	+ CMSG_SPACE(sizeof(uint8_t)) /* dest addr */ \
+	+ CMSG_SPACE(sizeof(uint64_t)) /* dest name */ \
+	+ CMSG_SPACE(sizeof(uint8_t))) /* priority */
+
+static char ctrlmsg[BATCH][CTRLMSG_SIZE];
+static struct sockaddr_can src[BATCH];
+static struct iovec iov[BATCH];
+static struct mmsghdr msgs[BATCH];
+
+static char *line;
+static size_t line_size;
+
+static void sigterm(int signo)
+{
+	running = 0;
+}
+
+static void log_write(const void *data, size_t len)
+{
+	if (fwrite(data, 1, len, s.log) != len)
+		err(1, "write log");
+}
+
+/* announce an interface once per log, before its first message */
+static void spy_log_if(int ifindex)
+{
+	struct log_rec rec;
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < nifs; i++)
+		if (ifs[i].ifindex == ifindex)
+			return;
+
+	if (s.read_file || nifs >= MAX_IFS ||
+	    !if_indextoname(ifindex, ifs[nifs].name))
+		return;
+	ifs[nifs].ifindex = ifindex;
+
+	len = strlen(ifs[nifs].name);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = LOG_REC_IF;
+	rec.ifindex = htole32(ifindex);
+	rec.len = htole32(len);
+	log_write(&rec, sizeof(rec));
+	log_write(ifs[nifs].name, len);
+
+	nifs++;
+}
+
+static void print_msg(const struct spy_msg *m)
+{
+	static struct libj1939_addr_str src_str;
+	struct sockaddr_can saddr = {
+		.can_family = AF_CAN,
+		.can_ifindex = m->ifindex,
+		.can_addr.j1939 = {
+			.name = m->src_name,
+			.addr = m->src_addr,
+			.pgn = m->pgn,
+		},
+	};
+	struct timeval tdut, ttmp;
+	size_t need;
+	unsigned int j;
+	const char *str;
+	char *p;
+
+	need = m->len * 9 / 4 + 3 * IF_NAMESIZE + 128;
+	if (need > line_size) {
+		free(line);
+		line_size = need;
+		line = malloc(line_size);
+		if (!line)
+			err(1, "malloc %zu", line_size);
+	}
+	p = line;
+
+	if (m->flags & F_TIME) {
+		tdut = m->tv;
+		if ('z' == s.time) {
+			if (!s.tref.tv_sec)
+				s.tref = tdut;
+			timersub(&tdut, &s.tref, &ttmp);
+			tdut = ttmp;
+			goto abs_time;
+		} else if ('d' == s.time) {
+			timersub(&tdut, &s.tref, &ttmp);
+			s.tref = tdut;
+			tdut = ttmp;
+			goto abs_time;
+		} else if ('a' == s.time) {
+abs_time:
+			p += sprintf(p, "(%llu.%04llu)", (unsigned long long)tdut.tv_sec, (unsigned long long)tdut.tv_usec / 100);
+		} else if ('A' == s.time) {
+			struct tm tm;
+			tm = *localtime(&tdut.tv_sec);
+			p += sprintf(p, "(%04u%02u%02uT%02u%02u%02u.%04llu)",
+				tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+				tm.tm_hour, tm.tm_min, tm.tm_sec,
+				(unsigned long long)tdut.tv_usec/100);
+		}
+	}
+
+	*p++ = ' ';
+	str = libj1939_addr2str_cached(&src_str, &saddr);
+	memcpy(p, str, src_str.len);
+	p += src_str.len;
+	*p++ = ' ';
+
+	if (m->flags & F_DST_NAME)
+		p = libj1939_put_hex(p, m->dst_name, 16);
+	else if (m->flags & F_DST_ADDR)
+		p = libj1939_put_hex(p, m->dst_addr, 2);
+	else
+		*p++ = '-';
+	p += sprintf(p, " !%u [%u%s]", m->priority, m->len,
+		     (m->flags & F_TRUNC) ? "..." : "");
+
+	for (j = 0; j < m->len;) {
+		unsigned int end = j + 4;
+		if (end > m->len)
+			end = m->len;
+		*p++ = ' ';
+		for (; j < end; ++j)
+			p = libj1939_put_hex(p, m->data[j], 2);
+	}
+	*p++ = '\n';
+
+	fwrite(line, 1, p - line, stdout);
+}
+
+static void log_msg(const struct spy_msg *m)
+{
+	struct log_rec rec;
+
+	/* announce the interface first */
+	if (m->ifindex)
+		spy_log_if(m->ifindex);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = LOG_REC_MSG;
+	rec.sec = htole64(m->tv.tv_sec);
+	rec.usec = htole32(m->tv.tv_usec);
+	rec.pgn = htole32(m->pgn);
+	rec.src_name = htole64(m->src_name);
+	rec.dst_name = htole64(m->dst_name);
+	rec.ifindex = htole32(m->ifindex);
+	rec.len = htole32(m->len);
+	rec.flags = m->flags;
+	rec.src_addr = m->src_addr;
+	rec.dst_addr = m->dst_addr;
+	rec.priority = m->priority;
+
+	log_write(&rec, sizeof(rec));
+	log_write(m->data, m->len);
+}
+
+static void parse_msg(struct msghdr *msg, unsigned int len, struct spy_msg *m)
+{
+	const struct sockaddr_can *addr = msg->msg_name;
+	struct cmsghdr *cmsg;
+
+	memset(m, 0, sizeof(*m));
+	m->ifindex = addr->can_ifindex;
+	m->pgn = addr->can_addr.j1939.pgn;
+	m->src_name = addr->can_addr.j1939.name;
+	m->src_addr = addr->can_addr.j1939.addr;
+	m->len = len;
+	m->data = msg->msg_iov->iov_base;
+	if (msg->msg_flags & MSG_TRUNC)
+		m->flags |= F_TRUNC;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		switch (cmsg->cmsg_level) {
+		case SOL_SOCKET:
+			if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+				memcpy(&m->tv, CMSG_DATA(cmsg), sizeof(m->tv));
+				m->flags |= F_TIME;
+			}
+			break;
+		case SOL_CAN_J1939:
+			if (cmsg->cmsg_type == SCM_J1939_DEST_ADDR) {
+				m->dst_addr = *CMSG_DATA(cmsg);
+				m->flags |= F_DST_ADDR;
+			} else if (cmsg->cmsg_type == SCM_J1939_DEST_NAME) {
+				memcpy(&m->dst_name, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+				m->flags |= F_DST_NAME;
+			} else if (cmsg->cmsg_type == SCM_J1939_PRIO) {
+				m->priority = *CMSG_DATA(cmsg);
+			}
+			break;
+		}
+	}
+}
+
+/* convert a binary log back to the text output */
+static int convert(const char *file)
+{
+	struct log_hdr hdr;
+	struct log_rec rec;
+	struct spy_msg m;
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	FILE *in;
+
+	if (!strcmp(file, "-"))
+		in = stdin;
+	else
+		in = fopen(file, "r");
+	if (!in)
+		err(1, "open %s", file);
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(hdr.magic, LOG_MAGIC, sizeof(hdr.magic)))
+		errx(1, "%s: no j1939spy log", file);
+	if (le32toh(hdr.version) != LOG_VERSION)
+		errx(1, "%s: unsupported log version %u", file, le32toh(hdr.version));
+
+	while (fread(&rec, sizeof(rec), 1, in) == 1) {
+		memset(&m, 0, sizeof(m));
+		m.len = le32toh(rec.len);
+		if (m.len > data_size) {
+			free(data);
+			data_size = m.len;
+			data = malloc(data_size);
+			if (!data)
+				err(1, "malloc %zu", data_size);
+		}
+		if (m.len && fread(data, m.len, 1, in) != 1)
+			errx(1, "%s: truncated record", file);
+
+		m.ifindex = le32toh(rec.ifindex);
+		if (rec.type == LOG_REC_IF) {
+			char name[IF_NAMESIZE];
+
+			if (m.len >= IF_NAMESIZE)
+				m.len = IF_NAMESIZE - 1;
+			memcpy(name, data, m.len);
+			name[m.len] = 0;
+			if (libj1939_if_set_name(m.ifindex, name) < 0)
+				err(1, "interface %s", name);
+			continue;
+		} else if (rec.type != LOG_REC_MSG) {
+			continue;
+		}
+
+		m.tv.tv_sec = le64toh(rec.sec);
+		m.tv.tv_usec = le32toh(rec.usec);
+		m.pgn = le32toh(rec.pgn);
+		m.src_name = le64toh(rec.src_name);
+		m.dst_name = le64toh(rec.dst_name);
+		m.src_addr = rec.src_addr;
+		m.dst_addr = rec.dst_addr;
+		m.priority = rec.priority;
+		m.flags = rec.flags;
+		m.data = data;
+		if (!s.time)
+			m.flags &= ~F_TIME;
+
+		print_msg(&m);
+	}
+	if (ferror(in))
+		err(1, "read %s", file);
+
+	free(data);
+	if (in != stdin)
+		fclose(in);
+
+	return 0;
+}
+
+static void open_log(const char *file)
+{
+	struct log_hdr hdr;
+
+	if (!strcmp(file, "-"))
+		s.log = stdout;
+	else
+		s.log = fopen(file, "w");
+	if (!s.log)
+		err(1, "open %s", file);
+	setvbuf(s.log, NULL, _IOFBF, LOGBUF_SIZE);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LOG_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(LOG_VERSION);
+	log_write(&hdr, sizeof(hdr));
+}
 
 /*
  * program
  */
 int main(int argc, char **argv)
 {
-	int ret, sock, opt;
-	unsigned int j, len;
-	struct timeval tref, tdut, ttmp;
-	struct sockaddr_can src;
+	int ret, sock, nl_sock, opt, i;
+	struct sockaddr_can bind_addr;
+	struct pollfd pfd[2];
 	struct j1939_filter filt;
+	struct sigaction sa = { 0 };
+	struct spy_msg m;
 	int filter = 0;
-	uint8_t priority, dst_addr;
-	uint64_t dst_name;
-	uint64_t recvflags;
+	uint8_t *buf;
 
 	/* argument parsing */
 	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) != -1)
@@ -120,12 +481,21 @@ int main(int argc, char **argv)
 				s.time = 'z';
 			}
 			break;
+		case 'w':
+			s.write_file = optarg;
+			break;
+		case 'r':
+			s.read_file = optarg;
+			break;
 		default:
 			fputs(help_msg, stderr);
 			exit(1);
 			break;
 		}
 
+	if (s.read_file)
+		return convert(s.read_file);
+
 	if (argv[optind]) {
 		optarg = argv[optind];
 		ret = libj1939_str2addr(optarg, 0, &s.addr);
@@ -135,7 +505,7 @@ int main(int argc, char **argv)
 		}
 	}
 
-	buf = malloc(s.pkt_len);
+	buf = malloc((size_t)s.pkt_len * BATCH);
 	if (!buf)
 		err(1, "malloc %u", s.pkt_len);
 
@@ -172,7 +542,8 @@ int main(int argc, char **argv)
 			err(1, "setsockopt promisc");
 	}
 
-	if (s.time) {
+	/* the binary log always carries the timestamps */
+	if (s.time || s.write_file) {
 		ret = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &ival_1, sizeof(ival_1));
 		if (ret < 0)
 			err(1, "setsockopt timestamp");
@@ -182,114 +553,102 @@ int main(int argc, char **argv)
 		err(1, "setsockopt rcvbuf %u", s.pkt_len);
 
 	/* bind(): to default, only ifindex is used. */
-	memset(&src, 0, sizeof(src));
-	src.can_ifindex = s.addr.can_ifindex;
-	src.can_family = AF_CAN;
-	src.can_addr.j1939.name = J1939_NO_NAME;
-	src.can_addr.j1939.addr = J1939_NO_ADDR;
-	src.can_addr.j1939.pgn = J1939_NO_PGN;
-	ret = bind(sock, (void *)&src, sizeof(src));
+	memset(&bind_addr, 0, sizeof(bind_addr));
+	bind_addr.can_ifindex = s.addr.can_ifindex;
+	bind_addr.can_family = AF_CAN;
+	bind_addr.can_addr.j1939.name = J1939_NO_NAME;
+	bind_addr.can_addr.j1939.addr = J1939_NO_ADDR;
+	bind_addr.can_addr.j1939.pgn = J1939_NO_PGN;
+	ret = bind(sock, (void *)&bind_addr, sizeof(bind_addr));
 	if (ret < 0)
 		err(1, "bind(%s)", argv[1]);
 
+	if (s.write_file)
+		open_log(s.write_file);
+
+	/*
+	 * Follow the interfaces for the printed addresses. Without the
+	 * watch, the table is reloaded whenever an unknown ifindex shows up.
+	 */
+	nl_sock = libj1939_if_watch();
+	if (nl_sock < 0)
+		warnx("interface names are not updated");
+
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = nl_sock;
+	pfd[1].events = POLLIN;
+
+	/* flush the log on termination, poll() returns EINTR */
+	sa.sa_handler = sigterm;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
 	/* these settings are static and can be held out of the hot path */
-	iov.iov_base = &buf[0];
-	msg.msg_name = &src;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = &ctrlmsg;
-
-	memset(&tref, 0, sizeof(tref));
-	while (1) {
-		/* these settings may be modified by recvmsg() */
-		iov.iov_len = s.pkt_len;
-		msg.msg_namelen = sizeof(src);
-		msg.msg_controllen = sizeof(ctrlmsg);
-		msg.msg_flags = 0;
-
-		ret = recvmsg(sock, &msg, 0);
-		//ret = recvfrom(buf, s.pkt_len, 0, (void *)&addr, &len);
+	for (i = 0; i < BATCH; i++) {
+		iov[i].iov_base = &buf[i * s.pkt_len];
+		msgs[i].msg_hdr.msg_name = &src[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = &ctrlmsg[i];
+	}
+
+	while (running) {
+		/* these settings may be modified by recvmmsg() */
+		for (i = 0; i < BATCH; i++) {
+			iov[i].iov_len = s.pkt_len;
+			msgs[i].msg_hdr.msg_namelen = sizeof(src[i]);
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrlmsg[i]);
+			msgs[i].msg_hdr.msg_flags = 0;
+		}
+
+		ret = poll(pfd, nl_sock < 0 ? 1 : 2, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll()");
+		}
+
+		if (pfd[1].revents)
+			libj1939_if_update(nl_sock);
+		if (!pfd[0].revents)
+			continue;
+
+		ret = recvmmsg(sock, msgs, BATCH, MSG_WAITFORONE | MSG_DONTWAIT, NULL);
 		if (ret < 0) {
 			switch (errno) {
 			case ENETDOWN:
 				err(0, "ifindex %i", s.addr.can_ifindex);
 				continue;
 			case EINTR:
+			case EAGAIN:
 				continue;
 			default:
-				err(1, "recvmsg(ifindex %i)", s.addr.can_ifindex);
+				err(1, "recvmmsg(ifindex %i)", s.addr.can_ifindex);
 				break;
 			}
 		}
-		len = ret;
-		recvflags = 0;
-		dst_addr = 0;
-		priority = 0;
-		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-			switch (cmsg->cmsg_level) {
-			case SOL_SOCKET:
-				if (cmsg->cmsg_type == SCM_TIMESTAMP) {
-					memcpy(&tdut, CMSG_DATA(cmsg), sizeof(tdut));
-					recvflags |= 1ULL << cmsg->cmsg_type;
-				}
-				break;
-			case SOL_CAN_J1939:
-				recvflags |= 1ULL << cmsg->cmsg_type;
-				if (cmsg->cmsg_type == SCM_J1939_DEST_ADDR)
-					dst_addr = *CMSG_DATA(cmsg);
-				else if (cmsg->cmsg_type == SCM_J1939_DEST_NAME)
-					memcpy(&dst_name, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
-				else if (cmsg->cmsg_type == SCM_J1939_PRIO)
-					priority = *CMSG_DATA(cmsg);
-				break;
-			}
 
-		}
-		if (recvflags & (1ULL << SCM_TIMESTAMP)) {
-			if ('z' == s.time) {
-				if (!tref.tv_sec)
-					tref = tdut;
-				timersub(&tdut, &tref, &ttmp);
-				tdut = ttmp;
-				goto abs_time;
-			} else if ('d' == s.time) {
-				timersub(&tdut, &tref, &ttmp);
-				tref = tdut;
-				tdut = ttmp;
-				goto abs_time;
-			} else if ('a' == s.time) {
-abs_time:
-				printf("(%llu.%04llu)", (unsigned long long)tdut.tv_sec, (unsigned long long)tdut.tv_usec / 100);
-			} else if ('A' == s.time) {
-				struct tm tm;
-				tm = *localtime(&tdut.tv_sec);
-				printf("(%04u%02u%02uT%02u%02u%02u.%04llu)",
-					tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-					tm.tm_hour, tm.tm_min, tm.tm_sec,
-					(unsigned long long)tdut.tv_usec/100);
+		for (i = 0; i < ret; i++) {
+			parse_msg(&msgs[i].msg_hdr, msgs[i].msg_len, &m);
+			if (s.log) {
+				log_msg(&m);
+			} else {
+				if (!s.time)
+					m.flags &= ~F_TIME;
+				print_msg(&m);
 			}
 		}
-		printf(" %s ", libj1939_addr2str(&src));
-		if (recvflags & (1ULL << SCM_J1939_DEST_NAME))
-			printf("%016llx ", (unsigned long long)dst_name);
-		else if (recvflags & (1ULL << SCM_J1939_DEST_ADDR))
-			printf("%02x ", dst_addr);
-		else
-			printf("- ");
-		printf("!%u ", priority);
-
-		printf("[%i%s]", len, (msg.msg_flags & MSG_TRUNC) ? "..." : "");
-		for (j = 0; j < len;) {
-			unsigned int end = j + 4;
-			if (end > len)
-				end = len;
-			printf(" ");
-			for (; j < end; ++j)
-				printf("%02x", buf[j]);
-		}
-		printf("\n");
+		/* one write per batch */
+		if (!s.log)
+			fflush(stdout);
 	}
 
+	if (s.log && fclose(s.log))
+		err(1, "close log");
+	if (nl_sock >= 0)
+		close(nl_sock);
+	free(line);
 	free(buf);
 	return 0;
 }
@@ -16,67 +16,185 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <linux/kernel.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <net/if.h>
-#include <net/if.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "libj1939.h"
 #include "lib.h"
 
-/* static data */
-static struct if_nameindex *saved;
+/*
+ * Interface table, shared by all threads. It is loaded on first use and
+ * kept up to date by RTNETLINK link events if libj1939_if_watch() is used,
+ * otherwise it is reloaded if a lookup fails. if_gen changes with every
+ * update and invalidates the formatted addresses of the callers.
+ */
+struct libj1939_if {
+	int ifindex;
+	char name[IF_NAMESIZE];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct libj1939_if *ifs;
+	size_t num;
+	size_t size;
+	bool loaded;
+	bool watched;
+	bool fixed;		/* names set by libj1939_if_set_name() */
+	unsigned int gen;
+} libj1939_if_table = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 __attribute__((destructor))
 static void libj1939_cleanup(void)
 {
-	if (saved)
-		if_freenameindex(saved);
-	saved = 0;
+	free(libj1939_if_table.ifs);
+	libj1939_if_table.ifs = NULL;
+	libj1939_if_table.num = 0;
+	libj1939_if_table.size = 0;
 }
 
-static inline void fetch_names(void)
+static unsigned int libj1939_if_gen(void)
 {
-	if (!saved) {
-		saved = if_nameindex();
-		if (!saved)
-			err(1, "if_nameindex()");
-	}
+	return __atomic_load_n(&libj1939_if_table.gen, __ATOMIC_ACQUIRE);
 }
 
-/* retrieve name */
-static const char *libj1939_ifnam(int ifindex)
+/* called with the lock held */
+static int libj1939_if_set(int ifindex, const char *name)
 {
-	const struct if_nameindex *lp, *cached = saved;
+	struct libj1939_if *ifs;
+	size_t i;
 
-	fetch_names();
+	for (i = 0; i < libj1939_if_table.num; i++) {
+		if (libj1939_if_table.ifs[i].ifindex == ifindex)
+			break;
+	}
 
-	for (lp = saved; lp->if_index; ++lp) {
-		if (lp->if_index == (unsigned int)ifindex)
-			return lp->if_name;
+	if (i == libj1939_if_table.num) {
+		if (libj1939_if_table.num == libj1939_if_table.size) {
+			size_t size = libj1939_if_table.size ?
+				libj1939_if_table.size * 2 : 16;
+
+			ifs = realloc(libj1939_if_table.ifs,
+				      size * sizeof(*ifs));
+			if (!ifs)
+				return -ENOMEM;
+
+			libj1939_if_table.ifs = ifs;
+			libj1939_if_table.size = size;
+		}
+		libj1939_if_table.num++;
 	}
-	if (cached) {
-		/*
-		 * the list was not recent
-		 * iterate twice, but force a refresh now
-		 * recursion stops since the 'saved' pointer is cleaned
-		 */
-		libj1939_cleanup();
-		return libj1939_ifnam(ifindex);
+
+	ifs = &libj1939_if_table.ifs[i];
+	ifs->ifindex = ifindex;
+	strncpy(ifs->name, name, sizeof(ifs->name) - 1);
+	ifs->name[sizeof(ifs->name) - 1] = 0;
+
+	return 0;
+}
+
+/* called with the lock held */
+static void libj1939_if_del(int ifindex)
+{
+	size_t i;
+
+	for (i = 0; i < libj1939_if_table.num; i++) {
+		if (libj1939_if_table.ifs[i].ifindex == ifindex) {
+			libj1939_if_table.ifs[i] =
+				libj1939_if_table.ifs[--libj1939_if_table.num];
+			return;
+		}
 	}
+}
+
+/* called with the lock held */
+static void libj1939_if_load(void)
+{
+	struct if_nameindex *names, *lp;
+
+	names = if_nameindex();
+	if (!names)
+		err(1, "if_nameindex()");
+
+	libj1939_if_table.num = 0;
+	for (lp = names; lp->if_index; ++lp)
+		libj1939_if_set(lp->if_index, lp->if_name);
+	if_freenameindex(names);
+
+	libj1939_if_table.loaded = true;
+	__atomic_add_fetch(&libj1939_if_table.gen, 1, __ATOMIC_RELEASE);
+}
+
+/* called with the lock held */
+static const struct libj1939_if *libj1939_if_find(int ifindex,
+						    const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < libj1939_if_table.num; i++) {
+		const struct libj1939_if *ifs = &libj1939_if_table.ifs[i];
+
+		if (name ? !strcmp(ifs->name, name) : ifs->ifindex == ifindex)
+			return ifs;
+	}
+
 	return NULL;
 }
 
+/* called with the lock held */
+static const struct libj1939_if *libj1939_if_lookup(int ifindex,
+						      const char *name)
+{
+	const struct libj1939_if *ifs;
+	bool reloaded = false;
+
+	if (!libj1939_if_table.loaded) {
+		libj1939_if_load();
+		reloaded = true;
+	}
+
+	ifs = libj1939_if_find(ifindex, name);
+	if (ifs || reloaded || libj1939_if_table.watched ||
+	    libj1939_if_table.fixed)
+		return ifs;
+
+	/* the table was not recent, try again with a fresh one */
+	libj1939_if_load();
+
+	return libj1939_if_find(ifindex, name);
+}
+
+/* retrieve name, name must have room for IF_NAMESIZE bytes */
+static bool libj1939_ifnam(int ifindex, char *name)
+{
+	const struct libj1939_if *ifs;
+
+	pthread_mutex_lock(&libj1939_if_table.lock);
+	ifs = libj1939_if_lookup(ifindex, NULL);
+	if (ifs)
+		memcpy(name, ifs->name, IF_NAMESIZE);
+	pthread_mutex_unlock(&libj1939_if_table.lock);
+
+	return ifs;
+}
+
 /* retrieve index */
 static int libj1939_ifindex(const char *str)
 {
-	const struct if_nameindex *lp, *cached = saved;
+	const struct libj1939_if *ifs;
 	char *endp;
 	int ret;
 
@@ -85,16 +203,156 @@ static int libj1939_ifindex(const char *str)
 		/* did some good parse */
 		return ret;
 
-	fetch_names();
-	for (lp = saved; lp->if_index; ++lp) {
-		if (!strcmp(lp->if_name, str))
-			return lp->if_index;
+	pthread_mutex_lock(&libj1939_if_table.lock);
+	ifs = libj1939_if_lookup(0, str);
+	ret = ifs ? ifs->ifindex : 0;
+	pthread_mutex_unlock(&libj1939_if_table.lock);
+
+	return ret;
+}
+
+/**
+ * libj1939_if_watch - Keep the interface table up to date
+ *
+ * This function opens a RTNETLINK socket for link events, which the caller
+ * adds to its event loop and passes to libj1939_if_update() when readable.
+ * Lookups of unknown interfaces no longer reload the whole table.
+ *
+ * Return: The non blocking socket, or a negative error code.
+ */
+int libj1939_if_watch(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK,
+	};
+	int sock, ret;
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		      NETLINK_ROUTE);
+	if (sock < 0) {
+		ret = -errno;
+		pr_err("socket(NETLINK_ROUTE): %d (%s)", ret, strerror(-ret));
+		return ret;
 	}
-	if (cached) {
-		libj1939_cleanup();
-		return libj1939_ifindex(str);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ret = -errno;
+		pr_err("bind(RTMGRP_LINK): %d (%s)", ret, strerror(-ret));
+		close(sock);
+		return ret;
 	}
-	return 0;
+
+	/* events which happened before the bind() are not seen */
+	pthread_mutex_lock(&libj1939_if_table.lock);
+	libj1939_if_load();
+	libj1939_if_table.watched = true;
+	pthread_mutex_unlock(&libj1939_if_table.lock);
+
+	return sock;
+}
+
+static void libj1939_if_link_msg(const struct nlmsghdr *nlh)
+{
+	const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	const struct rtattr *rta;
+	const char *name = NULL;
+	int len;
+
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return;
+
+	len = IFLA_PAYLOAD(nlh);
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME) {
+			name = RTA_DATA(rta);
+			break;
+		}
+	}
+
+	if (nlh->nlmsg_type == RTM_DELLINK)
+		libj1939_if_del(ifi->ifi_index);
+	else if (name)
+		libj1939_if_set(ifi->ifi_index, name);
+}
+
+/**
+ * libj1939_if_update - Apply the pending link events to the interface table
+ * @nl_sock: The socket of libj1939_if_watch()
+ *
+ * Return: 0 on success, or a negative error code.
+ */
+int libj1939_if_update(int nl_sock)
+{
+	char buf[8192] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+	const struct nlmsghdr *nlh;
+	bool changed = false;
+	ssize_t len;
+	int ret = 0;
+
+	pthread_mutex_lock(&libj1939_if_table.lock);
+	while (1) {
+		len = recv(nl_sock, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			if (errno == ENOBUFS) {
+				/* events were lost */
+				libj1939_if_load();
+				continue;
+			}
+			ret = -errno;
+			pr_err("recv(NETLINK_ROUTE): %d (%s)", ret,
+			       strerror(-ret));
+			break;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type != RTM_NEWLINK &&
+			    nlh->nlmsg_type != RTM_DELLINK)
+				continue;
+
+			libj1939_if_link_msg(nlh);
+			changed = true;
+		}
+	}
+
+	if (changed)
+		__atomic_add_fetch(&libj1939_if_table.gen, 1,
+				   __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&libj1939_if_table.lock);
+
+	return ret;
+}
+
+/**
+ * libj1939_if_set_name - Set the name of an interface
+ * @ifindex: The interface index
+ * @name: The interface name
+ *
+ * This function is meant for addresses which don't belong to the local
+ * system, e.g. from a recorded log. After the first call, the interface
+ * table contains only the names set by this function and is no longer
+ * loaded from the system.
+ *
+ * Return: 0 on success, or a negative error code.
+ */
+int libj1939_if_set_name(int ifindex, const char *name)
+{
+	int ret;
+
+	pthread_mutex_lock(&libj1939_if_table.lock);
+	if (!libj1939_if_table.fixed) {
+		libj1939_if_table.num = 0;
+		libj1939_if_table.loaded = true;
+		libj1939_if_table.fixed = true;
+	}
+	ret = libj1939_if_set(ifindex, name);
+	__atomic_add_fetch(&libj1939_if_table.gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&libj1939_if_table.lock);
+
+	return ret;
 }
 
 void libj1939_parse_canaddr(char *spec, struct sockaddr_can *paddr)
@@ -172,30 +430,139 @@ int libj1939_str2addr(const char *str, char **endp, struct sockaddr_can *can)
 	return 0;
 }
 
-const char *libj1939_addr2str(const struct sockaddr_can *can)
+static const char libj1939_hex[] = "0123456789abcdef";
+
+/**
+ * libj1939_put_hex - Write a number as lower case hex digits
+ * @p: The output buffer, not NUL terminated
+ * @val: The number
+ * @digits: The number of digits, with leading zeros
+ *
+ * Return: The position after the last digit.
+ */
+char *libj1939_put_hex(char *p, uint64_t val, int digits)
 {
-	char *str;
-	static char buf[128];
+	while (digits--)
+		*p++ = libj1939_hex[(val >> (digits * 4)) & 0xf];
+
+	return p;
+}
+
+static char *libj1939_put_dec(char *p, unsigned int val)
+{
+	char tmp[10];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+
+	while (n)
+		*p++ = tmp[--n];
+
+	return p;
+}
+
+/**
+ * libj1939_addr2str_r - Format a J1939 address
+ * @can: The address
+ * @buf: Output buffer, LIBJ1939_ADDR_STRLEN bytes are always enough
+ * @size: Size of @buf
+ *
+ * This function formats the address like libj1939_addr2str(), but into a
+ * buffer of the caller and without allocations, so it may be used from
+ * several threads.
+ *
+ * Return: The length of the formatted address. The output is truncated if
+ * it is not less than @size.
+ */
+size_t libj1939_addr2str_r(const struct sockaddr_can *can, char *buf,
+			   size_t size)
+{
+	char tmp[LIBJ1939_ADDR_STRLEN];
+	char ifname[IF_NAMESIZE];
+	char *str = tmp;
+	size_t len;
 
-	str = buf;
 	if (can->can_ifindex) {
-		const char *ifname;
-		ifname = libj1939_ifnam(can->can_ifindex);
-		if (!ifname)
-			str += sprintf(str, "#%i:", can->can_ifindex);
-		else
-			str += sprintf(str, "%s:", ifname);
+		if (!libj1939_ifnam(can->can_ifindex, ifname)) {
+			*str++ = '#';
+			if (can->can_ifindex < 0)
+				*str++ = '-';
+			str = libj1939_put_dec(str, can->can_ifindex < 0 ?
+					       -(unsigned int)can->can_ifindex :
+					       (unsigned int)can->can_ifindex);
+		} else {
+			len = strnlen(ifname, sizeof(ifname));
+			memcpy(str, ifname, len);
+			str += len;
+		}
+		*str++ = ':';
 	}
 	if (can->can_addr.j1939.name) {
-		str += sprintf(str, "%016llx", (unsigned long long)can->can_addr.j1939.name);
-		if (can->can_addr.j1939.pgn == J1939_PGN_ADDRESS_CLAIMED)
-			str += sprintf(str, ".%02x", can->can_addr.j1939.addr);
-	} else if (can->can_addr.j1939.addr <= 0xfe)
-		str += sprintf(str, "%02x", can->can_addr.j1939.addr);
-	else
-		str += sprintf(str, "-");
-	if (can->can_addr.j1939.pgn <= J1939_PGN_MAX)
-		str += sprintf(str, ",%05x", can->can_addr.j1939.pgn);
+		str = libj1939_put_hex(str, can->can_addr.j1939.name, 16);
+		if (can->can_addr.j1939.pgn == J1939_PGN_ADDRESS_CLAIMED) {
+			*str++ = '.';
+			str = libj1939_put_hex(str, can->can_addr.j1939.addr, 2);
+		}
+	} else if (can->can_addr.j1939.addr <= 0xfe) {
+		str = libj1939_put_hex(str, can->can_addr.j1939.addr, 2);
+	} else {
+		*str++ = '-';
+	}
+	if (can->can_addr.j1939.pgn <= J1939_PGN_MAX) {
+		*str++ = ',';
+		str = libj1939_put_hex(str, can->can_addr.j1939.pgn, 5);
+	}
+
+	len = str - tmp;
+	if (size) {
+		size_t n = len < size ? len : size - 1;
+
+		memcpy(buf, tmp, n);
+		buf[n] = 0;
+	}
+
+	return len;
+}
+
+/**
+ * libj1939_addr2str_cached - Format a J1939 address with a cache
+ * @cache: The last formatted address, zero initialized before first use
+ * @can: The address
+ *
+ * Repeated identical addresses are returned from @cache without formatting
+ * them again. The cache belongs to the caller, so it is not shared between
+ * threads.
+ *
+ * Return: The formatted address in @cache, valid until the next call.
+ */
+const char *libj1939_addr2str_cached(struct libj1939_addr_str *cache,
+				     const struct sockaddr_can *can)
+{
+	unsigned int gen = libj1939_if_gen();
+
+	if (cache->len && cache->if_gen == gen &&
+	    cache->addr.can_ifindex == can->can_ifindex &&
+	    cache->addr.can_addr.j1939.name == can->can_addr.j1939.name &&
+	    cache->addr.can_addr.j1939.addr == can->can_addr.j1939.addr &&
+	    cache->addr.can_addr.j1939.pgn == can->can_addr.j1939.pgn)
+		return cache->str;
+
+	cache->len = libj1939_addr2str_r(can, cache->str, sizeof(cache->str));
+	cache->addr = *can;
+	/* a concurrent update invalidates the result at the next call */
+	cache->if_gen = gen;
+
+	return cache->str;
+}
+
+const char *libj1939_addr2str(const struct sockaddr_can *can)
+{
+	static char buf[LIBJ1939_ADDR_STRLEN];
+
+	libj1939_addr2str_r(can, buf, sizeof(buf));
 
 	return buf;
 }
@@ -322,8 +689,8 @@ int libj1939_add_socket_to_epoll(int epoll_fd, int sock, uint32_t events)
 
 	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
 	if (ret < 0) {
-		ret = errno;
-		pr_err("epoll_ctl(EPOLL_CTL_ADD): %d (%s)", ret, strerror(ret));
+		ret = -errno;
+		pr_err("epoll_ctl(EPOLL_CTL_ADD): %d (%s)", ret, strerror(-ret));
 		return ret;
 	}
 
@@ -352,37 +719,522 @@ int libj1939_create_epoll(void)
 	return epoll_fd;
 }
 
+/* room for SCM_TIMESTAMP, SCM_J1939_DEST_ADDR, _DEST_NAME and _PRIO */
+#define LIBJ1939_RX_CMSG_SIZE \
+	(CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(uint8_t)) + \
+	 CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(uint8_t)))
+
 /**
- * libj1939_get_timeout_ms - Get the timeout in milliseconds until a specific
- *			     time
- * @ts: The time to wait for
- * @return: The timeout in milliseconds until the specified time
+ * libj1939_rx_init - Allocate the buffers for batched receiving
+ * @rx: The receive context
+ * @batch: The maximal number of messages received with one system call
+ * @buf_size: The maximal length of a message
  *
- * This function calculates the timeout in milliseconds until a specific time.
+ * Return: 0 on success, or a negative error code.
+ */
+int libj1939_rx_init(struct libj1939_rx *rx, unsigned int batch,
+		     size_t buf_size)
+{
+	unsigned int i;
+
+	memset(rx, 0, sizeof(*rx));
+	rx->batch = batch;
+	rx->buf_size = buf_size;
+
+	rx->bufs = malloc(batch * buf_size);
+	rx->cmsgs = malloc(batch * LIBJ1939_RX_CMSG_SIZE);
+	rx->iovs = calloc(batch, sizeof(*rx->iovs));
+	rx->names = calloc(batch, sizeof(*rx->names));
+	rx->mmsgs = calloc(batch, sizeof(*rx->mmsgs));
+	rx->msgs = calloc(batch, sizeof(*rx->msgs));
+	if (!rx->bufs || !rx->cmsgs || !rx->iovs || !rx->names ||
+	    !rx->mmsgs || !rx->msgs) {
+		libj1939_rx_free(rx);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < batch; i++) {
+		struct msghdr *hdr = &rx->mmsgs[i].msg_hdr;
+
+		rx->iovs[i].iov_base = &rx->bufs[i * buf_size];
+		hdr->msg_iov = &rx->iovs[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_name = &rx->names[i];
+		hdr->msg_control = &rx->cmsgs[i * LIBJ1939_RX_CMSG_SIZE];
+	}
+
+	return 0;
+}
+
+/**
+ * libj1939_rx_free - Release the buffers of a receive context
+ * @rx: The receive context
+ */
+void libj1939_rx_free(struct libj1939_rx *rx)
+{
+	free(rx->bufs);
+	free(rx->cmsgs);
+	free(rx->iovs);
+	free(rx->names);
+	free(rx->mmsgs);
+	free(rx->msgs);
+	memset(rx, 0, sizeof(*rx));
+}
+
+/**
+ * libj1939_rx_set_handlers - Register the handlers of libj1939_rx_dispatch()
+ * @rx: The receive context
+ * @handlers: Table of handlers by PGN, must stay valid
+ * @handlers_num: Number of entries in @handlers
+ * @unhandled: Called for messages of other PGNs, may be NULL
+ * @ctx: Passed to the handlers
+ */
+void libj1939_rx_set_handlers(struct libj1939_rx *rx,
+			      const struct libj1939_rx_handler *handlers,
+			      size_t handlers_num, libj1939_rx_cb_t unhandled,
+			      void *ctx)
+{
+	rx->handlers = handlers;
+	rx->handlers_num = handlers_num;
+	rx->unhandled = unhandled;
+	rx->ctx = ctx;
+}
+
+static void libj1939_rx_decode(struct libj1939_rx *rx, unsigned int i, int sock)
+{
+	struct msghdr *hdr = &rx->mmsgs[i].msg_hdr;
+	struct libj1939_rx_msg *msg = &rx->msgs[i];
+	struct cmsghdr *cmsg;
+
+	msg->buf = rx->iovs[i].iov_base;
+	msg->len = rx->mmsgs[i].msg_len;
+	msg->truncated = hdr->msg_flags & MSG_TRUNC;
+	if (msg->truncated)
+		msg->len = rx->buf_size;
+	msg->sock = sock;
+	msg->peername = rx->names[i];
+	msg->dst_addr = J1939_NO_ADDR;
+	msg->dst_name = J1939_NO_NAME;
+	msg->priority = 0;
+	timerclear(&msg->tstamp);
+
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		switch (cmsg->cmsg_level) {
+		case SOL_SOCKET:
+			if (cmsg->cmsg_type == SCM_TIMESTAMP)
+				memcpy(&msg->tstamp, CMSG_DATA(cmsg),
+				       sizeof(msg->tstamp));
+			break;
+		case SOL_CAN_J1939:
+			if (cmsg->cmsg_type == SCM_J1939_DEST_ADDR)
+				msg->dst_addr = *CMSG_DATA(cmsg);
+			else if (cmsg->cmsg_type == SCM_J1939_DEST_NAME)
+				memcpy(&msg->dst_name, CMSG_DATA(cmsg),
+				       sizeof(msg->dst_name));
+			else if (cmsg->cmsg_type == SCM_J1939_PRIO)
+				msg->priority = *CMSG_DATA(cmsg);
+			break;
+		}
+	}
+}
+
+/**
+ * libj1939_rx_recv - Receive a batch of messages
+ * @rx: The receive context
+ * @sock: A non blocking or readable J1939 socket
+ *
+ * This function receives up to rx->batch queued messages with one
+ * recvmmsg() call and decodes them into rx->msgs.
  *
- * Return: The timeout in milliseconds until the specified time.
+ * Return: The number of received messages, 0 if none was queued, or a
+ * negative error code.
  */
-static int libj1939_get_timeout_ms(struct timespec *ts)
+int libj1939_rx_recv(struct libj1939_rx *rx, int sock)
 {
-	struct timespec curr_time;
-	int64_t time_diff;
-	int timeout_ms;
+	unsigned int i;
+	int ret;
 
-	clock_gettime(CLOCK_MONOTONIC, &curr_time);
-	time_diff = timespec_diff_ms(ts, &curr_time);
-	if (time_diff < 0) {
-		/* Too late to send next message. Send it now */
-		timeout_ms = 0;
+	/* recvmmsg() updates these fields */
+	for (i = 0; i < rx->batch; i++) {
+		struct msghdr *hdr = &rx->mmsgs[i].msg_hdr;
+
+		rx->iovs[i].iov_len = rx->buf_size;
+		hdr->msg_namelen = sizeof(rx->names[i]);
+		hdr->msg_controllen = LIBJ1939_RX_CMSG_SIZE;
+		hdr->msg_flags = 0;
+	}
+
+	ret = recvmmsg(sock, rx->mmsgs, rx->batch, MSG_DONTWAIT, NULL);
+	if (ret < 0) {
+		ret = -errno;
+		if (ret == -EAGAIN || ret == -EINTR)
+			return 0;
+
+		pr_err("recvmmsg(): %d (%s)", ret, strerror(-ret));
+		return ret;
+	}
+
+	for (i = 0; i < (unsigned int)ret; i++)
+		libj1939_rx_decode(rx, i, sock);
+
+	return ret;
+}
+
+static libj1939_rx_cb_t libj1939_rx_lookup(struct libj1939_rx *rx,
+					   uint32_t pgn)
+{
+	size_t i;
+
+	/* the tables of the tools are short, a scan is the fastest */
+	for (i = 0; i < rx->handlers_num; i++) {
+		if (rx->handlers[i].pgn == pgn)
+			return rx->handlers[i].cb;
+	}
+
+	return rx->unhandled;
+}
+
+/**
+ * libj1939_rx_dispatch - Receive a batch of messages and dispatch them by PGN
+ * @rx: The receive context with the registered handlers
+ * @sock: A non blocking or readable J1939 socket
+ *
+ * All received messages are passed to their handler, even if a handler
+ * fails.
+ *
+ * Return: The number of received messages, or the first negative error code
+ * of recvmmsg() or a handler.
+ */
+int libj1939_rx_dispatch(struct libj1939_rx *rx, int sock)
+{
+	libj1939_rx_cb_t cb;
+	int i, n, ret = 0;
+
+	n = libj1939_rx_recv(rx, sock);
+	if (n <= 0)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		struct libj1939_rx_msg *msg = &rx->msgs[i];
+		int err;
+
+		cb = libj1939_rx_lookup(rx, msg->peername.can_addr.j1939.pgn);
+		if (!cb)
+			continue;
+
+		err = cb(rx->ctx, msg);
+		if (err < 0 && !ret)
+			ret = err;
+	}
+
+	return ret < 0 ? ret : n;
+}
+
+static bool libj1939_timespec_before(const struct timespec *a,
+				     const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void libj1939_timer_heap_set(struct libj1939_cmn *cmn, size_t pos,
+				    struct libj1939_timer *timer)
+{
+	cmn->timers[pos] = timer;
+	timer->idx = pos + 1;
+}
+
+static void libj1939_timer_sift_up(struct libj1939_cmn *cmn, size_t pos)
+{
+	struct libj1939_timer *timer = cmn->timers[pos];
+
+	while (pos) {
+		size_t parent = (pos - 1) / 2;
+
+		if (!libj1939_timespec_before(&timer->expires,
+					      &cmn->timers[parent]->expires))
+			break;
+
+		libj1939_timer_heap_set(cmn, pos, cmn->timers[parent]);
+		pos = parent;
+	}
+
+	libj1939_timer_heap_set(cmn, pos, timer);
+}
+
+static void libj1939_timer_sift_down(struct libj1939_cmn *cmn, size_t pos)
+{
+	struct libj1939_timer *timer = cmn->timers[pos];
+
+	while (1) {
+		size_t child = pos * 2 + 1;
+
+		if (child >= cmn->timers_num)
+			break;
+
+		if (child + 1 < cmn->timers_num &&
+		    libj1939_timespec_before(&cmn->timers[child + 1]->expires,
+					     &cmn->timers[child]->expires))
+			child++;
+
+		if (!libj1939_timespec_before(&cmn->timers[child]->expires,
+					      &timer->expires))
+			break;
+
+		libj1939_timer_heap_set(cmn, pos, cmn->timers[child]);
+		pos = child;
+	}
+
+	libj1939_timer_heap_set(cmn, pos, timer);
+}
+
+static void libj1939_timer_heap_remove(struct libj1939_cmn *cmn,
+				       struct libj1939_timer *timer)
+{
+	size_t pos = timer->idx - 1;
+	struct libj1939_timer *last;
+
+	timer->idx = 0;
+	last = cmn->timers[--cmn->timers_num];
+	if (last == timer)
+		return;
+
+	libj1939_timer_heap_set(cmn, pos, last);
+	if (pos && libj1939_timespec_before(&last->expires,
+					    &cmn->timers[(pos - 1) / 2]->expires))
+		libj1939_timer_sift_up(cmn, pos);
+	else
+		libj1939_timer_sift_down(cmn, pos);
+}
+
+static int libj1939_timer_heap_insert(struct libj1939_cmn *cmn,
+				      struct libj1939_timer *timer)
+{
+	if (cmn->timers_num == cmn->timers_size) {
+		size_t size = cmn->timers_size ? cmn->timers_size * 2 : 16;
+		struct libj1939_timer **timers;
+
+		timers = realloc(cmn->timers, size * sizeof(*timers));
+		if (!timers)
+			return -ENOMEM;
+
+		cmn->timers = timers;
+		cmn->timers_size = size;
+	}
+
+	cmn->timers[cmn->timers_num++] = timer;
+	libj1939_timer_sift_up(cmn, cmn->timers_num - 1);
+
+	return 0;
+}
+
+/* program the timerfd for the earliest timer, if it changed */
+static void libj1939_timers_arm(struct libj1939_cmn *cmn)
+{
+	struct itimerspec its = {0};
+
+	if (!cmn->timers_ready)
+		return;
+
+	if (cmn->timers_num)
+		its.it_value = cmn->timers[0]->expires;
+
+	if (its.it_value.tv_sec == cmn->timer_fd_expires.tv_sec &&
+	    its.it_value.tv_nsec == cmn->timer_fd_expires.tv_nsec)
+		return;
+
+	if (timerfd_settime(cmn->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		pr_err("timerfd_settime(): %i (%s)", errno, strerror(errno));
+		return;
+	}
+
+	cmn->timer_fd_expires = its.it_value;
+}
+
+/**
+ * libj1939_timers_init - Set up the timers of an event loop
+ * @cmn: The common J1939 instance data, with the epoll instance created
+ *
+ * This function creates the timerfd which backs the timers and adds it to
+ * the epoll instance. The timerfd is handled by libj1939_prepare_for_events()
+ * and never shows up in the returned events.
+ *
+ * Return: 0 on success, or a negative error code.
+ */
+int libj1939_timers_init(struct libj1939_cmn *cmn)
+{
+	int ret;
+
+	ret = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ret < 0) {
+		ret = -errno;
+		pr_err("timerfd_create(): %d (%s)", ret, strerror(-ret));
+		return ret;
+	}
+
+	cmn->timer_fd = ret;
+	cmn->timer_fd_expires = (struct timespec){ 0 };
+
+	ret = libj1939_add_socket_to_epoll(cmn->epoll_fd, cmn->timer_fd,
+					   EPOLLIN);
+	if (ret) {
+		close(cmn->timer_fd);
+		return ret;
+	}
+
+	cmn->timers_ready = true;
+
+	return 0;
+}
+
+/**
+ * libj1939_timers_free - Release the timers of an event loop
+ * @cmn: The common J1939 instance data
+ */
+void libj1939_timers_free(struct libj1939_cmn *cmn)
+{
+	size_t i;
+
+	if (!cmn->timers_ready)
+		return;
+
+	for (i = 0; i < cmn->timers_num; i++)
+		cmn->timers[i]->idx = 0;
+
+	free(cmn->timers);
+	cmn->timers = NULL;
+	cmn->timers_num = 0;
+	cmn->timers_size = 0;
+	close(cmn->timer_fd);
+	cmn->timers_ready = false;
+}
+
+/**
+ * libj1939_timer_init - Initialize a timer
+ * @timer: The timer, owned by the caller
+ * @cb: The function to call on expiry, from libj1939_prepare_for_events()
+ * @ctx: Free for the caller
+ */
+void libj1939_timer_init(struct libj1939_timer *timer, libj1939_timer_cb_t cb,
+			 void *ctx)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->cb = cb;
+	timer->ctx = ctx;
+}
+
+/**
+ * libj1939_timer_start - Arm or rearm a timer
+ * @cmn: The common J1939 instance data
+ * @timer: The timer
+ * @delay_ms: Time until the first expiry
+ * @period_ms: Interval of the following expiries, 0 for a one-shot timer
+ *
+ * Periodic timers keep their phase: the next expiry is computed from the
+ * previous one and not from the time the callback ran. Expiries which were
+ * missed completely are skipped. A timer may be (re)started and stopped from
+ * its own callback.
+ *
+ * Return: 0 on success, or a negative error code.
+ */
+int libj1939_timer_start(struct libj1939_cmn *cmn,
+			 struct libj1939_timer *timer, unsigned int delay_ms,
+			 unsigned int period_ms)
+{
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &timer->expires);
+	timespec_add_ms(&timer->expires, delay_ms);
+	timer->period_ms = period_ms;
+
+	if (timer->idx) {
+		size_t pos = timer->idx - 1;
+
+		if (pos && libj1939_timespec_before(&timer->expires,
+						    &cmn->timers[(pos - 1) / 2]->expires))
+			libj1939_timer_sift_up(cmn, pos);
+		else
+			libj1939_timer_sift_down(cmn, pos);
 	} else {
-		if (time_diff > INT_MAX) {
-			pr_warn("timeout too long: %" PRId64 " ms", time_diff);
-			time_diff = INT_MAX;
+		ret = libj1939_timer_heap_insert(cmn, timer);
+		if (ret)
+			return ret;
+	}
+
+	libj1939_timers_arm(cmn);
+
+	return 0;
+}
+
+/**
+ * libj1939_timer_stop - Disarm a timer
+ * @cmn: The common J1939 instance data
+ * @timer: The timer, may be not armed
+ */
+void libj1939_timer_stop(struct libj1939_cmn *cmn,
+			 struct libj1939_timer *timer)
+{
+	if (!timer->idx)
+		return;
+
+	libj1939_timer_heap_remove(cmn, timer);
+	libj1939_timers_arm(cmn);
+}
+
+/* run the callbacks of all timers which expired until cmn->last_time */
+static int libj1939_timers_run(struct libj1939_cmn *cmn)
+{
+	struct libj1939_timer *timer;
+	int ret = 0;
+
+	while (cmn->timers_num) {
+		timer = cmn->timers[0];
+		if (libj1939_timespec_before(&cmn->last_time, &timer->expires))
+			break;
+
+		if (timer->period_ms) {
+			timespec_add_ms(&timer->expires, timer->period_ms);
+			if (!libj1939_timespec_before(&cmn->last_time,
+						      &timer->expires)) {
+				timer->expires = cmn->last_time;
+				timespec_add_ms(&timer->expires,
+						timer->period_ms);
+			}
+			libj1939_timer_sift_down(cmn, 0);
+		} else {
+			libj1939_timer_heap_remove(cmn, timer);
 		}
 
-		timeout_ms = time_diff;
+		ret = timer->cb(cmn, timer);
+		if (ret < 0)
+			break;
 	}
 
-	return timeout_ms;
+	libj1939_timers_arm(cmn);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* consume the event of the timerfd, the tools don't know about it */
+static void libj1939_timers_filter_events(struct libj1939_cmn *cmn, int *nfds)
+{
+	uint64_t expirations;
+	int n;
+
+	for (n = 0; n < *nfds; n++) {
+		if (cmn->epoll_events[n].data.fd != cmn->timer_fd)
+			continue;
+
+		if (read(cmn->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+		    errno != EAGAIN)
+			pr_warn("can't read timerfd: %i (%s)", errno,
+				strerror(errno));
+
+		(*nfds)--;
+		memmove(&cmn->epoll_events[n], &cmn->epoll_events[n + 1],
+			(*nfds - n) * sizeof(cmn->epoll_events[0]));
+		break;
+	}
 }
 
 /**
@@ -391,10 +1243,9 @@ static int libj1939_get_timeout_ms(struct timespec *ts)
  * @nfds: The number of file descriptors that are ready
  * @dont_wait: Don't wait for events, just check if there are any
  *
- * This function calculates the timeout until the next message should be sent
- * or any other event should be handled, prepares the epoll instance for events
- * by waiting for the specified timeout or until an event occurs, and waits for
- * events on the epoll instance.
+ * This function waits for events on the epoll instance until an event
+ * occurs or the next timer expires, updates cmn->last_time and runs the
+ * callbacks of the expired timers.
  *
  * Return: 0 on success, or a negative error code.
  */
@@ -403,10 +1254,11 @@ int libj1939_prepare_for_events(struct libj1939_cmn *cmn, int *nfds,
 {
 	int ret, timeout_ms;
 
+	/* the timerfd wakes us up for the timers */
 	if (dont_wait)
 		timeout_ms = 0;
 	else
-		timeout_ms = libj1939_get_timeout_ms(&cmn->next_send_time);
+		timeout_ms = -1;
 
 	ret = epoll_wait(cmn->epoll_fd, cmn->epoll_events,
 			 cmn->epoll_events_size, timeout_ms);
@@ -416,6 +1268,8 @@ int libj1939_prepare_for_events(struct libj1939_cmn *cmn, int *nfds,
 			*nfds = 0;
 			return ret;
 		}
+		/* interrupted, but the timers may be due */
+		ret = 0;
 	}
 
 	*nfds = ret;
@@ -427,5 +1281,10 @@ int libj1939_prepare_for_events(struct libj1939_cmn *cmn, int *nfds,
 		return ret;
 	}
 
-	return 0;
+	if (!cmn->timers_ready)
+		return 0;
+
+	libj1939_timers_filter_events(cmn, nfds);
+
+	return libj1939_timers_run(cmn);
 }
@@ -18,6 +18,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
 
 #ifndef J1939_LIB_H
 #define J1939_LIB_H
@@ -26,17 +28,98 @@
 extern "C" {
 #endif
 
+struct libj1939_cmn;
+struct libj1939_timer;
+
+/* a negative return value is returned by libj1939_prepare_for_events() */
+typedef int (*libj1939_timer_cb_t)(struct libj1939_cmn *cmn,
+				   struct libj1939_timer *timer);
+
+struct libj1939_timer {
+	struct timespec expires;	/* CLOCK_MONOTONIC */
+	unsigned int period_ms;		/* 0 for one-shot timers */
+	libj1939_timer_cb_t cb;
+	void *ctx;
+	size_t idx;			/* heap position + 1, 0 if not armed */
+};
+
 struct libj1939_cmn {
 	int epoll_fd;
 	struct epoll_event *epoll_events;
 	size_t epoll_events_size;
-	struct timespec next_send_time;
 	struct timespec last_time;
+
+	/* armed timers in a binary min-heap, ordered by expiry */
+	bool timers_ready;
+	int timer_fd;
+	struct timespec timer_fd_expires;	/* zero if disarmed */
+	struct libj1939_timer **timers;
+	size_t timers_num;
+	size_t timers_size;
+};
+
+/* a received message, decoded by libj1939_rx_recv() */
+struct libj1939_rx_msg {
+	uint8_t *buf;		/* valid until the next receive */
+	size_t len;
+	bool truncated;		/* the message was longer than the buffer */
+	int sock;
+	struct sockaddr_can peername;	/* source name, address and PGN */
+	uint8_t dst_addr;	/* J1939_NO_ADDR if not reported */
+	uint64_t dst_name;	/* J1939_NO_NAME if not reported */
+	uint8_t priority;
+	struct timeval tstamp;	/* zero if SO_TIMESTAMP is not enabled */
+};
+
+/* a negative return value is returned by libj1939_rx_dispatch() */
+typedef int (*libj1939_rx_cb_t)(void *ctx, struct libj1939_rx_msg *msg);
+
+struct libj1939_rx_handler {
+	uint32_t pgn;
+	libj1939_rx_cb_t cb;
+};
+
+struct libj1939_rx {
+	unsigned int batch;	/* messages per recvmmsg() */
+	size_t buf_size;	/* maximal length of a message */
+	uint8_t *bufs;
+	uint8_t *cmsgs;
+	struct iovec *iovs;
+	struct sockaddr_can *names;
+	struct mmsghdr *mmsgs;
+	struct libj1939_rx_msg *msgs;
+
+	const struct libj1939_rx_handler *handlers;
+	size_t handlers_num;
+	libj1939_rx_cb_t unhandled;	/* PGNs without handler, may be NULL */
+	void *ctx;
+};
+
+/* longest output of libj1939_addr2str_r(), including the terminating NUL */
+#define LIBJ1939_ADDR_STRLEN	48
+
+/*
+ * Last formatted address, owned by the caller. Repeated identical addresses
+ * are returned from here, until the interface table changes.
+ */
+struct libj1939_addr_str {
+	struct sockaddr_can addr;
+	unsigned int if_gen;
+	size_t len;		/* 0 if empty */
+	char str[LIBJ1939_ADDR_STRLEN];
 };
 
 void libj1939_parse_canaddr(char *spec, struct sockaddr_can *paddr);
 extern int libj1939_str2addr(const char *str, char **endp, struct sockaddr_can *can);
 extern const char *libj1939_addr2str(const struct sockaddr_can *can);
+size_t libj1939_addr2str_r(const struct sockaddr_can *can, char *buf,
+			   size_t size);
+const char *libj1939_addr2str_cached(struct libj1939_addr_str *cache,
+				     const struct sockaddr_can *can);
+int libj1939_if_watch(void);
+int libj1939_if_update(int nl_sock);
+int libj1939_if_set_name(int ifindex, const char *name);
+char *libj1939_put_hex(char *p, uint64_t val, int digits);
 
 void libj1939_init_sockaddr_can(struct sockaddr_can *sac, uint32_t pgn);
 
@@ -50,6 +133,31 @@ int libj1939_create_epoll(void);
 int libj1939_prepare_for_events(struct libj1939_cmn *cmn, int *nfds,
 				bool dont_wait);
 
+int libj1939_rx_init(struct libj1939_rx *rx, unsigned int batch,
+		     size_t buf_size);
+void libj1939_rx_free(struct libj1939_rx *rx);
+void libj1939_rx_set_handlers(struct libj1939_rx *rx,
+			      const struct libj1939_rx_handler *handlers,
+			      size_t handlers_num, libj1939_rx_cb_t unhandled,
+			      void *ctx);
+int libj1939_rx_recv(struct libj1939_rx *rx, int sock);
+int libj1939_rx_dispatch(struct libj1939_rx *rx, int sock);
+
+int libj1939_timers_init(struct libj1939_cmn *cmn);
+void libj1939_timers_free(struct libj1939_cmn *cmn);
+void libj1939_timer_init(struct libj1939_timer *timer, libj1939_timer_cb_t cb,
+			 void *ctx);
+int libj1939_timer_start(struct libj1939_cmn *cmn,
+			 struct libj1939_timer *timer, unsigned int delay_ms,
+			 unsigned int period_ms);
+void libj1939_timer_stop(struct libj1939_cmn *cmn,
+			 struct libj1939_timer *timer);
+
+static inline bool libj1939_timer_pending(const struct libj1939_timer *timer)
+{
+	return timer->idx;
+}
+
 #ifdef __cplusplus
 }
 #endif